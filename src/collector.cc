@@ -4,8 +4,10 @@
 #include <engine.hh>
 #include <configuration.hh>
 #include <filter.hh>
+#include <statistics.hh>
 #include <signal.h>
 
+#include <algorithm>
 #include <unordered_map>
 #include <string>
 #include <vector>
@@ -22,6 +24,7 @@ public:
 		m_fileParser(fileParser),
 		m_engine(engine),
 		m_exitCode(-1),
+		m_perProcess(IConfiguration::getInstance().keyAsInt("per-process")),
 		m_filter(filter)
 	{
 		m_fileParser.registerLineListener(*this);
@@ -56,6 +59,10 @@ public:
 				break;
 		}
 
+		// Processes which are still running (or which the engine doesn't report)
+		while (!m_processHits.empty())
+			reportProcess(m_processHits.begin()->first);
+
 		return m_exitCode;
 	}
 
@@ -80,6 +87,8 @@ private:
 			return fmt("breakpoint at 0x%llx", (unsigned long long)ev.addr);
 		case ev_exit:
 			return fmt("exit code %d", ev.data);
+		case ev_process_exit:
+			return fmt("exit of process %d", ev.pid);
 		case ev_signal:
 		case ev_signal_exit:
 		{
@@ -152,12 +161,18 @@ private:
 		case ev_exit:
 			m_exitCode = ev.data;
 			break;
+		case ev_process_exit:
+			reportProcess(ev.pid);
+			break;
 		case ev_breakpoint:
-			for (ListenerList_t::const_iterator it = m_listeners.begin();
-					it != m_listeners.end();
-					++it)
-				(*it)->onAddressHit(ev.addr, 1);
+			onBreakpoints(&ev.addr, 1);
+
+			// The lines of the breakpoint are in m_hits now
+			if (m_perProcess && ev.pid != 0) {
+				AddressList_t &processHits = m_processHits[ev.pid];
 
+				processHits.insert(processHits.end(), m_hits.begin(), m_hits.end());
+			}
 			break;
 
 		default:
@@ -165,26 +180,118 @@ private:
 		}
 	}
 
+	void reportProcess(int pid)
+	{
+		ProcessHitMap_t::iterator it = m_processHits.find(pid);
+
+		if (it == m_processHits.end())
+			return;
+
+		AddressList_t &hits = it->second;
+
+		// Lines can be in more than one basic block
+		std::sort(hits.begin(), hits.end());
+		hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+
+		for (ListenerList_t::const_iterator lit = m_listeners.begin();
+				lit != m_listeners.end();
+				++lit)
+			(*lit)->onProcessHits(pid, hits.data(), hits.size());
+
+		m_processHits.erase(it);
+	}
+
+	void onBreakpoints(const uint64_t *addrs, size_t n)
+	{
+		// Timed per batch, single breakpoints come here from onEvent() as well
+		StatisticsScope scope(IStatistics::PHASE_TRAP);
+
+		IStatistics::getInstance().count(IStatistics::COUNTER_TRAPS, n);
+		m_hits.clear();
+
+		for (size_t i = 0; i < n; i++) {
+			BlockLineMap_t::const_iterator block = m_blockLines.find(addrs[i]);
+
+			// A basic block breakpoint covers all lines in the block
+			if (block == m_blockLines.end()) {
+				m_hits.push_back(addrs[i]);
+				continue;
+			}
+
+			m_hits.insert(m_hits.end(), block->second.begin(), block->second.end());
+		}
+
+		if (m_hits.empty())
+			return;
+
+		for (ListenerList_t::const_iterator it = m_listeners.begin();
+				it != m_listeners.end();
+				++it)
+			(*it)->onAddressHits(m_hits.data(), m_hits.size());
+	}
+
 
 	// From IFileParser
 	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		onFileLine(IPathInterner::getInstance().intern(file), lineNr, addr, 0);
+	}
+
+	void onBasicBlockLine(const std::string &file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+	{
+		onFileLine(IPathInterner::getInstance().intern(file), lineNr, addr, blockAddr);
+	}
+
+	void onFileLine(FileId file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+	{
+		onFileLines(file, &lineNr, &addr, &blockAddr, 1);
+	}
+
+	void onFileLines(FileId file, const unsigned int *lineNrs, const uint64_t *addrs,
+			const uint64_t *blockAddrs, size_t n)
 	{
 		if (!m_filter.runFilters(file))
 		{
 			return;
 		}
 
-		m_engine.registerBreakpoint(addr);
+		for (size_t i = 0; i < n; i++) {
+			if (!blockAddrs[i]) {
+				m_engine.registerBreakpoint(addrs[i]);
+				continue;
+			}
+
+			AddressList_t &lines = m_blockLines[blockAddrs[i]];
+
+			// Only the first instruction in the block needs a breakpoint
+			if (lines.empty())
+				m_engine.registerBreakpoint(blockAddrs[i]);
+
+			if (std::find(lines.begin(), lines.end(), addrs[i]) == lines.end())
+				lines.push_back(addrs[i]);
+		}
+	}
+
+	void onCodeRange(uint64_t start, uint64_t end)
+	{
+		m_engine.registerCodeRange(start, end);
 	}
 
 	typedef std::vector<ICollector::IListener *> ListenerList_t;
 	typedef std::vector<ICollector::IEventTickListener *> EventTickListenerList_t;
+	typedef std::vector<uint64_t> AddressList_t;
+	typedef std::unordered_map<uint64_t, AddressList_t> BlockLineMap_t;
+	typedef std::unordered_map<int, AddressList_t> ProcessHitMap_t;
 
 	IFileParser &m_fileParser;
 	IEngine &m_engine;
 	ListenerList_t m_listeners;
 	EventTickListenerList_t m_eventTickListeners;
 	int m_exitCode;
+	BlockLineMap_t m_blockLines;
+	AddressList_t m_hits;
+	bool m_perProcess;
+	ProcessHitMap_t m_processHits;
 
 	IFilter &m_filter;
 };
@@ -69,6 +69,13 @@ public:
 				"                         Cobertura output)\n"
 				" --report-only           Produce output from stored databases, don't collect\n"
 				" --merge                 Merge output from multiple source dirs\n"
+				" --incremental-merge     Only read the dirs which are new or changed since\n"
+				"                         the last merge, with the merged result kept in\n"
+				"                         kcov-merged/merge-state\n"
+				" --test-matrix           Also record which output dirs (tests) covered each\n"
+				"                         line, in kcov-merged/test-matrix\n"
+				" --tests-covering=file:line  List the tests covering a line, from the test\n"
+				"                         matrix in out-dir\n"
 				"\n"
 				" --include-path=path     comma-separated paths to include in the coverage report\n"
 				" --exclude-path=path     comma-separated paths to exclude from the coverage\n"
@@ -95,6 +102,7 @@ public:
 				"  kcov --collect-only /tmp/kcov ./frodo  # Collect coverage, don't report\n"
 				"  kcov --report-only /tmp/kcov ./frodo   # Report coverage collected above\n"
 				"  kcov --merge /tmp/out /tmp/dir1 /tmp/dir2     # Merge the dir1/dir2 reports\n"
+				"  kcov --tests-covering=/src/frodo.c:12 /tmp/kcov # Tests which ran line 12\n"
 				"  kcov --system-record /tmp/out-dir sysroot     # Perform full-system in-\n"
 				"                                                  strumentation for sysroot\n"
 				"  kcov --system-report  /tmp/data-dir           # Report all data from a full-\n"
@@ -133,18 +141,31 @@ public:
 				{"exclude-line", required_argument, 0, 'u'},
 				{"exclude-region", required_argument, 0, 'G'},
 				{"debug", required_argument, 0, 'D'},
+				{"chrome-trace", required_argument, 0, 'E'},
 				{"debug-force-bash-stderr", no_argument, 0, 'd'},
 				{"bash-handle-sh-invocation", no_argument, 0, 's'},
 				{"replace-src-path", required_argument, 0, 'R'},
 				{"collect-only", no_argument, 0, 'C'},
 				{"report-only", no_argument, 0, 'r'},
 				{"merge", no_argument, 0, 'm'},
+				{"incremental-merge", no_argument, 0, 'k'},
+				{"test-matrix", no_argument, 0, 'A'},
+				{"tests-covering", required_argument, 0, 'q'},
 				{"python-parser", required_argument, 0, 'P'},
 				{"bash-parser", required_argument, 0, 'B'},
 				{"bash-method", required_argument, 0, '4'},
 				{"system-record", no_argument, 0, '8'},
 				{"system-report", no_argument, 0, '9'},
 				{"verify", no_argument, 0, 'V'},
+				{"basic-block-breakpoints", no_argument, 0, 'b'},
+				{"trap-handler", no_argument, 0, 'H'},
+				{"uprobes", no_argument, 0, 'K'},
+				{"rewrite", no_argument, 0, 'W'},
+				{"rewrite-cache", required_argument, 0, 'Y'},
+				{"sample", required_argument, 0, 'Q'},
+				{"per-process", no_argument, 0, 'N'},
+				{"server", required_argument, 0, 'J'},
+				{"connect", required_argument, 0, 'j'},
 				{"version", no_argument, 0, 'v'},
 				{"uncommon-options", no_argument, 0, 'U'},
 				/*{"write-file", required_argument, 0, 'w'}, Take back when the kernel stuff works */
@@ -236,6 +257,41 @@ public:
 						"kcov: binutils-dev), so the --verify option will not do anything.\n");
 #endif
 				break;
+			case 'b':
+				setKey("basic-block-breakpoints", 1);
+#if KCOV_HAS_LIBBFD == 0
+				warning("kcov: WARNING: kcov has been built without libbfd-dev (or\n"
+						"kcov: binutils-dev), so the --basic-block-breakpoints option will not do anything.\n");
+#endif
+				break;
+			case 'H':
+				setKey("trap-handler", 1);
+				break;
+			case 'K':
+				setKey("uprobes", 1);
+				break;
+			case 'W':
+				setKey("rewrite", 1);
+				break;
+			case 'Y':
+				setKey("rewrite-cache", optarg);
+				break;
+			case 'Q':
+				if (!isInteger(std::string(optarg)) || stoul(std::string(optarg)) == 0)
+					return usage();
+
+				setKey("sample-frequency", stoul(std::string(optarg)));
+				break;
+			case 'N':
+				setKey("per-process", 1);
+				break;
+			case 'J':
+				setKey("server-socket", optarg);
+				setKey("running-mode", IConfiguration::MODE_SERVER);
+				break;
+			case 'j':
+				setKey("connect-socket", optarg);
+				break;
 			case 'v':
 				printf("kcov %s\n", kcov_version);
 				exit(0);
@@ -289,6 +345,9 @@ public:
 					return usage();
 				g_kcov_debug_mask = stoul(std::string(optarg));
 				break;
+			case 'E':
+				setKey("chrome-trace", optarg);
+				break;
 			case 'M':
 			{
 				std::vector<std::string> values = split_string(optarg, ",");
@@ -377,6 +436,24 @@ public:
 			case 'm':
 				setKey("running-mode", IConfiguration::MODE_MERGE_ONLY);
 				break;
+			case 'k':
+				setKey("incremental-merge", 1);
+				break;
+			case 'A':
+				setKey("test-matrix", 1);
+				break;
+			case 'q': {
+				std::string where = std::string(optarg);
+				size_t colon = where.find_last_of(":");
+
+				if (colon == std::string::npos || colon == 0 || !isInteger(where.substr(colon + 1)))
+					return usage();
+
+				setKey("tests-covering", where);
+				setKey("running-mode", IConfiguration::MODE_TEST_QUERY);
+				extraNeeded = 1;
+				break;
+			}
 			case '8': // Full system record
 				setKey("running-mode", IConfiguration::MODE_SYSTEM_RECORD);
 				break;
@@ -433,6 +510,10 @@ public:
 		if (printUsage)
 			return usage();
 
+		// Requests bring their own out-dir and in-file
+		if (keyAsInt("running-mode") == IConfiguration::MODE_SERVER)
+			return true;
+
 		afterOpts = optind;
 
 		/* When tracing by PID, the filename is optional */
@@ -444,7 +525,10 @@ public:
 			outDirectory += "/";
 
 		setKey("out-directory", outDirectory);
-		if (keyAsInt("running-mode") == IConfiguration::MODE_MERGE_ONLY) {
+		if (keyAsInt("running-mode") == IConfiguration::MODE_TEST_QUERY) {
+			// Only the out-dir with the test matrix
+			setKey("binary-name", "");
+		} else if (keyAsInt("running-mode") == IConfiguration::MODE_MERGE_ONLY) {
 			// argv contains the directories to merge in this case, but we have no binary name etc
 			setKey("binary-name", "merged-kcov-output");
 			setKey("target-directory", outDirectory + "/merged-kcov-output");
@@ -523,6 +607,7 @@ public:
 		setKey("path-strip-level", 2);
 		setKey("attach-pid", 0);
 		setKey("parse-solibs", 1);
+		setKey("solib-sync-timeout", 20);
 		setKey("gcov", 0);
 		setKey("clang-sanitizer", 0);
 		setKey("low-limit", 25);
@@ -545,6 +630,19 @@ public:
 		setKey("bash-use-basic-parser", 0);
 		setKey("bash-use-ps4", 1);
 		setKey("verify", 0);
+		setKey("basic-block-breakpoints", 0);
+		setKey("trap-handler", 0);
+		setKey("uprobes", 0);
+		setKey("rewrite", 0);
+		setKey("rewrite-cache", "");
+		setKey("sample-frequency", 0);
+		setKey("per-process", 0);
+		setKey("incremental-merge", 0);
+		setKey("test-matrix", 0);
+		setKey("tests-covering", "");
+		setKey("server-socket", "");
+		setKey("connect-socket", "");
+		setKey("chrome-trace", "");
 		setKey("command-name", "");
 		setKey("merged-name", "[merged]");
 		setKey("css-file", "");
@@ -649,12 +747,40 @@ public:
 				" --output-interval=ms    Interval to produce output in milliseconds (0 to\n"
 				"                         only output when kcov terminates, default %d)\n"
 				"\n"
-				" --debug=X               set kcov debugging level (max 31, default 0)\n"
+				" --debug=X               set kcov debugging level (max 63, default 0)\n"
+				" --chrome-trace=file     write where kcov spends its time as a Chrome trace,\n"
+				"                         in addition to stats.json in the output directory\n"
 				"\n"
 				" --configure=key=value,... Manually set configuration values. Possible values:\n"
 				"%s"
 				"\n"
 				" --verify                verify breakpoint setup (to catch compiler bugs)\n"
+				" --basic-block-breakpoints  use one breakpoint per basic block instead of one\n"
+				"                         per line. Faster, but blocks entered through jump\n"
+				"                         tables can be missed\n"
+				" --trap-handler          handle breakpoints with a signal handler in the\n"
+				"                         traced process instead of stopping it (x86 only).\n"
+				"                         Not for programs with their own SIGTRAP handler\n"
+				" --uprobes               use kernel uprobes instead of breakpoints (needs\n"
+				"                         root and tracefs, x86 only). Setting the probes is\n"
+				"                         slow, around 20 s for 20000 breakpoints against\n"
+				"                         250 ms with ptrace, so for long-running programs\n"
+				" --rewrite               run a copy of the executable with the lines\n"
+				"                         instrumented instead of breakpoints (x86-64 only).\n"
+				"                         /proc/self/exe is the copy, and executables with\n"
+				"                         $ORIGIN in their RPATH/RUNPATH use breakpoints\n"
+				" --rewrite-cache=dir     where to keep rewritten executables, default\n"
+				"                         ~/.cache/kcov\n"
+				" --sample=freq           sample where the program runs freq times a second\n"
+				"                         instead of setting breakpoints. Approximate, but\n"
+				"                         with hit counts and little overhead (x86 only)\n"
+				" --per-process           also write what each traced process covered to\n"
+				"                         processes/<pid>.db, with the breakpoints re-armed\n"
+				"                         in forked processes (ptrace only)\n"
+				"\n"
+				" --server=socket         run kcov --connect=socket invocations, keeping the\n"
+				"                         binaries and sources parsed between them\n"
+				" --connect=socket        have a kcov --server run this invocation\n"
 				"\n"
 				" --python-parser=cmd     Python parser to use (for python script coverage),\n"
 				"                         default: %s\n"
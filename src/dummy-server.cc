@@ -0,0 +1,22 @@
+#include <server.hh>
+#include <utils.hh>
+
+using namespace kcov;
+
+int kcov::runServer(const std::string &socketPath, ServerRequestHandler_t handler)
+{
+	error("kcov: --server is only supported on Linux\n");
+
+	return 1;
+}
+
+int kcov::runClient(const std::string &socketPath, unsigned int argc, const char *argv[])
+{
+	error("kcov: --connect is only supported on Linux\n");
+
+	return 1;
+}
+
+void kcov::requestWarmUp(const std::string &file)
+{
+}
@@ -8,6 +8,10 @@ public:
 	virtual void startup()
 	{
 	}
+
+	virtual void stop()
+	{
+	}
 };
 
 ISolibHandler &kcov::createSolibHandler(IFileParser &parser, ICollector &collector)
@@ -208,18 +208,38 @@ public:
 
 	bool checkEvents()
 	{
-		char *curLine = NULL;
-		ssize_t len;
-		size_t linecap = 0;
+		size_t n = 0;
+		bool out;
 
 		// First printout any collected stdout data
 		handleStdout();
 
+		// Wait for the first line, and then take whatever else is already there
+		do {
+			out = handleLine();
+			n++;
+		} while (out && n < maxBatchSize && file_readable(m_stderr, 0));
+
+		flushBreakpoints();
+
+		return out;
+	}
+
+	bool handleLine()
+	{
+		char *curLine = NULL;
+		ssize_t len;
+		size_t linecap = 0;
+
 		len = getline(&curLine, &linecap, m_stderr);
-		if (len < 0)
+		if (len < 0) {
+			free(curLine);
 			return false;
+		}
 
 		std::string cur(curLine);
+		free(curLine);
+
 		// Line markers always start with kcov@
 
 		size_t kcovStr = cur.find("kcov@");
@@ -268,20 +288,7 @@ public:
 			parseFile(filename);
 		}
 
-		if (m_listener) {
-			uint64_t address = 0;
-			Event ev;
-
-			LineIdToAddressMap_t::iterator it = m_lineIdToAddress.find(getLineId(filename, string_to_integer(lineNo)));
-			if (it != m_lineIdToAddress.end())
-				address = it->second;
-
-			ev.type = ev_breakpoint;
-			ev.addr = address;
-			ev.data = 1;
-
-			m_listener->onEvent(ev);
-		}
+		queueBreakpoint(lineAddress(filename, string_to_integer(lineNo)));
 
 		return true;
 	}
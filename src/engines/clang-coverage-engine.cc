@@ -12,10 +12,13 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <signal.h>
 
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
 #include <utility> // std::pair
 
 #include "../parsers/dwarf.hh"
@@ -29,7 +32,8 @@ public:
 	ClangEngine() :
 		ScriptEngineBase(),
 		m_child(-1),
-		m_checksum(0)
+		m_checksum(0),
+		m_lineTableSorted(true)
 	{
 	}
 
@@ -90,6 +94,9 @@ public:
 		}
 		closedir(dir);
 
+		// Resolve the PCs from all files in one go
+		reportCoveredPcs();
+
 		Event ev(ev_exit, WEXITSTATUS(status));
 
 		// Report the exit status
@@ -135,101 +142,373 @@ public:
 		const std::vector<Segment> &segs = elf->getSegments();
 		for (std::vector<Segment>::const_iterator it = segs.begin();
 				it != segs.end();
-				++it)
+				++it) {
 			IDisassembler::getInstance().addSection(it->getData(), it->getSize(), it->getBase());
+			m_coveredPcs.addRange(it->getBase(), it->getSize());
+		}
 
 		bool rv = m_dwarfParser.open(filename);
 
 		// Get a list of all possible source lines
-		if (rv)
+		if (rv) {
 			m_dwarfParser.forEachLine(*this);
+			flushLines();
+		}
 
-		size_t sz;
-		uint8_t *p = (uint8_t *)read_file(&sz, "%s", filename.c_str());
-
-		m_checksum = hash_block(p, sz);
+		m_checksum = elf->getChecksum();
 
-		free(p);
+		delete elf;
 
 		return rv;
 	}
 
 private:
-	typedef std::vector<std::string> FileList_t;
+	typedef std::vector<FileId> FileIdList_t;
+
+	/**
+	 * Deduplicated set of covered PCs.
+	 *
+	 * PCs within the executable segments are kept in one bitmap per segment,
+	 * which both removes duplicates and gives them back in address order. The
+	 * (unusual) PCs outside of these are kept in a plain list.
+	 */
+	class PcSet
+	{
+	public:
+		void addRange(uint64_t base, size_t size)
+		{
+			Range r;
+
+			r.m_base = base;
+			r.m_size = size;
+			r.m_bits.resize(size / 64 + 1);
+
+			m_ranges.push_back(r);
+			std::sort(m_ranges.begin(), m_ranges.end());
+		}
+
+		void add(uint64_t pc)
+		{
+			Range *r = lookupRange(pc);
+
+			if (!r) {
+				m_outside.push_back(pc);
+				return;
+			}
+
+			uint64_t offs = pc - r->m_base;
+
+			r->m_bits[offs / 64] |= 1ULL << (offs % 64);
+			r->m_used = true;
+		}
+
+		// Return the PCs in sorted order and clear the set
+		std::vector<uint64_t> takeSorted()
+		{
+			std::vector<uint64_t> out;
+
+			for (std::vector<Range>::iterator it = m_ranges.begin();
+					it != m_ranges.end();
+					++it) {
+				Range &r = *it;
+
+				if (!r.m_used)
+					continue;
+
+				for (size_t word = 0; word < r.m_bits.size(); word++) {
+					uint64_t cur = r.m_bits[word];
+
+					while (cur) {
+						unsigned int bit = __builtin_ctzll(cur);
+
+						out.push_back(r.m_base + word * 64 + bit);
+						cur &= cur - 1;
+					}
+					r.m_bits[word] = 0;
+				}
+				r.m_used = false;
+			}
+
+			if (!m_outside.empty()) {
+				out.insert(out.end(), m_outside.begin(), m_outside.end());
+				m_outside.clear();
+
+				std::sort(out.begin(), out.end());
+				out.erase(std::unique(out.begin(), out.end()), out.end());
+			}
+
+			return out;
+		}
+
+	private:
+		class Range
+		{
+		public:
+			Range() : m_base(0), m_size(0), m_used(false)
+			{
+			}
+
+			bool operator<(const Range &other) const
+			{
+				return m_base < other.m_base;
+			}
+
+			uint64_t m_base;
+			size_t m_size;
+			bool m_used;
+			std::vector<uint64_t> m_bits;
+		};
+
+		Range *lookupRange(uint64_t pc)
+		{
+			// Few segments, typically one or two
+			for (std::vector<Range>::iterator it = m_ranges.begin();
+					it != m_ranges.end();
+					++it) {
+				if (pc >= it->m_base && pc < it->m_base + it->m_size)
+					return &*it;
+			}
+
+			return NULL;
+		}
+
+		std::vector<Range> m_ranges;
+		std::vector<uint64_t> m_outside;
+	};
+
+	/**
+	 * A line table row, sorted by address to resolve PCs with a linear sweep
+	 */
+	class LineEntry
+	{
+	public:
+		LineEntry(uint64_t addr, FileId file, unsigned int lineNr) :
+			m_addr(addr), m_file(file), m_lineNr(lineNr)
+		{
+		}
+
+		bool operator<(const LineEntry &other) const
+		{
+			return m_addr < other.m_addr;
+		}
+
+		uint64_t m_addr;
+		FileId m_file;
+		unsigned int m_lineNr;
+	};
+
+	typedef std::vector<LineEntry> LineTable_t;
+	typedef std::vector<std::pair<uint64_t, uint64_t> > CodeRangeList_t;
 
 
 	void onLine(const std::string &file, unsigned int lineNr,
 			uint64_t addr)
 	{
+		onFileLine(IPathInterner::getInstance().intern(file), lineNr, addr, 0);
+	}
+
+	void onFileLine(FileId file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+	{
+		if (file >= m_realPaths.size())
+			m_realPaths.resize(file + 1, invalidFileId);
 
+		// Resolve the real path once per file instead of once per row
+		FileId &realPath = m_realPaths[file];
+
+		if (realPath == invalidFileId) {
+			IPathInterner &interner = IPathInterner::getInstance();
+
+			realPath = interner.intern(get_real_path(interner.getPath(file)));
+		}
+
+		m_lineTable.push_back(LineEntry(addr, realPath, lineNr));
+		m_lineTableSorted = false;
+
+		reportLine(realPath, lineNr, addr);
+	}
+
+	// Where the rows end, so that PCs past a sequence aren't given its last line
+	void onCodeRange(uint64_t start, uint64_t end)
+	{
+		m_codeRanges.push_back(std::pair<uint64_t, uint64_t>(start, end));
+		m_lineTableSorted = false;
+	}
+
+	void reportLine(FileId file, unsigned int lineNr, uint64_t addr)
+	{
+		m_pendingLines.add(file, lineNr, addr, 0);
+	}
+
+	// Report the collected lines with one call per file
+	void flushLines()
+	{
 		for (LineListenerList_t::const_iterator it = m_lineListeners.begin();
 				it != m_lineListeners.end();
 				++it)
-			(*it)->onLine(get_real_path(file), lineNr, addr);
+			m_pendingLines.deliver(**it);
+
+		m_pendingLines.clear();
 	}
 
 	void parseCoverageFile(const std::string &name)
 	{
-		size_t sz;
-		void *p;
+		int fd = ::open(name.c_str(), O_RDONLY);
 
-		p = read_file(&sz, "%s", name.c_str());
-		if (!p) {
+		if (fd < 0)
 			return;
-		}
 
 		// Remove the coverage file for the next round
 		unlink(name.c_str());
 
+		uint64_t header;
+
 		// Only header?
-		if (sz < 8) {
-			free(p);
+		if (readFull(fd, &header, sizeof(header)) != sizeof(header)) {
+			::close(fd);
 			return;
 		}
 
-		uint64_t header = *(uint64_t *)p;
 		// Assume native-endianness (?)
-		if (header == 0xC0BFFFFFFFFFFF64ULL) {
-			size_t nEntries = (sz - sizeof(uint64_t)) / sizeof(uint64_t);
-			uint64_t *entries = &((uint64_t *)p)[1];
+		size_t entrySize;
+
+		if (header == 0xC0BFFFFFFFFFFF64ULL)
+			entrySize = sizeof(uint64_t);
+		else if (header == 0xC0BFFFFFFFFFFF32ULL)
+			entrySize = sizeof(uint32_t);
+		else {
+			::close(fd);
+			return;
+		}
+
+		// Stream the file in chunks, the PCs are deduplicated across all files
+		uint64_t buf[8192];
+		ssize_t n;
+
+		while ((n = readFull(fd, buf, sizeof(buf))) > 0) {
+			size_t nEntries = n / entrySize;
 
-			for (size_t i = 0; i < nEntries; i++) {
-				m_dwarfParser.forAddress(*this, entries[i] + 1);
-				reportBreakpoint(entries[i] + 1);
+			if (entrySize == sizeof(uint64_t)) {
+				for (size_t i = 0; i < nEntries; i++)
+					m_coveredPcs.add(buf[i] + 1);
+			} else {
+				uint32_t *entries = (uint32_t *)buf;
+
+				for (size_t i = 0; i < nEntries; i++)
+					m_coveredPcs.add(entries[i] + 1);
 			}
 		}
-		else if (header == 0xC0BFFFFFFFFFFF32ULL) {
-			size_t nEntries = (sz - sizeof(uint64_t)) / sizeof(uint32_t);
-			uint32_t *entries = &((uint32_t *)p)[1];
 
-			for (size_t i = 0; i < nEntries; i++) {
-				m_dwarfParser.forAddress(*this, entries[i] + 1);
-				reportBreakpoint(entries[i] + 1);
+		::close(fd);
+	}
+
+	// read() until the buffer is full or the file ends
+	ssize_t readFull(int fd, void *buf, size_t size)
+	{
+		size_t pos = 0;
+
+		while (pos < size) {
+			ssize_t n = ::read(fd, (uint8_t *)buf + pos, size - pos);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+
+			pos += n;
+		}
+
+		return pos;
+	}
+
+	void reportCoveredPcs()
+	{
+		std::vector<uint64_t> pcs = m_coveredPcs.takeSorted();
+
+		if (pcs.empty())
+			return;
+
+		if (!m_lineTableSorted) {
+			std::stable_sort(m_lineTable.begin(), m_lineTable.end());
+			mergeCodeRanges();
+			m_lineTableSorted = true;
+		}
+
+		// All lists are sorted, so a single sweep finds the line of each PC
+		size_t row = 0;
+		size_t range = 0;
+
+		for (std::vector<uint64_t>::const_iterator it = pcs.begin();
+				it != pcs.end();
+				++it) {
+			uint64_t pc = *it;
+
+			while (row + 1 < m_lineTable.size() && m_lineTable[row + 1].m_addr <= pc)
+				row++;
+			while (range < m_codeRanges.size() && m_codeRanges[range].second <= pc)
+				range++;
+
+			// In a gap between sequences, or in code without lines
+			bool inCode = range < m_codeRanges.size() && m_codeRanges[range].first <= pc;
+
+			if (inCode && row < m_lineTable.size() && m_lineTable[row].m_addr <= pc &&
+					m_lineTable[row].m_addr >= m_codeRanges[range].first) {
+				const LineEntry &cur = m_lineTable[row];
+
+				reportLine(cur.m_file, cur.m_lineNr, pc);
 			}
+
+			reportBreakpoint(pc);
 		}
 
-		free(p);
+		// The lines must be known before the hits on them
+		flushLines();
+		flushBreakpoints();
+	}
+
+	// Sort, and join overlapping ranges so that they can be swept in order
+	void mergeCodeRanges()
+	{
+		CodeRangeList_t merged;
+
+		std::sort(m_codeRanges.begin(), m_codeRanges.end());
+		for (CodeRangeList_t::const_iterator it = m_codeRanges.begin();
+				it != m_codeRanges.end();
+				++it) {
+			if (!merged.empty() && it->first <= merged.back().second)
+				merged.back().second = std::max(merged.back().second, it->second);
+			else
+				merged.push_back(*it);
+		}
+
+		m_codeRanges.swap(merged);
 	}
 
 	void reportBreakpoint(uint64_t address)
 	{
-		std::vector<uint64_t> bb = IDisassembler::getInstance().getBasicBlock(address);
+		const std::vector<uint64_t> &bb = IDisassembler::getInstance().getBasicBlock(address);
 
-		for (std::vector<uint64_t>::iterator it = bb.begin();
+		for (std::vector<uint64_t>::const_iterator it = bb.begin();
 				it != bb.end();
 				++it)
-			reportEvent(ev_breakpoint, 0, *it);
+			queueBreakpoint(*it);
 
 		// Fallback in case kcov is broken
 		if (bb.empty()) {
 			kcov_debug(ENGINE_MSG, "Address 0x%llx not in a basic block\n", (long long)address);
-			reportEvent(ev_breakpoint, 0, address);
+			queueBreakpoint(address);
 		}
 	}
 
 	pid_t m_child;
 	DwarfParser m_dwarfParser;
 	uint64_t m_checksum;
+
+	PcSet m_coveredPcs;
+	LineTable_t m_lineTable;
+	CodeRangeList_t m_codeRanges;
+	bool m_lineTableSorted;
+	FileIdList_t m_realPaths; // By DWARF path
+	LineBatch m_pendingLines;
 };
 
 static ClangEngine *g_clangEngine;
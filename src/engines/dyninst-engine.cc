@@ -178,9 +178,10 @@ public:
 		m_listener = &listener;
 
 		size_t sz;
-		uint8_t *p = (uint8_t *)read_file(&sz, "%s", m_filename.c_str());
-		m_checksum = hash_block(p, sz);
-		free(p);
+		void *p = map_file(&sz, "%s", m_filename.c_str());
+		uint64_t hash = p ? hash_block_parallel(p, sz) : 0;
+		m_checksum = (uint32_t)(hash >> 32) ^ (uint32_t)hash;
+		unmap_file(p, sz);
 
 		m_binaryEdit = m_bpatch->openBinary(m_filename.c_str());
 
@@ -0,0 +1,574 @@
+#include "elf-rewriter.hh"
+#include "../parsers/x86-decoder.hh"
+
+#include <utils.hh>
+
+#include <elf.h>
+#include <string.h>
+
+#include <algorithm>
+
+using namespace kcov;
+
+/*
+ * Stored last in a rewritten executable, after the sites
+ */
+struct rewrite_site
+{
+	uint64_t addr;
+	uint32_t size;
+	uint32_t pad;
+};
+
+struct rewrite_trailer
+{
+	uint32_t magic;
+	uint32_t version; // Bumped when the instrumentation changes
+	uint64_t coverage_addr;
+	uint64_t coverage_size;
+	uint64_t n_sites;
+};
+
+const uint32_t REWRITE_MAGIC = 0x6b727772; // "krwr"
+const uint32_t REWRITE_VERSION = 2;
+
+static const uint64_t pageSize = 4096;
+
+// jmp rel32, which replaces the instrumented instructions
+static const unsigned int jumpSize = 5;
+
+static uint64_t alignUp(uint64_t v, uint64_t align)
+{
+	return (v + align - 1) & ~(align - 1);
+}
+
+static bool fitsRel32(int64_t v)
+{
+	return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+static int32_t read32(const uint8_t *p)
+{
+	return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static void write32(uint8_t *p, int64_t v)
+{
+	for (unsigned int i = 0; i < 4; i++)
+		p[i] = (uint8_t)((uint64_t)v >> (i * 8));
+}
+
+static void put32(std::vector<uint8_t> &out, int64_t v)
+{
+	out.resize(out.size() + 4);
+	write32(&out[out.size() - 4], v);
+}
+
+ElfRewriter::ElfRewriter() :
+	m_coverageAddress(0),
+	m_coverageSize(0),
+	m_codeAddress(0),
+	m_entry(0)
+{
+}
+
+bool ElfRewriter::rewrite(const void *data, size_t size, const std::vector<uint64_t> &addresses)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)p;
+
+	m_out.clear();
+	m_sites.clear();
+
+	if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+			ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_X86_64 ||
+			(ehdr->e_type != ET_EXEC && ehdr->e_type != ET_DYN)) {
+		kcov_debug(ENGINE_MSG, "REWRITE not an x86-64 executable\n");
+		return false;
+	}
+
+	if (ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+			ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > size)
+		return false;
+
+	const Elf64_Phdr *phdrStart = (const Elf64_Phdr *)(p + ehdr->e_phoff);
+	std::vector<Elf64_Phdr> phdrs(phdrStart, phdrStart + ehdr->e_phnum);
+	unsigned int notes = 0;
+	uint64_t end = 0;
+	bool dynamic = false;
+
+	for (std::vector<Elf64_Phdr>::const_iterator it = phdrs.begin();
+			it != phdrs.end();
+			++it) {
+		if (it->p_type == PT_LOAD)
+			end = std::max(end, (uint64_t)(it->p_vaddr + it->p_memsz));
+		else if (it->p_type == PT_NOTE)
+			notes++;
+		else if (it->p_type == PT_INTERP)
+			dynamic = true;
+	}
+
+	// The coverage map is shared by the trap handler, which is preloaded
+	if (!dynamic) {
+		kcov_debug(ENGINE_MSG, "REWRITE not a dynamically linked executable\n");
+		return false;
+	}
+
+	// There's no room for more program headers, so notes are replaced
+	if (notes == 0) {
+		kcov_debug(ENGINE_MSG, "REWRITE no PT_NOTE to replace\n");
+		return false;
+	}
+
+	std::vector<uint64_t> sorted(addresses);
+
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+	// Other lines are jump targets as well
+	findTargets(p, size);
+	m_targets.insert(m_targets.end(), sorted.begin(), sorted.end());
+	std::sort(m_targets.begin(), m_targets.end());
+
+	m_entry = ehdr->e_entry;
+	m_coverageAddress = alignUp(end, pageSize);
+	m_coverageSize = alignUp(std::max(sorted.size(), (size_t)1), pageSize);
+	m_codeAddress = m_coverageAddress + m_coverageSize;
+
+	std::vector<uint8_t> code;
+	std::vector<uint8_t> trampoline;
+
+	m_out.assign(p, p + size);
+
+	for (std::vector<uint64_t>::const_iterator it = sorted.begin();
+			it != sorted.end();
+			++it) {
+		uint64_t addr = *it;
+		const Elf64_Phdr *segment = NULL;
+
+		for (std::vector<Elf64_Phdr>::const_iterator phdr = phdrs.begin();
+				phdr != phdrs.end();
+				++phdr) {
+			if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X) &&
+					addr >= phdr->p_vaddr && addr < phdr->p_vaddr + phdr->p_filesz &&
+					phdr->p_offset + phdr->p_filesz <= size) {
+				segment = &*phdr;
+				break;
+			}
+		}
+
+		if (!segment)
+			continue;
+
+		uint64_t offset = segment->p_offset + (addr - segment->p_vaddr);
+		uint64_t trampolineAddr = m_codeAddress + code.size();
+		int64_t rel = (int64_t)(trampolineAddr - (addr + jumpSize));
+		uint32_t patchedSize;
+
+		trampoline.clear();
+		if (!fitsRel32(rel) ||
+				!patchSite(p + offset, addr, segment->p_vaddr + segment->p_filesz - addr,
+						trampolineAddr, m_coverageAddress + m_sites.size(), trampoline, patchedSize)) {
+			kcov_debug(BP_MSG, "REWRITE can't patch 0x%llx\n", (unsigned long long)addr);
+			continue;
+		}
+
+		uint8_t *dst = &m_out[offset];
+
+		dst[0] = 0xe9;
+		write32(dst + 1, rel);
+		// Not reached, the instructions are in the trampoline now
+		memset(dst + jumpSize, 0xcc, patchedSize - jumpSize);
+
+		code.insert(code.end(), trampoline.begin(), trampoline.end());
+		m_sites.push_back(Site(addr, patchedSize));
+	}
+
+	kcov_debug(ENGINE_MSG, "REWRITE patched %zu of %zu addresses\n", m_sites.size(), sorted.size());
+
+	if (m_sites.empty()) {
+		m_out.clear();
+		return false;
+	}
+
+	// The coverage map and then the trampolines, after everything else
+	uint64_t mapOffset = alignUp(size, pageSize);
+
+	m_out.resize(mapOffset + m_coverageSize, 0);
+	m_out.insert(m_out.end(), code.begin(), code.end());
+
+	Elf64_Phdr map;
+
+	memset(&map, 0, sizeof(map));
+	map.p_type = PT_LOAD;
+	map.p_flags = PF_R | PF_W;
+	map.p_offset = mapOffset;
+	map.p_vaddr = m_coverageAddress;
+	map.p_paddr = m_coverageAddress;
+	map.p_filesz = m_coverageSize;
+	map.p_memsz = m_coverageSize;
+	map.p_align = pageSize;
+
+	Elf64_Phdr text = map;
+
+	text.p_flags = PF_R | PF_X;
+	text.p_offset = mapOffset + m_coverageSize;
+	text.p_vaddr = m_codeAddress;
+	text.p_paddr = m_codeAddress;
+	text.p_filesz = code.size();
+	text.p_memsz = code.size();
+
+	std::vector<Elf64_Phdr> added;
+
+	added.push_back(map);
+	if (notes >= 2) {
+		added.push_back(text);
+	} else {
+		// Only room for one segment, so the trampolines are writable as well
+		added[0].p_flags |= PF_X;
+		added[0].p_filesz += code.size();
+		added[0].p_memsz += code.size();
+	}
+
+	// Replace notes, and keep the loads sorted by address as the loader expects
+	std::vector<Elf64_Phdr> out;
+	unsigned int dropped = 0;
+
+	for (std::vector<Elf64_Phdr>::const_iterator it = phdrs.begin();
+			it != phdrs.end();
+			++it) {
+		if (it->p_type == PT_NOTE && dropped < added.size()) {
+			dropped++;
+			continue;
+		}
+		out.push_back(*it);
+	}
+
+	std::vector<Elf64_Phdr>::iterator lastLoad = out.begin();
+	for (std::vector<Elf64_Phdr>::iterator it = out.begin();
+			it != out.end();
+			++it) {
+		if (it->p_type == PT_LOAD)
+			lastLoad = it + 1;
+	}
+	out.insert(lastLoad, added.begin(), added.end());
+
+	memcpy(&m_out[ehdr->e_phoff], out.data(), out.size() * sizeof(Elf64_Phdr));
+
+	// The sites and the trailer
+	m_out.resize(alignUp(m_out.size(), sizeof(uint64_t)), 0);
+
+	for (SiteList_t::const_iterator it = m_sites.begin();
+			it != m_sites.end();
+			++it) {
+		struct rewrite_site site;
+
+		memset(&site, 0, sizeof(site));
+		site.addr = it->m_addr;
+		site.size = it->m_size;
+		m_out.insert(m_out.end(), (uint8_t *)&site, (uint8_t *)(&site + 1));
+	}
+
+	struct rewrite_trailer trailer;
+
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.magic = REWRITE_MAGIC;
+	trailer.version = REWRITE_VERSION;
+	trailer.coverage_addr = m_coverageAddress;
+	trailer.coverage_size = m_coverageSize;
+	trailer.n_sites = m_sites.size();
+	m_out.insert(m_out.end(), (uint8_t *)&trailer, (uint8_t *)(&trailer + 1));
+
+	return true;
+}
+
+bool ElfRewriter::usesOrigin(const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)p;
+
+	if (size < sizeof(*ehdr) || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+			ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+			ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > size)
+		return false;
+
+	const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(p + ehdr->e_phoff);
+	const Elf64_Dyn *dyn = NULL;
+	size_t nDyn = 0;
+
+	for (unsigned int i = 0; i < ehdr->e_phnum; i++) {
+		if (phdrs[i].p_type == PT_DYNAMIC && phdrs[i].p_offset + phdrs[i].p_filesz <= size) {
+			dyn = (const Elf64_Dyn *)(p + phdrs[i].p_offset);
+			nDyn = phdrs[i].p_filesz / sizeof(Elf64_Dyn);
+		}
+	}
+
+	uint64_t strtab = 0;
+	std::vector<uint64_t> paths;
+
+	for (size_t i = 0; i < nDyn && dyn[i].d_tag != DT_NULL; i++) {
+		if (dyn[i].d_tag == DT_STRTAB)
+			strtab = dyn[i].d_un.d_ptr;
+		else if (dyn[i].d_tag == DT_RPATH || dyn[i].d_tag == DT_RUNPATH)
+			paths.push_back(dyn[i].d_un.d_val);
+	}
+
+	if (paths.empty())
+		return false;
+
+	// The string table is given by address, so find it in the file
+	for (unsigned int i = 0; i < ehdr->e_phnum; i++) {
+		const Elf64_Phdr *phdr = &phdrs[i];
+
+		if (phdr->p_type != PT_LOAD || strtab < phdr->p_vaddr ||
+				strtab >= phdr->p_vaddr + phdr->p_filesz ||
+				phdr->p_offset + phdr->p_filesz > size)
+			continue;
+
+		const char *strings = (const char *)p + phdr->p_offset + (strtab - phdr->p_vaddr);
+		size_t left = phdr->p_vaddr + phdr->p_filesz - strtab;
+
+		for (std::vector<uint64_t>::const_iterator it = paths.begin();
+				it != paths.end();
+				++it) {
+			if (*it >= left)
+				continue;
+
+			std::string path(strings + *it, strnlen(strings + *it, left - *it));
+
+			if (path.find("$ORIGIN") != std::string::npos ||
+					path.find("${ORIGIN}") != std::string::npos)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+bool ElfRewriter::patchSite(const uint8_t *code, uint64_t addr, size_t available, uint64_t trampolineAddr,
+		uint64_t mapAddr, std::vector<uint8_t> &trampoline, uint32_t &patchedSize)
+{
+	uint32_t size = 0;
+	bool fallsThrough = true;
+	int64_t rel;
+
+	// mov byte [rip + disp32], 1, which leaves the flags alone
+	rel = (int64_t)(mapAddr - (trampolineAddr + 7));
+	if (!fitsRel32(rel))
+		return false;
+
+	trampoline.push_back(0xc6);
+	trampoline.push_back(0x05);
+	put32(trampoline, rel);
+	trampoline.push_back(1);
+
+	// Move whole instructions until there's room for the jump
+	while (size < jumpSize) {
+		const uint8_t *cur = code + size;
+		uint64_t curAddr = addr + size;
+		uint64_t at = trampolineAddr + trampoline.size();
+		X86Instruction insn;
+
+		// The bytes after a ret or jmp might not be code
+		if (!fallsThrough)
+			return false;
+
+		if (x86DecodeInstruction(cur, available - size, curAddr, true, insn) == 0)
+			return false;
+
+		switch (insn.m_controlFlow) {
+		case X86_CF_NONE:
+		case X86_CF_RETURN:
+		{
+			size_t start = trampoline.size();
+
+			trampoline.insert(trampoline.end(), cur, cur + insn.m_size);
+
+			// RIP-relative operands refer to the same address from the new place
+			if (insn.m_ripDisplacement) {
+				rel = (int64_t)read32(cur + insn.m_ripDisplacement) + (int64_t)(curAddr - at);
+				if (!fitsRel32(rel))
+					return false;
+
+				write32(&trampoline[start + insn.m_ripDisplacement], rel);
+			}
+
+			fallsThrough = insn.m_controlFlow == X86_CF_NONE;
+			break;
+		}
+		case X86_CF_BRANCH:
+		{
+			uint8_t condition;
+
+			// jcc, which have a rel32 form. Not loop/jcxz or prefixed ones
+			if ((cur[0] & 0xf0) == 0x70 && insn.m_size == 2)
+				condition = cur[0] & 0x0f;
+			else if (cur[0] == 0x0f && (cur[1] & 0xf0) == 0x80 && insn.m_size == 6)
+				condition = cur[1] & 0x0f;
+			else
+				return false;
+
+			rel = (int64_t)(insn.m_target - (at + 6));
+			if (!fitsRel32(rel))
+				return false;
+
+			trampoline.push_back(0x0f);
+			trampoline.push_back(0x80 | condition);
+			put32(trampoline, rel);
+			break;
+		}
+		case X86_CF_JUMP:
+			if (!(cur[0] == 0xeb && insn.m_size == 2) && !(cur[0] == 0xe9 && insn.m_size == 5))
+				return false;
+
+			rel = (int64_t)(insn.m_target - (at + 5));
+			if (!fitsRel32(rel))
+				return false;
+
+			trampoline.push_back(0xe9);
+			put32(trampoline, rel);
+			fallsThrough = false;
+			break;
+		default:
+			// Calls would return into the trampoline, which unwinders don't know about
+			return false;
+		}
+
+		size += insn.m_size;
+	}
+
+	// Nothing may jump into the moved instructions
+	std::vector<uint64_t>::const_iterator it = std::upper_bound(m_targets.begin(), m_targets.end(), addr);
+	if (it != m_targets.end() && *it < addr + size)
+		return false;
+
+	// Back to the instruction after the moved ones
+	if (fallsThrough) {
+		rel = (int64_t)((addr + size) - (trampolineAddr + trampoline.size() + 5));
+		if (!fitsRel32(rel))
+			return false;
+
+		trampoline.push_back(0xe9);
+		put32(trampoline, rel);
+	}
+
+	patchedSize = size;
+
+	return true;
+}
+
+void ElfRewriter::findTargets(const uint8_t *data, size_t size)
+{
+	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
+
+	m_targets.clear();
+
+	if (ehdr->e_shoff == 0 || ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+			ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > size)
+		return;
+
+	const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(data + ehdr->e_shoff);
+
+	for (unsigned int i = 0; i < ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &shdrs[i];
+
+		if (shdr->sh_type == SHT_NOBITS || shdr->sh_offset + shdr->sh_size > size)
+			continue;
+
+		// Direct branch targets and what follows conditional branches, from a linear sweep
+		if (shdr->sh_type == SHT_PROGBITS && (shdr->sh_flags & SHF_EXECINSTR)) {
+			const uint8_t *code = data + shdr->sh_offset;
+
+			for (uint64_t pos = 0; pos < shdr->sh_size; ) {
+				X86Instruction insn;
+				unsigned int insnSize = x86DecodeInstruction(code + pos, shdr->sh_size - pos,
+						shdr->sh_addr + pos, true, insn);
+
+				if (insnSize == 0) {
+					pos++;
+					continue;
+				}
+
+				if (insn.hasTarget())
+					m_targets.push_back(insn.m_target);
+				// Not a jump target, but a basic block starts there as well
+				if (insn.m_controlFlow == X86_CF_BRANCH)
+					m_targets.push_back(shdr->sh_addr + pos + insnSize);
+				pos += insnSize;
+			}
+		}
+
+		// Functions, which can be called indirectly
+		if ((shdr->sh_type == SHT_SYMTAB || shdr->sh_type == SHT_DYNSYM) &&
+				shdr->sh_entsize == sizeof(Elf64_Sym)) {
+			const Elf64_Sym *syms = (const Elf64_Sym *)(data + shdr->sh_offset);
+
+			for (uint64_t j = 0; j < shdr->sh_size / sizeof(Elf64_Sym); j++) {
+				if (ELF64_ST_TYPE(syms[j].st_info) == STT_FUNC && syms[j].st_value != 0)
+					m_targets.push_back(syms[j].st_value);
+			}
+		}
+	}
+}
+
+static bool addressBeforeSite(uint64_t addr, const ElfRewriter::Site &site)
+{
+	return addr < site.m_addr;
+}
+
+const ElfRewriter::Site *ElfRewriter::lookupSite(uint64_t addr) const
+{
+	SiteList_t::const_iterator it = std::upper_bound(m_sites.begin(), m_sites.end(), addr,
+			addressBeforeSite);
+
+	if (it == m_sites.begin())
+		return NULL;
+	--it;
+
+	if (addr >= it->m_addr + it->m_size)
+		return NULL;
+
+	return &*it;
+}
+
+bool ElfRewriter::write(const std::string &path) const
+{
+	if (m_out.empty())
+		return false;
+
+	return write_file(m_out.data(), m_out.size(), "%s", path.c_str()) == 0;
+}
+
+bool ElfRewriter::load(const std::string &path)
+{
+	size_t size;
+	const uint8_t *p = (const uint8_t *)map_file(&size, "%s", path.c_str());
+	bool out = false;
+
+	if (!p)
+		return false;
+
+	m_sites.clear();
+
+	if (size >= sizeof(Elf64_Ehdr) + sizeof(struct rewrite_trailer)) {
+		const struct rewrite_trailer *trailer = (const struct rewrite_trailer *)(p + size - sizeof(*trailer));
+		uint64_t maxSites = (size - sizeof(Elf64_Ehdr) - sizeof(*trailer)) / sizeof(struct rewrite_site);
+
+		if (trailer->magic == REWRITE_MAGIC && trailer->version == REWRITE_VERSION &&
+				trailer->n_sites <= maxSites) {
+			const struct rewrite_site *sites = (const struct rewrite_site *)trailer - trailer->n_sites;
+
+			for (uint64_t i = 0; i < trailer->n_sites; i++)
+				m_sites.push_back(Site(sites[i].addr, sites[i].size));
+
+			m_coverageAddress = trailer->coverage_addr;
+			m_coverageSize = trailer->coverage_size;
+			m_entry = ((const Elf64_Ehdr *)p)->e_entry;
+			out = true;
+		}
+	}
+
+	unmap_file((void *)p, size);
+
+	return out;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+namespace kcov
+{
+	/**
+	 * Writes a copy of an x86-64 executable where the instrumented addresses
+	 * jump to trampolines. A trampoline sets the byte for its address in a
+	 * coverage map segment, runs the instructions which were moved to make
+	 * room for the jump, and jumps back.
+	 *
+	 * The sites and the coverage map location are stored last in the file,
+	 * so that a rewritten executable can be loaded again instead of
+	 * rewriting it each time.
+	 */
+	class ElfRewriter
+	{
+	public:
+		class Site
+		{
+		public:
+			Site(uint64_t addr, uint32_t size) :
+				m_addr(addr), m_size(size)
+			{
+			}
+
+			uint64_t m_addr;
+			uint32_t m_size; //< Bytes moved to the trampoline
+		};
+
+		typedef std::vector<Site> SiteList_t;
+
+		ElfRewriter();
+
+		/**
+		 * Rewrite an executable
+		 *
+		 * @param data the ELF file
+		 * @param size the size of @a data
+		 * @param addresses the addresses to instrument. Those which can't be
+		 * patched safely are left out of the sites
+		 *
+		 * @return true if the executable was rewritten
+		 */
+		bool rewrite(const void *data, size_t size, const std::vector<uint64_t> &addresses);
+
+		/**
+		 * The copy runs from another directory, so executables which find
+		 * their libraries relative to themselves can't be rewritten
+		 *
+		 * @return true if DT_RPATH or DT_RUNPATH of @a data has $ORIGIN
+		 */
+		static bool usesOrigin(const void *data, size_t size);
+
+		/**
+		 * Write the rewritten executable
+		 */
+		bool write(const std::string &path) const;
+
+		/**
+		 * Load the sites of an executable written earlier
+		 *
+		 * @return false if @a path isn't a rewritten executable from this
+		 * version of kcov
+		 */
+		bool load(const std::string &path);
+
+		/**
+		 * @return the sites, sorted by address. The index of a site is the
+		 * index of its byte in the coverage map
+		 */
+		const SiteList_t &getSites() const
+		{
+			return m_sites;
+		}
+
+		/**
+		 * @return the site which covers @a addr (at link-time), or NULL
+		 */
+		const Site *lookupSite(uint64_t addr) const;
+
+		uint64_t getCoverageAddress() const
+		{
+			return m_coverageAddress;
+		}
+
+		/**
+		 * @return the size of the coverage map, a whole number of pages
+		 */
+		uint64_t getCoverageSize() const
+		{
+			return m_coverageSize;
+		}
+
+		uint64_t getEntry() const
+		{
+			return m_entry;
+		}
+
+	private:
+		bool patchSite(const uint8_t *code, uint64_t addr, size_t available, uint64_t trampolineAddr,
+				uint64_t mapAddr, std::vector<uint8_t> &trampoline, uint32_t &patchedSize);
+
+		void findTargets(const uint8_t *data, size_t size);
+
+		std::vector<uint8_t> m_out;
+		SiteList_t m_sites;
+		std::vector<uint64_t> m_targets; //< Sorted addresses which might be jumped to
+
+		uint64_t m_coverageAddress;
+		uint64_t m_coverageSize;
+		uint64_t m_codeAddress;
+		uint64_t m_entry;
+	};
+}
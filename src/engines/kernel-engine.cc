@@ -9,19 +9,42 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <signal.h>
 
 #include <list>
 #include <unordered_map>
+#include <vector>
 
 using namespace kcov;
 
+#define KPC_CONTROL_MAGIC 0x6b706362 /* "kpcb" */
+
+/*
+ * Binary hit record from the kprobe-coverage "hits" file and the header
+ * for binary writes to "control". Keep in sync with src/kernel/kprobe-coverage.c
+ */
+struct kprobe_coverage_hit
+{
+	uint64_t addr;
+	uint32_t module_index;
+	uint32_t reserved;
+};
+
+struct kprobe_coverage_control
+{
+	uint32_t magic;
+	uint32_t n_addrs;
+	char module_name[64];
+};
+
 class KernelEngine : public IEngine
 {
 public:
 	KernelEngine() :
-		m_control(NULL),
-		m_show(NULL),
+		m_control(-1),
+		m_hits(-1),
 		m_listener(NULL)
 	{
 	}
@@ -40,14 +63,14 @@ public:
 
 		m_addresses[addr] = true;
 
-		std::string s = fmt("%s0x%llx\n", m_module.c_str(), (unsigned long long)addr);
-
 		kcov_debug(ENGINE_MSG, "KNRL set BP at 0x%llx\n", (unsigned long long)addr);
-		panic_if (!m_control,
+		panic_if (m_control < 0,
 				"Control file not open???");
 
-		fprintf(m_control, "%s", s.c_str());
-		fflush(m_control);
+		// Written to the module in batches
+		m_pendingBreakpoints.push_back(addr);
+		if (m_pendingBreakpoints.size() >= maxBatchSize)
+			flushBreakpoints();
 
 		return 0;
 	}
@@ -65,15 +88,15 @@ public:
 	{
 		std::string path = IConfiguration::getInstance().keyAsString("kernel-coverage-path");
 		std::string control = path + "/control";
-		std::string show = path + "/show";
+		std::string hits = path + "/hits";
 
 		m_listener = &listener;
 
 		// Open kprobe-coverage files
-		m_control = fopen(control.c_str(), "w");
-		m_show = fopen(show.c_str(), "r");
+		m_control = ::open(control.c_str(), O_WRONLY);
+		m_hits = ::open(hits.c_str(), O_RDONLY);
 
-		if (!m_control || !m_show) {
+		if (m_control < 0 || m_hits < 0) {
 			error("Can't open kprobe-coverage files. Is the kprobe-coverage module loaded?");
 
 			kill(0);
@@ -85,65 +108,86 @@ public:
 
 	bool continueExecution()
 	{
-		char buf[256]; // More than enough for one line
-		char *p;
+		struct kprobe_coverage_hit buf[512];
+		uint64_t addrs[512];
+		ssize_t n;
+
+		// Arm everything registered since the last round
+		flushBreakpoints();
+
+		// Blocks until there is at least one hit, then returns all available
+		do {
+			n = ::read(m_hits, buf, sizeof(buf));
+		} while (n < 0 && errno == EINTR);
 
-		p = fgets(buf, sizeof(buf) - 1, m_show);
-		if (!p)
+		if (n <= 0)
 			return false;
 
-		buf[sizeof(buf) - 1] = '\0';
-		buf[strlen(buf) - 1] = '\0'; // Remove the \n
+		size_t nHits = n / sizeof(buf[0]);
 
-		parseOneLine(buf);
+		for (size_t i = 0; i < nHits; i++) {
+			kcov_debug(ENGINE_MSG, "KNRL BP at 0x%llx\n", (unsigned long long)buf[i].addr);
+
+			addrs[i] = buf[i].addr;
+		}
+
+		m_listener->onBreakpoints(addrs, nHits);
 
 		return true;
 	}
 
 	void kill(int sig)
 	{
-		if (m_control) {
-			fprintf(m_control, "clear\n");
-			fclose(m_control);
+		if (m_control >= 0) {
+			const char clear[] = "clear\n";
+
+			if (::write(m_control, clear, sizeof(clear) - 1) < 0)
+				kcov_debug(ENGINE_MSG, "KNRL can't clear probes\n");
+			::close(m_control);
 		}
-		if (m_show)
-			fclose(m_show);
+		if (m_hits >= 0)
+			::close(m_hits);
 
-		m_control = NULL;
-		m_show = NULL;
+		m_pendingBreakpoints.clear();
+		m_control = -1;
+		m_hits = -1;
 	}
 
 private:
-	void parseOneLine(const std::string &line)
-	{
-		std::string moduleName;
-		std::string addr;
+	static const size_t maxBatchSize = 16384;
 
-		size_t pos = line.find(":");
+	// Write all pending breakpoints with one binary control write
+	void flushBreakpoints()
+	{
+		if (m_pendingBreakpoints.empty() || m_control < 0)
+			return;
 
-		if (pos != std::string::npos) {
-			moduleName = line.substr(0, pos);
-			addr = line.substr(pos + 1);
-		} else {
-			addr = line;
-		}
+		size_t sz = sizeof(struct kprobe_coverage_control) +
+				m_pendingBreakpoints.size() * sizeof(uint64_t);
+		uint8_t *buf = (uint8_t *)xmalloc(sz);
+		struct kprobe_coverage_control *hdr = (struct kprobe_coverage_control *)buf;
 
-		// Invalid?
-		if (!string_is_integer(addr, 16))
-			return;
+		hdr->magic = KPC_CONTROL_MAGIC;
+		hdr->n_addrs = m_pendingBreakpoints.size();
+		strncpy(hdr->module_name, m_module.c_str(), sizeof(hdr->module_name) - 1);
+		memcpy(buf + sizeof(*hdr), m_pendingBreakpoints.data(),
+				m_pendingBreakpoints.size() * sizeof(uint64_t));
 
-		uint64_t value = string_to_integer(addr, 16);
+		kcov_debug(ENGINE_MSG, "KNRL arming %zu BPs\n", m_pendingBreakpoints.size());
 
-		kcov_debug(ENGINE_MSG, "KNRL BP at 0x%llx\n", (unsigned long long)value);
+		if (::write(m_control, buf, sz) != (ssize_t)sz)
+			warning("Can't write %zu breakpoints to kprobe-coverage\n", m_pendingBreakpoints.size());
 
-		m_listener->onEvent(Event(ev_breakpoint, 0, value));
+		free(buf);
+		m_pendingBreakpoints.clear();
 	}
 
-	FILE *m_control;
-	FILE *m_show;
+	int m_control;
+	int m_hits;
 	IEventListener *m_listener;
 
 	std::unordered_map<unsigned long, bool> m_addresses;
+	std::vector<uint64_t> m_pendingBreakpoints;
 
 	std::string m_module;
 };
@@ -178,7 +222,7 @@ public:
 			slashPos++; // Skip the actual slash
 
 		// Remove path before and .ko after the name
-		m_module = m_module.substr(slashPos, m_module.size() - slashPos - 3) + ":";
+		m_module = m_module.substr(slashPos, m_module.size() - slashPos - 3);
 #endif
 
 		return match_perfect;
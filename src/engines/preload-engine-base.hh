@@ -0,0 +1,478 @@
+#pragma once
+
+#include <engine.hh>
+#include <utils.hh>
+#include <configuration.hh>
+#include <solib-handler.hh>
+#include <statistics.hh>
+#include <trap-table.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/personality.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <vector>
+
+namespace kcov
+{
+	/**
+	 * Base-class for engines where the traced process runs without being
+	 * stopped on breakpoint hits, with the trap handler in the solib wrapper
+	 * (see trap-handler.c) preloaded.
+	 *
+	 * The process is only stopped after exec, so that the breakpoints in the
+	 * main executable can be set before it runs. After that kcov polls for
+	 * hits, solib notifications and the exit of the process. Traps from the
+	 * solib wrapper go through the trap table, which the handler waits on
+	 * until kcov has set the breakpoints in the new solibs.
+	 */
+	class PreloadEngineBase : public IEngine
+	{
+	public:
+		PreloadEngineBase(const char *name, uint32_t tableCapacity) :
+			m_table(NULL),
+			m_tableSize(0),
+			m_tableFd(-1),
+			m_tableCapacity(tableCapacity),
+			m_coverageSize(0),
+			m_coverageOffset(0),
+			m_memFd(-1),
+			m_child(0),
+			m_running(false),
+			m_exited(false),
+			m_syncRequest(0),
+			m_entries(0),
+			m_lastHits(0),
+			m_hitFdHungUp(false),
+			m_listener(NULL),
+			m_name(name),
+			m_envString(NULL)
+		{
+		}
+
+		virtual ~PreloadEngineBase()
+		{
+			if (!m_exited)
+				kill(SIGTERM);
+
+			if (m_memFd >= 0)
+				close(m_memFd);
+			if (m_table)
+				munmap(m_table, m_tableSize);
+			if (m_tableFd >= 0)
+				close(m_tableFd);
+			free(m_envString);
+		}
+
+		virtual bool start(IEventListener &listener, const std::string &executable)
+		{
+			IConfiguration &conf = IConfiguration::getInstance();
+
+			m_listener = &listener;
+
+			if (access(executable.c_str(), X_OK) != 0)
+				return false;
+
+			if (conf.keyAsInt("attach-pid") != 0) {
+				error("kcov: The %s engine can't attach to a running process\n", m_name);
+				return false;
+			}
+
+			// The handler lives in the solib wrapper, which is preloaded unless --skip-solibs
+			const char *preload = getenv("LD_PRELOAD");
+			if (!preload || !strstr(preload, "libkcov_sowrapper.so")) {
+				error("kcov: The %s engine needs shared library parsing (no --skip-solibs)\n", m_name);
+				return false;
+			}
+
+			if (!setupTable())
+				return false;
+
+			if (!forkChild(executable.c_str()))
+				return false;
+
+			std::string memPath = fmt("/proc/%d/mem", m_child);
+
+			m_memFd = open(memPath.c_str(), O_RDWR | O_CLOEXEC);
+			if (m_memFd < 0) {
+				error("kcov: Can't open %s\n", memPath.c_str());
+				return false;
+			}
+
+			return true;
+		}
+
+		/**
+		 * Continue execution with an event
+		 */
+		bool continueExecution()
+		{
+			if (!m_running) {
+				kcov_debug(ENGINE_MSG, "%s detaching %d\n", m_name, m_child);
+
+				if (ptrace(PTRACE_DETACH, m_child, 0, 0) < 0) {
+					error("kcov: Can't detach from %d\n", m_child);
+					return false;
+				}
+				m_running = true;
+			}
+
+			// Breakpoints for the solibs reported before the trap are set now
+			__atomic_store_n(&m_table->sync_ack, m_syncRequest, __ATOMIC_RELEASE);
+
+			while (1) {
+				int status;
+				pid_t who = waitpid(m_child, &status, WNOHANG);
+
+				if (who == m_child && (WIFEXITED(status) || WIFSIGNALED(status))) {
+					collectHits();
+					reportExit(status);
+
+					return false;
+				}
+
+				if (who < 0 && errno != EINTR) {
+					collectHits();
+					m_exited = true;
+
+					return false;
+				}
+
+				uint32_t request = __atomic_load_n(&m_table->sync_request, __ATOMIC_ACQUIRE);
+
+				// Let the solib handler parse (on the next tick) before the ack
+				if (request != m_syncRequest) {
+					collectHits();
+					m_syncRequest = request;
+
+					return true;
+				}
+
+				if (collectHits())
+					return true;
+
+				struct pollfd fds[2];
+				int solibFd = solibNotificationFd();
+				int hitFd = m_hitFdHungUp ? -1 : hitNotificationFd();
+				nfds_t n = 0;
+
+				if (solibFd >= 0) {
+					fds[n].fd = solibFd;
+					fds[n].events = POLLIN;
+					fds[n].revents = 0;
+					n++;
+				}
+				if (hitFd >= 0) {
+					fds[n].fd = hitFd;
+					fds[n].events = POLLIN;
+					fds[n].revents = 0;
+					n++;
+				}
+
+				uint64_t start = IStatistics::getInstance().enter(IStatistics::PHASE_TRACEE);
+				int rv = poll(fds, n, pollIntervalMs);
+
+				IStatistics::getInstance().leave(IStatistics::PHASE_TRACEE, start);
+				if (rv > 0 && solibFd >= 0 && (fds[0].revents & POLLIN)) {
+					handleSolibNotification();
+
+					return true;
+				}
+
+				// Perf events hang up when the process exits, before it can be waited for
+				if (rv > 0 && hitFd >= 0 && (fds[n - 1].revents & POLLHUP))
+					m_hitFdHungUp = true;
+			}
+		}
+
+		void kill(int signal)
+		{
+			// Don't kill kcov itself (PID 0)
+			if (m_child != 0)
+				::kill(m_child, signal);
+		}
+
+	protected:
+		/**
+		 * Report and clear the hits since the last time
+		 *
+		 * @return true if there were any
+		 */
+		virtual bool collectHits() = 0;
+
+		/**
+		 * @return a file descriptor which becomes readable on new hits, or -1
+		 * to just poll
+		 */
+		virtual int hitNotificationFd()
+		{
+			return -1;
+		}
+
+		// Changes each time the process reports new solibs
+		uint32_t solibGeneration() const
+		{
+			return m_syncRequest;
+		}
+
+		// Deliver hits to the collector
+		void reportHits(const uint64_t *addrs, size_t n)
+		{
+			if (n != 0 && m_listener)
+				m_listener->onBreakpoints(addrs, n);
+		}
+
+		/**
+		 * Set a breakpoint which is handled by the trap handler
+		 *
+		 * @return 0 on success, -1 otherwise
+		 */
+		int setTrap(unsigned long addr)
+		{
+			if (addr == 0 || m_memFd < 0)
+				return -1;
+
+			uint32_t mask = m_table->capacity - 1;
+			uint32_t i = trap_table_hash(m_table, addr);
+			struct trap_table_entry *entry;
+
+			// There already?
+			while (1) {
+				entry = &m_table->entries[i];
+
+				if (entry->addr == addr)
+					return 0;
+				if (entry->addr == 0)
+					break;
+
+				i = (i + 1) & mask;
+			}
+
+			// Keep the probe sequences short
+			if (m_entries >= m_table->capacity / 4 * 3) {
+				if (m_entries == m_table->capacity / 4 * 3)
+					warning("kcov: Trap table full, skipping the remaining breakpoints\n");
+				m_entries++;
+
+				return -1;
+			}
+
+			uint8_t data;
+			uint8_t breakpoint = 0xcc; // int3
+
+			if (pread(m_memFd, &data, sizeof(data), addr) != sizeof(data)) {
+				kcov_debug(BP_MSG, "Can't read instruction at 0x%lx\n", addr);
+				return -1;
+			}
+
+			// Publish the entry before the handler can see the breakpoint
+			entry->data = data;
+			__atomic_store_n(&entry->addr, (uint64_t)addr, __ATOMIC_RELEASE);
+
+			if (pwrite(m_memFd, &breakpoint, sizeof(breakpoint), addr) != sizeof(breakpoint)) {
+				kcov_debug(BP_MSG, "Can't write breakpoint at 0x%lx\n", addr);
+				return -1;
+			}
+			m_entries++;
+
+			kcov_debug(BP_MSG, "BP registered at 0x%lx\n", addr);
+
+			return 0;
+		}
+
+		/**
+		 * Add the addresses of the traps hit since the last time to @a out
+		 */
+		void collectTraps(std::vector<uint64_t> &out)
+		{
+			uint64_t hits = __atomic_load_n(&m_table->hits, __ATOMIC_ACQUIRE);
+
+			if (hits == m_lastHits)
+				return;
+			m_lastHits = hits;
+
+			uint64_t *bitmap = trap_table_bitmap(m_table);
+
+			for (uint32_t i = 0; i < m_table->capacity / 64; i++) {
+				if (__atomic_load_n(&bitmap[i], __ATOMIC_RELAXED) == 0)
+					continue;
+
+				uint64_t word = __atomic_exchange_n(&bitmap[i], 0, __ATOMIC_ACQ_REL);
+
+				while (word) {
+					unsigned int bit = __builtin_ctzll(word);
+
+					out.push_back(m_table->entries[i * 64 + bit].addr);
+					word &= word - 1;
+				}
+			}
+		}
+
+		// The coverage map shared with the process, see trap-table.h
+		uint8_t *coverageMap()
+		{
+			return (uint8_t *)m_table + m_coverageOffset;
+		}
+
+		struct trap_table *m_table;
+		size_t m_tableSize;
+		int m_tableFd;
+		uint32_t m_tableCapacity;
+		size_t m_coverageSize; //< Set before start() to share a coverage map
+		size_t m_coverageOffset;
+		int m_memFd;
+
+		pid_t m_child;
+		bool m_running;
+		bool m_exited;
+
+	private:
+		// How often hits are checked for when nothing else happens
+		static const int pollIntervalMs = 10;
+
+		// How long the traced process waits for kcov to handle new solibs
+		static const uint32_t syncTimeoutMs = 60 * 1000;
+
+		bool setupTable()
+		{
+			const char *tmpdir = getenv("TMPDIR");
+			char buf[1024];
+
+			// Preferably in memory, the bitmap is written to all the time
+			if (access("/dev/shm", W_OK) == 0)
+				tmpdir = "/dev/shm";
+			else if (!tmpdir)
+				tmpdir = "/tmp";
+
+			snprintf(buf, sizeof(buf), "%s/kcov-trapXXXXXX", tmpdir);
+
+			// Inherited by the traced process, which closes it after mapping
+			m_tableFd = mkstemp(buf);
+			if (m_tableFd < 0) {
+				error("kcov: Can't create trap table in %s\n", tmpdir);
+				return false;
+			}
+			unlink(buf);
+
+			// The coverage map is mapped separately, so on a page of its own
+			m_coverageOffset = (trap_table_size(m_tableCapacity) + getpagesize() - 1) & ~(getpagesize() - 1);
+			m_tableSize = m_coverageOffset + m_coverageSize;
+			if (ftruncate(m_tableFd, m_tableSize) < 0) {
+				error("kcov: Can't resize trap table\n");
+				return false;
+			}
+
+			void *p = mmap(NULL, m_tableSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_tableFd, 0);
+			if (p == MAP_FAILED) {
+				error("kcov: Can't map trap table\n");
+				return false;
+			}
+
+			m_table = (struct trap_table *)p;
+			m_table->magic = TRAP_TABLE_MAGIC;
+			m_table->version = TRAP_TABLE_VERSION;
+			m_table->capacity = m_tableCapacity;
+			m_table->sync_timeout = syncTimeoutMs;
+			m_table->coverage_size = m_coverageSize;
+			m_table->coverage_offset = m_coverageOffset;
+
+			std::string env = fmt("KCOV_TRAP_FD=%d", m_tableFd);
+
+			free(m_envString);
+			m_envString = (char *)xmalloc(env.size() + 1);
+			strcpy(m_envString, env.c_str());
+			putenv(m_envString);
+
+			return true;
+		}
+
+		bool forkChild(const char *executable)
+		{
+			char *const *argv = (char *const *)IConfiguration::getInstance().getArgv();
+			pid_t child, who;
+			int status;
+
+			if ((child = fork()) == 0) {
+				int persona;
+
+				/* Avoid address randomization */
+				persona = personality(0xffffffff);
+				if (persona < 0) {
+					perror("Can't get personality");
+					_exit(1);
+				}
+				persona |= 0x0040000; /* ADDR_NO_RANDOMIZE */
+				if (personality(persona) < 0) {
+					perror("Can't set personality");
+					_exit(1);
+				}
+
+				// Stopped after exec until the first breakpoints are set
+				if (ptrace(PTRACE_TRACEME, 0, 0, 0) < 0) {
+					perror("Can't set me as ptraced");
+					_exit(1);
+				}
+				execv(executable, argv);
+
+				/* Exec failed */
+				_exit(1);
+			}
+
+			if (child < 0) {
+				perror("fork");
+				return false;
+			}
+			m_child = child;
+
+			kcov_debug(ENGINE_MSG, "%s forked %d\n", m_name, child);
+
+			who = waitpid(child, &status, 0);
+			if (who < 0) {
+				perror("waitpid");
+				return false;
+			}
+			if (!WIFSTOPPED(status)) {
+				fprintf(stderr, "Child hasn't stopped: %x\n", status);
+				return false;
+			}
+
+			return true;
+		}
+
+		void reportExit(int status)
+		{
+			Event ev;
+
+			m_exited = true;
+
+			if (WIFSIGNALED(status)) {
+				ev.type = ev_signal_exit;
+				ev.data = WTERMSIG(status);
+			} else {
+				ev.type = ev_exit_first_process;
+				ev.data = WEXITSTATUS(status);
+			}
+
+			kcov_debug(ENGINE_MSG, "%s %d exited, %s %d\n", m_name, m_child,
+					ev.type == ev_signal_exit ? "signal" : "status", ev.data);
+
+			if (m_listener)
+				m_listener->onEvent(ev);
+		}
+
+		uint32_t m_syncRequest;
+		uint32_t m_entries;
+		uint64_t m_lastHits;
+		bool m_hitFdHungUp;
+		IEventListener *m_listener;
+		const char *m_name;
+		char *m_envString;
+	};
+}
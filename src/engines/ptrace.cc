@@ -5,6 +5,7 @@
 #include <solib-handler.hh>
 #include <file-parser.hh>
 #include <phdr_data.h>
+#include <statistics.hh>
 
 #include <unistd.h>
 #include <sys/personality.h>
@@ -13,9 +14,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <poll.h>
 #include <libelf.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sched.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -45,6 +49,14 @@ static unsigned long getAligned(unsigned long addr)
 	return (addr / sizeof(unsigned long)) * sizeof(unsigned long);
 }
 
+// ptrace, counted for the statistics
+static long tracePtrace(enum __ptrace_request request, pid_t pid, void *addr, void *data)
+{
+	IStatistics::getInstance().count(IStatistics::COUNTER_PTRACE);
+
+	return ptrace(request, pid, addr, data);
+}
+
 static unsigned long arch_getPcFromRegs(unsigned long *regs)
 {
 	unsigned long out;
@@ -241,20 +253,27 @@ class Ptrace : public IEngine
 {
 public:
 	Ptrace() :
-		m_firstBreakpoint(true),
+		m_sigchldFd(-1),
 		m_activeChild(0),
 		m_child(0),
 		m_firstChild(0),
 		m_parentCpu(0),
 		m_listener(NULL),
-		m_signal(0)
+		m_signal(0),
+		m_groupStop(false),
+		m_interruptPending(false),
+		m_perProcess(false),
+		m_exitedProcess(0)
 	{
 	}
 
 	~Ptrace()
 	{
 		kill(SIGTERM);
-		ptrace(PTRACE_DETACH, m_activeChild, 0, 0);
+		tracePtrace(PTRACE_DETACH, m_activeChild, NULL, NULL);
+
+		if (m_sigchldFd >= 0)
+			close(m_sigchldFd);
 	}
 
 
@@ -262,6 +281,7 @@ public:
 	bool start(IEventListener &listener, const std::string &executable)
 	{
 		m_listener = &listener;
+		m_perProcess = IConfiguration::getInstance().keyAsInt("per-process");
 
 		m_parentCpu = get_current_cpu();
 		tie_process_to_cpu(getpid(), m_parentCpu);
@@ -280,6 +300,9 @@ public:
 		else
 			res = forkChild(executable.c_str());
 
+		if (res)
+			setupChildNotification();
+
 		return res;
 	}
 
@@ -288,15 +311,12 @@ public:
 		if (addr == 0)
 			return -1;
 
-		unsigned long data;
-
 		// There already?
 		if (m_instructionMap.find(addr) != m_instructionMap.end())
 			return 0;
 
-		data = peekWord(addr);
-
-		m_instructionMap[addr] = data;
+		// The instruction is read when armed, the process might be running now
+		m_instructionMap[addr] = 0;
 		m_pendingBreakpoints.push_back(addr);
 
 		kcov_debug(BP_MSG, "BP registered at 0x%lx\n", addr);
@@ -309,9 +329,6 @@ public:
 		if (m_instructionMap.find(addr) == m_instructionMap.end()) {
 			kcov_debug(BP_MSG, "Can't find breakpoint at 0x%lx\n", addr);
 
-			// Stupid workaround for avoiding the solib thread race
-			msleep(1);
-
 			return false;
 		}
 
@@ -328,11 +345,11 @@ public:
 	{
 		unsigned long regs[1024];
 
-		ptrace((__ptrace_request)PTRACE_GETREGS, m_activeChild, 0, &regs);
+		tracePtrace((__ptrace_request)PTRACE_GETREGS, m_activeChild, NULL, &regs);
 
 		// Step back one instruction
 		arch_adjustPcAfterBreakpoint(regs);
-		ptrace((__ptrace_request)PTRACE_SETREGS, m_activeChild, 0, &regs);
+		tracePtrace((__ptrace_request)PTRACE_SETREGS, m_activeChild, NULL, &regs);
 	}
 
 	const Event waitEvent()
@@ -346,15 +363,23 @@ public:
 		out.type = ev_error;
 		out.data = -1;
 
-		who = waitpid(-1, &status, __WALL);
-		if (who == -1) {
-			kcov_debug(ENGINE_MSG, "Returning error\n");
-			return out;
+		while (1) {
+			who = waitChild(&status);
+			if (who == -1) {
+				kcov_debug(ENGINE_MSG, "Returning error\n");
+				return out;
+			}
+
+			if (!m_perProcess || !holdNewProcess(who, status))
+				break;
 		}
 
 		m_children[who] = 1;
+		if (m_perProcess)
+			out.pid = processOf(who);
 
 		m_activeChild = who;
+		m_groupStop = false;
 		out.addr = getPc(m_activeChild);
 
 		kcov_debug(ENGINE_MSG, "PT stopped PID %d 0x%08x\n", m_activeChild, status);
@@ -376,6 +401,20 @@ public:
 				kcov_debug(ENGINE_MSG, "PT clone at 0x%llx for %d\n",
 						(unsigned long long)out.addr, m_activeChild);
 				out.data = 0;
+
+				if (m_perProcess)
+					onNewChild(who, (status >> 16) == PTRACE_EVENT_FORK);
+			} else if ((status >> 16) == PTRACE_EVENT_STOP) {
+				/*
+				 * Interrupted, or a new thread of a seized process (SIGTRAP), or
+				 * a group-stop (the stop signal). Nothing to deliver, but a
+				 * group-stop should keep the process stopped.
+				 */
+				m_groupStop = sig != SIGTRAP;
+				kcov_debug(ENGINE_MSG, "PT %s stop at 0x%llx for %d\n",
+						m_groupStop ? "group" : "interrupt",
+						(unsigned long long)out.addr, m_activeChild);
+				out.data = 0;
 			} else if (sig == SIGTRAP || sig == SIGSTOP || sig == sigill) {
 				// A trap?
 						out.type = ev_breakpoint;
@@ -392,12 +431,6 @@ public:
 						else if (sig != SIGSTOP)
 							skipInstruction();
 
-						// Wait for solib data if this is the first time
-						if (m_firstBreakpoint && insnFound) {
-							blockUntilSolibDataRead();
-							m_firstBreakpoint = false;
-						}
-
 						return out;
 			}
 
@@ -415,6 +448,8 @@ public:
 			kcov_debug(ENGINE_MSG, "PT terminating signal %d at 0x%llx for %d\n",
 					sig, (unsigned long long)out.addr, m_activeChild);
 			m_children.erase(who);
+			if (m_perProcess)
+				onExit(who);
 
 			if (!childrenLeft())
 				out.type = ev_signal_exit;
@@ -426,6 +461,8 @@ public:
 					exitStatus, (unsigned long long)out.addr, m_activeChild, m_activeChild == m_firstChild ? " (first child)" : "");
 
 			m_children.erase(who);
+			if (m_perProcess)
+				onExit(who);
 
 			if (who == m_firstChild)
 				out.type = ev_exit_first_process;
@@ -452,10 +489,19 @@ public:
 	{
 		int res;
 
+		if (m_interruptPending && !interruptChild())
+			return false;
+
 		setupAllBreakpoints();
 
-		kcov_debug(ENGINE_MSG, "PT continuing %d with signal %lu\n", m_activeChild, m_signal);
-		res = ptrace(PTRACE_CONT, m_activeChild, 0, m_signal);
+		if (m_groupStop) {
+			// Stays stopped until SIGCONT, but other events are still reported
+			kcov_debug(ENGINE_MSG, "PT listening on %d\n", m_activeChild);
+			res = tracePtrace(PTRACE_LISTEN, m_activeChild, NULL, NULL);
+		} else {
+			kcov_debug(ENGINE_MSG, "PT continuing %d with signal %lu\n", m_activeChild, m_signal);
+			res = tracePtrace(PTRACE_CONT, m_activeChild, NULL, (void *)m_signal);
+		}
 		if (res < 0) {
 			kcov_debug(ENGINE_MSG, "PT error for %d: %d\n", m_activeChild, res);
 			m_children.erase(m_activeChild);
@@ -468,8 +514,15 @@ public:
 		if (m_listener)
 			m_listener->onEvent(ev);
 
-		if (ev.type == ev_breakpoint)
-			clearBreakpoint(ev.addr);
+		if (m_exitedProcess != 0) {
+			if (m_listener)
+				m_listener->onEvent(Event(ev_process_exit, 0, 0, m_exitedProcess));
+			m_exitedProcess = 0;
+		}
+
+		// Remembered per process, for the processes it forks
+		if (ev.type == ev_breakpoint && clearBreakpoint(ev.addr) && m_perProcess)
+			m_clearedBreakpoints[processOf(m_activeChild)].push_back(ev.addr);
 
 		if (ev.type == ev_error)
 			return false;
@@ -486,8 +539,95 @@ public:
 
 private:
 
+	/*
+	 * Block SIGCHLD and receive it through a file descriptor instead, so
+	 * that child events and solib notifications can be waited for together.
+	 */
+	void setupChildNotification()
+	{
+		sigset_t set;
+
+		sigemptyset(&set);
+		sigaddset(&set, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &set, NULL);
+
+		m_sigchldFd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (m_sigchldFd < 0)
+			warning("Can't create signalfd, solib data is read when the tracee stops\n");
+	}
+
+	// Wait for a child event, reading solib data as it arrives
+	pid_t waitChild(int *status)
+	{
+		int solibFd = solibNotificationFd();
+
+		if (solibFd < 0 || m_sigchldFd < 0) {
+			uint64_t start = IStatistics::getInstance().enter(IStatistics::PHASE_TRACEE);
+			pid_t who = waitpid(-1, status, __WALL);
+
+			IStatistics::getInstance().leave(IStatistics::PHASE_TRACEE, start);
+			handleSolibNotification();
+
+			return who;
+		}
+
+		while (1) {
+			pid_t who = waitpid(-1, status, __WALL | WNOHANG);
+
+			if (who != 0) {
+				// Everything written before the tracee stopped is in the FIFO now
+				handleSolibNotification();
+
+				return who;
+			}
+
+			struct pollfd fds[2];
+
+			fds[0].fd = m_sigchldFd;
+			fds[0].events = POLLIN;
+			fds[0].revents = 0;
+			fds[1].fd = solibFd;
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+
+			// Held processes are released after a while, so wake up for that
+			int timeout = m_heldProcesses.empty() ? -1 : (int)heldTimeoutMs;
+			uint64_t start = IStatistics::getInstance().enter(IStatistics::PHASE_TRACEE);
+			int rv = poll(fds, 2, timeout);
+
+			IStatistics::getInstance().leave(IStatistics::PHASE_TRACEE, start);
+			if (rv < 0 && errno != EINTR)
+				return -1;
+
+			if (!m_heldProcesses.empty())
+				releaseHeldProcesses(0);
+
+			if (fds[0].revents & POLLIN) {
+				struct signalfd_siginfo info;
+
+				// Coalesced, so just drain it and retry waitpid
+				while (read(m_sigchldFd, &info, sizeof(info)) == sizeof(info))
+					;
+			}
+
+			if (fds[1].revents & POLLIN)
+				handleSolibNotification();
+		}
+	}
+
 	void setupAllBreakpoints()
 	{
+		if (m_pendingBreakpoints.empty())
+			return;
+
+		StatisticsScope scope(IStatistics::PHASE_ARM);
+
+		// All original instructions first, since breakpoints can share a word
+		for (PendingBreakpointList_t::const_iterator addrIt = m_pendingBreakpoints.begin();
+				addrIt != m_pendingBreakpoints.end();
+				++addrIt)
+			m_instructionMap[*addrIt] = peekWord(*addrIt);
+
 		for (PendingBreakpointList_t::const_iterator addrIt = m_pendingBreakpoints.begin();
 				addrIt != m_pendingBreakpoints.end();
 				++addrIt) {
@@ -561,7 +701,8 @@ private:
 			return false;
 		}
 
-		ptrace(PTRACE_SETOPTIONS, m_activeChild, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+		tracePtrace(PTRACE_SETOPTIONS, m_activeChild, NULL,
+				(void *)(PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK));
 
 		return true;
 	}
@@ -572,6 +713,15 @@ private:
 
 		m_child = m_activeChild = m_firstChild = pid;
 
+		if (seizeProcess(pid))
+			return true;
+
+		// PTRACE_SEIZE is Linux 3.4+
+		if (errno != EIO) {
+			fprintf(stderr, "Can't attach to %d. Error %s\n", pid, strerror(errno));
+			return false;
+		}
+
 		errno = 0;
 		rv = linuxAttach(m_activeChild);
 		//rv = ptrace(PTRACE_ATTACH, m_activeChild, 0, 0);
@@ -598,6 +748,268 @@ private:
 		return true;
 	}
 
+	// The process (thread group) of a thread
+	pid_t processOf(pid_t tid)
+	{
+		ProcessMap_t::const_iterator it = m_processes.find(tid);
+
+		if (it != m_processes.end())
+			return it->second;
+
+		// Gone (a thread which exited before its first stop), so no hits of its own
+		if (!file_exists(fmt("/proc/%d/status", tid)))
+			return tid;
+
+		pid_t tgid = linux_proc_get_tgid(tid);
+
+		if (tgid <= 0)
+			tgid = tid;
+		m_processes[tid] = tgid;
+
+		return tgid;
+	}
+
+	/*
+	 * A forked process gets a copy of the memory of its parent, without the
+	 * breakpoints the parent has hit. They are re-armed before it runs, so
+	 * that it gets coverage of its own.
+	 *
+	 * The first stop of the new process can come before the fork event of
+	 * the parent, which tells if it's a fork. It's held (not continued)
+	 * until then, or until the parent exits or the wait times out (see
+	 * releaseHeldProcesses()).
+	 *
+	 * @return true if @a who is held
+	 */
+	bool holdNewProcess(pid_t who, int status)
+	{
+		if (!WIFSTOPPED(status) || who == m_firstChild || m_children.find(who) != m_children.end())
+			return false;
+
+		// A new thread
+		if (processOf(who) != who)
+			return false;
+
+		ChildMap_t::iterator it = m_newProcesses.find(who);
+		if (it == m_newProcesses.end()) {
+			kcov_debug(ENGINE_MSG, "PT holding %d until its fork event\n", who);
+			m_heldProcesses[who] = HeldProcess(linux_proc_get_int(who, "PPid"), get_ms_timestamp());
+
+			return true;
+		}
+
+		m_newProcesses.erase(it);
+		rearmBreakpoints(who);
+
+		return false;
+	}
+
+	// A clone, fork or vfork event in @a parent
+	void onNewChild(pid_t parent, bool isFork)
+	{
+		unsigned long msg = 0;
+
+		tracePtrace(PTRACE_GETEVENTMSG, parent, NULL, &msg);
+
+		pid_t child = (pid_t)msg;
+
+		if (child <= 0 || processOf(child) != child)
+			return;
+
+		// vfork children (and clones sharing the memory) use the breakpoints of the parent
+		if (isFork)
+			m_clearedBreakpoints[child] = m_clearedBreakpoints[processOf(parent)];
+
+		HeldProcessMap_t::iterator it = m_heldProcesses.find(child);
+		if (it == m_heldProcesses.end()) {
+			m_newProcesses[child] = 1;
+			return;
+		}
+
+		// Its first stop has already been seen, continue it without reporting it
+		m_heldProcesses.erase(it);
+		rearmBreakpoints(child);
+		m_children[child] = 1;
+		tracePtrace(PTRACE_CONT, child, NULL, NULL);
+	}
+
+	/*
+	 * Continue held processes without their fork event: the ones of
+	 * @a parent when it exits, and any held for longer than heldTimeoutMs
+	 * (the event can be lost if the parent is killed). Without a parent the
+	 * memory isn't shared, so the breakpoints are re-armed as for a fork.
+	 * After a timeout it might be a vfork, so the breakpoints are left as
+	 * they are.
+	 */
+	void releaseHeldProcesses(pid_t parent)
+	{
+		uint64_t now = get_ms_timestamp();
+		HeldProcessMap_t::iterator it = m_heldProcesses.begin();
+
+		while (it != m_heldProcesses.end()) {
+			pid_t child = it->first;
+
+			if (parent != 0 && it->second.m_parent == parent) {
+				m_clearedBreakpoints[child] = m_clearedBreakpoints[parent];
+				rearmBreakpoints(child);
+			} else if (now - it->second.m_since < heldTimeoutMs) {
+				++it;
+				continue;
+			}
+
+			kcov_debug(ENGINE_MSG, "PT releasing held %d without its fork event\n", child);
+			it = m_heldProcesses.erase(it);
+			m_children[child] = 1;
+			tracePtrace(PTRACE_CONT, child, NULL, NULL);
+		}
+	}
+
+	void onExit(pid_t who)
+	{
+		if (processOf(who) == who) {
+			m_exitedProcess = who;
+			releaseHeldProcesses(who);
+			m_clearedBreakpoints.erase(who);
+			m_newProcesses.erase(who);
+		}
+		m_processes.erase(who);
+	}
+
+	// In one go, to the stopped process @a pid
+	void rearmBreakpoints(pid_t pid)
+	{
+		ClearedBreakpointMap_t::iterator it = m_clearedBreakpoints.find(pid);
+
+		if (it == m_clearedBreakpoints.end())
+			return;
+
+		StatisticsScope scope(IStatistics::PHASE_ARM);
+
+		for (PendingBreakpointList_t::const_iterator addrIt = it->second.begin();
+				addrIt != it->second.end();
+				++addrIt) {
+			unsigned long aligned = getAligned(*addrIt);
+			unsigned long cur_data = tracePtrace((__ptrace_request)PTRACE_PEEKTEXT, pid, (void *)aligned, NULL);
+
+			tracePtrace((__ptrace_request)PTRACE_POKETEXT, pid, (void *)aligned,
+					(void *)arch_setupBreakpoint(*addrIt, cur_data));
+		}
+
+		kcov_debug(ENGINE_MSG, "PT re-armed %zu breakpoints in %d\n", it->second.size(), pid);
+		m_clearedBreakpoints.erase(it);
+	}
+
+	/*
+	 * Attach to all threads of the process without stopping them. Threads
+	 * created by seized threads are attached by the kernel (through
+	 * PTRACE_O_TRACECLONE), so only threads created by not yet seized ones
+	 * can be missed by a scan. Scan until that's no longer the case.
+	 *
+	 * Only the thread which breakpoints are written through is stopped,
+	 * and only when they are (see interruptChild()), so the process runs
+	 * while kcov parses.
+	 */
+	bool seizeProcess(pid_t pid)
+	{
+		unsigned long options = PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK;
+
+		if (tracePtrace(PTRACE_SEIZE, pid, NULL, (void *)options) < 0)
+			return false;
+
+		m_interruptPending = true;
+		tie_process_to_cpu(pid, m_parentCpu);
+
+		// A thread given, not a process
+		if (linux_proc_get_tgid(pid) != pid)
+			return true;
+
+		std::string pathname = fmt("/proc/%d/task", pid);
+		DIR *dir = opendir(pathname.c_str());
+
+		if (!dir) {
+			error("Could not open %s\n", pathname.c_str());
+
+			return true;
+		}
+
+		std::unordered_map<pid_t, bool> threads;
+		unsigned int iterations = 0;
+		unsigned int seized = 1;
+
+		threads[pid] = true;
+
+		// Like GDB, until two scans without new threads
+		while (iterations < 2) {
+			unsigned int newThreads = 0;
+			struct dirent *dp;
+
+			while ((dp = readdir(dir)) != NULL) {
+				pid_t lwp = strtoul(dp->d_name, NULL, 10);
+
+				if (lwp == 0 || threads.find(lwp) != threads.end())
+					continue;
+
+				threads[lwp] = true;
+				newThreads++;
+
+				// EPERM for threads the kernel has already attached
+				if (tracePtrace(PTRACE_SEIZE, lwp, NULL, (void *)options) == 0)
+					seized++;
+				else if (errno != EPERM)
+					kcov_debug(ENGINE_MSG, "PT can't seize lwp %d: %s\n", lwp, strerror(errno));
+			}
+
+			if (newThreads == 0)
+				iterations++;
+			else
+				iterations = 0;
+
+			rewinddir(dir);
+		}
+		closedir(dir);
+
+		kcov_debug(ENGINE_MSG, "PT seized %u of %zu threads of %d\n", seized, threads.size(), pid);
+
+		return true;
+	}
+
+	// Stop the seized process (the thread it was attached through) to set the first breakpoints
+	bool interruptChild()
+	{
+		int status;
+
+		m_interruptPending = false;
+
+		if (tracePtrace(PTRACE_INTERRUPT, m_activeChild, NULL, NULL) < 0) {
+			error("Can't interrupt %d: %s\n", m_activeChild, strerror(errno));
+			return false;
+		}
+
+		// Any stop will do, an interrupt which comes after it is handled as an event
+		if (waitpid(m_activeChild, &status, __WALL) < 0 || !WIFSTOPPED(status)) {
+			error("%d didn't stop: %x\n", m_activeChild, status);
+			return false;
+		}
+
+		int sig = WSTOPSIG(status);
+		int event = status >> 16;
+
+		// Not the interrupt, so keep what the stop was for
+		if (event == PTRACE_EVENT_STOP) {
+			m_groupStop = sig != SIGTRAP;
+		} else if (event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK) {
+			if (m_perProcess)
+				onNewChild(m_activeChild, event == PTRACE_EVENT_FORK);
+		} else if (event == 0) {
+			// Delivered on the next PTRACE_CONT
+			m_signal = sig;
+		}
+
+		kcov_debug(ENGINE_MSG, "PT interrupted %d (0x%x)\n", m_activeChild, status);
+
+		return true;
+	}
+
 	/* Taken from GDB (loop through all threads and attach to each one)  */
 	int linuxAttach (pid_t pid)
 	{
@@ -685,7 +1097,8 @@ private:
 
 		if (rv < 0)
 			return errno;
-		ptrace(PTRACE_SETOPTIONS, lwpid, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+		tracePtrace(PTRACE_SETOPTIONS, lwpid, NULL,
+				(void *)(PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK));
 
 		if (!linux_proc_pid_is_stopped (lwpid)) {
 			/*
@@ -710,7 +1123,7 @@ private:
 #if defined(__powerpc__) || defined(__arm__) || defined(__aarch64__)
 		unsigned long regs[1024];
 
-		ptrace((__ptrace_request)PTRACE_GETREGS, m_activeChild, 0, &regs);
+		tracePtrace((__ptrace_request)PTRACE_GETREGS, m_activeChild, NULL, &regs);
 
 # if defined(__powerpc__)
 		regs[ppc_NIP] += 4;
@@ -719,7 +1132,7 @@ private:
 # else
 		regs[arm_PC] += 4;
 # endif
-		ptrace((__ptrace_request)PTRACE_SETREGS, m_activeChild, 0, &regs);
+		tracePtrace((__ptrace_request)PTRACE_SETREGS, m_activeChild, NULL, &regs);
 #endif
 	}
 
@@ -733,7 +1146,7 @@ private:
 		unsigned long regs[1024];
 
 		memset(&regs, 0, sizeof(regs));
-		ptrace((__ptrace_request)PTRACE_GETREGS, pid, 0, &regs);
+		tracePtrace((__ptrace_request)PTRACE_GETREGS, pid, NULL, &regs);
 
 		return getPcFromRegs(regs);
 	}
@@ -742,21 +1155,40 @@ private:
 	{
 		unsigned long aligned = getAligned(addr);
 
-		return ptrace((__ptrace_request)PTRACE_PEEKTEXT, m_activeChild, aligned, 0);
+		return tracePtrace((__ptrace_request)PTRACE_PEEKTEXT, m_activeChild, (void *)aligned, NULL);
 	}
 
 	void pokeWord(unsigned long addr, unsigned long val)
 	{
-		ptrace((__ptrace_request)PTRACE_POKETEXT, m_activeChild, getAligned(addr), val);
+		tracePtrace((__ptrace_request)PTRACE_POKETEXT, m_activeChild, (void *)getAligned(addr), (void *)val);
 	}
 
 	typedef std::unordered_map<unsigned long, unsigned long > instructionMap_t;
 	typedef std::vector<unsigned long> PendingBreakpointList_t;
 	typedef std::unordered_map<pid_t, int> ChildMap_t;
+	typedef std::unordered_map<pid_t, pid_t> ProcessMap_t;
+	typedef std::unordered_map<pid_t, PendingBreakpointList_t> ClearedBreakpointMap_t;
+
+	class HeldProcess
+	{
+	public:
+		HeldProcess(pid_t parent = 0, uint64_t since = 0) :
+			m_parent(parent), m_since(since)
+		{
+		}
+
+		pid_t m_parent;
+		uint64_t m_since;
+	};
+
+	typedef std::unordered_map<pid_t, HeldProcess> HeldProcessMap_t;
+
+	// How long a new process is held waiting for the fork event of its parent
+	static const uint64_t heldTimeoutMs = 1000;
 
 	instructionMap_t m_instructionMap;
 	PendingBreakpointList_t m_pendingBreakpoints;
-	bool m_firstBreakpoint;
+	int m_sigchldFd;
 
 	pid_t m_activeChild;
 	pid_t m_child;
@@ -767,6 +1199,16 @@ private:
 
 	IEventListener *m_listener;
 	unsigned long m_signal;
+	bool m_groupStop; //< Stopped by a stop signal, so left stopped on continue
+	bool m_interruptPending;
+
+	// With --per-process
+	bool m_perProcess;
+	ProcessMap_t m_processes; //< Thread to process
+	ClearedBreakpointMap_t m_clearedBreakpoints; //< Hit in each process
+	ChildMap_t m_newProcesses; //< Forked, but not stopped yet
+	HeldProcessMap_t m_heldProcesses; //< Stopped, but the fork not seen yet
+	pid_t m_exitedProcess;
 };
 
 
@@ -13,6 +13,9 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 
 #include <list>
 #include <unordered_map>
@@ -44,13 +47,20 @@ public:
 	PythonEngine() :
 		ScriptEngineBase(),
 		m_child(0),
-		m_pipe(NULL)
+		m_pipeFd(-1),
+		m_readBuffer(readBufferSize),
+		m_readPos(0),
+		m_readEnd(0),
+		m_pipeEof(false)
 	{
 	}
 
 	~PythonEngine()
 	{
 		kill(SIGTERM);
+
+		if (m_pipeFd >= 0)
+			close(m_pipeFd);
 	}
 
 	bool start(IEventListener &listener, const std::string &executable)
@@ -107,8 +117,8 @@ public:
 
 			return false;
 		}
-		m_pipe = fopen(kcov_python_pipe_path.c_str(), "r");
-		panic_if (!m_pipe,
+		m_pipeFd = open(kcov_python_pipe_path.c_str(), O_RDONLY | O_CLOEXEC);
+		panic_if (m_pipeFd < 0,
 				"Can't open python pipe %s", kcov_python_pipe_path.c_str());
 
 		return true;
@@ -118,15 +128,31 @@ public:
 	{
 		uint8_t buf[8192];
 		struct coverage_data *p;
+		size_t n = 0;
+
+		// Wait for the first one, and then take whatever else is already there
+		do {
+			p = readCoverageDatum(buf, sizeof(buf), n == 0 ? 100 : 0);
+			if (!p)
+				break;
 
-		p = readCoverageDatum(buf, sizeof(buf));
+			handleDatum(p);
+			n++;
+		} while (n < maxBatchSize);
 
-		if (!p) {
+		if (n == 0) {
 			reportEvent(ev_error, -1);
 
 			return false;
 		}
 
+		flushBreakpoints();
+
+		return true;
+	}
+
+	void handleDatum(const struct coverage_data *p)
+	{
 		if (!m_reportedFiles[p->filename]) {
 			m_reportedFiles[p->filename] = true;
 
@@ -138,22 +164,7 @@ public:
 			parseFile(p->filename);
 		}
 
-		if (m_listener) {
-			uint64_t address = 0;
-			Event ev;
-
-			LineIdToAddressMap_t::const_iterator it = m_lineIdToAddress.find(getLineId(p->filename, p->line));
-			if (it != m_lineIdToAddress.end())
-				address = it->second;
-
-			ev.type = ev_breakpoint;
-			ev.addr = address;
-			ev.data = 1;
-
-			m_listener->onEvent(ev);
-		}
-
-		return true;
+		queueBreakpoint(lineAddress(p->filename, p->line));
 	}
 
 	bool continueExecution()
@@ -364,28 +375,22 @@ private:
 	}
 
 
-	struct coverage_data *readCoverageDatum(uint8_t *buf, size_t totalSize)
+	struct coverage_data *readCoverageDatum(uint8_t *buf, size_t totalSize, unsigned int timeoutMs)
 	{
 		struct coverage_data *p = (struct coverage_data *)buf;
-		ssize_t rv;
-
-		if (feof(m_pipe))
-			return NULL; // Not an error
 
-		// No data?
-		if (!file_readable(m_pipe, 100))
+		// No data? Only the pipe itself needs to be waited for
+		if (bufferedBytes() == 0 && (m_pipeEof || !pipeReadable(timeoutMs)))
 			return NULL;
 
-		memset(buf, 0, sizeof(struct coverage_data));
-		rv = fread(buf, 1, sizeof(struct coverage_data), m_pipe);
-		if (rv == 0)
-			return NULL; // Not an error
-
-		if (rv < (int)sizeof(struct coverage_data)) {
-			error("Read too little %zd", rv);
+		if (!fillReadBuffer(sizeof(struct coverage_data))) {
+			// Not an error at the end of the pipe
+			if (bufferedBytes() != 0)
+				error("Read too little %zu", bufferedBytes());
 
 			return NULL;
 		}
+		consumeReadBuffer(buf, sizeof(struct coverage_data));
 		unmarshalCoverageData(p);
 
 		bool valid = p->magic == COVERAGE_MAGIC && p->size < totalSize;
@@ -404,18 +409,73 @@ private:
 		}
 
 		size_t remainder = p->size - sizeof(struct coverage_data);
-		rv = fread(buf + sizeof(struct coverage_data), 1, remainder, m_pipe);
-		if (rv < (ssize_t)remainder) {
-			error("Read too little %zd vs %zu", rv, remainder);
+		if (!fillReadBuffer(remainder)) {
+			error("Read too little %zu vs %zu", bufferedBytes(), remainder);
 
 			return NULL;
 		}
+		consumeReadBuffer(buf + sizeof(struct coverage_data), remainder);
 
 		return p;
 	}
 
+	size_t bufferedBytes() const
+	{
+		return m_readEnd - m_readPos;
+	}
+
+	bool pipeReadable(unsigned int timeoutMs)
+	{
+		struct pollfd pfd;
+
+		pfd.fd = m_pipeFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		return poll(&pfd, 1, timeoutMs) > 0;
+	}
+
+	// Read from the pipe until @a size bytes are buffered, false on EOF or error
+	bool fillReadBuffer(size_t size)
+	{
+		if (bufferedBytes() >= size)
+			return true;
+
+		// Move the start of the partial record to the front
+		memmove(m_readBuffer.data(), m_readBuffer.data() + m_readPos, bufferedBytes());
+		m_readEnd -= m_readPos;
+		m_readPos = 0;
+
+		while (m_readEnd < size && !m_pipeEof) {
+			ssize_t rv = read(m_pipeFd, m_readBuffer.data() + m_readEnd,
+					m_readBuffer.size() - m_readEnd);
+
+			if (rv > 0)
+				m_readEnd += rv;
+			else if (rv == 0)
+				m_pipeEof = true;
+			else if (errno != EINTR)
+				return false;
+		}
+
+		return m_readEnd >= size;
+	}
+
+	void consumeReadBuffer(uint8_t *dst, size_t size)
+	{
+		memcpy(dst, m_readBuffer.data() + m_readPos, size);
+		m_readPos += size;
+	}
+
+	// Whatever is in the pipe is read at once, and split into records from here
+	static const size_t readBufferSize = 64 * 1024;
+
 	pid_t m_child;
-	FILE *m_pipe;
+	int m_pipeFd;
+	std::vector<uint8_t> m_readBuffer;
+	size_t m_readPos;
+	size_t m_readEnd;
+	bool m_pipeEof;
 };
 
 
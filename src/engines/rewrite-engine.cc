@@ -0,0 +1,277 @@
+#include "preload-engine-base.hh"
+#include "elf-rewriter.hh"
+#include "../parsers/dwarf.hh"
+
+#include <elf.hh>
+#include <statistics.hh>
+
+#include <sys/stat.h>
+#include <elf.h>
+
+using namespace kcov;
+
+/*
+ * Engine which runs a copy of the executable with the lines instrumented
+ * (see elf-rewriter.cc), so that hits in it cost a store instead of a trap.
+ * The coverage map is shared with kcov through the trap handler, and the
+ * lines which can't be instrumented, as well as those in solibs, get
+ * breakpoints like with the trap engine.
+ *
+ * Rewritten executables are kept by checksum (i.e., build-id) in the
+ * rewrite cache, so that they are rewritten once per build. The program
+ * runs from there, so /proc/self/exe is the copy. Executables which look
+ * up libraries through $ORIGIN use breakpoints instead.
+ */
+class RewriteEngine : public PreloadEngineBase, public IFileParser::ILineListener
+{
+public:
+	RewriteEngine() :
+		PreloadEngineBase("REWRITE", tableCapacity),
+		m_relocation(0)
+	{
+	}
+
+	bool start(IEventListener &listener, const std::string &executable)
+	{
+		std::string path = executable;
+
+		if (prepare(executable)) {
+			path = m_path;
+			m_coverageSize = m_rewriter.getCoverageSize();
+		} else {
+			warning("kcov: Can't rewrite %s, using breakpoints\n", executable.c_str());
+		}
+
+		if (!PreloadEngineBase::start(listener, path))
+			return false;
+
+		if (m_coverageSize == 0)
+			return true;
+
+		if (!readRelocation())
+			return false;
+
+		m_table->coverage_addr = m_rewriter.getCoverageAddress() + m_relocation;
+		m_seen.resize((m_rewriter.getSites().size() + 7) / 8);
+
+		return true;
+	}
+
+	int registerBreakpoint(unsigned long addr)
+	{
+		const ElfRewriter::Site *site = m_coverageSize ? m_rewriter.lookupSite(addr - m_relocation) : NULL;
+
+		if (!site)
+			return setTrap(addr);
+
+		// Moved into a trampoline, so a trap would overwrite the jump
+		if (site->m_addr != addr - m_relocation)
+			return -1;
+
+		return 0;
+	}
+
+	// From IFileParser::ILineListener
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		m_lineAddresses.push_back(addr);
+	}
+
+	void onFileLine(FileId file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+	{
+		m_lineAddresses.push_back(addr);
+	}
+
+private:
+	// Only for what can't be rewritten
+	static const uint32_t tableCapacity = 1024 * 1024;
+
+	/*
+	 * Rewrite the executable, or use the cached one. The lines are read
+	 * here since the parser only reports them for PIEs after the process
+	 * has started.
+	 */
+	bool prepare(const std::string &executable)
+	{
+		IElf *elf = IElf::create(executable);
+
+		if (!elf)
+			return false;
+
+		size_t size;
+		void *data = elf->getRawData(size);
+
+		if (ElfRewriter::usesOrigin(data, size)) {
+			kcov_debug(ENGINE_MSG, "REWRITE %s uses $ORIGIN\n", executable.c_str());
+			delete elf;
+
+			return false;
+		}
+
+		std::string dir = cacheDirectory();
+
+		m_path = fmt("%s/%016llx", dir.c_str(), (unsigned long long)elf->getChecksum());
+
+		if (file_exists(m_path) && m_rewriter.load(m_path)) {
+			kcov_debug(ENGINE_MSG, "REWRITE using %s\n", m_path.c_str());
+			delete elf;
+
+			return true;
+		}
+
+		DwarfParser dwarf;
+		bool out = false;
+
+		if (dwarf.open(executable)) {
+			dwarf.forEachLine(*this);
+
+			StatisticsScope scope(IStatistics::PHASE_ARM);
+
+			out = m_rewriter.rewrite(data, size, m_lineAddresses);
+		}
+		delete elf;
+
+		if (!out)
+			return false;
+
+		mkdirs(dir);
+
+		// Other kcov instances might use it at the same time
+		std::string tmp = fmt("%s.%d", m_path.c_str(), getpid());
+
+		if (!m_rewriter.write(tmp) || chmod(tmp.c_str(), 0755) < 0 ||
+				rename(tmp.c_str(), m_path.c_str()) < 0) {
+			error("kcov: Can't write %s\n", m_path.c_str());
+			unlink(tmp.c_str());
+
+			return false;
+		}
+
+		kcov_debug(ENGINE_MSG, "REWRITE wrote %s\n", m_path.c_str());
+
+		return true;
+	}
+
+	std::string cacheDirectory()
+	{
+		std::string dir = IConfiguration::getInstance().keyAsString("rewrite-cache");
+		const char *cache = getenv("XDG_CACHE_HOME");
+		const char *home = getenv("HOME");
+
+		if (dir != "")
+			return dir;
+
+		if (cache)
+			return fmt("%s/kcov", cache);
+		if (home)
+			return fmt("%s/.cache/kcov", home);
+
+		return IConfiguration::getInstance().keyAsString("out-directory") + "/rewrite-cache";
+	}
+
+	void mkdirs(const std::string &dir)
+	{
+		for (size_t pos = dir.find('/', 1); pos != std::string::npos; pos = dir.find('/', pos + 1))
+			(void)mkdir(dir.substr(0, pos).c_str(), 0755);
+
+		(void)mkdir(dir.c_str(), 0755);
+	}
+
+	// Where PIEs are loaded, from the entry point the process got
+	bool readRelocation()
+	{
+		size_t size;
+		Elf64_auxv_t *auxv = (Elf64_auxv_t *)read_file(&size, "/proc/%d/auxv", m_child);
+
+		if (!auxv) {
+			error("kcov: Can't read auxv of %d\n", m_child);
+			return false;
+		}
+
+		bool out = false;
+
+		for (size_t i = 0; i < size / sizeof(*auxv); i++) {
+			if (auxv[i].a_type == AT_ENTRY) {
+				m_relocation = auxv[i].a_un.a_val - m_rewriter.getEntry();
+				out = true;
+				break;
+			}
+		}
+		free(auxv);
+
+		kcov_debug(ENGINE_MSG, "REWRITE relocation %#llx\n", (unsigned long long)m_relocation);
+
+		return out;
+	}
+
+	// From PreloadEngineBase
+	bool collectHits()
+	{
+		m_hitAddresses.clear();
+		collectTraps(m_hitAddresses);
+
+		if (m_coverageSize) {
+			const ElfRewriter::SiteList_t &sites = m_rewriter.getSites();
+			const uint64_t *map = (const uint64_t *)coverageMap();
+
+			// Bytes set since the last time, a word at a time
+			for (size_t i = 0; i < m_seen.size(); i++) {
+				uint64_t word = __atomic_load_n(&map[i], __ATOMIC_RELAXED);
+
+				if (word == m_seen[i])
+					continue;
+
+				uint64_t changed = word & ~m_seen[i];
+
+				m_seen[i] |= word;
+				while (changed) {
+					unsigned int byte = __builtin_ctzll(changed) / 8;
+
+					m_hitAddresses.push_back(sites[i * 8 + byte].m_addr + m_relocation);
+					changed &= ~(0xffULL << (byte * 8));
+				}
+			}
+		}
+
+		reportHits(m_hitAddresses.data(), m_hitAddresses.size());
+
+		return !m_hitAddresses.empty();
+	}
+
+	typedef std::vector<uint64_t> AddressList_t;
+
+	ElfRewriter m_rewriter;
+	std::string m_path;
+	uint64_t m_relocation;
+	AddressList_t m_lineAddresses;
+	std::vector<uint64_t> m_seen;
+	AddressList_t m_hitAddresses;
+};
+
+
+
+class RewriteEngineCreator : public IEngineFactory::IEngineCreator
+{
+public:
+	virtual ~RewriteEngineCreator()
+	{
+	}
+
+	virtual IEngine *create(IFileParser &parser)
+	{
+		return new RewriteEngine();
+	}
+
+	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+#if defined(__x86_64__)
+		if (IConfiguration::getInstance().keyAsInt("rewrite") &&
+				dataSize >= 4 && memcmp(data, "\x7f" "ELF", 4) == 0)
+			return 2;
+#endif
+
+		return match_none;
+	}
+};
+
+static RewriteEngineCreator g_rewriteEngineCreator;
@@ -0,0 +1,317 @@
+#include "preload-engine-base.hh"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+
+using namespace kcov;
+
+/*
+ * Engine which doesn't set any breakpoints, but samples the program
+ * counter of the traced process with a perf cpu-clock event instead. Each
+ * sample is reported as a hit on the closest preceding line (or basic
+ * block) address, so the hit counts estimate how often the lines run.
+ *
+ * The cost is a timer interrupt per sample, so the overhead depends on the
+ * frequency and not on the program. Lines which run seldom or quickly can
+ * be missed though, so the coverage is approximate.
+ *
+ * Samples outside the code of the lines (from the DWARF line table) are
+ * dropped, so code in excluded files or without debugging info doesn't add
+ * to unrelated lines.
+ */
+class SamplingEngine : public PreloadEngineBase
+{
+public:
+	SamplingEngine() :
+		// The trap table is only used for solib notifications here
+		PreloadEngineBase("SAMPLE", 64),
+		m_ringFd(-1),
+		m_sampleFd(-1),
+		m_ring(NULL),
+		m_ringSize(0),
+		m_addressesSorted(true),
+		m_lostShown(false)
+	{
+	}
+
+	~SamplingEngine()
+	{
+		if (m_sampleFd >= 0)
+			close(m_sampleFd);
+		if (m_ring)
+			munmap(m_ring, m_ringSize);
+		if (m_ringFd >= 0)
+			close(m_ringFd);
+	}
+
+	bool start(IEventListener &listener, const std::string &executable)
+	{
+		if (!PreloadEngineBase::start(listener, executable))
+			return false;
+
+		// The process is stopped after exec, so nothing is sampled before the lines are known
+		return setupSampling(IConfiguration::getInstance().keyAsInt("sample-frequency"));
+	}
+
+	int registerBreakpoint(unsigned long addr)
+	{
+		if (addr == 0)
+			return -1;
+
+		m_addresses.push_back(addr);
+		m_addressesSorted = false;
+
+		return 0;
+	}
+
+	void registerCodeRange(uint64_t start, uint64_t end)
+	{
+		m_ranges.push_back(Range(start, end));
+		m_addressesSorted = false;
+	}
+
+private:
+	class Range
+	{
+	public:
+		Range(uint64_t start, uint64_t end) :
+			m_start(start), m_end(end)
+		{
+		}
+
+		bool operator<(const Range &other) const
+		{
+			return m_start < other.m_start;
+		}
+
+		uint64_t m_start;
+		uint64_t m_end;
+	};
+
+	typedef std::vector<uint64_t> AddressList_t;
+	typedef std::vector<Range> RangeList_t;
+
+	// Power of two number of data pages
+	static const unsigned int ringPages = 64;
+
+	int perfEventOpen(struct perf_event_attr &attr)
+	{
+		return syscall(SYS_perf_event_open, &attr, m_child, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	bool setupSampling(unsigned int frequency)
+	{
+		struct perf_event_attr attr;
+
+		/*
+		 * Inherited events can't be mapped, so the samples (from all threads)
+		 * are redirected to the ring buffer of a dummy event
+		 */
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_DUMMY;
+		attr.sample_type = PERF_SAMPLE_IP;
+		// Wake up kcov when a quarter is filled, it polls anyway
+		attr.watermark = 1;
+		attr.wakeup_watermark = ringPages * getpagesize() / 4;
+
+		m_ringFd = perfEventOpen(attr);
+		if (m_ringFd < 0) {
+			error("kcov: Can't open perf event for %d: %s\n", m_child, strerror(errno));
+			return false;
+		}
+
+		m_ringSize = (ringPages + 1) * getpagesize();
+		void *p = mmap(NULL, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_ringFd, 0);
+		if (p == MAP_FAILED) {
+			error("kcov: Can't map perf ring buffer\n");
+			return false;
+		}
+		m_ring = (struct perf_event_mmap_page *)p;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_CPU_CLOCK;
+		attr.freq = 1;
+		attr.sample_freq = frequency;
+		attr.sample_type = PERF_SAMPLE_IP;
+		attr.inherit = 1;
+		// Only the program itself, which is also what's allowed without privileges
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		m_sampleFd = perfEventOpen(attr);
+		if (m_sampleFd < 0) {
+			error("kcov: Can't sample %d at %u Hz: %s (see /proc/sys/kernel/perf_event_max_sample_rate)\n",
+					m_child, frequency, strerror(errno));
+			return false;
+		}
+
+		if (ioctl(m_sampleFd, PERF_EVENT_IOC_SET_OUTPUT, m_ringFd) < 0) {
+			error("kcov: Can't redirect perf samples: %s\n", strerror(errno));
+			return false;
+		}
+
+		kcov_debug(ENGINE_MSG, "SAMPLE %d at %u Hz\n", m_child, frequency);
+
+		return true;
+	}
+
+	// The line address a sample is counted on, or 0 if none
+	uint64_t lookupAddress(uint64_t ip) const
+	{
+		const Range *range = findRange(ip);
+
+		if (!range)
+			return 0;
+
+		AddressList_t::const_iterator it = std::upper_bound(m_addresses.begin(), m_addresses.end(), ip);
+
+		if (it == m_addresses.begin())
+			return 0;
+		--it;
+
+		// Not from before the code the sample is in
+		if (*it < range->m_start)
+			return 0;
+
+		return *it;
+	}
+
+	const Range *findRange(uint64_t addr) const
+	{
+		Range key(addr, 0);
+		RangeList_t::const_iterator it = std::upper_bound(m_ranges.begin(), m_ranges.end(), key);
+
+		if (it == m_ranges.begin())
+			return NULL;
+		--it;
+
+		if (addr >= it->m_end)
+			return NULL;
+
+		return &*it;
+	}
+
+	// Sort, and join overlapping and adjacent ranges
+	void mergeRanges()
+	{
+		RangeList_t merged;
+
+		std::sort(m_ranges.begin(), m_ranges.end());
+		for (RangeList_t::const_iterator it = m_ranges.begin();
+				it != m_ranges.end();
+				++it) {
+			if (!merged.empty() && it->m_start <= merged.back().m_end)
+				merged.back().m_end = std::max(merged.back().m_end, it->m_end);
+			else
+				merged.push_back(*it);
+		}
+
+		m_ranges.swap(merged);
+	}
+
+	// From PreloadEngineBase
+	bool collectHits()
+	{
+		uint64_t head = __atomic_load_n(&m_ring->data_head, __ATOMIC_ACQUIRE);
+		uint64_t tail = m_ring->data_tail;
+		uint8_t *data = (uint8_t *)m_ring + getpagesize();
+		uint64_t size = ringPages * getpagesize();
+
+		if (head == tail)
+			return false;
+
+		// New lines, typically from a new solib
+		if (!m_addressesSorted) {
+			std::sort(m_addresses.begin(), m_addresses.end());
+			m_addresses.erase(std::unique(m_addresses.begin(), m_addresses.end()), m_addresses.end());
+			mergeRanges();
+			m_addressesSorted = true;
+		}
+
+		m_hitAddresses.clear();
+		while (tail < head) {
+			uint8_t buf[sizeof(struct perf_event_header) + sizeof(uint64_t)];
+			struct perf_event_header *hdr = (struct perf_event_header *)buf;
+			uint64_t offs = tail % size;
+
+			// The records are small, so copy the start out to handle wrapping
+			for (unsigned int i = 0; i < sizeof(buf); i++)
+				buf[i] = data[(offs + i) % size];
+
+			if (hdr->size == 0)
+				break;
+
+			if (hdr->type == PERF_RECORD_SAMPLE) {
+				uint64_t addr = lookupAddress(*(uint64_t *)(buf + sizeof(*hdr)));
+
+				// Once per sample, the reporter adds them up
+				if (addr)
+					m_hitAddresses.push_back(addr);
+			} else if (hdr->type == PERF_RECORD_LOST && !m_lostShown) {
+				warning("kcov: Samples lost, the hit counts will be too low\n");
+				m_lostShown = true;
+			}
+
+			tail += hdr->size;
+		}
+
+		__atomic_store_n(&m_ring->data_tail, tail, __ATOMIC_RELEASE);
+
+		reportHits(m_hitAddresses.data(), m_hitAddresses.size());
+
+		return !m_hitAddresses.empty();
+	}
+
+	int hitNotificationFd()
+	{
+		return m_ringFd;
+	}
+
+	int m_ringFd;
+	int m_sampleFd;
+	struct perf_event_mmap_page *m_ring;
+	size_t m_ringSize;
+
+	AddressList_t m_addresses;
+	bool m_addressesSorted;
+	RangeList_t m_ranges;
+	AddressList_t m_hitAddresses;
+	bool m_lostShown;
+};
+
+
+
+class SamplingEngineCreator : public IEngineFactory::IEngineCreator
+{
+public:
+	virtual ~SamplingEngineCreator()
+	{
+	}
+
+	virtual IEngine *create(IFileParser &parser)
+	{
+		return new SamplingEngine();
+	}
+
+	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+		// Needs the trap handler for the solib notifications, so x86 only
+#if defined(__i386__) || defined(__x86_64__)
+		// Instead of any of the breakpoint engines
+		if (IConfiguration::getInstance().keyAsInt("sample-frequency") &&
+				dataSize >= 4 && memcmp(data, "\x7f" "ELF", 4) == 0)
+			return 3;
+#endif
+
+		return match_none;
+	}
+};
+
+static SamplingEngineCreator g_samplingEngineCreator;
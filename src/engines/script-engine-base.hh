@@ -90,9 +90,37 @@ protected:
 		if (!m_listener)
 			return;
 
+		// Keep the order: hits before e.g., the exit event
+		flushBreakpoints();
+
 		m_listener->onEvent(Event(type, data, address));
 	}
 
+	// Queue a hit, which is delivered with the others in flushBreakpoints()
+	void queueBreakpoint(uint64_t address)
+	{
+		m_pendingBreakpoints.push_back(address);
+	}
+
+	void flushBreakpoints()
+	{
+		if (!m_listener || m_pendingBreakpoints.empty())
+			return;
+
+		m_listener->onBreakpoints(m_pendingBreakpoints.data(), m_pendingBreakpoints.size());
+		m_pendingBreakpoints.clear();
+	}
+
+	uint64_t lineAddress(const std::string &filename, unsigned int lineNo) const
+	{
+		LineIdToAddressMap_t::const_iterator it = m_lineIdToAddress.find(getLineId(filename, lineNo));
+
+		if (it == m_lineIdToAddress.end())
+			return 0;
+
+		return it->second;
+	}
+
 	void fileLineFound(uint32_t crc, const std::string &filename, unsigned int lineNo)
 	{
 		uint64_t id = getLineId(filename, lineNo);
@@ -111,11 +139,16 @@ protected:
 	typedef std::vector<IFileListener *> FileListenerList_t;
 	typedef std::unordered_map<std::string, bool> ReportedFileMap_t;
 	typedef std::unordered_map<uint64_t, uint64_t> LineIdToAddressMap_t;
+	typedef std::vector<uint64_t> AddressList_t;
+
+	// The maximum number of hits to collect in one continueExecution()
+	static const size_t maxBatchSize = 4096;
 
 	LineListenerList_t m_lineListeners;
 	FileListenerList_t m_fileListeners;
 	ReportedFileMap_t m_reportedFiles;
 	LineIdToAddressMap_t m_lineIdToAddress;
+	AddressList_t m_pendingBreakpoints;
 
 	IEventListener *m_listener;
 };
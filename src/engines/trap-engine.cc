@@ -0,0 +1,76 @@
+#include "preload-engine-base.hh"
+
+using namespace kcov;
+
+/*
+ * Engine where the breakpoints are handled by a SIGTRAP handler in the
+ * traced process itself (in the solib wrapper, see trap-handler.c). kcov
+ * writes the breakpoints through /proc/<pid>/mem and reads the hits from a
+ * shared bitmap, so a hit costs a signal delivery instead of a ptrace stop
+ * and a round trip through kcov.
+ *
+ * Traps which aren't breakpoints go to the SIGTRAP handler from before,
+ * but a program which installs its own handler later takes the
+ * breakpoints with it and won't run correctly.
+ */
+class TrapEngine : public PreloadEngineBase
+{
+public:
+	TrapEngine() :
+		PreloadEngineBase("TRAP", tableCapacity)
+	{
+	}
+
+	int registerBreakpoint(unsigned long addr)
+	{
+		return setTrap(addr);
+	}
+
+private:
+	// Entries, a power of two. Mostly untouched, so it's cheap even for small programs
+	static const uint32_t tableCapacity = 4 * 1024 * 1024;
+
+	// From PreloadEngineBase
+	bool collectHits()
+	{
+		m_hitAddresses.clear();
+		collectTraps(m_hitAddresses);
+
+		reportHits(m_hitAddresses.data(), m_hitAddresses.size());
+
+		return !m_hitAddresses.empty();
+	}
+
+	typedef std::vector<uint64_t> AddressList_t;
+
+	AddressList_t m_hitAddresses;
+};
+
+
+
+class TrapEngineCreator : public IEngineFactory::IEngineCreator
+{
+public:
+	virtual ~TrapEngineCreator()
+	{
+	}
+
+	virtual IEngine *create(IFileParser &parser)
+	{
+		return new TrapEngine();
+	}
+
+	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+#if defined(__i386__) || defined(__x86_64__)
+		// Only on request, and only for ELF files. Wins over ptrace then
+		if (IConfiguration::getInstance().keyAsInt("trap-handler") &&
+				dataSize >= 4 && memcmp(data, "\x7f" "ELF", 4) == 0)
+			return 2;
+#endif
+
+		return match_none;
+	}
+};
+
+static TrapEngineCreator g_trapEngineCreator;
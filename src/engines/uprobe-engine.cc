@@ -0,0 +1,633 @@
+#include "preload-engine-base.hh"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+using namespace kcov;
+
+/*
+ * Engine where the breakpoints are kernel uprobes, so hits are handled
+ * in-kernel without stopping the process. The samples are read in batches
+ * from a perf ring buffer.
+ *
+ * The probes are defined through tracefs, many to an event. An event is
+ * enabled by opening a perf tracepoint event for the traced process, and
+ * removing it costs an RCU grace period (tens of ms) on close. That's too
+ * slow to pay per probe. Probes are instead removed after their first hit
+ * by moving the rest of the probes of their event to a new one, and closing
+ * the old in the background. Events with hits in the same batch are replaced
+ * together, so a batch costs defining their remaining probes once.
+ *
+ * The perf events are inherited, so threads created after a probe is set
+ * are covered. Forked processes might not be, since the kernel only sets
+ * per-process uprobes in the address space of the traced process.
+ *
+ * Defining a probe is linear in the number of probes already defined, so
+ * this suits programs with many hits rather than many breakpoints. Probes in
+ * solibs which aren't mapped yet are set when the process reports new solibs.
+ */
+class UprobeEngine : public PreloadEngineBase
+{
+public:
+	UprobeEngine() :
+		// The trap table is only used for solib notifications here
+		PreloadEngineBase("UPROBE", 64),
+		m_uprobeEventsFd(-1),
+		m_eventCount(0),
+		m_mappedGeneration(0),
+		m_ringFd(-1),
+		m_ring(NULL),
+		m_ringSize(0),
+		m_lostShown(false),
+		m_errorShown(false),
+		m_closerValid(false),
+		m_closerShouldExit(false)
+	{
+	}
+
+	~UprobeEngine()
+	{
+		for (ProbeEventList_t::iterator it = m_events.begin();
+				it != m_events.end();
+				++it)
+			retire(*it);
+		m_events.clear();
+
+		if (m_closerValid) {
+			void *rv;
+
+			m_closeMutex.lock();
+			m_closerShouldExit = true;
+			m_closeMutex.unlock();
+			m_closeCondition.notify_all();
+
+			pthread_join(m_closer, &rv);
+		}
+
+		// The closer is gone, so do the rest here
+		closeEvents();
+
+		if (m_ring)
+			munmap(m_ring, m_ringSize);
+		if (m_ringFd >= 0)
+			close(m_ringFd);
+		if (m_uprobeEventsFd >= 0)
+			close(m_uprobeEventsFd);
+	}
+
+	bool start(IEventListener &listener, const std::string &executable)
+	{
+		static const char *tracefsPaths[] = {"/sys/kernel/tracing", "/sys/kernel/debug/tracing"};
+
+		for (unsigned int i = 0; i < sizeof(tracefsPaths) / sizeof(tracefsPaths[0]); i++) {
+			std::string path = fmt("%s/uprobe_events", tracefsPaths[i]);
+
+			m_uprobeEventsFd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+			if (m_uprobeEventsFd >= 0) {
+				m_tracefs = tracefsPaths[i];
+				break;
+			}
+		}
+
+		if (m_uprobeEventsFd < 0) {
+			error("kcov: Can't open uprobe_events in tracefs (needs root and tracefs mounted)\n");
+			return false;
+		}
+		m_group = fmt("kcov_%d", getpid());
+
+		if (!PreloadEngineBase::start(listener, executable))
+			return false;
+
+		if (!setupRing())
+			return false;
+
+		sigset_t all, old;
+
+		// Like the solib worker, keep signals (SIGINT, SIGCHLD) for the main thread
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		m_closerValid = pthread_create(&m_closer, NULL,
+				UprobeEngine::closerThreadStatic, (void *)this) == 0;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		return true;
+	}
+
+	int registerBreakpoint(unsigned long addr)
+	{
+		if (addr == 0 || m_ringFd < 0)
+			return -1;
+
+		// There already?
+		if (m_probes.find(addr) != m_probes.end())
+			return 0;
+
+		m_probes[addr] = Probe();
+		m_pendingProbes.push_back(addr);
+
+		return 0;
+	}
+
+	bool continueExecution()
+	{
+		// Probes which had no mapping might be in the solibs reported since
+		if (!m_unmappedProbes.empty() && solibGeneration() != m_mappedGeneration) {
+			m_pendingProbes.insert(m_pendingProbes.end(), m_unmappedProbes.begin(), m_unmappedProbes.end());
+			m_unmappedProbes.clear();
+		}
+
+		// New solibs might be mapped since the last time
+		if (!m_pendingProbes.empty()) {
+			m_mappedGeneration = solibGeneration();
+			readMappings();
+
+			for (size_t i = 0; i < m_pendingProbes.size(); i += maxProbesPerEvent) {
+				size_t n = std::min((size_t)maxProbesPerEvent, m_pendingProbes.size() - i);
+
+				createEvent(&m_pendingProbes[i], n);
+			}
+			m_pendingProbes.clear();
+		}
+
+		return PreloadEngineBase::continueExecution();
+	}
+
+private:
+	class Mapping
+	{
+	public:
+		Mapping(uint64_t start, uint64_t end, uint64_t offset, const std::string &path) :
+			m_start(start), m_end(end), m_offset(offset), m_path(path)
+		{
+		}
+
+		bool operator<(const Mapping &other) const
+		{
+			return m_start < other.m_start;
+		}
+
+		uint64_t m_start;
+		uint64_t m_end;
+		uint64_t m_offset;
+		std::string m_path;
+	};
+
+	typedef std::vector<uint64_t> AddressList_t;
+
+	// A tracefs uprobe event with a number of probes
+	class ProbeEvent
+	{
+	public:
+		ProbeEvent(const std::string &name) :
+			m_name(name), m_fd(-1), m_hit(false)
+		{
+		}
+
+		std::string m_name;
+		int m_fd;
+		AddressList_t m_addrs;
+		bool m_hit; // Replaced after the current batch
+	};
+
+	class Probe
+	{
+	public:
+		Probe() :
+			m_event(NULL), m_hit(false)
+		{
+		}
+
+		ProbeEvent *m_event;
+		bool m_hit;
+	};
+
+	typedef std::vector<Mapping> MappingList_t;
+	typedef std::unordered_map<uint64_t, Probe> ProbeMap_t;
+	typedef std::vector<ProbeEvent *> ProbeEventList_t;
+	typedef std::list<ProbeEvent *> CloseList_t;
+
+	// Defining probes gets slower with the number already in the event
+	static const unsigned int maxProbesPerEvent = 1024;
+
+	// Power of two number of data pages
+	static const unsigned int ringPages = 256;
+
+	int perfEventOpen(struct perf_event_attr &attr)
+	{
+		return syscall(SYS_perf_event_open, &attr, m_child, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	bool setupRing()
+	{
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_DUMMY;
+		attr.sample_type = PERF_SAMPLE_IP;
+		// Wake up kcov when a quarter is filled, it polls anyway
+		attr.watermark = 1;
+		attr.wakeup_watermark = ringPages * getpagesize() / 4;
+
+		m_ringFd = perfEventOpen(attr);
+		if (m_ringFd < 0) {
+			error("kcov: Can't open perf event for %d: %s\n", m_child, strerror(errno));
+			return false;
+		}
+
+		m_ringSize = (ringPages + 1) * getpagesize();
+		void *p = mmap(NULL, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_ringFd, 0);
+		if (p == MAP_FAILED) {
+			error("kcov: Can't map perf ring buffer\n");
+			return false;
+		}
+		m_ring = (struct perf_event_mmap_page *)p;
+
+		return true;
+	}
+
+	// Define the probes in tracefs and enable them for the traced process
+	void createEvent(const uint64_t *addrs, size_t n)
+	{
+		ProbeEvent *ev = new ProbeEvent(fmt("p%u", m_eventCount++));
+		std::string commands;
+
+		for (size_t i = 0; i < n; i++) {
+			const Mapping *mapping = findMapping(addrs[i]);
+
+			if (!mapping) {
+				kcov_debug(BP_MSG, "No mapping for 0x%llx\n", (unsigned long long)addrs[i]);
+				m_unmappedProbes.push_back(addrs[i]);
+				continue;
+			}
+
+			// Spaces can't be escaped in probe definitions
+			if (mapping->m_path.find(' ') != std::string::npos) {
+				kcov_debug(BP_MSG, "Can't probe 0x%llx in %s\n", (unsigned long long)addrs[i],
+						mapping->m_path.c_str());
+				continue;
+			}
+
+			std::string cur = fmt("p:%s/%s %s:0x%llx\n", m_group.c_str(), ev->m_name.c_str(),
+					mapping->m_path.c_str(),
+					(unsigned long long)(addrs[i] - mapping->m_start + mapping->m_offset));
+
+			// tracefs parses at most a page at a time, in whole lines
+			if (commands.size() + cur.size() > 4000 && !writeCommands(commands))
+				break;
+
+			commands += cur;
+			ev->m_addrs.push_back(addrs[i]);
+		}
+
+		if (ev->m_addrs.empty() || !writeCommands(commands) || !enableEvent(ev)) {
+			deleteEvent(ev);
+			delete ev;
+
+			return;
+		}
+
+		for (AddressList_t::const_iterator it = ev->m_addrs.begin();
+				it != ev->m_addrs.end();
+				++it) {
+			m_probes[*it].m_event = ev;
+			kcov_debug(BP_MSG, "BP registered at 0x%llx\n", (unsigned long long)*it);
+		}
+
+		m_events.push_back(ev);
+	}
+
+	bool writeCommands(std::string &commands)
+	{
+		bool out = write(m_uprobeEventsFd, commands.c_str(), commands.size()) == (ssize_t)commands.size();
+
+		if (!out && !m_errorShown) {
+			warning("kcov: Can't define uprobes: %s\n", strerror(errno));
+			m_errorShown = true;
+		}
+		commands.clear();
+
+		return out;
+	}
+
+	bool enableEvent(ProbeEvent *ev)
+	{
+		std::string idPath = fmt("%s/events/%s/%s/id", m_tracefs.c_str(), m_group.c_str(), ev->m_name.c_str());
+		FILE *fp = fopen(idPath.c_str(), "r");
+		int id;
+
+		if (!fp)
+			return false;
+
+		bool found = fscanf(fp, "%d", &id) == 1;
+		fclose(fp);
+		if (!found)
+			return false;
+
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_TRACEPOINT;
+		attr.config = id;
+		attr.sample_period = 1;
+		attr.sample_type = PERF_SAMPLE_IP;
+		attr.inherit = 1;
+
+		ev->m_fd = perfEventOpen(attr);
+		if (ev->m_fd < 0) {
+			// ESRCH when rolling over the last hits after the process exited
+			if (!m_errorShown && errno != ESRCH)
+				warning("kcov: Can't enable uprobes: %s\n", strerror(errno));
+			m_errorShown = true;
+
+			return false;
+		}
+
+		if (ioctl(ev->m_fd, PERF_EVENT_IOC_SET_OUTPUT, m_ringFd) < 0) {
+			kcov_debug(ENGINE_MSG, "UPROBE can't redirect %s\n", ev->m_name.c_str());
+			close(ev->m_fd);
+			ev->m_fd = -1;
+
+			return false;
+		}
+
+		return true;
+	}
+
+	void deleteEvent(ProbeEvent *ev)
+	{
+		std::string command = fmt("-:%s/%s\n", m_group.c_str(), ev->m_name.c_str());
+
+		if (write(m_uprobeEventsFd, command.c_str(), command.size()) < 0)
+			kcov_debug(ENGINE_MSG, "UPROBE can't delete %s\n", ev->m_name.c_str());
+	}
+
+	// Replace events with ones without the probes which have hit
+	void rollover(const ProbeEventList_t &events)
+	{
+		AddressList_t left;
+
+		for (ProbeEventList_t::const_iterator evIt = events.begin();
+				evIt != events.end();
+				++evIt) {
+			ProbeEvent *ev = *evIt;
+
+			for (AddressList_t::const_iterator it = ev->m_addrs.begin();
+					it != ev->m_addrs.end();
+					++it) {
+				Probe &probe = m_probes[*it];
+
+				// Samples from the old event can still be in the ring
+				probe.m_event = NULL;
+				if (!probe.m_hit)
+					left.push_back(*it);
+			}
+		}
+
+		// The new events first, so that no hits are missed in between
+		for (size_t i = 0; i < left.size(); i += maxProbesPerEvent) {
+			size_t n = std::min((size_t)maxProbesPerEvent, left.size() - i);
+
+			createEvent(&left[i], n);
+		}
+
+		for (ProbeEventList_t::const_iterator it = events.begin();
+				it != events.end();
+				++it) {
+			m_events.erase(std::find(m_events.begin(), m_events.end(), *it));
+			retire(*it);
+		}
+	}
+
+	// Stop sampling right away, close (which removes the probes) in the background
+	void retire(ProbeEvent *ev)
+	{
+		ioctl(ev->m_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+		m_closeMutex.lock();
+		m_closeList.push_back(ev);
+		m_closeMutex.unlock();
+		m_closeCondition.notify_one();
+	}
+
+	void closeEvents()
+	{
+		std::unique_lock<std::mutex> lock(m_closeMutex);
+
+		while (!m_closeList.empty()) {
+			ProbeEvent *ev = m_closeList.front();
+
+			m_closeList.pop_front();
+			lock.unlock();
+
+			close(ev->m_fd);
+			deleteEvent(ev);
+			delete ev;
+
+			lock.lock();
+		}
+	}
+
+	static void *closerThreadStatic(void *pThis)
+	{
+		UprobeEngine *p = (UprobeEngine *)pThis;
+
+		p->closerThread();
+
+		return NULL;
+	}
+
+	void closerThread()
+	{
+		while (1) {
+			{
+				std::unique_lock<std::mutex> lock(m_closeMutex);
+
+				while (m_closeList.empty() && !m_closerShouldExit)
+					m_closeCondition.wait(lock);
+
+				if (m_closeList.empty() && m_closerShouldExit)
+					break;
+			}
+
+			closeEvents();
+		}
+	}
+
+	const Mapping *findMapping(uint64_t addr) const
+	{
+		Mapping key(addr, 0, 0, "");
+		MappingList_t::const_iterator it = std::upper_bound(m_mappings.begin(), m_mappings.end(), key);
+
+		if (it == m_mappings.begin())
+			return NULL;
+		--it;
+
+		if (addr >= it->m_end)
+			return NULL;
+
+		return &*it;
+	}
+
+	void readMappings()
+	{
+		std::string path = fmt("/proc/%d/maps", m_child);
+		FILE *fp = fopen(path.c_str(), "r");
+
+		if (!fp)
+			return;
+
+		m_mappings.clear();
+
+		char line[4096];
+		while (fgets(line, sizeof(line), fp)) {
+			unsigned long long start, end, offset;
+			char perms[8];
+			int pathStart = 0;
+
+			if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms, &offset, &pathStart) < 4)
+				continue;
+
+			// Only executable file mappings can have probes
+			if (perms[2] != 'x' || pathStart == 0 || line[pathStart] != '/')
+				continue;
+
+			std::string file = trim_string(std::string(&line[pathStart]));
+
+			m_mappings.push_back(Mapping(start, end, offset, file));
+		}
+		fclose(fp);
+
+		std::sort(m_mappings.begin(), m_mappings.end());
+	}
+
+	// From PreloadEngineBase
+	bool collectHits()
+	{
+		uint64_t head = __atomic_load_n(&m_ring->data_head, __ATOMIC_ACQUIRE);
+		uint64_t tail = m_ring->data_tail;
+		uint8_t *data = (uint8_t *)m_ring + getpagesize();
+		uint64_t size = ringPages * getpagesize();
+
+		if (head == tail)
+			return false;
+
+		ProbeEventList_t hitEvents;
+
+		m_hitAddresses.clear();
+		while (tail < head) {
+			uint8_t buf[sizeof(struct perf_event_header) + sizeof(uint64_t)];
+			struct perf_event_header *hdr = (struct perf_event_header *)buf;
+			uint64_t offs = tail % size;
+
+			// The records are small, so copy the start out to handle wrapping
+			for (unsigned int i = 0; i < sizeof(buf); i++)
+				buf[i] = data[(offs + i) % size];
+
+			if (hdr->size == 0)
+				break;
+
+			if (hdr->type == PERF_RECORD_SAMPLE) {
+				uint64_t ip = *(uint64_t *)(buf + sizeof(*hdr));
+				ProbeMap_t::iterator it = m_probes.find(ip);
+
+				if (it != m_probes.end() && !it->second.m_hit) {
+					ProbeEvent *ev = it->second.m_event;
+
+					it->second.m_hit = true;
+					m_hitAddresses.push_back(ip);
+
+					if (ev && !ev->m_hit) {
+						ev->m_hit = true;
+						hitEvents.push_back(ev);
+					}
+				}
+			} else if (hdr->type == PERF_RECORD_LOST && !m_lostShown) {
+				warning("kcov: uprobe samples lost, some lines might not be reported\n");
+				m_lostShown = true;
+			}
+
+			tail += hdr->size;
+		}
+
+		__atomic_store_n(&m_ring->data_tail, tail, __ATOMIC_RELEASE);
+
+		reportHits(m_hitAddresses.data(), m_hitAddresses.size());
+
+		// Hit probes keep trapping into the kernel until removed
+		if (!hitEvents.empty())
+			rollover(hitEvents);
+
+		return !m_hitAddresses.empty();
+	}
+
+	int hitNotificationFd()
+	{
+		return m_ringFd;
+	}
+
+	std::string m_tracefs;
+	std::string m_group;
+	int m_uprobeEventsFd;
+	unsigned int m_eventCount;
+	uint32_t m_mappedGeneration;
+
+	int m_ringFd;
+	struct perf_event_mmap_page *m_ring;
+	size_t m_ringSize;
+
+	MappingList_t m_mappings;
+	ProbeMap_t m_probes;
+	AddressList_t m_pendingProbes;
+	AddressList_t m_unmappedProbes;
+	ProbeEventList_t m_events;
+	AddressList_t m_hitAddresses;
+	bool m_lostShown;
+	bool m_errorShown;
+
+	pthread_t m_closer;
+	bool m_closerValid;
+	bool m_closerShouldExit;
+	std::mutex m_closeMutex;
+	std::condition_variable m_closeCondition;
+	CloseList_t m_closeList;
+};
+
+
+
+class UprobeEngineCreator : public IEngineFactory::IEngineCreator
+{
+public:
+	virtual ~UprobeEngineCreator()
+	{
+	}
+
+	virtual IEngine *create(IFileParser &parser)
+	{
+		return new UprobeEngine();
+	}
+
+	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+		// Needs the trap handler for the solib notifications, so x86 only
+#if defined(__i386__) || defined(__x86_64__)
+		if (IConfiguration::getInstance().keyAsInt("uprobes") &&
+				dataSize >= 4 && memcmp(data, "\x7f" "ELF", 4) == 0)
+			return 2;
+#endif
+
+		return match_none;
+	}
+};
+
+static UprobeEngineCreator g_uprobeEngineCreator;
@@ -1,9 +1,11 @@
 #include <filter.hh>
 #include <configuration.hh>
+#include <statistics.hh>
 #include <utils.hh>
 
 #include <limits.h>
 #include <stdlib.h>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -28,6 +30,24 @@ public:
 		return true;
 	}
 
+	bool runFilters(FileId file)
+	{
+		// The solib parser thread filters as well
+		std::lock_guard<std::mutex> lock(m_fileResultsMutex);
+
+		if (file >= m_fileResults.size())
+			m_fileResults.resize(file + 1, FILTER_UNKNOWN);
+
+		if (m_fileResults[file] == FILTER_UNKNOWN) {
+			StatisticsScope scope(IStatistics::PHASE_FILTER);
+
+			m_fileResults[file] = runFilters(IPathInterner::getInstance().getPath(file)) ?
+					FILTER_INCLUDED : FILTER_EXCLUDED;
+		}
+
+		return m_fileResults[file] == FILTER_INCLUDED;
+	}
+
 	virtual bool runLineFilters(const std::string &filePath,
 						unsigned int lineNr,
 						const std::string &line)
@@ -41,6 +61,13 @@ public:
 	}
 
 protected:
+	enum FilterResult
+	{
+		FILTER_UNKNOWN,
+		FILTER_INCLUDED,
+		FILTER_EXCLUDED,
+	};
+
 	class FileLineHandler
 	{
 	public:
@@ -142,6 +169,8 @@ protected:
 	};
 
 	FileLineHandler *m_fileLineHandler;
+	std::mutex m_fileResultsMutex;
+	std::vector<uint8_t> m_fileResults; // By file ID
 };
 
 class Filter : public BasicFilter
@@ -171,8 +200,13 @@ public:
 		m_patternHandler = new PatternHandler();
 		m_pathHandler = new PathHandler();
 		m_fileLineHandler = new FileLineHandler();
+
+		std::lock_guard<std::mutex> lock(m_fileResultsMutex);
+		m_fileResults.clear();
 	}
 
+	using BasicFilter::runFilters;
+
 	bool runFilters(const std::string &file)
 	{
 		bool out = true;
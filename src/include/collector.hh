@@ -2,6 +2,9 @@
 
 #include <string>
 
+#include <stddef.h>
+#include <stdint.h>
+
 namespace kcov
 {
 	class IFileParser;
@@ -24,6 +27,30 @@ namespace kcov
 			 * @param hits the number of hits for the address
 			 */
 			virtual void onAddressHit(uint64_t addr, unsigned long hits) = 0;
+
+			/**
+			 * Called with a batch of addresses, each hit once.
+			 *
+			 * @param addrs the addresses which just got executed
+			 * @param n the number of entries in @a addrs
+			 */
+			virtual void onAddressHits(const uint64_t *addrs, size_t n)
+			{
+				for (size_t i = 0; i < n; i++)
+					onAddressHit(addrs[i], 1);
+			}
+
+			/**
+			 * Called with the addresses a process has hit, when it has exited
+			 * or at the end of the run. Only with --per-process.
+			 *
+			 * @param pid the process
+			 * @param addrs the addresses, each once
+			 * @param n the number of entries in @a addrs
+			 */
+			virtual void onProcessHits(int pid, const uint64_t *addrs, size_t n)
+			{
+			}
 		};
 
 		class IEventTickListener
@@ -20,6 +20,8 @@ namespace kcov
 			MODE_MERGE_ONLY         = 4,
 			MODE_SYSTEM_RECORD      = 5,
 			MODE_SYSTEM_REPORT      = 6,
+			MODE_SERVER             = 7,
+			MODE_TEST_QUERY         = 8,
 		} RunMode_t;
 
 		class IListener
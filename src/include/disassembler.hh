@@ -16,6 +16,9 @@ namespace kcov
 
 		/**
 		 * Setup the verifier with an ELF file header
+		 *
+		 * Sections added for a previous file are dropped, since addresses
+		 * of different files (solibs, PIEs) overlap.
 		 */
 		virtual void setup(const void *header, size_t headerSize) = 0;
 
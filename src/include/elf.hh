@@ -70,6 +70,11 @@ namespace kcov
 			return m_vaddr;
 		}
 
+		uint64_t getPhysicalBase() const
+		{
+			return m_paddr;
+		}
+
 		const void *getData() const
 		{
 			return m_data;
@@ -89,6 +94,58 @@ namespace kcov
 		size_t m_size;
 	};
 
+	/**
+	 * Sorted index of segments, for looking up the segment of an address
+	 * without scanning all of them. Segments are not expected to overlap.
+	 */
+	class SegmentIndex
+	{
+	public:
+		SegmentIndex();
+
+		/**
+		 * Rebuild the index. @a segments must stay unchanged while it's used.
+		 *
+		 * @param segments the segments to index
+		 */
+		void setup(const std::vector<Segment> &segments);
+
+		/**
+		 * Lookup the segment containing an address
+		 *
+		 * @param addr the address to lookup
+		 *
+		 * @return the segment, or NULL if no segment contains @a addr
+		 */
+		const Segment *lookup(uint64_t addr) const;
+
+	private:
+		class Entry
+		{
+		public:
+			Entry(uint64_t start, uint64_t end, const Segment *segment) :
+				m_start(start), m_end(end), m_segment(segment)
+			{
+			}
+
+			bool operator<(const Entry &other) const
+			{
+				return m_start < other.m_start;
+			}
+
+			uint64_t m_start;
+			uint64_t m_end;
+			const Segment *m_segment;
+		};
+
+		typedef std::vector<Entry> EntryList_t;
+
+		EntryList_t m_entries; //< Sorted by start address
+
+		// Lines are typically looked up in address order
+		mutable const Entry *m_last;
+	};
+
 
 	class IElf
 	{
@@ -112,8 +169,20 @@ namespace kcov
 
 		virtual const std::vector<Segment> &getSegments() = 0;
 
+		/**
+		 * Return the file data, which is mapped and shared with other
+		 * views of the same file
+		 */
 		virtual void *getRawData(size_t &sz) = 0;
 
+		/**
+		 * Get a checksum of the file: from the build-id if there is one,
+		 * otherwise a hash of the contents.
+		 *
+		 * @return the checksum
+		 */
+		virtual uint64_t getChecksum() = 0;
+
 		static IElf *create(const std::string &filename);
 	};
 }
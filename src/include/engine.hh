@@ -19,6 +19,7 @@ namespace kcov
 		ev_exit        =  3,
 		ev_exit_first_process = 4,
 		ev_signal_exit =  5,
+		ev_process_exit = 6, //< A traced process and all its threads are gone
 	};
 
 	/**
@@ -30,10 +31,11 @@ namespace kcov
 		class Event
 		{
 		public:
-			Event(enum event_type type = ev_signal, int data = 0, uint64_t address = 0) :
+			Event(enum event_type type = ev_signal, int data = 0, uint64_t address = 0, int pid = 0) :
 				type(type),
 				data(data),
-				addr(address)
+				addr(address),
+				pid(pid)
 			{
 			}
 
@@ -41,12 +43,29 @@ namespace kcov
 
 			int data; // Typically the breakpoint
 			uint64_t addr;
+			int pid; // The process (not thread), where the engine tells. Otherwise 0
 		};
 
 		class IEventListener
 		{
 		public:
 			virtual void onEvent(const Event &ev) = 0;
+
+			/**
+			 * Report a batch of breakpoint hits in one go.
+			 *
+			 * Engines which collect many hits at a time should use this
+			 * instead of one onEvent() per hit. The default implementation
+			 * just does that though.
+			 *
+			 * @param addrs the breakpoint addresses which were hit
+			 * @param n the number of entries in @a addrs
+			 */
+			virtual void onBreakpoints(const uint64_t *addrs, size_t n)
+			{
+				for (size_t i = 0; i < n; i++)
+					onEvent(Event(ev_breakpoint, 0, addrs[i]));
+			}
 		};
 
 
@@ -61,6 +80,17 @@ namespace kcov
 		 */
 		virtual int registerBreakpoint(unsigned long addr) = 0;
 
+		/**
+		 * Code which belongs to the lines with breakpoints, for engines which
+		 * attribute hits at other addresses to lines
+		 *
+		 * @param start the first address
+		 * @param end the address after the range
+		 */
+		virtual void registerCodeRange(uint64_t start, uint64_t end)
+		{
+		}
+
 		/**
 		 * Fork a new process and attach to it
 		 *
@@ -7,9 +7,11 @@
 #include <string.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <utils.hh>
+#include <path-interner.hh>
 
 struct phdr_data_entry;
 
@@ -61,6 +63,168 @@ namespace kcov
 		public:
 			virtual void onLine(const std::string &file, unsigned int lineNr,
 					uint64_t addr) = 0;
+
+			/**
+			 * Called instead of onLine when the basic block of the address
+			 * is known. All lines in a basic block are executed together, so
+			 * it's enough to catch the first instruction of the block.
+			 *
+			 * @param blockAddr the (relocated) start address of the basic block
+			 */
+			virtual void onBasicBlockLine(const std::string &file, unsigned int lineNr,
+					uint64_t addr, uint64_t blockAddr)
+			{
+				onLine(file, lineNr, addr);
+			}
+
+			/**
+			 * Called instead of the above by parsers which intern their source
+			 * paths. Listeners which keep per-file state can override this
+			 * to avoid hashing the path for every line.
+			 *
+			 * @param file the interned source file
+			 * @param blockAddr the basic block start address, or 0 if not known
+			 */
+			virtual void onFileLine(FileId file, unsigned int lineNr,
+					uint64_t addr, uint64_t blockAddr)
+			{
+				const std::string &path = IPathInterner::getInstance().getPath(file);
+
+				if (blockAddr)
+					onBasicBlockLine(path, lineNr, addr, blockAddr);
+				else
+					onLine(path, lineNr, addr);
+			}
+
+			/**
+			 * Called with all lines of a source file found in one parse, so
+			 * that per-file work is done once. Rows are in the order the
+			 * parser found them.
+			 *
+			 * @param file the interned source file
+			 * @param lineNrs the line numbers
+			 * @param addrs the addresses
+			 * @param blockAddrs the basic block start addresses, 0 if not known
+			 * @param n the number of rows
+			 */
+			virtual void onFileLines(FileId file, const unsigned int *lineNrs,
+					const uint64_t *addrs, const uint64_t *blockAddrs, size_t n)
+			{
+				for (size_t i = 0; i < n; i++)
+					onFileLine(file, lineNrs[i], addrs[i], blockAddrs[i]);
+			}
+
+			/**
+			 * The code of reported lines is in [@a start, @a end). Only from
+			 * parsers which know where the lines end (DWARF).
+			 */
+			virtual void onCodeRange(uint64_t start, uint64_t end)
+			{
+			}
+		};
+
+		/**
+		 * Lines collected per source file, to be delivered with onFileLines()
+		 */
+		class LineBatch
+		{
+		public:
+			LineBatch()
+			{
+			}
+
+			~LineBatch()
+			{
+				clear();
+			}
+
+			void add(FileId file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+			{
+				if (file >= m_filesById.size())
+					m_filesById.resize(file + 1, NULL);
+
+				FileLines *cur = m_filesById[file];
+
+				if (!cur) {
+					cur = new FileLines();
+					m_filesById[file] = cur;
+					m_order.push_back(file);
+				}
+
+				cur->m_lineNrs.push_back(lineNr);
+				cur->m_addrs.push_back(addr);
+				cur->m_blockAddrs.push_back(blockAddr);
+			}
+
+			void add(FileId file, const unsigned int *lineNrs, const uint64_t *addrs,
+					const uint64_t *blockAddrs, size_t n)
+			{
+				for (size_t i = 0; i < n; i++)
+					add(file, lineNrs[i], addrs[i], blockAddrs[i]);
+			}
+
+			/**
+			 * Deliver the lines with one call per file, in the order the files
+			 * were first seen.
+			 */
+			void addRange(uint64_t start, uint64_t end)
+			{
+				m_ranges.push_back(std::pair<uint64_t, uint64_t>(start, end));
+			}
+
+			void deliver(ILineListener &listener) const
+			{
+				for (std::vector<FileId>::const_iterator it = m_order.begin();
+						it != m_order.end();
+						++it) {
+					const FileLines *cur = m_filesById[*it];
+
+					listener.onFileLines(*it, cur->m_lineNrs.data(), cur->m_addrs.data(),
+							cur->m_blockAddrs.data(), cur->m_addrs.size());
+				}
+
+				for (RangeList_t::const_iterator it = m_ranges.begin();
+						it != m_ranges.end();
+						++it)
+					listener.onCodeRange(it->first, it->second);
+			}
+
+			bool empty() const
+			{
+				return m_order.empty() && m_ranges.empty();
+			}
+
+			void clear()
+			{
+				for (std::vector<FileId>::const_iterator it = m_order.begin();
+						it != m_order.end();
+						++it) {
+					delete m_filesById[*it];
+					m_filesById[*it] = NULL;
+				}
+
+				m_order.clear();
+				m_ranges.clear();
+			}
+
+		private:
+			typedef std::vector<std::pair<uint64_t, uint64_t> > RangeList_t;
+
+			class FileLines
+			{
+			public:
+				std::vector<unsigned int> m_lineNrs;
+				std::vector<uint64_t> m_addrs;
+				std::vector<uint64_t> m_blockAddrs;
+			};
+
+			// Not copyable
+			LineBatch(const LineBatch &other);
+			LineBatch &operator=(const LineBatch &other);
+
+			std::vector<FileLines *> m_filesById;
+			std::vector<FileId> m_order;
+			RangeList_t m_ranges;
 		};
 
 		/**
@@ -116,6 +280,35 @@ namespace kcov
 		 */
 		virtual void registerFileListener(IFileListener &listener) = 0;
 
+		/**
+		 * Divert line and file notifications to the given listeners instead
+		 * of the registered ones, or restore them by passing NULL. Used to
+		 * parse files on a background thread and deliver the result later.
+		 *
+		 * @param lineListener the listener for lines while diverted
+		 * @param fileListener the listener for files while diverted
+		 *
+		 * @return true if the parser supports diverting notifications
+		 */
+		virtual bool divertListeners(ILineListener *lineListener, IFileListener *fileListener)
+		{
+			return false;
+		}
+
+		/**
+		 * Deliver previously diverted lines to the registered listeners
+		 */
+		virtual void deliverLines(const LineBatch &lines)
+		{
+		}
+
+		/**
+		 * Deliver a previously diverted file to the registered listeners
+		 */
+		virtual void deliverFile(const File &file)
+		{
+		}
+
 		/**
 		 * Parse the added files
 		 *
@@ -123,6 +316,18 @@ namespace kcov
 		 */
 		virtual bool parse() = 0;
 
+		/**
+		 * Do the expensive parts of parsing @a filename ahead of time, and
+		 * keep them for when the file is added later on in this process or
+		 * in processes forked from it (kcov --server). Nothing is reported
+		 * to the listeners.
+		 *
+		 * @param filename the file to parse
+		 */
+		virtual void warmUp(const std::string &filename)
+		{
+		}
+
 		/**
 		 * Get the checksum of the main file (not solibs)
 		 *
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <path-interner.hh>
+
 #include <string>
 
 namespace kcov
@@ -27,6 +29,15 @@ namespace kcov
 		 */
 		virtual bool runFilters(const std::string &path) = 0;
 
+		/**
+		 * Run filters on an interned path. The result is cached per file.
+		 *
+		 * @param file the file to check
+		 *
+		 * @return true if this file should be included in the output, false otherwise.
+		 */
+		virtual bool runFilters(FileId file) = 0;
+
 		/**
 		 * Run filters on file/line pair.
 		 *
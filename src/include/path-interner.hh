@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+namespace kcov
+{
+	/**
+	 * Interned source file path. IDs are small, dense and stable for the
+	 * lifetime of the process, so they can index plain vectors.
+	 */
+	typedef uint32_t FileId;
+
+	// Never returned by intern(), for marking unset IDs
+	static const FileId invalidFileId = 0xffffffff;
+
+	/**
+	 * Global map between source file paths and file IDs.
+	 *
+	 * Safe to use from the background parser threads.
+	 */
+	class IPathInterner
+	{
+	public:
+		virtual ~IPathInterner()
+		{
+		}
+
+		/**
+		 * Get the ID of a path, assigning a new one the first time it's seen
+		 *
+		 * @param path the path to lookup
+		 *
+		 * @return the ID for @a path
+		 */
+		virtual FileId intern(const std::string &path) = 0;
+
+		/**
+		 * Get the path of an ID
+		 *
+		 * @param id the ID, as returned by intern()
+		 *
+		 * @return a reference to the path, which stays valid
+		 */
+		virtual const std::string &getPath(FileId id) = 0;
+
+		/**
+		 * @return the number of interned paths, i.e., one more than the highest ID
+		 */
+		virtual size_t size() = 0;
+
+		static IPathInterner &getInstance();
+	};
+}
@@ -63,6 +63,18 @@ namespace kcov
 			 */
 			virtual void onAddress(uint64_t addr, unsigned long hits) = 0;
 
+			/**
+			 * A batch of addresses has been executed, each once.
+			 *
+			 * @param addrs the executed addresses
+			 * @param n the number of entries in @a addrs
+			 */
+			virtual void onAddresses(const uint64_t *addrs, size_t n)
+			{
+				for (size_t i = 0; i < n; i++)
+					onAddress(addrs[i], 1);
+			}
+
 			/**
 			 * Re-report on-lines from the file-parser.
 			 *
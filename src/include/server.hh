@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+
+namespace kcov
+{
+	/**
+	 * Runs one kcov invocation, as if from main()
+	 *
+	 * @return the exit code of kcov
+	 */
+	typedef int (*ServerRequestHandler_t)(unsigned int argc, const char *argv[]);
+
+	/**
+	 * Serve kcov --connect clients on a Unix socket until SIGINT/SIGTERM.
+	 *
+	 * Each request runs in a process forked from the server, in the
+	 * directory, environment and with the stdin/stdout/stderr of the
+	 * client. Binaries run earlier are kept parsed in the server (see
+	 * IFileParser::warmUp), so the forked runs start with that done.
+	 *
+	 * @param socketPath the path of the socket
+	 * @param handler runs each request
+	 *
+	 * @return the exit code of the server
+	 */
+	int runServer(const std::string &socketPath, ServerRequestHandler_t handler);
+
+	/**
+	 * Have a kcov --server run this invocation, and wait for it
+	 *
+	 * @return the exit code of the run
+	 */
+	int runClient(const std::string &socketPath, unsigned int argc, const char *argv[]);
+
+	/**
+	 * Called from a request: Keep @a file parsed in the server for the
+	 * requests after this one. Does nothing outside of the server.
+	 */
+	void requestWarmUp(const std::string &file);
+}
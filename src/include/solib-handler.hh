@@ -13,10 +13,16 @@ namespace kcov
 		}
 
 		virtual void startup() = 0;
+
+		// Wait for solibs still being parsed and hand them over to the listeners
+		virtual void stop() = 0;
 	};
 
 	ISolibHandler &createSolibHandler(IFileParser &parser, ICollector &collector);
 
-	// Wait for the solib thread to finish parsing the solib data
-	void blockUntilSolibDataRead();
+	// File descriptor which becomes readable on new solib data, -1 if there is none
+	int solibNotificationFd();
+
+	// Read out available solib data without blocking (parsed on the next tick)
+	void handleSolibNotification();
 }
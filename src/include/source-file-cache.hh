@@ -33,6 +33,12 @@ namespace kcov
 
 		virtual bool fileExists(const std::string &filePath) = 0;
 
+		/**
+		 * Forget files which have changed since they were read. Needed when
+		 * the cache outlives a run, like in kcov --server
+		 */
+		virtual void refresh() = 0;
+
 		static ISourceFileCache &getInstance();
 	};
 }
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+namespace kcov
+{
+	/**
+	 * Where kcov itself spends its time. Phases may nest (filtering happens
+	 * while parsing, for example), so their times don't add up to the total.
+	 *
+	 * Safe to use from the background parser threads.
+	 */
+	class IStatistics
+	{
+	public:
+		enum Phase
+		{
+			PHASE_PARSE,   //< ELF/DWARF parsing
+			PHASE_FILTER,  //< Evaluating the include/exclude filters
+			PHASE_ARM,     //< Writing breakpoints/instrumentation into the program
+			PHASE_TRACEE,  //< Waiting for the traced program to stop or report hits
+			PHASE_TRAP,    //< Handling the hits reported by the engine
+			PHASE_SOLIB,   //< Handling newly loaded shared libraries
+			PHASE_WRITE,   //< Producing the reports
+			PHASE_MARSHAL, //< Writing/reading the coverage database
+			N_PHASES
+		};
+
+		enum Counter
+		{
+			COUNTER_TRAPS,
+			COUNTER_PTRACE,
+			N_COUNTERS
+		};
+
+		virtual ~IStatistics()
+		{
+		}
+
+		/**
+		 * Start timing a phase
+		 *
+		 * @return the timestamp to pass to leave()
+		 */
+		virtual uint64_t enter(enum Phase phase) = 0;
+
+		/**
+		 * Stop timing a phase
+		 *
+		 * @param phase the phase passed to enter()
+		 * @param start what enter() returned
+		 */
+		virtual void leave(enum Phase phase, uint64_t start) = 0;
+
+		virtual void count(enum Counter counter, uint64_t n = 1) = 0;
+
+		/**
+		 * Also keep each phase as an event, for writeTrace()
+		 */
+		virtual void enableTrace() = 0;
+
+		/**
+		 * Start over, for runs forked from a process which already has some
+		 * statistics (kcov --server)
+		 */
+		virtual void reset() = 0;
+
+		/**
+		 * Write the phase times and counters as JSON, with the bytes written
+		 * by kcov where the system tells
+		 *
+		 * @param path the file to write
+		 *
+		 * @return true if the file could be written
+		 */
+		virtual bool writeStats(const std::string &path) = 0;
+
+		/**
+		 * Write the events recorded after enableTrace() in the Chrome trace
+		 * event format (for chrome://tracing or Perfetto)
+		 *
+		 * @param path the file to write
+		 *
+		 * @return true if the file could be written
+		 */
+		virtual bool writeTrace(const std::string &path) = 0;
+
+		static IStatistics &getInstance();
+	};
+
+	/**
+	 * Times a phase while in scope
+	 */
+	class StatisticsScope
+	{
+	public:
+		StatisticsScope(enum IStatistics::Phase phase) :
+			m_phase(phase),
+			m_start(IStatistics::getInstance().enter(phase))
+		{
+		}
+
+		~StatisticsScope()
+		{
+			IStatistics::getInstance().leave(m_phase, m_start);
+		}
+
+	private:
+		enum IStatistics::Phase m_phase;
+		uint64_t m_start;
+	};
+}
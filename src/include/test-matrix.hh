@@ -0,0 +1,86 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace kcov
+{
+	/**
+	 * Which tests covered which lines, for running only the tests affected
+	 * by a change. A test is the output directory of one kcov run.
+	 *
+	 * The lines of all files get an index (files sorted by name, then the
+	 * lines in order), and each test has a compressed bitmap over it.
+	 */
+	class ITestMatrix
+	{
+	public:
+		typedef std::vector<std::string> TestList_t;
+
+		virtual ~ITestMatrix()
+		{
+		}
+
+		/**
+		 * Get the tests which covered a line
+		 *
+		 * @param filename the source file, as in the reports
+		 * @param lineNr the line number
+		 *
+		 * @return the names of the tests, empty if the line is unknown
+		 */
+		virtual TestList_t getTests(const std::string &filename, unsigned int lineNr) = 0;
+
+		/**
+		 * @param filename the source file
+		 *
+		 * @return true if there are lines for @a filename in the matrix
+		 */
+		virtual bool hasFile(const std::string &filename) = 0;
+
+		/**
+		 * Map a matrix file written by ITestMatrixBuilder::write()
+		 *
+		 * @param path the file
+		 *
+		 * @return the matrix, or NULL if @a path can't be read or isn't a matrix
+		 */
+		static ITestMatrix *open(const std::string &path);
+	};
+
+	class ITestMatrixBuilder
+	{
+	public:
+		virtual ~ITestMatrixBuilder()
+		{
+		}
+
+		/**
+		 * Add a line which can be covered, hit or not
+		 *
+		 * @param filename the source file
+		 * @param lineNr the line number
+		 */
+		virtual void addLine(const std::string &filename, unsigned int lineNr) = 0;
+
+		/**
+		 * Add a line covered by a test. The line is added as well.
+		 *
+		 * @param test the name of the test
+		 * @param filename the source file
+		 * @param lineNr the line number
+		 */
+		virtual void addHit(const std::string &test, const std::string &filename, unsigned int lineNr) = 0;
+
+		/**
+		 * Write the matrix
+		 *
+		 * @param path the file to write
+		 *
+		 * @return true if the file could be written
+		 */
+		virtual bool write(const std::string &path) = 0;
+
+		static ITestMatrixBuilder &create();
+	};
+}
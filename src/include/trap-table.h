@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Breakpoint table shared between kcov and the trap handler in the
+ * preloaded solib wrapper. kcov adds entries and writes the breakpoint
+ * instructions, the handler restores the original instruction on a hit
+ * and sets the bit for the entry in the hit bitmap.
+ *
+ * Entries are an open-addressed hash table keyed on the address. An entry
+ * is published by storing the address last, and never removed.
+ */
+struct trap_table_entry
+{
+	uint64_t addr; // 0 for free entries
+	uint64_t data; // The original instruction bytes
+};
+
+struct trap_table
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity; // Number of entries, a power of two
+	uint32_t sync_timeout; // ms to wait for sync_ack
+
+	uint64_t hits; // Incremented on each hit, so kcov knows when to scan
+
+	/*
+	 * Traps which aren't in the table (i.e., the solib notifications)
+	 * bump sync_request and wait until kcov has set sync_ack to the same
+	 * value, so that breakpoints in new solibs are set before they run.
+	 */
+	uint32_t sync_request;
+	uint32_t sync_ack;
+
+	/*
+	 * Coverage map of an executable rewritten by kcov, which the handler
+	 * maps over the one in the executable at startup. Zero-sized if none.
+	 */
+	uint64_t coverage_addr; // Run-time address, page aligned
+	uint64_t coverage_size;
+	uint64_t coverage_offset; // In the table file, page aligned
+
+	struct trap_table_entry entries[];
+	// Followed by the hit bitmap, capacity / 64 words
+};
+
+#define TRAP_TABLE_MAGIC   0x6b747270 /* "ktrp" */
+#define TRAP_TABLE_VERSION 2
+
+static inline size_t trap_table_size(uint32_t capacity)
+{
+	return sizeof(struct trap_table) +
+			capacity * sizeof(struct trap_table_entry) +
+			capacity / 8;
+}
+
+static inline uint64_t *trap_table_bitmap(struct trap_table *p)
+{
+	return (uint64_t *)&p->entries[p->capacity];
+}
+
+static inline uint32_t trap_table_hash(const struct trap_table *p, uint64_t addr)
+{
+	// Fibonacci hashing, since instruction addresses are far from random
+	return (uint32_t)((addr * 0x9e3779b97f4a7c15ULL) >> 32) & (p->capacity - 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -43,6 +43,7 @@ enum debug_mask
 	ELF_MSG    =   4,
 	BP_MSG     =   8,
 	STATUS_MSG =  16,
+	STATS_MSG  =  32,
 };
 extern int g_kcov_debug_mask;
 
@@ -97,6 +98,15 @@ extern void *read_file(size_t *out_size, const char *fmt, ...) __attribute__((fo
 
 extern void *peek_file(size_t *out_size, const char *fmt, ...) __attribute__((format(printf,2,3)));
 
+/**
+ * Map a whole file privately into memory, instead of reading it.
+ *
+ * @return the file data, to be released with unmap_file(), or NULL
+ */
+extern void *map_file(size_t *out_size, const char *fmt, ...) __attribute__((format(printf,2,3)));
+
+extern void unmap_file(void *data, size_t size);
+
 extern std::string dir_concat(const std::string &dir, const std::string &filename);
 
 #define xwrite_file(data, len, dir...) do { \
@@ -121,6 +131,9 @@ extern const char *get_home();
 /**
  * Return true if a FILE * is readable without blocking.
  *
+ * Only the file descriptor is checked, so input already read into the
+ * stdio buffer isn't seen. Use unbuffered streams where that matters.
+ *
  * @param fp the file to read
  * @param ms the number of milliseconds to wait
  *
@@ -203,3 +216,9 @@ void mock_file_exists(bool (*callback)(const std::string &path));
 void mock_get_file_timestamp(uint64_t (*callback)(const std::string &path));
 
 uint32_t hash_block(const void *buf, size_t len);
+
+/**
+ * Hash a (large) block in fixed-size chunks on all CPUs, with CRC32C
+ * instructions where available. Not compatible with hash_block().
+ */
+uint64_t hash_block_parallel(const void *buf, size_t len);
@@ -14,31 +14,98 @@
 #include <linux/list.h>
 #include <linux/mutex.h>
 #include <linux/debugfs.h>
-#include <linux/workqueue.h>
+#include <linux/irq_work.h>
 #include <linux/wait.h>
 #include <linux/fs.h>
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
-#include <linux/seq_file.h>
 #include <linux/uaccess.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+
+/* Per-CPU hit ring size, must be a power of two */
+#define KPC_HIT_BUFFER_ENTRIES 8192
+#define KPC_HIT_BUFFER_MASK    (KPC_HIT_BUFFER_ENTRIES - 1)
+
+/* Max number of probes handled in one readout */
+#define KPC_READ_BATCH         512
+
+/* Set when the probe has been hit and handed over to the hit buffers */
+#define KPC_ENTRY_HIT          0
+/* Set (with the lock held) when the probe has been unregistered */
+#define KPC_ENTRY_UNREGISTERED 1
+
+/* Binary control writes, see struct kprobe_coverage_control */
+#define KPC_CONTROL_MAGIC      0x6b706362 /* "kpcb" */
+#define KPC_CONTROL_MAX_ADDRS  65536
+
+/* Number of kprobes registered with one register_kprobes() call */
+#define KPC_REGISTER_BATCH     64
+
+struct kprobe_coverage_entry;
+
+/*
+ * Single-producer/single-consumer ring of hit probes. The producer is the
+ * kprobe handler on the owning CPU, the consumer is the (serialized)
+ * reader, so no locks are needed.
+ */
+struct kpc_hit_buffer
+{
+	unsigned long head; /* Written by the producer */
+	unsigned long tail; /* Written by the consumer */
+
+	struct kprobe_coverage_entry *entries[KPC_HIT_BUFFER_ENTRIES];
+};
+
+/*
+ * Binary record returned from the "hits" file. Keep in sync with
+ * src/engines/kernel-engine.cc
+ */
+struct kprobe_coverage_hit
+{
+	u64 addr;         /* Offset from the module base (kernel address for vmlinux) */
+	u32 module_index; /* 0 is always the kernel */
+	u32 reserved;
+};
+
+/* Scratch space for one readout */
+struct kpc_read_batch
+{
+	struct kprobe_coverage_entry *entries[KPC_READ_BATCH];
+	struct kprobe *kps[KPC_READ_BATCH];
+	struct kprobe_coverage_hit hits[KPC_READ_BATCH];
+};
+
+/*
+ * Header of a binary control write, followed by n_addrs u64 addresses
+ * (offsets for modules). Keep in sync with src/engines/kernel-engine.cc
+ */
+struct kprobe_coverage_control
+{
+	u32 magic;
+	u32 n_addrs;
+	char module_name[64]; /* NUL-terminated, empty for the kernel */
+};
 
 struct kprobe_coverage
 {
 	struct dentry *debugfs_root;
 
-	struct workqueue_struct *workqueue;
 	wait_queue_head_t wait_queue;
+	struct irq_work wakeup_work;
 
-	/* Each coverage entry is on exactly one of these lists */
+	struct kpc_hit_buffer **hit_buffers; /* One per possible CPU */
+
+	/* Each non-hit coverage entry is on exactly one of these lists */
 	struct list_head deferred_list; /* Probes for not-yet-loaded-modules */
 
 	struct list_head pending_list;  /* Probes which has not yet triggered */
-	struct list_head hit_list;      /* Triggered probes awaiting readout */
 
 	const char *module_names[32];
 	unsigned int name_count;
 
 	struct mutex lock;
+	struct mutex read_lock; /* Serializes the hit buffer consumers */
 };
 
 struct kprobe_coverage_entry
@@ -46,9 +113,9 @@ struct kprobe_coverage_entry
 	struct kprobe kp;
 	int name_index; /* an index into the name table above (0 is always the kernel */
 	unsigned long base_addr;
+	unsigned long flags;
 
 	struct list_head lh;
-	struct work_struct work;
 };
 
 static struct kprobe_coverage *global_kpc;
@@ -95,37 +162,93 @@ static int kpc_allocate_module_name_index(struct kprobe_coverage *kpc,
 
 }
 
+static void kpc_wakeup_work(struct irq_work *work)
+{
+	struct kprobe_coverage *kpc = container_of(work, struct kprobe_coverage, wakeup_work);
+
+	wake_up(&kpc->wait_queue);
+}
+
 static int kpc_pre_handler(struct kprobe *kp, struct pt_regs *regs)
 {
 	struct kprobe_coverage_entry *entry = (struct kprobe_coverage_entry *)
 					container_of(kp, struct kprobe_coverage_entry, kp);
+	struct kprobe_coverage *kpc = global_kpc;
+	struct kpc_hit_buffer *buf;
+	unsigned long irqflags;
+	unsigned long head;
+
+	/* Already handed over, the probe is removed on readout */
+	if (test_bit(KPC_ENTRY_HIT, &entry->flags))
+		return 0;
+
+	local_irq_save(irqflags);
+	buf = kpc->hit_buffers[smp_processor_id()];
+	head = buf->head;
 
-	/* Schedule it for removal */
-	queue_work(global_kpc->workqueue, &entry->work);
+	/*
+	 * Buffer full: Leave the probe armed, it will be recorded on a later hit
+	 * when the reader has caught up.
+	 */
+	if (head - smp_load_acquire(&buf->tail) >= KPC_HIT_BUFFER_ENTRIES)
+		goto out;
+
+	/* Another CPU got it first */
+	if (test_and_set_bit(KPC_ENTRY_HIT, &entry->flags))
+		goto out;
+
+	buf->entries[head & KPC_HIT_BUFFER_MASK] = entry;
+	smp_store_release(&buf->head, head + 1);
+
+	/* Wake up the listener, wake_up() itself is not safe in probe context */
+	irq_work_queue(&kpc->wakeup_work);
+
+out:
+	local_irq_restore(irqflags);
 
 	return 0;
 }
 
-static void kpc_probe_work(struct work_struct *work)
+static bool kpc_have_hits(struct kprobe_coverage *kpc)
 {
-	struct kprobe_coverage_entry *entry = (struct kprobe_coverage_entry *)
-					container_of(work, struct kprobe_coverage_entry, work);
-	struct kprobe_coverage *kpc = global_kpc;
+	unsigned int cpu;
 
-	unregister_kprobe(&entry->kp);
+	for_each_possible_cpu(cpu) {
+		struct kpc_hit_buffer *buf = kpc->hit_buffers[cpu];
 
-	/* Move from pending list to the hit list */
-	mutex_lock(&kpc->lock);
+		if (smp_load_acquire(&buf->head) != buf->tail)
+			return true;
+	}
 
-	list_del(&entry->lh);
-	list_add_tail(&entry->lh, &kpc->hit_list);
+	return false;
+}
 
-	/* Wake up the listener */
-	wake_up(&kpc->wait_queue);
+/* Collect up to max hit entries from the per-CPU buffers. Called with read_lock held */
+static unsigned int kpc_drain_hit_buffers(struct kprobe_coverage *kpc,
+		struct kprobe_coverage_entry **out, unsigned int max)
+{
+	unsigned int n = 0;
+	unsigned int cpu;
 
-	mutex_unlock(&kpc->lock);
-}
+	BUG_ON(!mutex_is_locked(&kpc->read_lock));
+
+	for_each_possible_cpu(cpu) {
+		struct kpc_hit_buffer *buf = kpc->hit_buffers[cpu];
+		unsigned long head = smp_load_acquire(&buf->head);
+		unsigned long tail = buf->tail;
+
+		while (tail != head && n < max) {
+			out[n++] = buf->entries[tail & KPC_HIT_BUFFER_MASK];
+			tail++;
+		}
+		smp_store_release(&buf->tail, tail);
+
+		if (n == max)
+			break;
+	}
 
+	return n;
+}
 
 static void free_entry(struct kprobe_coverage_entry *entry)
 {
@@ -133,7 +256,7 @@ static void free_entry(struct kprobe_coverage_entry *entry)
 }
 
 static struct kprobe_coverage_entry *new_entry(struct kprobe_coverage *kpc,
-		const char *module_name, struct module *mod, unsigned long where)
+		int name_index, struct module *mod, unsigned long where)
 {
 	struct kprobe_coverage_entry *out;
 	unsigned long base_addr = 0;
@@ -146,33 +269,47 @@ static struct kprobe_coverage_entry *new_entry(struct kprobe_coverage *kpc,
 	if (mod)
 		base_addr = (unsigned long)mod->module_core;
 
-	out->name_index = kpc_allocate_module_name_index(kpc, module_name);
+	out->name_index = name_index;
 	out->base_addr = base_addr;
 	out->kp.addr = (void *)(base_addr + where);
 	out->kp.pre_handler = kpc_pre_handler;
-	INIT_WORK(&out->work, kpc_probe_work);
+	INIT_LIST_HEAD(&out->lh);
 
 	return out;
 }
 
-/* Called with the lock held */
-static int enable_probe(struct kprobe_coverage *kpc,
-		struct kprobe_coverage_entry *entry)
+/*
+ * Register a batch of probes. Called with the lock held.
+ *
+ * register_kprobes() backs out the whole batch if one probe fails, so fall
+ * back to one-by-one registration in that case. Failed entries are freed.
+ */
+static void enable_probes(struct kprobe_coverage *kpc,
+		struct kprobe_coverage_entry **entries, unsigned int n)
 {
-	int err;
+	struct kprobe *kps[KPC_REGISTER_BATCH];
+	unsigned int i;
 
 	BUG_ON(!mutex_is_locked(&kpc->lock));
+	BUG_ON(n > KPC_REGISTER_BATCH);
 
-	/* Done before enable_kprobe so that it's really on the list if
+	/* Done before register_kprobes so that they're really on the list if
 	 * triggered */
-	list_add(&entry->lh, &kpc->pending_list);
-
-	if ( (err = register_kprobe(&entry->kp)) < 0) {
-		list_del(&entry->lh);
-		return -EINVAL;
+	for (i = 0; i < n; i++) {
+		list_add(&entries[i]->lh, &kpc->pending_list);
+		kps[i] = &entries[i]->kp;
 	}
 
-	return 0;
+	if (register_kprobes(kps, n) == 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (register_kprobe(&entries[i]->kp) == 0)
+			continue;
+
+		list_del_init(&entries[i]->lh);
+		free_entry(entries[i]);
+	}
 }
 
 /* Called with the lock held */
@@ -182,41 +319,59 @@ static void defer_probe(struct kprobe_coverage *kpc,
 	list_add(&entry->lh, &kpc->deferred_list);
 }
 
-static void kpc_add_probe(struct kprobe_coverage *kpc, const char *module_name,
-		unsigned long where)
+static void kpc_add_probes(struct kprobe_coverage *kpc, const char *module_name,
+		const u64 *where, unsigned int n)
 {
+	struct kprobe_coverage_entry *entries[KPC_REGISTER_BATCH];
 	struct module *module = NULL;
-	struct kprobe_coverage_entry *entry;
-	int rv = 0;
+	int name_index;
+	unsigned int i;
 
-	/* Lookup the module which should be instrumented */
+	/* Lookup the module which should be instrumented, once for the batch */
 	if (module_name) {
 		preempt_disable();
 		module = find_module(module_name);
 		preempt_enable();
 	}
 
-	entry = new_entry(kpc, module_name, module, where);
+	name_index = kpc_allocate_module_name_index(kpc, module_name);
+	if (name_index < 0)
+		return;
 
-	/* Three cases:
-	 *
-	 * 1. pending module - module_name is !NULL, module is NULL: Defer
-	 *    instrumentation
-	 *
-	 * 2. vmlinux - module_name and module is NULL: Instrument directly
-	 *
-	 * 3. loaded module - module_name and module is !NULL: Instrument directly
-	 */
-	mutex_lock(&kpc->lock);
-	if (module_name && !module)
-		defer_probe(kpc, entry);
-	else
-		rv = enable_probe(kpc, entry);
-	mutex_unlock(&kpc->lock);
+	while (n > 0) {
+		unsigned int count = 0;
 
-	/* Probe enabling might fail, just free the entry */
-	if (rv < 0)
-		free_entry(entry);
+		while (n > 0 && count < KPC_REGISTER_BATCH) {
+			struct kprobe_coverage_entry *entry;
+
+			entry = new_entry(kpc, name_index, module, (unsigned long)*where);
+			where++;
+			n--;
+
+			if (entry)
+				entries[count++] = entry;
+		}
+
+		/* Three cases:
+		 *
+		 * 1. pending module - module_name is !NULL, module is NULL: Defer
+		 *    instrumentation
+		 *
+		 * 2. vmlinux - module_name and module is NULL: Instrument directly
+		 *
+		 * 3. loaded module - module_name and module is !NULL: Instrument directly
+		 */
+		mutex_lock(&kpc->lock);
+		if (module_name && !module) {
+			for (i = 0; i < count; i++)
+				defer_probe(kpc, entries[i]);
+		} else if (count > 0) {
+			enable_probes(kpc, entries, count);
+		}
+		mutex_unlock(&kpc->lock);
+
+		cond_resched();
+	}
 }
 
 /* Called with lock held */
@@ -233,27 +388,67 @@ static void clear_list(struct kprobe_coverage *kpc,
 
 		entry = (struct kprobe_coverage_entry *)container_of(iter,
 				struct kprobe_coverage_entry, lh);
-		if (do_unregister)
+		list_del_init(&entry->lh);
+
+		/*
+		 * Unregister first, which waits for running handlers. A handler
+		 * can set the hit bit up to then.
+		 */
+		if (do_unregister && !test_bit(KPC_ENTRY_UNREGISTERED, &entry->flags)) {
 			unregister_kprobe(&entry->kp);
-		list_del(&entry->lh);
+			set_bit(KPC_ENTRY_UNREGISTERED, &entry->flags);
+		}
+
+		/* Owned by the hit buffers, freed on readout */
+		if (test_bit(KPC_ENTRY_HIT, &entry->flags))
+			continue;
+
 		free_entry(entry);
 	}
 }
 
+/*
+ * Unregister and unlink a batch of hit entries. unregister_kprobes() waits
+ * for running handlers only once for the whole batch. Entries unregistered
+ * by a clear or a module unload are skipped, unregistering them again
+ * would clear their address.
+ */
+static void kpc_release_hit_entries(struct kprobe_coverage *kpc,
+		struct kpc_read_batch *batch, unsigned int n)
+{
+	unsigned int count = 0;
+	unsigned int i;
+
+	mutex_lock(&kpc->lock);
+	for (i = 0; i < n; i++) {
+		struct kprobe_coverage_entry *entry = batch->entries[i];
+
+		list_del_init(&entry->lh);
+		if (test_and_set_bit(KPC_ENTRY_UNREGISTERED, &entry->flags))
+			continue;
+
+		batch->kps[count++] = &entry->kp;
+	}
+
+	if (count > 0)
+		unregister_kprobes(batch->kps, count);
+	mutex_unlock(&kpc->lock);
+}
+
 static void kpc_clear(struct kprobe_coverage *kpc)
 {
+	struct kpc_read_batch *batch;
+	unsigned int n;
 	int i;
 
 	/* Free everything on the lists */
 	mutex_lock(&kpc->lock);
 
 	clear_list(kpc, &kpc->deferred_list, 0);
-	clear_list(kpc, &kpc->hit_list, 1);
 	clear_list(kpc, &kpc->pending_list, 1);
 
 	INIT_LIST_HEAD(&kpc->deferred_list);
 	INIT_LIST_HEAD(&kpc->pending_list);
-	INIT_LIST_HEAD(&kpc->hit_list);
 
 	for (i = 0; i < kpc->name_count; i++) {
 		kfree(kpc->module_names[i]);
@@ -264,93 +459,211 @@ static void kpc_clear(struct kprobe_coverage *kpc)
 	kpc->name_count = 1;
 
 	mutex_unlock(&kpc->lock);
-}
 
-static void *kpc_unlink_next(struct kprobe_coverage *kpc)
-{
-	struct kprobe_coverage_entry *entry = NULL;
+	/*
+	 * Throw away hits which haven't been read out. Wait for running handlers
+	 * first so that nothing is added to the buffers behind our back.
+	 */
+	synchronize_rcu();
 
-	/* Remove the next entry, if any */
-	mutex_lock(&kpc->lock);
-	if (!list_empty(&kpc->hit_list)) {
-		entry = list_first_entry(&kpc->hit_list, struct kprobe_coverage_entry, lh);
-		list_del(&entry->lh);
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (WARN_ON(!batch))
+		return;
+
+	mutex_lock(&kpc->read_lock);
+	while ((n = kpc_drain_hit_buffers(kpc, batch->entries, KPC_READ_BATCH)) > 0) {
+		kpc_release_hit_entries(kpc, batch, n);
+
+		while (n--)
+			free_entry(batch->entries[n]);
 	}
-	mutex_unlock(&kpc->lock);
+	mutex_unlock(&kpc->read_lock);
 
-	return entry;
+	kfree(batch);
 }
 
-static void *kpc_seq_start(struct seq_file *s, loff_t *pos)
+/*
+ * Wait for and read out a batch of hit probes. The probes are unregistered
+ * and the entries are returned for the caller to format and free.
+ */
+static int kpc_read_hits(struct kprobe_coverage *kpc,
+		struct kpc_read_batch *batch, unsigned int max)
 {
-	struct kprobe_coverage *kpc = s->private;
+	unsigned int n;
 	int rv;
 
-	 /* Wait for something to arrive on the hit list, abort on signal */
-	rv = wait_event_interruptible(kpc->wait_queue, !list_empty(&kpc->hit_list));
-	if (rv< 0)
-		return NULL;
+	if (max > KPC_READ_BATCH)
+		max = KPC_READ_BATCH;
 
-	return kpc_unlink_next(kpc);
-}
+	/* Wait for something to arrive in the hit buffers, abort on signal */
+	rv = wait_event_interruptible(kpc->wait_queue, kpc_have_hits(kpc));
+	if (rv < 0)
+		return rv;
 
-static void *kpc_seq_next(struct seq_file *s, void *v, loff_t *pos)
-{
-	struct kprobe_coverage *kpc = s->private;
+	mutex_lock(&kpc->read_lock);
+	n = kpc_drain_hit_buffers(kpc, batch->entries, max);
+	if (n > 0)
+		kpc_release_hit_entries(kpc, batch, n);
+	mutex_unlock(&kpc->read_lock);
 
-	/* Returns NULL if there is nothing more to handle */
-	return kpc_unlink_next(kpc);
+	return n;
 }
 
-static void kpc_seq_stop(struct seq_file *s, void *v)
+/* Binary readout, an array of struct kprobe_coverage_hit */
+static ssize_t kpc_hits_read(struct file *file, char __user *user_buf,
+		size_t count, loff_t *off)
 {
+	struct kprobe_coverage *kpc = file->private_data;
+	struct kpc_read_batch *batch;
+	ssize_t out;
+	int n, i;
+
+	if (count < sizeof(struct kprobe_coverage_hit))
+		return -EINVAL;
+
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	n = kpc_read_hits(kpc, batch, count / sizeof(struct kprobe_coverage_hit));
+	if (n < 0) {
+		out = n;
+		goto out_free;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct kprobe_coverage_entry *entry = batch->entries[i];
+		struct kprobe_coverage_hit *hit = &batch->hits[i];
+
+		hit->addr = (unsigned long)entry->kp.addr - entry->base_addr;
+		hit->module_index = entry->name_index;
+		hit->reserved = 0;
+
+		free_entry(entry);
+	}
+
+	out = n * sizeof(struct kprobe_coverage_hit);
+	if (copy_to_user(user_buf, batch->hits, out))
+		out = -EFAULT;
+	else
+		*off += out;
+
+out_free:
+	kfree(batch);
+
+	return out;
 }
 
-static int kpc_seq_show(struct seq_file *s, void *v)
+/* Max length of a "show" line: module name, colon, address and newline */
+#define KPC_SHOW_LINE_MAX (MODULE_NAME_LEN + 1 + 18 + 1)
+
+/* Human-readable readout, one module:address line per hit */
+static ssize_t kpc_show_read(struct file *file, char __user *user_buf,
+		size_t count, loff_t *off)
 {
-	struct kprobe_coverage *kpc = s->private;
-	struct kprobe_coverage_entry *entry = v;
-	const char *module_name;
-	unsigned long addr;
+	struct kprobe_coverage *kpc = file->private_data;
+	struct kpc_read_batch *batch;
+	char *buf;
+	ssize_t out = 0;
+	int n, i;
 
-	/* Lookup the module name from the module table */
-	module_name = kpc->module_names[entry->name_index];
-	addr = (unsigned long)entry->kp.addr - entry->base_addr;
+	if (count < KPC_SHOW_LINE_MAX)
+		return -EINVAL;
 
-	seq_printf(s, "%s%s0x%016lx\n",
-			module_name ? module_name : "",
-			module_name ? ":" : "",
-			addr);
+	if (count > KPC_READ_BATCH * KPC_SHOW_LINE_MAX)
+		count = KPC_READ_BATCH * KPC_SHOW_LINE_MAX;
 
-	free_entry(entry);
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	buf = kmalloc(count, GFP_KERNEL);
+	if (!batch || !buf) {
+		out = -ENOMEM;
+		goto out_free;
+	}
 
-	return 0;
+	n = kpc_read_hits(kpc, batch, count / KPC_SHOW_LINE_MAX);
+	if (n < 0) {
+		out = n;
+		goto out_free;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct kprobe_coverage_entry *entry = batch->entries[i];
+		const char *module_name;
+		unsigned long addr;
+
+		/* Lookup the module name from the module table */
+		mutex_lock(&kpc->lock);
+		module_name = kpc->module_names[entry->name_index];
+		addr = (unsigned long)entry->kp.addr - entry->base_addr;
+
+		out += scnprintf(buf + out, count - out, "%s%s0x%016lx\n",
+				module_name ? module_name : "",
+				module_name ? ":" : "",
+				addr);
+		mutex_unlock(&kpc->lock);
+
+		free_entry(entry);
+	}
+
+	if (copy_to_user(user_buf, buf, out))
+		out = -EFAULT;
+	else
+		*off += out;
+
+out_free:
+	kfree(buf);
+	kfree(batch);
+
+	return out;
 }
 
-static struct seq_operations kpc_seq_ops =
+static int kpc_read_open(struct inode *inode, struct file *file)
 {
-	.start = kpc_seq_start,
-	.next  = kpc_seq_next,
-	.stop  = kpc_seq_stop,
-	.show  = kpc_seq_show
-};
+	file->private_data = inode->i_private; /* kpc */
+
+	return nonseekable_open(inode, file);
+}
 
-static int kpc_show_open(struct inode *inode, struct file *file)
+
+/* Binary control write: A struct kprobe_coverage_control and an address array */
+static ssize_t kpc_control_write_batch(struct kprobe_coverage *kpc,
+		const char __user *user_buf, size_t count, loff_t *off)
 {
-	struct kprobe_coverage *kpc = inode->i_private;
-	int rv;
+	struct kprobe_coverage_control hdr;
+	const char *module_name = NULL; /* Assume for the kernel */
+	size_t addrs_size;
+	u64 *addrs;
 
-	rv = seq_open(file, &kpc_seq_ops);
+	if (copy_from_user(&hdr, user_buf, sizeof(hdr)))
+		return -EFAULT;
 
-	if (rv == 0) {
-		struct seq_file *s = file->private_data;
+	if (hdr.n_addrs > KPC_CONTROL_MAX_ADDRS)
+		return -E2BIG;
+
+	addrs_size = hdr.n_addrs * sizeof(u64);
+	if (count != sizeof(hdr) + addrs_size)
+		return -EINVAL;
+
+	hdr.module_name[sizeof(hdr.module_name) - 1] = '\0';
+	if (hdr.module_name[0] != '\0')
+		module_name = hdr.module_name;
+
+	addrs = vmalloc(addrs_size + 1);
+	if (!addrs)
+		return -ENOMEM;
 
-		s->private = kpc;
+	if (copy_from_user(addrs, user_buf + sizeof(hdr), addrs_size)) {
+		vfree(addrs);
+		return -EFAULT;
 	}
 
-	return rv;
-}
+	kpc_add_probes(kpc, module_name, addrs, hdr.n_addrs);
 
+	vfree(addrs);
+	*off += count;
+
+	return count;
+}
 
 static ssize_t kpc_control_write(struct file *file, const char __user *user_buf,
 		size_t count, loff_t *off)
@@ -361,6 +674,16 @@ static ssize_t kpc_control_write(struct file *file, const char __user *user_buf,
 	char *buf;
 	char *p;
 
+	if (count >= sizeof(struct kprobe_coverage_control)) {
+		u32 magic;
+
+		if (get_user(magic, (const u32 __user *)user_buf))
+			return -EFAULT;
+
+		if (magic == KPC_CONTROL_MAGIC)
+			return kpc_control_write_batch(kpc, user_buf, count, off);
+	}
+
 	if (count > PAGE_SIZE)
 		return -E2BIG;
 
@@ -376,7 +699,7 @@ static ssize_t kpc_control_write(struct file *file, const char __user *user_buf,
 	p = buf;
 
 	while ( (line = strsep(&p, "\r\n")) ) {
-		unsigned long addr;
+		u64 addr;
 		char *module = NULL; /* Assume for the kernel */
 		char *colon;
 		char *addr_p;
@@ -404,7 +727,7 @@ static ssize_t kpc_control_write(struct file *file, const char __user *user_buf,
 		if (endp == addr_p || *endp != '\0')
 			continue;
 
-		kpc_add_probe(kpc, module, addr);
+		kpc_add_probes(kpc, module, &addr, 1);
 	}
 
 	kfree(buf);
@@ -437,12 +760,11 @@ static void kpc_handle_coming_module(struct kprobe_coverage *kpc,
 			continue;
 
 		/* Move the deferred entry to the pending list and enable */
-		list_del(&entry->lh);
+		list_del_init(&entry->lh);
 		entry->base_addr = (unsigned long)mod->module_core;
 		entry->kp.addr += entry->base_addr;
 
-		if (enable_probe(kpc, entry) < 0)
-			free_entry(entry);
+		enable_probes(kpc, &entry, 1);
 	}
 	mutex_unlock(&kpc->lock);
 }
@@ -463,9 +785,20 @@ static void kpc_handle_going_module(struct kprobe_coverage *kpc,
 		if (module_name_to_index(kpc, mod->name) != entry->name_index)
 			continue;
 
-		/* Remove pending entries for the current module */
-		unregister_kprobe(&entry->kp);
-		list_del(&entry->lh);
+		/*
+		 * Remove pending entries for the current module. Unregistering
+		 * waits for running handlers, so the hit bit is final after it.
+		 */
+		list_del_init(&entry->lh);
+		if (!test_bit(KPC_ENTRY_UNREGISTERED, &entry->flags)) {
+			unregister_kprobe(&entry->kp);
+			set_bit(KPC_ENTRY_UNREGISTERED, &entry->flags);
+		}
+
+		/* Hit entries are freed on readout */
+		if (test_bit(KPC_ENTRY_HIT, &entry->flags))
+			continue;
+
 		free_entry(entry);
 	}
 	mutex_unlock(&kpc->lock);
@@ -495,10 +828,17 @@ static const struct file_operations kpc_control_fops =
 static const struct file_operations kpc_show_fops =
 {
 	.owner = THIS_MODULE,
-	.open = kpc_show_open,
-	.read = seq_read,
-	.llseek = seq_lseek,
-	.release = seq_release,
+	.open = kpc_read_open,
+	.read = kpc_show_read,
+	.llseek = no_llseek,
+};
+
+static const struct file_operations kpc_hits_fops =
+{
+	.owner = THIS_MODULE,
+	.open = kpc_read_open,
+	.read = kpc_hits_read,
+	.llseek = no_llseek,
 };
 
 
@@ -508,18 +848,61 @@ static struct notifier_block kpc_module_notifier_block =
 	.notifier_call = kpc_module_notifier,
 };
 
+static void kpc_free_hit_buffers(struct kprobe_coverage *kpc)
+{
+	unsigned int cpu;
+
+	if (!kpc->hit_buffers)
+		return;
+
+	for_each_possible_cpu(cpu)
+		vfree(kpc->hit_buffers[cpu]);
+
+	kfree(kpc->hit_buffers);
+	kpc->hit_buffers = NULL;
+}
+
+static int kpc_alloc_hit_buffers(struct kprobe_coverage *kpc)
+{
+	unsigned int cpu;
+
+	kpc->hit_buffers = kcalloc(nr_cpu_ids, sizeof(*kpc->hit_buffers), GFP_KERNEL);
+	if (!kpc->hit_buffers)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		kpc->hit_buffers[cpu] = vzalloc(sizeof(struct kpc_hit_buffer));
+
+		if (!kpc->hit_buffers[cpu]) {
+			kpc_free_hit_buffers(kpc);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 static int __init kpc_init(struct kprobe_coverage *kpc)
 {
-	kpc->workqueue = create_singlethread_workqueue("kprobe-coverage");
+	INIT_LIST_HEAD(&kpc->pending_list);
+	INIT_LIST_HEAD(&kpc->deferred_list);
 
-	if (!kpc->workqueue)
-		return -ENODEV;
+	init_waitqueue_head(&kpc->wait_queue);
+	init_irq_work(&kpc->wakeup_work, kpc_wakeup_work);
+	mutex_init(&kpc->lock);
+	mutex_init(&kpc->read_lock);
+
+	/* The kernel is always index 0 */
+	kpc->name_count = 1;
+
+	if (kpc_alloc_hit_buffers(kpc) < 0)
+		return -ENOMEM;
 
 	/* Create debugfs entries */
 	kpc->debugfs_root = debugfs_create_dir("kprobe-coverage", NULL);
 	if (!kpc->debugfs_root) {
 		printk(KERN_ERR "kprobe-coverage: creating root dir failed\n");
-		goto out_workqueue;
+		goto out_buffers;
 	}
 	if (!debugfs_create_file("control", 0200, kpc->debugfs_root, kpc,
 			&kpc_control_fops))
@@ -529,25 +912,19 @@ static int __init kpc_init(struct kprobe_coverage *kpc)
 			&kpc_show_fops))
 		goto out_files;
 
-	if (register_module_notifier(&kpc_module_notifier_block) < 0)
+	if (!debugfs_create_file("hits", 0400, kpc->debugfs_root, kpc,
+			&kpc_hits_fops))
 		goto out_files;
 
-	INIT_LIST_HEAD(&kpc->pending_list);
-	INIT_LIST_HEAD(&kpc->hit_list);
-	INIT_LIST_HEAD(&kpc->deferred_list);
-
-	init_waitqueue_head(&kpc->wait_queue);
-	mutex_init(&kpc->lock);
-
-	/* The kernel is always index 0 */
-	kpc->name_count = 1;
+	if (register_module_notifier(&kpc_module_notifier_block) < 0)
+		goto out_files;
 
 	return 0;
 
 out_files:
 	debugfs_remove_recursive(kpc->debugfs_root);
-out_workqueue:
-	destroy_workqueue(kpc->workqueue);
+out_buffers:
+	kpc_free_hit_buffers(kpc);
 
 	return -EINVAL;
 }
@@ -576,7 +953,8 @@ static void __exit kpc_exit_module(void)
 
 	debugfs_remove_recursive(global_kpc->debugfs_root);
 	unregister_module_notifier(&kpc_module_notifier_block);
-	destroy_workqueue(global_kpc->workqueue);
+	irq_work_sync(&global_kpc->wakeup_work);
+	kpc_free_hit_buffers(global_kpc);
 
 	kfree(global_kpc);
 	global_kpc = NULL;
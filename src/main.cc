@@ -7,6 +7,9 @@
 #include <output-handler.hh>
 #include <file-parser.hh>
 #include <solib-handler.hh>
+#include <server.hh>
+#include <statistics.hh>
+#include <test-matrix.hh>
 #include <utils.hh>
 
 #include <string.h>
@@ -195,6 +198,10 @@ static int runMergeMode()
 static int runKcov(IConfiguration::RunMode_t runningMode)
 {
 	IConfiguration &conf = IConfiguration::getInstance();
+	IStatistics &stats = IStatistics::getInstance();
+
+	if (conf.keyAsString("chrome-trace") != "")
+		stats.enableTrace();
 
 	std::string file = conf.keyAsString("binary-path") + conf.keyAsString("binary-name");
 	IFileParser *parser = IParserManager::getInstance().matchParser(file);
@@ -202,6 +209,7 @@ static int runKcov(IConfiguration::RunMode_t runningMode)
 		error("Can't find or open %s\n", file.c_str());
 		return 1;
 	}
+	requestWarmUp(file);
 
 	// Match and create an engine
 	IEngineFactory::IEngineCreator &engineCreator = IEngineFactory::getInstance().matchEngine(file);
@@ -290,12 +298,18 @@ static int runKcov(IConfiguration::RunMode_t runningMode)
 
 	if (runningMode != IConfiguration::MODE_REPORT_ONLY) {
 		ret = collector.run(file);
+		solibHandler.stop();
 	} else {
 		parser->parse();
 	}
 
 	do_cleanup();
 
+	// After the cleanup, which writes the reports
+	stats.writeStats(conf.keyAsString("target-directory") + "/stats.json");
+	if (conf.keyAsString("chrome-trace") != "" && !stats.writeTrace(conf.keyAsString("chrome-trace")))
+		warning("kcov: Can't write %s\n", conf.keyAsString("chrome-trace").c_str());
+
 	return ret;
 }
 
@@ -497,18 +511,56 @@ static int runSystemModeReport()
 	return runSystemModeReportDirectory(base);
 }
 
-int main(int argc, const char *argv[])
+/*
+ * List the tests covering --tests-covering=file:line, one per line, from the
+ * test matrix written with --test-matrix.
+ */
+static int runTestQuery()
 {
 	IConfiguration &conf = IConfiguration::getInstance();
+	std::string where = conf.keyAsString("tests-covering");
+	std::string path = conf.keyAsString("out-directory") + "kcov-merged/test-matrix";
 
-	if (!conf.parse(argc, argv))
+	ITestMatrix *matrix = ITestMatrix::open(path);
+	if (!matrix) {
+		error("Can't read the test matrix %s (run kcov with --test-matrix)\n", path.c_str());
 		return 1;
+	}
 
-	IConfiguration::RunMode_t runningMode = (IConfiguration::RunMode_t)conf.keyAsInt("running-mode");
+	// Checked when parsing the options
+	size_t colon = where.find_last_of(":");
+	std::string file = where.substr(0, colon);
+	unsigned int line = stoul(where.substr(colon + 1));
+
+	// The reports have absolute paths
+	if (!matrix->hasFile(file) && file_exists(file))
+		file = get_real_path(file);
+
+	if (!matrix->hasFile(file)) {
+		error("%s isn't in the test matrix\n", file.c_str());
+		delete matrix;
+		return 1;
+	}
 
+	ITestMatrix::TestList_t tests = matrix->getTests(file, line);
+	for (ITestMatrix::TestList_t::const_iterator it = tests.begin();
+			it != tests.end();
+			++it)
+		printf("%s\n", it->c_str());
+
+	delete matrix;
+
+	return 0;
+}
+
+static int runMode(IConfiguration::RunMode_t runningMode)
+{
 	if (runningMode == IConfiguration::MODE_MERGE_ONLY)
 		return runMergeMode();
 
+	if (runningMode == IConfiguration::MODE_TEST_QUERY)
+		return runTestQuery();
+
 	if (runningMode == IConfiguration::MODE_SYSTEM_RECORD)
 		return runSystemModeRecord();
 
@@ -517,3 +569,44 @@ int main(int argc, const char *argv[])
 
 	return runKcov(runningMode);
 }
+
+// One kcov --connect invocation, in a process forked from the server
+static int runServerRequest(unsigned int argc, const char *argv[])
+{
+	IConfiguration &conf = IConfiguration::getInstance();
+
+	// --debug given to the server is not for the requests
+	g_kcov_debug_mask = STATUS_MSG;
+	if (!conf.parse(argc, argv))
+		return 1;
+
+	// Not what the server did before forking
+	IStatistics::getInstance().reset();
+
+	IConfiguration::RunMode_t runningMode = (IConfiguration::RunMode_t)conf.keyAsInt("running-mode");
+
+	if (runningMode == IConfiguration::MODE_SERVER) {
+		error("kcov: Can't start a server from a server\n");
+		return 1;
+	}
+
+	return runMode(runningMode);
+}
+
+int main(int argc, const char *argv[])
+{
+	IConfiguration &conf = IConfiguration::getInstance();
+
+	if (!conf.parse(argc, argv))
+		return 1;
+
+	IConfiguration::RunMode_t runningMode = (IConfiguration::RunMode_t)conf.keyAsInt("running-mode");
+
+	if (runningMode == IConfiguration::MODE_SERVER)
+		return runServer(conf.keyAsString("server-socket"), runServerRequest);
+
+	if (conf.keyAsString("connect-socket") != "")
+		return runClient(conf.keyAsString("connect-socket"), argc, argv);
+
+	return runMode(runningMode);
+}
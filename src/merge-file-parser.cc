@@ -4,6 +4,7 @@
 #include <filter.hh>
 #include <writer.hh>
 #include <configuration.hh>
+#include <test-matrix.hh>
 
 #include <vector>
 #include <string>
@@ -11,9 +12,15 @@
 #include <unordered_map>
 #include <map>
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <algorithm>
 
 #include <swap-endian.hh>
 
@@ -24,6 +31,17 @@ using namespace kcov;
 #define MERGE_MAGIC   0x4d6f6172 // "Moar"
 #define MERGE_VERSION 4
 
+#define STATE_MAGIC   0x4d726773 // "Mrgs"
+#define STATE_VERSION 1
+
+#define MANIFEST_VERSION 2
+
+#ifdef __APPLE__
+#ifndef st_mtim
+#define st_mtim st_mtimespec
+#endif
+#endif
+
 struct line_entry
 {
 	uint32_t line;
@@ -45,6 +63,21 @@ struct file_data
 	struct line_entry entries[];
 } __attribute__((packed));
 
+/*
+ * Everything merged so far, for --incremental-merge: the file_data of
+ * each file, in the same format as the metadata directories
+ */
+struct merge_state
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_files;
+	uint32_t padding;
+	uint64_t size;
+
+	// n_files struct file_data, each 8-byte aligned
+} __attribute__((packed));
+
 // Unit test stuff
 namespace merge_parser
 {
@@ -67,9 +100,17 @@ public:
 			IFilter &filter) :
 		m_baseDirectory(baseDirectory),
 		m_outputDirectory(outputDirectory),
-		m_filter(filter)
+		m_filter(filter),
+		m_testMatrix(NULL),
+		m_incremental(IConfiguration::getInstance().keyAsInt("incremental-merge")),
+		m_skipUnchanged(false),
+		m_stateFileName(baseDirectory + "kcov-merged/merge-state"),
+		m_manifestFileName(baseDirectory + "kcov-merged/merge-manifest")
 	{
 		reporter.registerListener(*this);
+
+		if (IConfiguration::getInstance().keyAsInt("test-matrix"))
+			m_testMatrix = &ITestMatrixBuilder::create();
 	}
 
 	~MergeParser()
@@ -83,6 +124,7 @@ public:
 		}
 
 		m_files.clear();
+		delete m_testMatrix;
 	}
 
 	// From IFileParser
@@ -140,24 +182,34 @@ public:
 	// From IReporter::IListener
 	void onAddress(uint64_t addr, unsigned long hits)
 	{
-		if (m_fileLineByAddress.find(addr) == m_fileLineByAddress.end()) {
-			m_pendingHits[addr] = hits;
+		if (!registerAddress(addr, hits, &addr))
 			return;
-		}
 
-		addr = m_fileLineByAddress[addr];
+		for (CollectorListenerList_t::const_iterator it = m_collectorListeners.begin();
+				it != m_collectorListeners.end();
+				++it)
+			(*it)->onAddressHit(addr, hits);
+	}
+
+	// From IReporter::IListener
+	void onAddresses(const uint64_t *addrs, size_t n)
+	{
+		m_batchAddresses.clear();
 
-		File *file = m_filesByAddress[addr];
+		for (size_t i = 0; i < n; i++) {
+			uint64_t addr;
 
-		if (!file)
-			return;
+			if (registerAddress(addrs[i], 1, &addr))
+				m_batchAddresses.push_back(addr);
+		}
 
-		file->registerHits(addr, hits);
+		if (m_batchAddresses.empty())
+			return;
 
 		for (CollectorListenerList_t::const_iterator it = m_collectorListeners.begin();
 				it != m_collectorListeners.end();
 				++it)
-			(*it)->onAddressHit(addr, hits);
+			(*it)->onAddressHits(m_batchAddresses.data(), m_batchAddresses.size());
 	}
 
 	// From IReporter::IListener
@@ -176,7 +228,7 @@ public:
 
 		file = m_files[filename];
 		if (!file) {
-			file = new File(filename);
+			file = new File(filename, knownSource(filename));
 
 			m_files[filename] = file;
 		}
@@ -224,12 +276,23 @@ public:
 		IConfiguration &conf = IConfiguration::getInstance();
 		bool inMergeMode = conf.keyAsInt("running-mode") == IConfiguration::MODE_MERGE_ONLY;
 
+		// The run itself is a test as well, before the hits of the others are added
+		if (m_testMatrix && !inMergeMode)
+			addLocalHits(testName(m_baseDirectory, m_outputDirectory));
+
+		// The matrix needs the hits of each directory, so it's always a full merge
+		if (m_incremental && !m_testMatrix)
+			m_skipUnchanged = loadIncrementalMerge(inMergeMode);
+
 		// Parse data from earlier runs
 		if (inMergeMode)
 			parseStoredDataMerged();
 		else
 			parseStoredData();
 
+		if (m_testMatrix)
+			writeTestMatrix();
+
 		/* Produce something like
 		 *
 		 *   /tmp/kcov/calc/metadata/4f332bca
@@ -254,14 +317,19 @@ public:
 				continue;
 
 			uint32_t crc = hash_block((const void *)it->second->m_filename.c_str(), it->second->m_filename.size());
-			std::string name = fmt("%08x", crc);
+			std::string name = fmt("%s/metadata/%08x", m_outputDirectory.c_str(), crc);
+			std::string tmpName = name + ".tmp";
 
-			write_file((const void *)fd, be_to_host<uint32_t>(fd->size), "%s/metadata/%s",
-					m_outputDirectory.c_str(), name.c_str()
-					);
+			// Renamed in place, so the directory time tells if it has changed
+			if (write_file((const void *)fd, be_to_host<uint32_t>(fd->size), "%s", tmpName.c_str()) != 0 ||
+					rename(tmpName.c_str(), name.c_str()) != 0)
+				(void)unlink(tmpName.c_str());
 
 			free((void *)fd);
 		}
+
+		if (m_incremental)
+			writeIncrementalMerge(inMergeMode);
 	}
 
 	void write()
@@ -314,7 +382,7 @@ private:
 			if (cur == m_outputDirectory)
 				continue;
 
-			parseDirectory(cur);
+			parseDirectory(cur, testName(m_baseDirectory, de->d_name));
 		}
 		closedir(dir);
 	}
@@ -341,23 +409,29 @@ private:
 			for (de = readdir(dir); de; de = readdir(dir)) {
 				std::string cur = fmt("%s/%s", argv[i], de->d_name);
 
-				parseDirectory(cur);
+				parseDirectory(cur, testName(argv[i], de->d_name));
 			}
 			closedir(dir);
 		}
 	}
 
-	void parseDirectory(const std::string &dirName)
+	void parseDirectory(const std::string &dirName, const std::string &test)
 	{
 		DIR *dir;
 		struct dirent *de;
 		std::string metadataDirName = dirName + "/metadata";
 
+		if (m_incremental && !ingestDirectory(dirName))
+			return;
+
 		dir = opendir(metadataDirName.c_str());
 		// Can occur naturally
 		if(!dir)
 			return;
 
+		// Earlier merges have the union of their tests
+		m_currentTest = lastComponent(dirName) == "merged-kcov-output" ? "" : test;
+
 		// Read all metadata from the directory
 		for (de = readdir(dir); de; de = readdir(dir))
 			parseOne(metadataDirName, de->d_name);
@@ -391,8 +465,11 @@ private:
 	{
 		std::string filename((const char *)fd + fd->file_name_offset);
 
-		filename = m_filter.mangleSourcePath(filename);
+		addFileData(fd, m_filter.mangleSourcePath(filename));
+	}
 
+	void addFileData(struct file_data *fd, const std::string &filename)
+	{
 		// File has been removed since last test
 		if (!file_exists(filename))
 			return;
@@ -401,7 +478,7 @@ private:
 
 		file = m_files[filename];
 		if (!file) {
-			file = new File(filename);
+			file = new File(filename, knownSource(filename));
 
 			m_files[filename] = file;
 		} else {
@@ -432,6 +509,9 @@ private:
 				if (hit) {
 					file->registerHits(addr, 1);
 
+					if (m_testMatrix && m_currentTest != "")
+						m_testMatrix->addHit(m_currentTest, filename, lineNr);
+
 
 					for (CollectorListenerList_t::const_iterator itC = m_collectorListeners.begin();
 							itC != m_collectorListeners.end();
@@ -442,6 +522,495 @@ private:
 		}
 	}
 
+	/*
+	 * What's in a merged directory. The checksum is over the names, sizes
+	 * and times of the metadata files, so it doesn't have to be read. The
+	 * identity tells if the directory has been removed and created again.
+	 *
+	 * Metadata files are renamed into place, so while the time of the
+	 * directory is the same, so is the checksum and the files aren't listed.
+	 */
+	class Ingested
+	{
+	public:
+		Ingested() :
+			m_identity(0),
+			m_checksum(0),
+			m_timestamp(0),
+			m_directoryTime(0)
+		{
+		}
+
+		uint64_t m_identity;
+		uint32_t m_checksum;
+		uint64_t m_timestamp; //< Of the newest metadata file
+		uint64_t m_directoryTime; //< In ns, 0 if too recent to trust
+	};
+
+	// A source file as it was at the last merge
+	class SourceStat
+	{
+	public:
+		SourceStat() :
+			m_size(0),
+			m_time(0),
+			m_checksum(0)
+		{
+		}
+
+		uint64_t m_size;
+		uint64_t m_time; //< In ns, 0 if too recent to trust
+		uint32_t m_checksum;
+	};
+
+	typedef std::map<std::string, Ingested> IngestedMap_t;
+	typedef std::map<std::string, SourceStat> SourceStatMap_t;
+
+	/*
+	 * The modification time of @a st in ns, or 0 when it's within a second
+	 * of now. A change in the same clock tick would then keep the same time.
+	 */
+	static uint64_t trustedTime(const struct stat &st)
+	{
+		if ((uint64_t)st.st_mtim.tv_sec + 1 >= (uint64_t)time(NULL))
+			return 0;
+
+		return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+	}
+
+	// Just the directory itself, @a out gets its identity and time
+	bool statDirectory(const std::string &dirName, Ingested &out)
+	{
+		struct stat st;
+
+		if (stat((dirName + "/metadata").c_str(), &st) != 0)
+			return false;
+		out.m_identity = ((uint64_t)st.st_dev << 32) ^ (uint64_t)st.st_ino;
+		out.m_directoryTime = trustedTime(st);
+
+		return true;
+	}
+
+	bool fingerprint(const std::string &dirName, Ingested &out)
+	{
+		std::string metadataDirName = dirName + "/metadata";
+		std::vector<std::string> entries;
+		struct stat st;
+		DIR *dir;
+		struct dirent *de;
+
+		if (!statDirectory(dirName, out))
+			return false;
+
+		dir = opendir(metadataDirName.c_str());
+		if (!dir)
+			return false;
+
+		for (de = readdir(dir); de; de = readdir(dir)) {
+			std::string cur = de->d_name;
+
+			if (!string_is_integer(cur, 16) ||
+					stat((metadataDirName + "/" + cur).c_str(), &st) != 0)
+				continue;
+
+			entries.push_back(fmt("%s %llu %llu.%09lu\n", cur.c_str(),
+					(unsigned long long)st.st_size,
+					(unsigned long long)st.st_mtim.tv_sec, (unsigned long)st.st_mtim.tv_nsec));
+			out.m_timestamp = std::max(out.m_timestamp, (uint64_t)st.st_mtim.tv_sec);
+		}
+		closedir(dir);
+
+		// In readdir order otherwise
+		std::sort(entries.begin(), entries.end());
+
+		std::string all;
+		for (std::vector<std::string>::const_iterator it = entries.begin();
+				it != entries.end();
+				++it)
+			all += *it;
+		out.m_checksum = hash_block(all.c_str(), all.size());
+
+		return true;
+	}
+
+	// Record a directory in the manifest, and return true if it should be parsed
+	bool ingestDirectory(const std::string &dirName)
+	{
+		IngestedMap_t::const_iterator it = m_lastIngested.find(dirName);
+		Ingested cur;
+
+		if (!statDirectory(dirName, cur))
+			return true;
+
+		// Untouched since the last merge, so no need to list it again
+		if (it != m_lastIngested.end() && cur.m_directoryTime != 0 &&
+				it->second.m_identity == cur.m_identity &&
+				it->second.m_directoryTime == cur.m_directoryTime) {
+			cur = it->second;
+		} else if (!fingerprint(dirName, cur)) {
+			return true;
+		}
+
+		m_ingested[dirName] = cur;
+
+		if (!m_skipUnchanged || it == m_lastIngested.end() ||
+				it->second.m_checksum != cur.m_checksum)
+			return true;
+
+		kcov_debug(INFO_MSG, "Merge: %s is unchanged\n", dirName.c_str());
+
+		return false;
+	}
+
+	/*
+	 * Read the manifest and the merged state of the last merge, and return
+	 * true if only new and changed directories need to be parsed.
+	 *
+	 * kcov adds to the output directories, so a changed directory has the
+	 * coverage it had last time as well, and is simply merged again. A
+	 * directory which is gone, or has been created again, can have taken
+	 * away coverage though, so then everything is merged again.
+	 */
+	bool loadIncrementalMerge(bool inMergeMode)
+	{
+		size_t size;
+		char *data = (char *)read_file(&size, "%s", m_manifestFileName.c_str());
+
+		if (!data)
+			return false;
+
+		std::vector<std::string> lines = split_string(std::string(data, size), "\n");
+		unsigned int version = 0;
+		uint32_t stateChecksum = 0;
+
+		free(data);
+		if (lines.empty() ||
+				sscanf(lines[0].c_str(), "kcov-merge-manifest %u %x", &version, &stateChecksum) != 2 ||
+				version != MANIFEST_VERSION)
+			return false;
+
+		std::vector<std::string> roots = mergeRoots(inMergeMode);
+
+		for (unsigned int i = 1; i < lines.size(); i++) {
+			unsigned long long identity, timestamp, directoryTime, sourceSize;
+			unsigned int checksum;
+			int pathStart = 0;
+
+			if (sscanf(lines[i].c_str(), "source %llu %llu %x %n", &sourceSize, &timestamp, &checksum, &pathStart) == 3 &&
+					pathStart != 0) {
+				SourceStat &source = m_lastSources[lines[i].substr(pathStart)];
+
+				source.m_size = sourceSize;
+				source.m_time = timestamp;
+				source.m_checksum = checksum;
+				continue;
+			}
+
+			if (sscanf(lines[i].c_str(), "%llx %x %llu %llu %n", &identity, &checksum, &timestamp, &directoryTime, &pathStart) != 4 ||
+					pathStart == 0)
+				continue;
+
+			std::string path = lines[i].substr(pathStart);
+			Ingested cur;
+
+			// Not merged this time, or removed since
+			if (std::find(roots.begin(), roots.end(), path.substr(0, path.rfind('/') + 1)) == roots.end() ||
+					!statDirectory(path, cur) || cur.m_identity != identity) {
+				kcov_debug(INFO_MSG, "Merge: %s is gone, merging everything\n", path.c_str());
+				m_lastIngested.clear();
+				return false;
+			}
+
+			Ingested &last = m_lastIngested[path];
+
+			last.m_identity = identity;
+			last.m_checksum = checksum;
+			last.m_timestamp = timestamp;
+			last.m_directoryTime = directoryTime;
+		}
+
+		if (!loadMergeState(stateChecksum)) {
+			m_lastIngested.clear();
+			return false;
+		}
+
+		return true;
+	}
+
+	// The directories the merged directories are in
+	std::vector<std::string> mergeRoots(bool inMergeMode)
+	{
+		std::vector<std::string> out;
+
+		if (!inMergeMode) {
+			out.push_back(m_baseDirectory);
+			return out;
+		}
+
+		IConfiguration &conf = IConfiguration::getInstance();
+		const char **argv = conf.getArgv();
+
+		for (unsigned int i = 0; i < conf.getArgc(); i++)
+			out.push_back(fmt("%s/", argv[i]));
+
+		return out;
+	}
+
+	bool loadMergeState(uint32_t checksum)
+	{
+		int fd = open(m_stateFileName.c_str(), O_RDONLY);
+
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		void *p = MAP_FAILED;
+
+		// Private and writable, since the file data is unmarshalled in place
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct merge_state))
+			p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (p == MAP_FAILED)
+			return false;
+
+		uint8_t *data = (uint8_t *)p;
+		size_t size = st.st_size;
+		struct merge_state *hdr = (struct merge_state *)data;
+		uint32_t nFiles = be_to_host<uint32_t>(hdr->n_files);
+		bool ok = be_to_host<uint32_t>(hdr->magic) == STATE_MAGIC &&
+				be_to_host<uint32_t>(hdr->version) == STATE_VERSION &&
+				be_to_host<uint64_t>(hdr->size) == size &&
+				hash_block(data, size) == checksum;
+
+		// Check all of it before merging any
+		size_t offset = sizeof(struct merge_state);
+		for (uint32_t i = 0; ok && i < nFiles; i++) {
+			struct file_data *cur = (struct file_data *)(data + offset);
+
+			if (offset + sizeof(struct file_data) > size ||
+					be_to_host<uint32_t>(cur->size) < sizeof(struct file_data) ||
+					offset + be_to_host<uint32_t>(cur->size) > size ||
+					be_to_host<uint32_t>(cur->file_name_offset) >= be_to_host<uint32_t>(cur->size)) {
+				ok = false;
+				break;
+			}
+
+			const char *name = (const char *)cur + be_to_host<uint32_t>(cur->file_name_offset);
+			std::string filename(name, strnlen(name, be_to_host<uint32_t>(cur->size) -
+					be_to_host<uint32_t>(cur->file_name_offset)));
+
+			/*
+			 * Edited since the last merge: the merged lines are stale, and
+			 * directories with data for the new source may be unchanged
+			 */
+			if (sourceChanged(filename, be_to_host<uint32_t>(cur->checksum))) {
+				kcov_debug(INFO_MSG, "Merge: %s has changed, merging everything\n", filename.c_str());
+				ok = false;
+				break;
+			}
+
+			offset = alignOffset(offset + be_to_host<uint32_t>(cur->size));
+		}
+
+		offset = sizeof(struct merge_state);
+		for (uint32_t i = 0; ok && i < nFiles; i++) {
+			struct file_data *cur = (struct file_data *)(data + offset);
+
+			offset = alignOffset(offset + be_to_host<uint32_t>(cur->size));
+
+			// Already mangled when it was merged
+			if (unMarshalFile(cur))
+				addFileData(cur, std::string((const char *)cur + cur->file_name_offset));
+		}
+
+		munmap(p, size);
+
+		kcov_debug(INFO_MSG, "Merge: %s %s\n", m_stateFileName.c_str(), ok ? "loaded" : "is invalid");
+
+		return ok;
+	}
+
+	// The source as it was at the last merge, if known
+	const SourceStat *knownSource(const std::string &filename) const
+	{
+		SourceStatMap_t::const_iterator it = m_lastSources.find(filename);
+
+		return it != m_lastSources.end() ? &it->second : NULL;
+	}
+
+	// The checksum is the one File has, removed files don't matter
+	bool sourceChanged(const std::string &filename, uint32_t checksum)
+	{
+		const SourceStat *known = knownSource(filename);
+		struct stat st;
+
+		if (stat(filename.c_str(), &st) != 0)
+			return false;
+
+		// Same size and time as when it had this checksum, so no need to read it
+		if (known && known->m_time != 0 && known->m_checksum == checksum &&
+				known->m_size == (uint64_t)st.st_size && known->m_time == trustedTime(st))
+			return false;
+
+		size_t size;
+		void *data = read_file(&size, "%s", filename.c_str());
+
+		if (!data)
+			return false;
+
+		uint32_t cur = hash_block(data, size);
+
+		free(data);
+
+		return cur != checksum;
+	}
+
+	size_t alignOffset(size_t offset)
+	{
+		return (offset + 7) & ~7;
+	}
+
+	// The merged state (all files), and then the manifest which refers to it
+	void writeIncrementalMerge(bool inMergeMode)
+	{
+		// The coveree's own metadata is in the state now
+		if (!inMergeMode)
+			ingestDirectory(m_baseDirectory + lastComponent(m_outputDirectory));
+
+		std::vector<uint8_t> state(sizeof(struct merge_state));
+		uint32_t nFiles = 0;
+
+		for (FileByNameMap_t::const_iterator it = m_files.begin();
+				it != m_files.end();
+				++it) {
+			const struct file_data *fd = marshalFile(it->first);
+
+			if (!fd)
+				continue;
+
+			size_t offset = state.size();
+			size_t size = be_to_host<uint32_t>(fd->size);
+
+			state.resize(alignOffset(offset + size));
+			memcpy(&state[offset], fd, size);
+			free((void *)fd);
+			nFiles++;
+		}
+
+		struct merge_state *hdr = (struct merge_state *)state.data();
+
+		hdr->magic = to_be<uint32_t>(STATE_MAGIC);
+		hdr->version = to_be<uint32_t>(STATE_VERSION);
+		hdr->n_files = to_be<uint32_t>(nFiles);
+		hdr->padding = 0;
+		hdr->size = to_be<uint64_t>(state.size());
+
+		if (write_file(state.data(), state.size(), "%s", m_stateFileName.c_str()) != 0) {
+			warning("kcov: Can't write %s\n", m_stateFileName.c_str());
+			(void)unlink(m_manifestFileName.c_str());
+			return;
+		}
+
+		std::string manifest = fmt("kcov-merge-manifest %u %08x\n",
+				MANIFEST_VERSION, hash_block(state.data(), state.size()));
+
+		for (IngestedMap_t::const_iterator it = m_ingested.begin();
+				it != m_ingested.end();
+				++it)
+			manifest += fmt("%016llx %08x %llu %llu %s\n",
+					(unsigned long long)it->second.m_identity, it->second.m_checksum,
+					(unsigned long long)it->second.m_timestamp,
+					(unsigned long long)it->second.m_directoryTime, it->first.c_str());
+
+		// For checking the sources without reading them next time
+		for (FileByNameMap_t::const_iterator it = m_files.begin();
+				it != m_files.end();
+				++it) {
+			if (it->second->m_time == 0)
+				continue;
+
+			manifest += fmt("source %llu %llu %08x %s\n",
+					(unsigned long long)it->second->m_size, (unsigned long long)it->second->m_time,
+					it->second->m_checksum, it->first.c_str());
+		}
+
+		if (write_file(manifest.c_str(), manifest.size(), "%s", m_manifestFileName.c_str()) != 0)
+			warning("kcov: Can't write %s\n", m_manifestFileName.c_str());
+	}
+
+	// The last component of a directory
+	std::string lastComponent(const std::string &dirName)
+	{
+		std::string out = dirName;
+
+		while (out.size() > 1 && out[out.size() - 1] == '/')
+			out.erase(out.size() - 1);
+
+		return split_path(out).second;
+	}
+
+	/*
+	 * Tests are named by the output directory they were run with, and
+	 * their directory in it ("kcov/calc"), with or without --merge
+	 */
+	std::string testName(const std::string &root, const std::string &dirName)
+	{
+		// Relative roots such as "." get a name as well
+		return lastComponent(get_real_path(root)) + "/" + lastComponent(dirName);
+	}
+
+	// Lines hit in the files of the coveree
+	void addLocalHits(const std::string &test)
+	{
+		for (FileByNameMap_t::const_iterator it = m_files.begin();
+				it != m_files.end();
+				++it) {
+			File *file = it->second;
+
+			if (!file || !file->m_local)
+				continue;
+
+			for (LineAddrMap_t::const_iterator lineIt = file->m_lines.begin();
+					lineIt != file->m_lines.end();
+					++lineIt) {
+				for (AddrMap_t::const_iterator addrIt = lineIt->second.begin();
+						addrIt != lineIt->second.end();
+						++addrIt) {
+					AddrMap_t::const_iterator hits = file->m_addrHits.find(addrIt->first);
+
+					if (hits != file->m_addrHits.end() && hits->second) {
+						m_testMatrix->addHit(test, file->m_filename, lineIt->first);
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	void writeTestMatrix()
+	{
+		// All lines, so that the index covers what the reports do
+		for (FileByNameMap_t::const_iterator it = m_files.begin();
+				it != m_files.end();
+				++it) {
+			File *file = it->second;
+
+			if (!file)
+				continue;
+
+			for (LineAddrMap_t::const_iterator lineIt = file->m_lines.begin();
+					lineIt != file->m_lines.end();
+					++lineIt)
+				m_testMatrix->addLine(file->m_filename, lineIt->first);
+		}
+
+		std::string path = m_baseDirectory + "kcov-merged/test-matrix";
+
+		if (!m_testMatrix->write(path))
+			warning("kcov: Can't write the test matrix %s\n", path.c_str());
+	}
+
 	const struct file_data *marshalFile(const std::string &filename)
 	{
 		File *file = m_files[filename];
@@ -564,18 +1133,33 @@ private:
 	class File
 	{
 	public:
-		File(const std::string &filename) :
+		File(const std::string &filename, const SourceStat *known) :
 			m_filename(filename),
+			m_size(0),
+			m_time(0),
 			m_local(false)
 		{
 			void *data;
 			size_t size;
+			struct stat st;
+
+			// Before reading, so that an edit in between shows as a change
+			if (stat(filename.c_str(), &st) == 0) {
+				m_size = st.st_size;
+				m_time = trustedTime(st);
+			}
+			m_fileTimestamp = get_file_timestamp(filename.c_str());
+
+			// Unchanged since the last merge
+			if (known && m_time != 0 && known->m_time == m_time && known->m_size == m_size) {
+				m_checksum = known->m_checksum;
+				return;
+			}
 
 			data = read_file(&size, "%s", filename.c_str());
 			panic_if(!data,
 					"File %s exists, but can't be read???", filename.c_str());
 			m_checksum = hash_block(data, size);
-			m_fileTimestamp = get_file_timestamp(filename.c_str());
 
 			free((void *)data);
 		}
@@ -600,10 +1184,35 @@ private:
 		LineAddrMap_t m_lines;
 		AddrMap_t m_addrHits;
 		uint32_t m_checksum;
+		uint64_t m_size; //< As m_checksum was taken
+		uint64_t m_time;
 		bool m_local;
 	};
 
 
+	// Register hits for a reporter address, and return the file/line address for it
+	bool registerAddress(uint64_t addr, unsigned long hits, uint64_t *out)
+	{
+		FileLineByAddress_t::const_iterator fileLine = m_fileLineByAddress.find(addr);
+
+		if (fileLine == m_fileLineByAddress.end()) {
+			m_pendingHits[addr] = hits;
+			return false;
+		}
+
+		addr = fileLine->second;
+
+		FileByAddressMap_t::const_iterator file = m_filesByAddress.find(addr);
+
+		if (file == m_filesByAddress.end() || !file->second)
+			return false;
+
+		file->second->registerHits(addr, hits);
+		*out = addr;
+
+		return true;
+	}
+
 	typedef std::vector<ICollector::IListener *> CollectorListenerList_t;
 	typedef std::unordered_map<std::string, File *> FileByNameMap_t;
 	typedef std::unordered_map<uint64_t, File *> FileByAddressMap_t;
@@ -617,6 +1226,7 @@ private:
 	FileByAddressMap_t m_filesByAddress;
 	FileLineByAddress_t m_fileLineByAddress;
 	AddrToHitsMap_t m_pendingHits;
+	std::vector<uint64_t> m_batchAddresses;
 
 	LineListenerList_t m_lineListeners;
 	const std::string m_baseDirectory;
@@ -624,6 +1234,19 @@ private:
 
 	CollectorListenerList_t m_collectorListeners;
 	IFilter &m_filter;
+
+	// With --test-matrix
+	ITestMatrixBuilder *m_testMatrix;
+	std::string m_currentTest;
+
+	// With --incremental-merge
+	bool m_incremental;
+	bool m_skipUnchanged;
+	const std::string m_stateFileName;
+	const std::string m_manifestFileName;
+	IngestedMap_t m_lastIngested;
+	IngestedMap_t m_ingested;
+	SourceStatMap_t m_lastSources;
 };
 
 namespace kcov
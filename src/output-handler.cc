@@ -4,6 +4,7 @@
 #include <reporter.hh>
 #include <collector.hh>
 #include <file-parser.hh>
+#include <statistics.hh>
 #include <utils.hh>
 
 #include <list>
@@ -90,6 +91,8 @@ namespace kcov
 
 		void produce()
 		{
+			StatisticsScope scope(IStatistics::PHASE_WRITE);
+
 			for (WriterList_t::const_iterator it = m_writers.begin();
 					it != m_writers.end();
 					++it)
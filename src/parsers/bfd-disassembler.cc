@@ -1,11 +1,14 @@
 #include <disassembler.hh>
 #include <utils.hh>
 
-#include <unordered_map>
 #include <set>
 #include <map>
+#include <mutex>
 #include <algorithm>
 
+#include <pthread.h>
+#include <unistd.h>
+
 #ifndef ATTRIBUTE_FPTR_PRINTF_2
 # define ATTRIBUTE_FPTR_PRINTF_2
 #endif
@@ -15,6 +18,8 @@
 
 #include <elf.h>
 
+#include "x86-decoder.hh"
+
 using namespace kcov;
 
 const uint64_t BT_INVALID = 0xfffffffffffffffeull;
@@ -65,7 +70,9 @@ const std::set<std::string> x86BranchInstructions =
 class BfdDisassembler : public IDisassembler
 {
 public:
-	BfdDisassembler()
+	BfdDisassembler() :
+		m_is64Bit(false),
+		m_indexValid(true)
 	{
 		memset(&m_info, 0, sizeof(m_info));
 		init_disassemble_info(&m_info, (void *)this, BfdDisassembler::opcodesFprintFuncStatic);
@@ -84,10 +91,22 @@ public:
 		panic_if(headerSize <= EI_CLASS,
 				"Header size must be at least %u", EI_CLASS);
 
-		if (data[EI_CLASS] == ELFCLASS64)
+		m_is64Bit = data[EI_CLASS] == ELFCLASS64;
+
+		if (m_is64Bit)
 			m_info.mach = bfd_mach_x86_64;
 		else
 			m_info.mach = bfd_mach_i386_i386;
+
+		// A new file, whose addresses can overlap those of the last one
+		for (SectionCache_t::iterator it = m_cache.begin();
+				it != m_cache.end();
+				++it)
+			delete it->second;
+		m_cache.clear();
+		m_instructions.clear();
+		m_leaders.clear();
+		m_indexValid = true;
 	}
 
 	void addSection(const void *sectionData, size_t sectionSize, uint64_t baseAddress)
@@ -95,8 +114,10 @@ public:
 		SectionCache_t::iterator it = m_cache.find(baseAddress);
 
 		// Not visited before
-		if (it == m_cache.end())
+		if (it == m_cache.end()) {
 			m_cache[baseAddress] = new Section(sectionData, sectionSize, baseAddress);
+			m_indexValid = false;
+		}
 	}
 
 	bool verify(uint64_t address)
@@ -106,90 +127,61 @@ public:
 		if (!p)
 			return true;
 
-		if (!p->isDisassembled())
-			p->disassemble(*this, m_info, m_disassembler);
+		updateIndex();
 
 		// The address is valid there is an instruction starting at it
-		return getInstruction(address) != NULL;
+		return findInstruction(address) >= 0;
 	}
 
+	// The returned block is valid until the next call
 	const std::vector<uint64_t> &getBasicBlock(uint64_t address)
 	{
-		if (m_bbs.empty())
-			setupBasicBlocks();
+		updateIndex();
 
-		if (m_instructions.find(address) == m_instructions.end())
-			return m_empty;
+		m_basicBlock.clear();
 
-		return m_instructions[address].getBasicBlock()->getInstructionAddresses();
-	}
+		int64_t idx = findInstruction(address);
+		if (idx < 0)
+			return m_basicBlock;
 
-private:
-	class BasicBlock
-	{
-	public:
-		BasicBlock()
-		{
-		}
-
-		const std::vector<uint64_t> &getInstructionAddresses() const
-		{
-			return m_instructionAddresses;
-		}
+		size_t first = idx;
+		size_t last = idx + 1;
 
-		void addInstructionAddress(uint64_t address)
-		{
-			m_instructionAddresses.push_back(address);
-		}
+		while (first > 0 && !m_leaders[first])
+			first--;
+		while (last < m_instructions.size() && !m_leaders[last])
+			last++;
 
-	private:
-		std::vector<uint64_t> m_instructionAddresses;
-	};
+		m_basicBlock.assign(m_instructions.begin() + first, m_instructions.begin() + last);
 
-	class Instruction
-	{
-	public:
-		Instruction(uint64_t branchTarget = 0) :
-			m_branchTarget(branchTarget),
-			m_leader(false),
-			m_bb(NULL)
-		{
-		}
+		return m_basicBlock;
+	}
 
-		uint64_t getBranchTarget() const
-		{
-			return m_branchTarget;
-		}
+private:
+	typedef std::vector<uint64_t> InstructionList_t;
+	typedef std::vector<bool> LeaderBitmap_t;
 
-		bool isBranch() const
-		{
-			return m_branchTarget != BT_INVALID;
-		}
+	// Chunks are decoded in parallel and stitched together afterwards
+	static const size_t chunkSize = 256 * 1024;
 
-		bool isLeader() const
-		{
-			return m_leader;
-		}
+	class Section;
 
-		void makeLeader()
-		{
-			m_leader = true;
-		}
-
-		const BasicBlock *getBasicBlock() const
+	class Chunk
+	{
+	public:
+		Chunk(Section *section, size_t begin, size_t end) :
+			m_section(section), m_begin(begin), m_end(end), m_next(begin)
 		{
-			return m_bb;
 		}
 
-		void setBasicBlock(const BasicBlock *bb)
-		{
-			m_bb = bb;
-		}
+		Section *m_section;
+		size_t m_begin;
+		size_t m_end;
+		size_t m_next; //< Where decoding stopped, i.e., at or after m_end
 
-	private:
-		uint64_t m_branchTarget;
-		bool m_leader;
-		const BasicBlock *m_bb;
+		std::vector<uint32_t> m_offsets; //< Instruction starts, relative to the section
+		std::vector<bool> m_blockEnds;
+		std::vector<std::pair<uint32_t, uint64_t> > m_targets; //< Instruction index, branch target
 	};
 
 	class Section
@@ -198,12 +190,17 @@ private:
 		Section(const void *data, size_t size, uint64_t startAddress) :
 			m_size(size),
 			m_startAddress(startAddress),
-			m_disassembled(false)
+			m_decoded(false)
 		{
 			m_data = xmalloc(size);
 			memcpy(m_data, data, size);
 		}
 
+		~Section()
+		{
+			free(m_data);
+		}
+
 		uint64_t getBase() const
 		{
 			return m_startAddress;
@@ -214,39 +211,80 @@ private:
 			return m_size;
 		}
 
-		bool isDisassembled() const
+		const uint8_t *getData() const
 		{
-			return m_disassembled;
+			return (const uint8_t *)m_data;
 		}
 
-		void disassemble(BfdDisassembler &target, struct disassemble_info info, disassembler_ftype disassembler)
+		bool isDecoded() const
 		{
-			if (m_disassembled)
-					return;
-
-			m_disassembled = true;
-
-			info.buffer_vma = 0;
-			info.buffer_length = m_size;
-			info.buffer = (bfd_byte *)m_data;
-			info.stream = (void *)&target;
-
-			uint64_t pc = 0;
-			int count;
-			do
-			{
-				target.m_instructionVector.clear();
-				count = disassembler(pc, &info);
-
-				if (count < 0)
-					break;
+			return m_decoded;
+		}
 
-				target.m_instructions[pc + m_startAddress] = target.instructionFactory(pc, target.m_instructionVector);
-				// Point back into the other map
-				target.m_orderedInstructions[pc + m_startAddress] = &target.m_instructions[pc + m_startAddress];
+		/*
+		 * Stitch the chunks together. x86 decoding synchronizes quickly, so
+		 * when the previous chunk ends at an instruction start the next chunk
+		 * also found, the rest of that chunk is valid as is. Otherwise decode
+		 * serially until it is.
+		 */
+		void merge(BfdDisassembler &target, std::vector<Chunk *> &chunks,
+				InstructionList_t &instructions, LeaderBitmap_t &leaders,
+				std::vector<uint64_t> &branchTargets)
+		{
+			size_t pos = 0;
+			bool leader = true;
+
+			for (std::vector<Chunk *>::iterator it = chunks.begin();
+					it != chunks.end();
+					++it) {
+				Chunk *cur = *it;
+
+				while (pos < cur->m_end) {
+					std::vector<uint32_t>::iterator found = std::lower_bound(cur->m_offsets.begin(),
+							cur->m_offsets.end(), (uint32_t)pos);
+
+					if (found != cur->m_offsets.end() && *found == pos) {
+						size_t first = found - cur->m_offsets.begin();
+
+						for (size_t i = first; i < cur->m_offsets.size(); i++) {
+							instructions.push_back(m_startAddress + cur->m_offsets[i]);
+							leaders.push_back(leader);
+							leader = cur->m_blockEnds[i];
+						}
+						for (std::vector<std::pair<uint32_t, uint64_t> >::iterator tIt = cur->m_targets.begin();
+								tIt != cur->m_targets.end();
+								++tIt) {
+							if (tIt->first >= first)
+								branchTargets.push_back(tIt->second);
+						}
+
+						pos = cur->m_next;
+						break;
+					}
+
+					bool endsBlock;
+					uint64_t branchTarget;
+					size_t count = target.decodeOne(*this, pos, endsBlock, branchTarget);
+
+					if (count > 0) {
+						instructions.push_back(m_startAddress + pos);
+						leaders.push_back(leader);
+						leader = endsBlock;
+						if (branchTarget != BT_INVALID)
+							branchTargets.push_back(branchTarget);
+					} else {
+						count = 1;
+					}
+					pos += count;
+				}
+
+				delete cur;
+			}
 
-				pc += count;
-			} while (count > 0 && pc < m_size);
+			// Not needed anymore
+			free(m_data);
+			m_data = NULL;
+			m_decoded = true;
 		}
 
 	private:
@@ -254,123 +292,235 @@ private:
 		const size_t m_size;
 		const uint64_t m_startAddress;
 
-		bool m_disassembled; // Lazy disassembly once it's used
+		bool m_decoded; // Lazy decoding once it's used
 	};
 
-	// Implementation taken from EmilPRO, https://github.com/SimonKagstrom/emilpro
-	Instruction instructionFactory(uint64_t pc, const std::vector<std::string> &vec)
+	// Decode one instruction, returns the size or 0 if it can't be decoded
+	size_t decodeOne(const Section &section, size_t offset, bool &endsBlock, uint64_t &branchTarget)
 	{
-		uint64_t branchTarget = BT_INVALID; // Invalid
+		X86Instruction insn;
+		size_t count;
 
-		// No encoding???
-		if (vec.size() < 1)
-			return Instruction();
+		endsBlock = false;
+		branchTarget = BT_INVALID;
 
-		std::set<std::string>::const_iterator it = x86BranchInstructions.find(vec[0]);
+		// Table-driven decoding first, libopcodes for what it doesn't handle
+		count = x86DecodeInstruction(section.getData() + offset, section.getSize() - offset,
+				section.getBase() + offset, m_is64Bit, insn);
+		if (count > 0) {
+			if (insn.hasTarget())
+				branchTarget = insn.m_target;
+			endsBlock = insn.m_controlFlow != X86_CF_NONE;
 
-		// Address?
-		if (it != x86BranchInstructions.end() &&
-				vec.size() >= 2 && string_is_integer(vec[1])) {
-			int64_t offset = string_to_integer(vec[1]);
+			return count;
+		}
 
-			// FIXME! Check if this is correct
-			if ( (offset & (1 << 31)) )
-				offset |= 0xffffffff00000000ULL;
+		// libopcodes isn't thread safe
+		std::lock_guard<std::mutex> lock(m_opcodesMutex);
+		struct disassemble_info info = m_info;
 
-			branchTarget = pc + offset;
-		}
+		info.buffer_vma = section.getBase();
+		info.buffer_length = section.getSize();
+		info.buffer = (bfd_byte *)section.getData();
+		info.stream = (void *)this;
+
+		m_instructionVector.clear();
+		int rv = m_disassembler(section.getBase() + offset, &info);
+		if (rv <= 0)
+			return 0;
 
-		return Instruction(branchTarget);
+		branchTarget = instructionFactory(m_instructionVector);
+		endsBlock = branchTarget != BT_INVALID;
+
+		return rv;
 	}
 
-	Section *lookupSection(uint64_t address)
+	void decodeChunk(Chunk &chunk)
 	{
-		SectionCache_t::iterator it = m_cache.lower_bound(address);
+		size_t pos = chunk.m_begin;
 
-		if (it == m_cache.end())
-			return NULL;
-		--it;
+		while (pos < chunk.m_end) {
+			bool endsBlock;
+			uint64_t branchTarget;
+			size_t count = decodeOne(*chunk.m_section, pos, endsBlock, branchTarget);
 
-		// Above the last symbol
-		if (it == m_cache.end())
-			return NULL;
+			// Skip undecodable bytes
+			if (count == 0) {
+				pos++;
+				continue;
+			}
 
-		Section *cur = it->second;
-		uint64_t end = cur->getBase() + cur->getSize() - 1;
+			if (branchTarget != BT_INVALID)
+				chunk.m_targets.push_back(std::pair<uint32_t, uint64_t>(chunk.m_offsets.size(), branchTarget));
+			chunk.m_offsets.push_back(pos);
+			chunk.m_blockEnds.push_back(endsBlock);
 
-		// Below nearest (possible?)
-		if (address < cur->getBase())
-			return NULL;
+			pos += count;
+		}
+		chunk.m_next = pos;
+	}
 
-		// Above section
-		if (address > end)
-			return NULL;
+	static void *decodeThreadStatic(void *pThis)
+	{
+		BfdDisassembler *p = (BfdDisassembler *)pThis;
 
-		// Just right!
-		return cur;
+		p->decodeThread();
+
+		return NULL;
 	}
 
-	void setupBasicBlocks()
+	void decodeThread()
 	{
-		for (SectionCache_t::iterator it = m_cache.begin();
-				it != m_cache.end();
-				++it)
-			it->second->disassemble(*this, m_info, m_disassembler);
+		while (1) {
+			Chunk *cur = NULL;
+
+			m_chunkMutex.lock();
+			if (m_nextChunk < m_chunks.size())
+				cur = m_chunks[m_nextChunk++];
+			m_chunkMutex.unlock();
+
+			if (!cur)
+				break;
 
-		InstructionOrderedMap_t::iterator cur = m_orderedInstructions.begin();
+			decodeChunk(*cur);
+		}
+	}
 
-		// The no-instructions program. Uncommon.
-		if (cur == m_orderedInstructions.end())
+	// Decode the new sections in parallel and add them to the index
+	void updateIndex()
+	{
+		if (m_indexValid)
 			return;
 
-		InstructionOrderedMap_t::iterator next = cur;
-		next++;
+		m_indexValid = true;
+
+		m_chunks.clear();
+		m_nextChunk = 0;
+		for (SectionCache_t::iterator it = m_cache.begin();
+				it != m_cache.end();
+				++it) {
+			Section *cur = it->second;
 
-		// The first instruction is always a leader
-		cur->second->makeLeader();
+			if (cur->isDecoded())
+				continue;
 
-		// The one-instructions program. Also uncommon.
-		if (next == m_orderedInstructions.end())
-			return;
+			for (size_t offset = 0; offset < cur->getSize(); offset += chunkSize)
+				m_chunks.push_back(new Chunk(cur, offset, std::min(offset + chunkSize, cur->getSize())));
+		}
 
-		// Iterate the instruction pairs
-		for (; next != m_orderedInstructions.end(); ++cur, ++next) {
-			// Mark branch targets as leaders, as well as the instruction after that
-			if (cur->second->isBranch()) {
-				m_instructions[cur->second->getBranchTarget()].makeLeader();
-				next->second->makeLeader();
-			}
+		long nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+		std::vector<pthread_t> threads;
+
+		if (nThreads > (long)m_chunks.size())
+			nThreads = m_chunks.size();
+		for (long i = 1; i < nThreads; i++) {
+			pthread_t thread;
+
+			if (pthread_create(&thread, NULL, BfdDisassembler::decodeThreadStatic, (void *)this) == 0)
+				threads.push_back(thread);
 		}
 
-		// Create and populate basic blocks
-		BasicBlock *bb = NULL;
+		// Work on this thread as well
+		decodeThread();
 
-		m_bbs.push_back(bb);
-		for (InstructionOrderedMap_t::iterator it = m_orderedInstructions.begin();
-				it != m_orderedInstructions.end();
+		for (std::vector<pthread_t>::iterator it = threads.begin();
+				it != threads.end();
+				++it)
+			pthread_join(*it, NULL);
+
+		// Rebuild the index in address order, keeping what was there before
+		InstructionList_t instructions;
+		LeaderBitmap_t leaders;
+		std::vector<uint64_t> branchTargets;
+		std::vector<Chunk *>::iterator chunkIt = m_chunks.begin();
+
+		for (SectionCache_t::iterator it = m_cache.begin();
+				it != m_cache.end();
 				++it) {
-			Instruction *cur = it->second;
+			Section *cur = it->second;
 
-			if (cur->isLeader()) {
-				bb = new BasicBlock();
-				m_bbs.push_back(bb);
+			if (cur->isDecoded()) {
+				InstructionList_t::iterator first = std::lower_bound(m_instructions.begin(),
+						m_instructions.end(), cur->getBase());
+				InstructionList_t::iterator last = std::lower_bound(first,
+						m_instructions.end(), cur->getBase() + cur->getSize());
+
+				instructions.insert(instructions.end(), first, last);
+				leaders.insert(leaders.end(), m_leaders.begin() + (first - m_instructions.begin()),
+						m_leaders.begin() + (last - m_instructions.begin()));
+
+				continue;
 			}
 
-			cur->setBasicBlock(bb);
-			bb->addInstructionAddress(it->first);
+			std::vector<Chunk *> sectionChunks;
+
+			while (chunkIt != m_chunks.end() && (*chunkIt)->m_section == cur)
+				sectionChunks.push_back(*chunkIt++);
+
+			cur->merge(*this, sectionChunks, instructions, leaders, branchTargets);
+		}
+		m_chunks.clear();
+
+		m_instructions.swap(instructions);
+		m_leaders.swap(leaders);
+
+		// Mark branch targets as leaders
+		for (std::vector<uint64_t>::iterator it = branchTargets.begin();
+				it != branchTargets.end();
+				++it) {
+			int64_t idx = findInstruction(*it);
+
+			if (idx >= 0)
+				m_leaders[idx] = true;
 		}
 	}
 
+	int64_t findInstruction(uint64_t address) const
+	{
+		InstructionList_t::const_iterator it = std::lower_bound(m_instructions.begin(),
+				m_instructions.end(), address);
+
+		if (it == m_instructions.end() || *it != address)
+			return -1;
+
+		return it - m_instructions.begin();
+	}
 
-	Instruction *getInstruction(uint64_t address)
+	// Implementation taken from EmilPRO, https://github.com/SimonKagstrom/emilpro
+	uint64_t instructionFactory(const std::vector<std::string> &vec)
 	{
-		if (m_instructions.find(address) == m_instructions.end())
-			return NULL;
+		// No encoding???
+		if (vec.size() < 1)
+			return BT_INVALID;
+
+		std::set<std::string>::const_iterator it = x86BranchInstructions.find(vec[0]);
+
+		// Address? (absolute since buffer_vma is the section address)
+		if (it != x86BranchInstructions.end() &&
+				vec.size() >= 2 && string_is_integer(vec[1]))
+			return string_to_integer(vec[1]);
 
-		return &m_instructions[address];
+		return BT_INVALID;
 	}
 
+	Section *lookupSection(uint64_t address)
+	{
+		SectionCache_t::iterator it = m_cache.upper_bound(address);
+
+		// Below the first section
+		if (it == m_cache.begin())
+			return NULL;
+		--it;
+
+		Section *cur = it->second;
+
+		// Above section
+		if (address >= cur->getBase() + cur->getSize())
+			return NULL;
 
+		// Just right!
+		return cur;
+	}
 
 	void opcodesFprintFunc(const char *str)
 	{
@@ -396,21 +546,26 @@ private:
 	}
 
 	typedef std::map<uint64_t, Section *> SectionCache_t;
-	typedef std::unordered_map<uint64_t, Instruction> InstructionAddressMap_t;
-	typedef std::map<uint64_t, Instruction *> InstructionOrderedMap_t;
 
 	struct disassemble_info m_info;
 	disassembler_ftype m_disassembler;
-
+	bool m_is64Bit;
 
 	std::vector<std::string> m_instructionVector;
+	std::mutex m_opcodesMutex;
 
 	SectionCache_t m_cache;
-	InstructionAddressMap_t m_instructions;
-	InstructionOrderedMap_t m_orderedInstructions;
 
-	std::vector<BasicBlock *> m_bbs;
-	std::vector<uint64_t> m_empty;
+	// Sorted instruction starts, and if each one starts a basic block
+	InstructionList_t m_instructions;
+	LeaderBitmap_t m_leaders;
+	bool m_indexValid;
+
+	std::vector<Chunk *> m_chunks;
+	size_t m_nextChunk;
+	std::mutex m_chunkMutex;
+
+	std::vector<uint64_t> m_basicBlock;
 };
 
 IDisassembler &IDisassembler::getInstance()
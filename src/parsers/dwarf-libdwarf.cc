@@ -44,7 +44,7 @@ DwarfParser::~DwarfParser()
 	delete m_impl;
 }
 
-void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
+void DwarfParser::forEachLine(IFileParser::ILineListener& listener, ISourceFileResolver *resolver)
 {
 	Dwarf_Unsigned header;
 
@@ -82,7 +82,10 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 
 			if (line_nr && is_code) {
 				static char *srcDirs[1] = {NULL};
-				listener.onLine(fullPath(srcDirs, line_source), line_nr, addr);
+				std::string path = fullPath(srcDirs, line_source);
+
+				if (!resolver || resolver->resolveSourceFile(path))
+					listener.onFileLine(IPathInterner::getInstance().intern(path), line_nr, addr, 0);
 			}
 
 			dwarf_dealloc(m_impl->m_dwarf, line_source, DW_DLA_STRING);
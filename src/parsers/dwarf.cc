@@ -25,6 +25,26 @@ public:
 	Dwarf *m_dwarf;
 };
 
+// Where the code of a row ends: at the next row, or at the end of the sequence
+static uint64_t rowEnd(Dwarf_Lines *lines, size_t lineCount, size_t i, uint64_t addr)
+{
+	Dwarf_Line *line = dwarf_onesrcline(lines, i);
+	Dwarf_Line *next;
+	Dwarf_Addr nextAddr;
+	bool endSequence;
+
+	if (dwarf_lineendsequence(line, &endSequence) != 0 || endSequence)
+		return addr;
+
+	if (i + 1 >= lineCount || !(next = dwarf_onesrcline(lines, i + 1)))
+		return addr;
+
+	if (dwarf_lineaddr(next, &nextAddr) != 0 || nextAddr < addr)
+		return addr;
+
+	return nextAddr;
+}
+
 DwarfParser::DwarfParser()
 {
 	m_impl = new DwarfParser::Impl();
@@ -36,7 +56,7 @@ DwarfParser::~DwarfParser()
 	delete m_impl;
 }
 
-void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
+void DwarfParser::forEachLine(IFileParser::ILineListener& listener, ISourceFileResolver *resolver)
 {
 	if (!m_impl->m_dwarf)
 		return;
@@ -59,11 +79,11 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 
 		lastOffset = offset;
 
-		/* Get the source lines */
-		if (dwarf_getsrclines(&die, &lines, &lineCount) != 0)
-			continue;
-
-		/* And the files */
+		/*
+		 * Get the files first, the line table might not be needed. Before
+		 * elfutils 0.191, dwarf_getsrcfiles() decodes the line program
+		 * anyway, so only the per-line work is saved there.
+		 */
 		if (dwarf_getsrcfiles(&die, &files, &fileCount) != 0)
 			continue;
 
@@ -77,6 +97,36 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 		if (ndirs == 0)
 			continue;
 
+		/*
+		 * Resolve and filter each file table entry once. Lines refer to
+		 * the same name strings, so they are looked up by pointer.
+		 */
+		SourceFileMap_t sourceFiles;
+		bool anyIncluded = false;
+
+		for (i = 0; i < fileCount; i++) {
+			const char *name = dwarf_filesrc(files, i, NULL, NULL);
+
+			if (!name)
+				continue;
+
+			bool included = lookupSourceFile(sourceFiles, srcDirs, name, resolver).m_included;
+
+			anyIncluded = anyIncluded || included;
+		}
+
+		/* Nothing of interest in this CU, so skip the line program */
+		if (fileCount > 0 && !anyIncluded)
+			continue;
+
+		/* Get the source lines */
+		if (dwarf_getsrclines(&die, &lines, &lineCount) != 0)
+			continue;
+
+		/* The code of included lines, contiguous rows are reported together */
+		uint64_t rangeStart = 0;
+		uint64_t rangeEnd = 0;
+
 		/* Iterate through the source lines */
 		for (i = 0; i < lineCount; i++) {
 			Dwarf_Line *line;
@@ -89,13 +139,16 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 			if ( !(line = dwarf_onesrcline(lines, i)) )
 				continue;
 
-			if (dwarf_lineno(line, &lineNr) != 0)
+			if (!(lineSource = dwarf_linesrc(line, &mtime, &len)) )
 				continue;
 
-			if (!(lineSource = dwarf_linesrc(line, &mtime, &len)) )
+			const SourceFile &sourceFile = lookupSourceFile(sourceFiles, srcDirs, lineSource, resolver);
+
+			// Filtered out
+			if (!sourceFile.m_included)
 				continue;
 
-			if (dwarf_linebeginstatement(line, &isCode) != 0)
+			if (dwarf_lineno(line, &lineNr) != 0)
 				continue;
 
 			if (dwarf_lineaddr(line, &addr) != 0)
@@ -105,15 +158,52 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 			if (lineNr == 0)
 				continue;
 
+			uint64_t end = rowEnd(lines, lineCount, i, addr);
+
+			if (end > addr) {
+				if (addr != rangeEnd) {
+					if (rangeEnd > rangeStart)
+						listener.onCodeRange(rangeStart, rangeEnd);
+					rangeStart = addr;
+				}
+				rangeEnd = end;
+			}
+
+			if (dwarf_linebeginstatement(line, &isCode) != 0)
+				continue;
+
 			// Non-code?
 			if (!isCode)
 				continue;
 
-			listener.onLine(fullPath(srcDirs, lineSource), lineNr, addr);
+			listener.onFileLine(sourceFile.m_id, lineNr, addr, 0);
 		}
+
+		if (rangeEnd > rangeStart)
+			listener.onCodeRange(rangeStart, rangeEnd);
 	}
 }
 
+
+const DwarfParser::SourceFile &DwarfParser::lookupSourceFile(SourceFileMap_t &sourceFiles,
+		const char *const *srcDirs, const char *name, ISourceFileResolver *resolver)
+{
+	SourceFileMap_t::iterator it = sourceFiles.find(name);
+
+	if (it != sourceFiles.end())
+		return it->second;
+
+	SourceFile &out = sourceFiles[name];
+
+	out.m_path = fullPath(srcDirs, name);
+	if (resolver)
+		out.m_included = resolver->resolveSourceFile(out.m_path);
+	if (out.m_included)
+		out.m_id = IPathInterner::getInstance().intern(out.m_path);
+
+	return out;
+}
+
 void DwarfParser::forAddress(IFileParser::ILineListener& listener, uint64_t address)
 {
 	if (!m_impl->m_dwarf)
@@ -193,7 +283,8 @@ bool DwarfParser::open(const std::string& filename)
 {
 	close();
 
-	m_impl->m_fd = ::open(filename.c_str(), O_RDONLY);
+	// Not for the traced program, the parser can be kept open (kcov --server)
+	m_impl->m_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
 
 	if (m_impl->m_fd < 0)
 		return false;
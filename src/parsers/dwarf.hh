@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <file-parser.hh>
@@ -10,19 +11,66 @@ namespace kcov
 	class DwarfParser
 	{
 	public:
+		/**
+		 * Resolves source files once per file table entry, before any
+		 * lines in them are reported
+		 */
+		class ISourceFileResolver
+		{
+		public:
+			virtual ~ISourceFileResolver()
+			{
+			}
+
+			/**
+			 * @param path the full path of the source file, can be replaced
+			 * with the path to report lines with
+			 *
+			 * @return false if lines in this file should be skipped
+			 */
+			virtual bool resolveSourceFile(std::string &path) = 0;
+		};
+
 		DwarfParser();
 
 		~DwarfParser();
 
 		bool open(const std::string &filename);
 
-		void forEachLine(IFileParser::ILineListener &listener);
+		/**
+		 * Report all source lines, and the code ranges they cover, to @a listener.
+		 *
+		 * @param listener the listener
+		 * @param resolver if given, lines in source files it skips are not
+		 * reported, and compilation units with no included source files are
+		 * never decoded
+		 */
+		void forEachLine(IFileParser::ILineListener &listener, ISourceFileResolver *resolver = NULL);
 
 		void forAddress(IFileParser::ILineListener &listener, uint64_t address);
 
 	private:
 		class Impl;
 
+		class SourceFile
+		{
+		public:
+			SourceFile() :
+				m_included(true), m_id(0)
+			{
+			}
+
+			std::string m_path;
+			bool m_included;
+			FileId m_id; //< Only valid if included
+		};
+
+		// File table entries of a compilation unit, by name string
+		typedef std::unordered_map<const char *, SourceFile> SourceFileMap_t;
+
+		const SourceFile &lookupSourceFile(SourceFileMap_t &sourceFiles,
+				const char *const *srcDirs, const char *name, ISourceFileResolver *resolver);
+
 		std::string fullPath(const char *const *srcDirs, const std::string &filename);
 
 		void close();
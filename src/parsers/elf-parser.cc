@@ -6,6 +6,7 @@
 #include <phdr_data.h>
 #include <disassembler.hh>
 #include <elf.hh>
+#include <statistics.hh>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,6 +16,7 @@
 #include <dwarf.h>
 #include <elfutils/libdw.h>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <configuration.hh>
@@ -25,6 +27,7 @@
 #include <link.h>
 
 #include <filter.hh>
+#include <source-file-cache.hh>
 #include <libgen.h>
 
 #include "dwarf.hh"
@@ -38,7 +41,7 @@ enum SymbolType
 };
 typedef std::vector<Segment> SegmentList_t;
 
-class ElfInstance : public IFileParser, IFileParser::ILineListener
+class ElfInstance : public IFileParser, IFileParser::ILineListener, DwarfParser::ISourceFileResolver
 {
 public:
 	ElfInstance() :
@@ -53,15 +56,22 @@ public:
 		m_initialized = false;
 		m_filter = NULL;
 		m_verifyAddresses = false;
+		m_basicBlockBreakpoints = false;
 		m_debuglinkCrc = 0;
 		m_relocation = 0;
 		m_invalidBreakpoints = 0;
+		m_divertedLineListener = NULL;
+		m_divertedFileListener = NULL;
 
 		IParserManager::getInstance().registerParser(*this);
 	}
 
 	virtual ~ElfInstance()
 	{
+		for (WarmFileMap_t::iterator it = m_warmFiles.begin();
+				it != m_warmFiles.end();
+				++it)
+			delete it->second;
 	}
 
 	uint64_t getChecksum()
@@ -86,6 +96,10 @@ public:
 
 	enum IFileParser::PossibleHits maxPossibleHits()
 	{
+		// Samples are counted
+		if (IConfiguration::getInstance().keyAsInt("sample-frequency"))
+			return IFileParser::HITS_UNLIMITED;
+
 		return IFileParser::HITS_LIMITED; // Breakpoints are cleared after a hit
 	}
 
@@ -103,6 +117,7 @@ public:
 	{
 		if (!m_initialized) {
 			m_verifyAddresses = IConfiguration::getInstance().keyAsInt("verify");
+			m_basicBlockBreakpoints = IConfiguration::getInstance().keyAsInt("basic-block-breakpoints");
 
 			panic_if(elf_version(EV_CURRENT) == EV_NONE,
 					"ELF version failed\n");
@@ -117,6 +132,10 @@ public:
 
 		m_curSegments.clear();
 		m_executableSegments.clear();
+
+		delete m_elf;
+		m_elf = NULL;
+
 		for (uint32_t i = 0; data && i < data->n_segments; i++) {
 			struct phdr_data_segment *seg = &data->segments[i];
 
@@ -126,10 +145,7 @@ public:
 		if (!checkFile())
 			return false;
 
-		for (FileListenerList_t::const_iterator it = m_fileListeners.begin();
-				it != m_fileListeners.end();
-				++it)
-			(*it)->onFile(File(m_filename, m_isMainFile ? IFileParser::FLG_NONE : IFileParser::FLG_TYPE_SOLIB));
+		reportFile(File(m_filename, m_isMainFile ? IFileParser::FLG_NONE : IFileParser::FLG_TYPE_SOLIB));
 
 		return true;
 	}
@@ -177,7 +193,16 @@ public:
 			m_elfIsShared = e_type == ET_DYN;
 			if (!m_checksum)
 			{
-				m_checksum = m_elfIs32Bit ? elf32_checksum(elf) : elf64_checksum(elf);
+				WarmFile *warm = lookupWarmFile(m_filename);
+
+				if (warm) {
+					m_checksum = warm->m_checksum;
+				} else {
+					// Kept for parseOneElf, which uses the same mapped file
+					m_elf = IElf::create(m_filename);
+					if (m_elf)
+						m_checksum = m_elf->getChecksum();
+				}
 			}
 		}
 
@@ -210,6 +235,7 @@ out_open:
 
 	bool doParse(unsigned long relocation)
 	{
+		StatisticsScope scope(IStatistics::PHASE_PARSE);
 		struct stat st;
 
 		if (lstat(m_filename.c_str(), &st) < 0)
@@ -225,6 +251,8 @@ out_open:
 		else
 			parseOneDwarf(relocation);
 
+		flushLines();
+
 		return true;
 	}
 
@@ -247,6 +275,53 @@ out_open:
 		return true;
 	}
 
+	void warmUp(const std::string &filename)
+	{
+		struct stat st;
+
+		if (stat(filename.c_str(), &st) < 0 || lookupWarmFile(filename))
+			return;
+
+		panic_if(elf_version(EV_CURRENT) == EV_NONE,
+				"ELF version failed\n");
+
+		IElf *elf = IElf::create(filename);
+
+		if (!elf)
+			return;
+
+		std::string path = get_real_path(filename);
+		WarmFileMap_t::iterator it = m_warmFiles.find(path);
+		if (it != m_warmFiles.end()) {
+			delete it->second;
+			m_warmFiles.erase(it);
+		}
+
+		WarmFile *warm = new WarmFile(st);
+
+		warm->m_checksum = elf->getChecksum();
+		delete elf;
+
+		// libdw keeps the line tables once decoded, so go through all of them
+		WarmUpListener listener;
+
+		warm->m_hasDwarf = warm->m_dwarf.open(filename);
+		warm->m_dwarf.forEachLine(listener);
+
+		// ... and read the sources for the reports
+		ISourceFileCache &sources = ISourceFileCache::getInstance();
+		IPathInterner &interner = IPathInterner::getInstance();
+
+		for (FileId id = 0; id < listener.m_seen.size(); id++) {
+			if (listener.m_seen[id])
+				(void)sources.getLines(interner.getPath(id));
+		}
+
+		m_warmFiles[path] = warm;
+
+		kcov_debug(ELF_MSG, "Warmed up %s\n", path.c_str());
+	}
+
 	void parseGcnoFiles(unsigned long relocation)
 	{
 		for (FileList_t::const_iterator it = m_gcnoFiles.begin();
@@ -286,11 +361,8 @@ out_open:
 			const GcnoParser::BasicBlockMapping &cur = *it;
 
 			// Report a generated address
-			for (LineListenerList_t::const_iterator it = m_lineListeners.begin();
-					it != m_lineListeners.end();
-					++it)
-				(*it)->onLine(cur.m_file, cur.m_line,
-						gcovGetAddress(cur.m_file, cur.m_function, cur.m_basicBlock, cur.m_index) + relocation);
+			reportLine(IPathInterner::getInstance().intern(cur.m_file), cur.m_line,
+					gcovGetAddress(cur.m_file, cur.m_function, cur.m_basicBlock, cur.m_index) + relocation);
 		}
 	}
 
@@ -308,9 +380,18 @@ out_open:
 		m_invalidBreakpoints = 0;
 		m_relocation = relocation;
 
-		DwarfParser dp;
+		DwarfParser cold;
+		DwarfParser *dp = &cold;
+		WarmFile *warm = lookupWarmFile(m_filename);
+		bool rv;
 
-		bool rv = dp.open(m_filename);
+		// Already open, with the line tables decoded
+		if (warm && warm->m_hasDwarf) {
+			dp = &warm->m_dwarf;
+			rv = true;
+		} else {
+			rv = dp->open(m_filename);
+		}
 
 		if (!rv && m_buildId.length() > 0) {
 			/* Look for separate debug info: build-ids */
@@ -320,7 +401,7 @@ out_open:
 							     m_buildId.substr(2, std::string::npos) +
 							     ".debug");
 
-			rv = dp.open(debug_file);
+			rv = dp->open(debug_file);
 			if (!rv && m_isMainFile)
 				kcov_debug(ELF_MSG, "Cannot open %s\n", debug_file.c_str());
 		}
@@ -332,7 +413,7 @@ out_open:
 			if (debugPath == "" && m_isMainFile)
 				kcov_debug(ELF_MSG, "Cannot open debug-link file in standard locations\n");
 			else
-				rv = dp.open(debugPath);
+				rv = dp->open(debugPath);
 		}
 
 		if (!rv) {
@@ -345,7 +426,7 @@ out_open:
 		}
 
 		/* Iterate over the headers */
-		dp.forEachLine(*this);
+		dp->forEachLine(*this, this);
 
 		if (m_invalidBreakpoints > 0) {
 			kcov_debug(STATUS_MSG, "kcov: %u invalid breakpoints skipped in %s\n",
@@ -357,7 +438,8 @@ out_open:
 
 	bool parseOneElf()
 	{
-		m_elf = IElf::create(m_filename);
+		if (!m_elf)
+			m_elf = IElf::create(m_filename);
 
 		if (!m_elf)
 			return false;
@@ -377,16 +459,15 @@ out_open:
 				++it)
 			m_executableSegments.push_back(*it);
 
+		m_curIndex.setup(m_curSegments);
+		m_executableIndex.setup(m_executableSegments);
+
 		// Gcov data
 		std::vector<std::string> gcdaFiles = m_elf->getGcovGcdaFiles();
 		for (std::vector<std::string>::iterator it = gcdaFiles.begin();
 				it != gcdaFiles.end();
-				++it) {
-			for (FileListenerList_t::const_iterator lit = m_fileListeners.begin();
-					lit != m_fileListeners.end();
-					++lit)
-				(*lit)->onFile(File(*it, IFileParser::FLG_TYPE_COVERAGE_DATA));
-		}
+				++it)
+			reportFile(File(*it, IFileParser::FLG_TYPE_COVERAGE_DATA));
 
 		m_gcnoFiles = m_elf->getGcovGcnoFiles();
 		m_buildId = m_elf->getBuildId();
@@ -410,46 +491,125 @@ out_open:
 		m_fileListeners.push_back(&listener);
 	}
 
+	bool divertListeners(IFileParser::ILineListener *lineListener, IFileParser::IFileListener *fileListener)
+	{
+		m_divertedLineListener = lineListener;
+		m_divertedFileListener = fileListener;
+
+		return true;
+	}
+
+	void deliverLines(const LineBatch &lines)
+	{
+		for (LineListenerList_t::const_iterator it = m_lineListeners.begin();
+				it != m_lineListeners.end();
+				++it)
+			lines.deliver(**it);
+	}
+
+	void deliverFile(const File &file)
+	{
+		for (FileListenerList_t::const_iterator it = m_fileListeners.begin();
+				it != m_fileListeners.end();
+				++it)
+			(*it)->onFile(file);
+	}
+
 private:
+	// What warmUp() keeps of a file, valid as long as the file is unchanged
+	class WarmFile
+	{
+	public:
+		WarmFile(const struct stat &st) :
+			m_hasDwarf(false),
+			m_checksum(0),
+			m_dev(st.st_dev),
+			m_ino(st.st_ino),
+			m_size(st.st_size),
+			m_mtime(st.st_mtime)
+		{
+		}
+
+		bool isCurrent(const struct stat &st) const
+		{
+			return st.st_dev == m_dev && st.st_ino == m_ino &&
+					st.st_size == m_size && st.st_mtime == m_mtime;
+		}
+
+		DwarfParser m_dwarf;
+		bool m_hasDwarf;
+		uint64_t m_checksum;
+
+	private:
+		dev_t m_dev;
+		ino_t m_ino;
+		off_t m_size;
+		time_t m_mtime;
+	};
+
+	// Source files seen during warmUp()
+	class WarmUpListener : public IFileParser::ILineListener
+	{
+	public:
+		void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+		{
+		}
+
+		void onFileLine(FileId file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+		{
+			if (file >= m_seen.size())
+				m_seen.resize(file + 1, false);
+			m_seen[file] = true;
+		}
+
+		std::vector<bool> m_seen;
+	};
+
+	typedef std::unordered_map<std::string, WarmFile *> WarmFileMap_t;
+
+	WarmFile *lookupWarmFile(const std::string &filename)
+	{
+		if (m_warmFiles.empty())
+			return NULL;
+
+		WarmFileMap_t::const_iterator it = m_warmFiles.find(get_real_path(filename));
+		struct stat st;
+
+		if (it == m_warmFiles.end())
+			return NULL;
+
+		if (stat(filename.c_str(), &st) < 0 || !it->second->isCurrent(st))
+			return NULL;
+
+		return it->second;
+	}
+
 	typedef std::vector<IFileParser::ILineListener *> LineListenerList_t;
 	typedef std::vector<IFileListener *> FileListenerList_t;
 	typedef std::vector<std::string> FileList_t;
 
 	bool addressIsValid(uint64_t addr, unsigned &invalidBreakpoints) const
 	{
-		for (SegmentList_t::const_iterator it = m_executableSegments.begin();
-				it != m_executableSegments.end();
-				++it) {
-			if (it->addressIsWithinSegment(addr)) {
-				bool out = true;
+		if (!m_executableIndex.lookup(addr))
+			return false;
 
-				if (m_verifyAddresses) {
-					out = m_addressVerifier.verify(addr);
+		if (m_verifyAddresses && !m_addressVerifier.verify(addr)) {
+			kcov_debug(ELF_MSG, "kcov: Address 0x%llx is not at an instruction boundary, skipping\n",
+					(unsigned long long)addr);
+			invalidBreakpoints++;
 
-					if (!out) {
-						kcov_debug(ELF_MSG, "kcov: Address 0x%llx is not at an instruction boundary, skipping\n",
-								(unsigned long long)addr);
-						invalidBreakpoints++;
-					}
-				}
-
-				return out;
-			}
+			return false;
 		}
 
-		return false;
+		return true;
 	}
 
 	uint64_t adjustAddressBySegment(uint64_t addr)
 	{
-		for (SegmentList_t::const_iterator it = m_curSegments.begin();
-				it != m_curSegments.end();
-				++it) {
-			if (it->addressIsWithinSegment(addr)) {
-				addr = it->adjustAddress(addr);
-				break;
-			}
-		}
+		const Segment *seg = m_curIndex.lookup(addr);
+
+		if (seg)
+			addr = seg->adjustAddress(addr);
 
 		return addr;
 	}
@@ -457,16 +617,69 @@ private:
 
 	// From IFileParser::ILineListener
 	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		onFileLine(IPathInterner::getInstance().intern(file), lineNr, addr, 0);
+	}
+
+	// From IFileParser::ILineListener, with the path already mangled
+	void onFileLine(FileId file, unsigned int lineNr, uint64_t addr, uint64_t)
 	{
 		if (!addressIsValid(addr, m_invalidBreakpoints))
 			return;
 
-		std::string rp = m_filter->mangleSourcePath(file);
+		uint64_t blockAddr = 0;
 
-		for (LineListenerList_t::const_iterator it = m_lineListeners.begin();
-				it != m_lineListeners.end();
-				++it)
-			(*it)->onLine(rp, lineNr, adjustAddressBySegment(addr) + m_relocation);
+		if (m_basicBlockBreakpoints) {
+			const std::vector<uint64_t> &bb = m_addressVerifier.getBasicBlock(addr);
+
+			if (!bb.empty())
+				blockAddr = adjustAddressBySegment(bb[0]) + m_relocation;
+		}
+
+		reportLine(file, lineNr, adjustAddressBySegment(addr) + m_relocation, blockAddr);
+	}
+
+	// From IFileParser::ILineListener
+	void onCodeRange(uint64_t start, uint64_t end)
+	{
+		m_pendingLines.addRange(adjustAddressBySegment(start) + m_relocation,
+				adjustAddressBySegment(end - 1) + 1 + m_relocation);
+	}
+
+	// From DwarfParser::ISourceFileResolver, called once per file table entry
+	bool resolveSourceFile(std::string &path)
+	{
+		if (!m_filter)
+			return true;
+
+		path = m_filter->mangleSourcePath(path);
+
+		return m_filter->runFilters(path);
+	}
+
+	// Lines are collected per file during a parse, and reported in flushLines()
+	void reportLine(FileId file, unsigned int lineNr, uint64_t addr,
+			uint64_t blockAddr = 0)
+	{
+		m_pendingLines.add(file, lineNr, addr, blockAddr);
+	}
+
+	void flushLines()
+	{
+		if (!m_divertedLineListener)
+			deliverLines(m_pendingLines);
+		else
+			m_pendingLines.deliver(*m_divertedLineListener);
+
+		m_pendingLines.clear();
+	}
+
+	void reportFile(const File &file)
+	{
+		if (m_divertedFileListener)
+			m_divertedFileListener->onFile(file);
+		else
+			deliverFile(file);
 	}
 
 
@@ -583,15 +796,21 @@ private:
 
 	SegmentList_t m_curSegments;
 	SegmentList_t m_executableSegments;
+	SegmentIndex m_curIndex;
+	SegmentIndex m_executableIndex;
 	FileList_t m_gcnoFiles;
 
 	IDisassembler &m_addressVerifier;
 	bool m_verifyAddresses;
+	bool m_basicBlockBreakpoints;
 	IElf *m_elf;
 	bool m_elfIs32Bit;
 	bool m_elfIsShared;
 	LineListenerList_t m_lineListeners;
 	FileListenerList_t m_fileListeners;
+	IFileParser::ILineListener *m_divertedLineListener;
+	IFileParser::IFileListener *m_divertedFileListener;
+	LineBatch m_pendingLines;
 	std::string m_filename;
 	std::string m_buildId;
 	std::string m_debuglink;
@@ -601,6 +820,7 @@ private:
 	bool m_initialized;
 	uint64_t m_relocation;
 	uint32_t m_invalidBreakpoints;
+	WarmFileMap_t m_warmFiles;
 
 	/***** Add strings to update path information. *******/
 	std::string m_origRoot;
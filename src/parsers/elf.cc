@@ -4,19 +4,139 @@
 
 #include <elfutils/libdw.h>
 
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
 using namespace kcov;
 
+/**
+ * A mapped file, shared by all ELF views of it
+ */
+class MappedImage
+{
+public:
+	MappedImage(const std::string &filename, const struct stat &st, void *data, size_t size) :
+		m_filename(filename),
+		m_dev(st.st_dev),
+		m_ino(st.st_ino),
+		m_mtime(st.st_mtime),
+		m_data(data),
+		m_size(size),
+		m_refs(1)
+	{
+	}
+
+	bool matches(const struct stat &st) const
+	{
+		return m_dev == st.st_dev && m_ino == st.st_ino &&
+				m_mtime == st.st_mtime && m_size == (size_t)st.st_size;
+	}
+
+	const std::string m_filename;
+	const dev_t m_dev;
+	const ino_t m_ino;
+	const time_t m_mtime;
+	void *m_data;
+	size_t m_size;
+	unsigned int m_refs;
+};
+
+typedef std::unordered_map<std::string, MappedImage *> MappedImageMap_t;
+
+static MappedImageMap_t g_mappedImages;
+static std::mutex g_mappedImageMutex;
+
+static MappedImage *acquireImage(const std::string &filename)
+{
+	struct stat st;
+
+	if (stat(filename.c_str(), &st) < 0)
+		return NULL;
+
+	std::lock_guard<std::mutex> lock(g_mappedImageMutex);
+	MappedImageMap_t::iterator it = g_mappedImages.find(filename);
+
+	if (it != g_mappedImages.end()) {
+		MappedImage *cur = it->second;
+
+		if (cur->matches(st)) {
+			cur->m_refs++;
+
+			return cur;
+		}
+
+		// Changed on disk, the old image goes away with its last user
+		g_mappedImages.erase(it);
+	}
+
+	size_t sz;
+	void *data = map_file(&sz, "%s", filename.c_str());
+
+	if (!data)
+		return NULL;
+
+	MappedImage *out = new MappedImage(filename, st, data, sz);
+	g_mappedImages[filename] = out;
+
+	return out;
+}
+
+static void releaseImage(MappedImage *image)
+{
+	std::lock_guard<std::mutex> lock(g_mappedImageMutex);
+
+	if (--image->m_refs > 0)
+		return;
+
+	MappedImageMap_t::iterator it = g_mappedImages.find(image->m_filename);
+	if (it != g_mappedImages.end() && it->second == image)
+		g_mappedImages.erase(it);
+
+	unmap_file(image->m_data, image->m_size);
+	delete image;
+}
+
 class ElfImpl : public IElf
 {
 public:
-	ElfImpl(void *data, size_t size) :
-		m_debugLinkValid(false), m_fileData((char *)data), m_fileSize(size)
+	ElfImpl(MappedImage *image) :
+		m_debugLinkValid(false),
+		m_image(image),
+		m_fileData((char *)image->m_data),
+		m_fileSize(image->m_size),
+		m_checksum(0),
+		m_checksumValid(false)
 	{
 		parse();
 	}
 
 	~ElfImpl()
 	{
+		releaseImage(m_image);
+	}
+
+	virtual uint64_t getChecksum()
+	{
+		if (m_checksumValid)
+			return m_checksum;
+
+		// The build-id identifies the contents, so there is no need to read it all
+		if (!m_buildId.empty()) {
+			m_checksum = 0xcbf29ce484222325ULL;
+
+			for (std::string::const_iterator it = m_buildId.begin();
+					it != m_buildId.end();
+					++it) {
+				m_checksum ^= (uint8_t)*it;
+				m_checksum *= 0x100000001b3ULL;
+			}
+		} else {
+			m_checksum = hash_block_parallel(m_fileData, m_fileSize);
+		}
+		m_checksumValid = true;
+
+		return m_checksum;
 	}
 
 	virtual const std::vector<std::string> &getGcovGcdaFiles()
@@ -244,19 +364,69 @@ out_elf_begin:
 	std::pair<std::string, uint32_t> m_debugLink;
 	std::vector<Segment> m_segments;
 
+	MappedImage *m_image;
 	char *m_fileData;
 	size_t m_fileSize;
+
+	uint64_t m_checksum;
+	bool m_checksumValid;
 };
 
 IElf *IElf::create(const std::string &filename)
 {
-	size_t sz;
-	void *data;
+	MappedImage *image = acquireImage(filename);
 
-	// The data is freed by the parser
-	data = read_file(&sz, "%s", filename.c_str());
-	if (!data)
+	if (!image)
 		return NULL;
 
-	return new ElfImpl(data, sz);
+	return new ElfImpl(image);
+}
+
+SegmentIndex::SegmentIndex() :
+	m_last(NULL)
+{
+}
+
+void SegmentIndex::setup(const std::vector<Segment> &segments)
+{
+	m_entries.clear();
+	m_last = NULL;
+
+	for (std::vector<Segment>::const_iterator it = segments.begin();
+			it != segments.end();
+			++it) {
+		uint64_t start = it->getPhysicalBase();
+
+		if (it->getSize() != 0)
+			m_entries.push_back(Entry(start, start + it->getSize(), &*it));
+	}
+
+	std::stable_sort(m_entries.begin(), m_entries.end());
+}
+
+const Segment *SegmentIndex::lookup(uint64_t addr) const
+{
+	if (m_last && addr >= m_last->m_start && addr < m_last->m_end)
+		return m_last->m_segment;
+
+	if (m_entries.empty() || addr < m_entries[0].m_start)
+		return NULL;
+
+	// Branch-free binary search for the last entry starting at or below addr
+	const Entry *base = &m_entries[0];
+	size_t n = m_entries.size();
+
+	while (n > 1) {
+		size_t half = n / 2;
+
+		base = base[half].m_start <= addr ? base + half : base;
+		n -= half;
+	}
+
+	if (addr >= base->m_end)
+		return NULL;
+
+	m_last = base;
+
+	return m_last->m_segment;
 }
@@ -0,0 +1,420 @@
+#include "x86-decoder.hh"
+
+using namespace kcov;
+
+enum OpcodeFlags
+{
+	M    = 1 << 0,  //< Has a ModRM byte
+	I8   = 1 << 1,  //< 8-bit immediate
+	I16  = 1 << 2,  //< 16-bit immediate
+	IZ   = 1 << 3,  //< 16/32-bit immediate depending on operand size
+	IV   = 1 << 4,  //< 16/32/64-bit immediate depending on operand size
+	MO   = 1 << 5,  //< Memory offset, sized by address size
+	FAR  = 1 << 6,  //< Far pointer (16:16/16:32)
+	R8   = 1 << 7,  //< 8-bit relative branch
+	RZ   = 1 << 8,  //< 16/32-bit relative branch
+	G3   = 1 << 9,  //< Group 3 (test has an immediate for /0 and /1)
+	MR   = 1 << 10, //< ModRM which is always a register (mov to/from cr/dr)
+	N64  = 1 << 11, //< Invalid in 64-bit mode
+	P    = 1 << 12, //< Legacy prefix
+	ESC  = 1 << 13, //< Handled separately (escape or VEX/EVEX/XOP candidates)
+	BAD  = 1 << 14, //< Invalid or not handled, leave to the fallback
+};
+
+static const uint16_t oneByteOpcodes[256] =
+{
+	/* 00 */ M, M, M, M, I8, IZ, N64, N64, M, M, M, M, I8, IZ, N64, ESC,
+	/* 10 */ M, M, M, M, I8, IZ, N64, N64, M, M, M, M, I8, IZ, N64, N64,
+	/* 20 */ M, M, M, M, I8, IZ, P, N64, M, M, M, M, I8, IZ, P, N64,
+	/* 30 */ M, M, M, M, I8, IZ, P, N64, M, M, M, M, I8, IZ, P, N64,
+	/* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 60 */ N64, N64, ESC, M, P, P, P, P, IZ, M | IZ, I8, M | I8, 0, 0, 0, 0,
+	/* 70 */ R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8,
+	/* 80 */ M | I8, M | IZ, M | I8 | N64, M | I8, M, M, M, M, M, M, M, M, M, M, M, ESC,
+	/* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, FAR | N64, 0, 0, 0, 0, 0,
+	/* a0 */ MO, MO, MO, MO, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+	/* b0 */ I8, I8, I8, I8, I8, I8, I8, I8, IV, IV, IV, IV, IV, IV, IV, IV,
+	/* c0 */ M | I8, M | I8, I16, 0, ESC, ESC, M | I8, M | IZ, I16 | I8, 0, I16, 0, 0, I8, N64, 0,
+	/* d0 */ M, M, M, M, I8 | N64, I8 | N64, BAD, 0, M, M, M, M, M, M, M, M,
+	/* e0 */ R8, R8, R8, R8, I8, I8, I8, I8, RZ, RZ, FAR | N64, R8, 0, 0, 0, 0,
+	/* f0 */ P, 0, P, P, 0, 0, M | G3, M | G3, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+static const uint16_t twoByteOpcodes[256] =
+{
+	/* 00 */ M, M, M, M, BAD, 0, 0, 0, 0, 0, BAD, 0, BAD, M, 0, M | I8,
+	/* 10 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 20 */ MR, MR, MR, MR, BAD, BAD, BAD, BAD, M, M, M, M, M, M, M, M,
+	/* 30 */ 0, 0, 0, 0, 0, 0, BAD, 0, ESC, BAD, ESC, BAD, BAD, BAD, BAD, BAD,
+	/* 40 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 50 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 60 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 70 */ M | I8, M | I8, M | I8, M | I8, M, M, M, 0, M, M, BAD, BAD, M, M, M, M,
+	/* 80 */ RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ,
+	/* 90 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* a0 */ 0, 0, 0, M, M | I8, M, BAD, BAD, 0, 0, 0, M, M | I8, M, M, M,
+	/* b0 */ M, M, M, M, M, M, M, M, M, M, M | I8, M, M, M, M, M,
+	/* c0 */ M, M, M | I8, M, M | I8, M | I8, M | I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* d0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* e0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* f0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+};
+
+class Decoder
+{
+public:
+	Decoder(const uint8_t *data, size_t size, bool is64Bit) :
+		m_data(data),
+		m_size(size > 15 ? 15 : size),
+		m_pos(0),
+		m_map(0),
+		m_is64Bit(is64Bit),
+		m_operandSize16(false),
+		m_addressSize16(false),
+		m_addressSize32(false),
+		m_rexW(false),
+		m_ripDisplacement(0)
+	{
+	}
+
+	unsigned int decode(uint64_t address, X86Instruction &out)
+	{
+		uint8_t opcode;
+		uint16_t flags;
+
+		// Legacy prefixes and REX
+		while (1) {
+			if (!next(opcode))
+				return 0;
+
+			if (opcode == 0x66) {
+				m_operandSize16 = true;
+			} else if (opcode == 0x67) {
+				if (m_is64Bit)
+					m_addressSize32 = true;
+				else
+					m_addressSize16 = true;
+			} else if (oneByteOpcodes[opcode] & P) {
+				// Segment overrides, lock, rep
+			} else if (m_is64Bit && (opcode & 0xf0) == 0x40) {
+				// REX, only valid directly before the opcode
+				m_rexW = (opcode & 0x08) != 0;
+				if (!peek(opcode) || (oneByteOpcodes[opcode] & P) || opcode == 0x66 || opcode == 0x67 ||
+						(opcode & 0xf0) == 0x40)
+					return 0;
+			} else {
+				break;
+			}
+		}
+
+		flags = oneByteOpcodes[opcode];
+
+		if (flags & ESC) {
+			if (opcode == 0x0f)
+				return decodeTwoByte(address, out);
+
+			return decodeEscape(opcode, address, out);
+		}
+
+		if ((flags & BAD) || (m_is64Bit && (flags & N64)))
+			return 0;
+
+		switch (opcode) {
+		case 0xc2: case 0xc3: case 0xca: case 0xcb: case 0xcf:
+			out.m_controlFlow = X86_CF_RETURN;
+			break;
+		case 0xe8:
+			out.m_controlFlow = X86_CF_CALL;
+			break;
+		case 0xe9: case 0xeb:
+			out.m_controlFlow = X86_CF_JUMP;
+			break;
+		case 0x9a: case 0xea:
+			out.m_controlFlow = X86_CF_INDIRECT;
+			break;
+		default:
+			if (flags & (R8 | RZ))
+				out.m_controlFlow = X86_CF_BRANCH;
+			break;
+		}
+
+		return finish(flags, opcode, address, out);
+	}
+
+private:
+	unsigned int decodeTwoByte(uint64_t address, X86Instruction &out)
+	{
+		uint8_t opcode;
+
+		if (!next(opcode))
+			return 0;
+
+		if (opcode == 0x38)
+			return decodeMap(2, address, out);
+		if (opcode == 0x3a)
+			return decodeMap(3, address, out);
+
+		uint16_t flags = twoByteOpcodes[opcode];
+
+		if (flags & BAD)
+			return 0;
+
+		m_map = 1;
+		if (flags & RZ)
+			out.m_controlFlow = X86_CF_BRANCH;
+
+		return finish(flags, opcode, address, out);
+	}
+
+	// Opcode maps for three-byte opcodes and VEX/EVEX/XOP encodings
+	unsigned int decodeMap(unsigned int map, uint64_t address, X86Instruction &out)
+	{
+		uint8_t opcode;
+
+		if (!next(opcode))
+			return 0;
+
+		m_map = map;
+		switch (map) {
+		case 1:
+			// vzeroupper/vzeroall have no ModRM
+			if (opcode == 0x77)
+				return finish(0, opcode, address, out);
+			if (twoByteOpcodes[opcode] & (BAD | RZ | ESC))
+				return 0;
+			return finish(M | (twoByteOpcodes[opcode] & I8), opcode, address, out);
+		case 2:
+		case 5:
+		case 6:
+		case 9:
+			return finish(M, opcode, address, out);
+		case 3:
+		case 8:
+			return finish(M | I8, opcode, address, out);
+		case 10:
+			// XOP map 0xa has a 32-bit immediate
+			m_operandSize16 = false;
+			return finish(M | IZ, opcode, address, out);
+		default:
+			break;
+		}
+
+		return 0;
+	}
+
+	unsigned int decodeEscape(uint8_t opcode, uint64_t address, X86Instruction &out)
+	{
+		uint8_t p0, p1, p2;
+
+		if (!peek(p0))
+			return 0;
+
+		switch (opcode) {
+		case 0xc4: // VEX3 (or les)
+		case 0xc5: // VEX2 (or lds)
+			if (!m_is64Bit && (p0 & 0xc0) != 0xc0)
+				return finish(M, opcode, address, out);
+
+			if (opcode == 0xc5) {
+				next(p0);
+				return decodeMap(1, address, out);
+			}
+
+			if (!next(p0) || !next(p1))
+				return 0;
+
+			return decodeMap(p0 & 0x1f, address, out);
+
+		case 0x62: // EVEX (or bound)
+			if (!m_is64Bit && (p0 & 0xc0) != 0xc0)
+				return finish(M, opcode, address, out);
+
+			if (!next(p0) || !next(p1) || !next(p2))
+				return 0;
+
+			return decodeMap(p0 & 0x07, address, out);
+
+		case 0x8f: // XOP (or pop r/m)
+			if ((p0 & 0x38) == 0)
+				return finish(M, opcode, address, out);
+
+			if (!next(p0) || !next(p1))
+				return 0;
+
+			return decodeMap(p0 & 0x1f, address, out);
+
+		default:
+			break;
+		}
+
+		return 0;
+	}
+
+	unsigned int finish(uint16_t flags, uint8_t opcode, uint64_t address, X86Instruction &out)
+	{
+		if (flags & (M | MR)) {
+			uint8_t modrm;
+
+			if (!next(modrm))
+				return 0;
+
+			if (!(flags & MR) && !skipModrm(modrm))
+				return 0;
+
+			uint8_t reg = (modrm >> 3) & 7;
+
+			// test r/m, imm
+			if ((flags & G3) && reg < 2)
+				flags |= (opcode == 0xf6) ? I8 : IZ;
+
+			// Indirect call/jmp in group 5
+			if (m_map == 0 && opcode == 0xff && reg >= 2 && reg <= 5)
+				out.m_controlFlow = X86_CF_INDIRECT;
+		}
+
+		unsigned int immSize = 0;
+
+		if (flags & I8)
+			immSize += 1;
+		if (flags & I16)
+			immSize += 2;
+		if (flags & IZ)
+			immSize += m_operandSize16 && !m_rexW ? 2 : 4;
+		if (flags & IV)
+			immSize += m_rexW ? 8 : (m_operandSize16 ? 2 : 4);
+		if (flags & MO) {
+			if (m_is64Bit)
+				immSize += m_addressSize32 ? 4 : 8;
+			else
+				immSize += m_addressSize16 ? 2 : 4;
+		}
+		if (flags & FAR)
+			immSize += m_operandSize16 ? 4 : 6;
+
+		if (flags & (R8 | RZ)) {
+			unsigned int relSize = 1;
+
+			// Near branches are always 32-bit in 64-bit mode
+			if (flags & RZ)
+				relSize = (m_operandSize16 && !m_is64Bit) ? 2 : 4;
+
+			if (m_pos + relSize > m_size)
+				return 0;
+
+			int64_t rel = 0;
+
+			if (relSize == 1)
+				rel = (int8_t)m_data[m_pos];
+			else if (relSize == 2)
+				rel = (int16_t)(m_data[m_pos] | (m_data[m_pos + 1] << 8));
+			else
+				rel = (int32_t)((uint32_t)m_data[m_pos] | ((uint32_t)m_data[m_pos + 1] << 8) |
+						((uint32_t)m_data[m_pos + 2] << 16) | ((uint32_t)m_data[m_pos + 3] << 24));
+
+			m_pos += relSize;
+			out.m_target = address + m_pos + rel;
+			if (!m_is64Bit)
+				out.m_target &= 0xffffffffULL;
+		}
+
+		if (m_pos + immSize > m_size)
+			return 0;
+		m_pos += immSize;
+
+		out.m_size = m_pos;
+		out.m_ripDisplacement = m_ripDisplacement;
+
+		return m_pos;
+	}
+
+	bool skipModrm(uint8_t modrm)
+	{
+		uint8_t mod = modrm >> 6;
+		uint8_t rm = modrm & 7;
+		unsigned int disp = 0;
+
+		if (mod == 3)
+			return true;
+
+		if (m_addressSize16) {
+			if (mod == 0 && rm == 6)
+				disp = 2;
+			else if (mod == 1)
+				disp = 1;
+			else if (mod == 2)
+				disp = 2;
+		} else {
+			if (rm == 4) {
+				uint8_t sib;
+
+				if (!next(sib))
+					return false;
+
+				if (mod == 0 && (sib & 7) == 5)
+					disp = 4;
+			}
+
+			if (mod == 0 && rm == 5) {
+				disp = 4;
+				if (m_is64Bit)
+					m_ripDisplacement = m_pos;
+			} else if (mod == 1)
+				disp = 1;
+			else if (mod == 2)
+				disp = 4;
+		}
+
+		if (m_pos + disp > m_size)
+			return false;
+		m_pos += disp;
+
+		return true;
+	}
+
+	bool next(uint8_t &out)
+	{
+		if (m_pos >= m_size)
+			return false;
+
+		out = m_data[m_pos++];
+
+		return true;
+	}
+
+	bool peek(uint8_t &out) const
+	{
+		if (m_pos >= m_size)
+			return false;
+
+		out = m_data[m_pos];
+
+		return true;
+	}
+
+	const uint8_t *m_data;
+	const size_t m_size;
+	unsigned int m_pos;
+	unsigned int m_map; //< 0 for the one-byte map, 1 for 0f, 2 for 0f38 and so on
+
+	bool m_is64Bit;
+	bool m_operandSize16;
+	bool m_addressSize16;
+	bool m_addressSize32;
+	bool m_rexW;
+	unsigned int m_ripDisplacement;
+};
+
+unsigned int kcov::x86DecodeInstruction(const uint8_t *data, size_t size, uint64_t address,
+		bool is64Bit, X86Instruction &out)
+{
+	Decoder decoder(data, size, is64Bit);
+
+	out = X86Instruction();
+
+	unsigned int rv = decoder.decode(address, out);
+	if (rv == 0)
+		out = X86Instruction();
+
+	return rv;
+}
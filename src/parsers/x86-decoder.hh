@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace kcov
+{
+	/**
+	 * Control flow of a decoded instruction, as far as basic blocks go
+	 */
+	enum X86ControlFlow
+	{
+		X86_CF_NONE,      //< Falls through to the next instruction
+		X86_CF_BRANCH,    //< Direct conditional branch (jcc, loop, jcxz)
+		X86_CF_JUMP,      //< Direct unconditional jump
+		X86_CF_CALL,      //< Direct call
+		X86_CF_INDIRECT,  //< Indirect or far jump/call
+		X86_CF_RETURN,    //< ret, retf, iret
+	};
+
+	class X86Instruction
+	{
+	public:
+		X86Instruction() :
+			m_size(0), m_controlFlow(X86_CF_NONE), m_target(0), m_ripDisplacement(0)
+		{
+		}
+
+		bool hasTarget() const
+		{
+			return m_controlFlow == X86_CF_BRANCH ||
+					m_controlFlow == X86_CF_JUMP ||
+					m_controlFlow == X86_CF_CALL;
+		}
+
+		unsigned int m_size;
+		enum X86ControlFlow m_controlFlow;
+		uint64_t m_target; //< Absolute target for direct branches, jumps and calls
+		unsigned int m_ripDisplacement; //< Offset of the disp32 of a RIP-relative operand, 0 if none
+	};
+
+	/**
+	 * Decode the length and control flow of one i386/x86-64 instruction.
+	 *
+	 * Opcodes not covered by the tables (and invalid ones) are left to the
+	 * caller, which can fall back to a full disassembler.
+	 *
+	 * @param data the instruction bytes
+	 * @param size the number of bytes available at @a data
+	 * @param address the address of the instruction
+	 * @param is64Bit true for 64-bit mode, false for 32-bit protected mode
+	 * @param out the decoded instruction
+	 *
+	 * @return the instruction size, or 0 if it couldn't be decoded
+	 */
+	unsigned int x86DecodeInstruction(const uint8_t *data, size_t size, uint64_t address,
+			bool is64Bit, X86Instruction &out);
+}
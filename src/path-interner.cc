@@ -0,0 +1,82 @@
+#include <path-interner.hh>
+#include <utils.hh>
+
+#include <mutex>
+#include <unordered_map>
+
+using namespace kcov;
+
+class PathInterner : public IPathInterner
+{
+public:
+	PathInterner() :
+		m_size(0)
+	{
+		memset(m_chunks, 0, sizeof(m_chunks));
+	}
+
+	FileId intern(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		IdByPathMap_t::const_iterator it = m_ids.find(path);
+
+		if (it != m_ids.end())
+			return it->second;
+
+		FileId id = (FileId)m_size;
+		unsigned int chunk = id / chunkSize;
+
+		panic_if(chunk >= maxChunks,
+				"Too many source files (%u)", (unsigned int)id);
+
+		if (!m_chunks[chunk])
+			m_chunks[chunk] = new std::string[chunkSize];
+
+		m_chunks[chunk][id % chunkSize] = path;
+		m_ids[path] = id;
+		m_size++;
+
+		return id;
+	}
+
+	/*
+	 * Lock-free, since paths are never moved or changed once interned. The
+	 * caller got the ID from intern(), so it's already visible here.
+	 */
+	const std::string &getPath(FileId id)
+	{
+		unsigned int chunk = id / chunkSize;
+
+		panic_if(chunk >= maxChunks || !m_chunks[chunk],
+				"File ID %u out of range", (unsigned int)id);
+
+		return m_chunks[chunk][id % chunkSize];
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		return m_size;
+	}
+
+private:
+	typedef std::unordered_map<std::string, FileId> IdByPathMap_t;
+
+	static const unsigned int chunkSize = 1024;
+	static const unsigned int maxChunks = 4096;
+
+	std::mutex m_mutex;
+	IdByPathMap_t m_ids;
+	std::string *m_chunks[maxChunks];
+	size_t m_size;
+};
+
+IPathInterner &IPathInterner::getInstance()
+{
+	// Initialised once, even when first used from a parser thread
+	static PathInterner *g_instance = new PathInterner();
+
+	return *g_instance;
+}
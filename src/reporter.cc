@@ -5,6 +5,7 @@
 #include <filter.hh>
 #include <configuration.hh>
 #include <source-file-cache.hh>
+#include <statistics.hh>
 
 #include <string>
 #include <list>
@@ -13,6 +14,8 @@
 #include <map>
 #include <fstream>
 
+#include <sys/stat.h>
+
 #include "swap-endian.hh"
 
 using namespace kcov;
@@ -48,6 +51,10 @@ public:
 		m_hashFilename = fileParser.getParserType() == "ELF";
 
 		m_dbFileName = IConfiguration::getInstance().keyAsString("target-directory") + "/coverage.db";
+		m_processDirectory = IConfiguration::getInstance().keyAsString("target-directory") + "/processes";
+
+		if (IConfiguration::getInstance().keyAsInt("per-process"))
+			(void)mkdir(m_processDirectory.c_str(), 0755);
 	}
 
 	~Reporter()
@@ -134,6 +141,7 @@ public:
 
 	void *marshal(size_t *szOut)
 	{
+		StatisticsScope scope(IStatistics::PHASE_MARSHAL);
 		size_t sz = getMarshalSize();
 		void *start;
 		uint8_t *p;
@@ -160,6 +168,7 @@ public:
 
 	bool unMarshal(void *data, size_t sz)
 	{
+		StatisticsScope scope(IStatistics::PHASE_MARSHAL);
 		uint8_t *start = (uint8_t *)data;
 		uint8_t *p = start;
 		size_t n;
@@ -230,6 +239,8 @@ public:
 
 
 private:
+	class File;
+
 	size_t getMarshalEntrySize()
 	{
 		return 4 * sizeof(uint64_t);
@@ -279,15 +290,48 @@ private:
 	/* Called when the file is parsed */
 	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
 	{
-		if (!m_filter.runFilters(file))
+		onFileLine(IPathInterner::getInstance().intern(file), lineNr, addr, 0);
+	}
+
+	void onFileLine(FileId fileId, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+	{
+		File *fp = lookupFile(fileId, lineNr);
+
+		if (fp)
+			addLine(fp, IPathInterner::getInstance().getPath(fileId), lineNr, addr);
+	}
+
+	// All lines of a file at once, so the file is only looked up once
+	void onFileLines(FileId fileId, const unsigned int *lineNrs, const uint64_t *addrs,
+			const uint64_t *blockAddrs, size_t n)
+	{
+		if (n == 0)
 			return;
 
-		kcov_debug(INFO_MSG, "REPORT %s:%u at 0x%lx\n",
-				file.c_str(), lineNr, (unsigned long)addr);
+		File *fp = lookupFile(fileId, lineNrs[0]);
+
+		if (!fp)
+			return;
+
+		const std::string &file = IPathInterner::getInstance().getPath(fileId);
 
-		File *fp = m_files[file];
+		for (size_t i = 0; i < n; i++)
+			addLine(fp, file, lineNrs[i], addrs[i]);
+	}
+
+	// Lookup or create a file, or NULL if it's filtered out
+	File *lookupFile(FileId fileId, unsigned int lineNr)
+	{
+		if (!m_filter.runFilters(fileId))
+			return NULL;
+
+		if (fileId >= m_filesById.size())
+			m_filesById.resize(fileId + 1, NULL);
+
+		File *fp = m_filesById[fileId];
 
 		if (!fp) {
+			const std::string &file = IPathInterner::getInstance().getPath(fileId);
 			uint64_t hash = 0;
 
 			/*
@@ -312,7 +356,8 @@ private:
 
 			fp = new File(hash);
 
-			// Mark unreachable lines separately (often none)
+			// Mark unreachable lines separately (often none), timed per file
+			StatisticsScope scope(IStatistics::PHASE_FILTER);
 			const std::vector<std::string> &lines = ISourceFileCache::getInstance().getLines(file);
 			for (unsigned int nr = 1; nr <= lines.size(); nr++) {
 				if (!m_filter.runLineFilters(file, lineNr, lines[nr - 1])) {
@@ -323,8 +368,17 @@ private:
 			}
 
 			m_files[file] = fp;
+			m_filesById[fileId] = fp;
 		}
 
+		return fp;
+	}
+
+	void addLine(File *fp, const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		kcov_debug(INFO_MSG, "REPORT %s:%u at 0x%lx\n",
+				file.c_str(), lineNr, (unsigned long)addr);
+
 		Line *line = fp->getLine(lineNr);
 
 		if (!line) {
@@ -417,6 +471,73 @@ private:
 		reportAddress(line->lineId(), hits);
 	}
 
+	// From ICollector::IListener
+	void onAddressHits(const uint64_t *addrs, size_t n)
+	{
+		m_batchLines.clear();
+		m_batchLineIds.clear();
+
+		// Look up all lines first, and prefetch them while the rest are resolved
+		for (size_t i = 0; i < n; i++) {
+			AddrToLineMap_t::const_iterator it = m_addrToLine.find(addrs[i]);
+
+			if (it == m_addrToLine.end())
+				continue;
+
+			__builtin_prefetch(it->second);
+			m_batchLines.push_back(std::pair<uint64_t, Line *>(addrs[i], it->second));
+		}
+
+		bool singleShot = m_maxPossibleHits != IFileParser::HITS_UNLIMITED;
+
+		for (BatchLineList_t::const_iterator it = m_batchLines.begin();
+				it != m_batchLines.end();
+				++it) {
+			Line *line = it->second;
+
+			line->registerHit(it->first, 1, singleShot);
+
+			if (line->getOrder() == 0) {
+				line->setOrder(m_order);
+				m_order++;
+			}
+
+			m_batchLineIds.push_back(line->lineId());
+		}
+
+		if (m_batchLineIds.empty())
+			return;
+
+		for (ListenerList_t::const_iterator it = m_listeners.begin();
+				it != m_listeners.end();
+				++it)
+			(*it)->onAddresses(m_batchLineIds.data(), m_batchLineIds.size());
+	}
+
+	// From ICollector::IListener, a coverage database with only what the process hit
+	void onProcessHits(int pid, const uint64_t *addrs, size_t n)
+	{
+		size_t sz = sizeof(struct marshalHeaderStruct) + n * getMarshalEntrySize();
+		uint8_t *start = (uint8_t *)xmalloc(sz);
+		uint64_t *data = (uint64_t *)marshalHeader(start);
+
+		for (size_t i = 0; i < n; i++) {
+			AddrToLineMap_t::const_iterator it = m_addrToLine.find(addrs[i]);
+
+			if (it == m_addrToLine.end())
+				continue;
+
+			// As Line::marshal, with one hit
+			*data++ = to_be<uint64_t>(addrs[i]);
+			*data++ = to_be<uint64_t>(it->second->lineId());
+			*data++ = to_be<uint64_t>(it->second->addressIndex(addrs[i]));
+			*data++ = to_be<uint64_t>(1);
+		}
+
+		write_file(start, (uint8_t *)data - start, "%s/%d.db", m_processDirectory.c_str(), pid);
+		free(start);
+	}
+
 	// From IReporter::IListener - report recursively
 	void onAddress(uint64_t addr, unsigned long hits)
 	{
@@ -494,6 +615,16 @@ private:
 			m_addrs[index].second += hits;
 		}
 
+		uint64_t addressIndex(uint64_t addr) const
+		{
+			for (unsigned int i = 0; i < m_addrs.size(); i++) {
+				if (m_addrs[i].first == addr)
+					return i;
+			}
+
+			return 0;
+		}
+
 		void clearHits()
 		{
 			for (AddrToHitsMap_t::iterator it = m_addrs.begin();
@@ -720,19 +851,25 @@ private:
 	};
 
 	typedef std::unordered_map<std::string, File *> FileMap_t;
+	typedef std::vector<File *> FileList_t;
 	typedef std::unordered_map<uint64_t, Line *> AddrToLineMap_t;
 	typedef std::unordered_map<uint64_t, unsigned long> AddrToHitsMap_t;
 	typedef std::vector<IReporter::IListener *> ListenerList_t;
 	typedef std::unordered_map<uint64_t, Line *> LineIdToFileMap_t;
 	typedef std::vector<PendingFileAddress> PendingHitsList_t; // Address, hits
 	typedef std::unordered_map<uint64_t, PendingHitsList_t> PendingFilesMap_t;
+	typedef std::vector<std::pair<uint64_t, Line *>> BatchLineList_t; // Address, line
+	typedef std::vector<uint64_t> LineIdList_t;
 
 	FileMap_t m_files;
+	FileList_t m_filesById;
 	AddrToLineMap_t m_addrToLine;
 	AddrToHitsMap_t m_pendingHits;
 	ListenerList_t m_listeners;
 	PendingFilesMap_t m_pendingFiles;
 	LineIdToFileMap_t m_lineIdToFileMap;
+	BatchLineList_t m_batchLines;
+	LineIdList_t m_batchLineIds;
 	std::hash<std::string> m_fileHash;
 	bool m_hashFilename;
 
@@ -743,6 +880,7 @@ private:
 
 	bool m_unmarshallingDone;
 	std::string m_dbFileName;
+	std::string m_processDirectory;
 
 	uint64_t m_order;
 };
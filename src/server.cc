@@ -0,0 +1,722 @@
+#include <server.hh>
+#include <file-parser.hh>
+#include <source-file-cache.hh>
+#include <utils.hh>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+using namespace kcov;
+
+/*
+ * The client sends a request with its stdin/stdout/stderr attached, and
+ * then the signal numbers it gets (int32_t each). The server replies with
+ * the exit code when the run is done.
+ */
+#define SERVER_MAGIC   0x6b637376 /* "kcsv" */
+#define SERVER_VERSION 1
+
+struct server_request
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t size; /* Of the strings which follow: cwd, argv and environment */
+};
+
+struct server_reply
+{
+	uint32_t magic;
+	int32_t status;
+};
+
+static const unsigned int nStdFds = 3;
+
+// Requests can contain the environment, but not more than this
+static const uint32_t maxRequestSize = 16 * 1024 * 1024;
+
+extern char **environ;
+
+static bool readAll(int fd, void *p, size_t size)
+{
+	uint8_t *dst = (uint8_t *)p;
+
+	while (size > 0) {
+		ssize_t rv = read(fd, dst, size);
+
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return false;
+
+		dst += rv;
+		size -= rv;
+	}
+
+	return true;
+}
+
+static bool writeAll(int fd, const void *p, size_t size)
+{
+	const uint8_t *src = (const uint8_t *)p;
+
+	while (size > 0) {
+		ssize_t rv = send(fd, src, size, MSG_NOSIGNAL);
+
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return false;
+
+		src += rv;
+		size -= rv;
+	}
+
+	return true;
+}
+
+static bool setupAddress(struct sockaddr_un &addr, const std::string &path)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		error("kcov: Socket path %s is too long\n", path.c_str());
+		return false;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	return true;
+}
+
+
+/*
+ * Client side
+ */
+static int g_clientFd = -1;
+
+static void forwardSignal(int sig)
+{
+	int32_t data = sig;
+
+	// Best effort, the server stops the run anyway if the client goes away
+	ssize_t rv = send(g_clientFd, &data, sizeof(data), MSG_NOSIGNAL);
+	(void)rv;
+}
+
+int kcov::runClient(const std::string &socketPath, unsigned int argc, const char *argv[])
+{
+	struct sockaddr_un addr;
+
+	if (!setupAddress(addr, socketPath))
+		return 1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		error("kcov: Can't connect to the kcov server at %s\n", socketPath.c_str());
+		if (fd >= 0)
+			close(fd);
+
+		return 1;
+	}
+
+	std::string strings;
+	char *cwd = getcwd(NULL, 0);
+	uint32_t envc = 0;
+
+	strings += cwd ? cwd : "/";
+	strings.push_back('\0');
+	free(cwd);
+
+	for (unsigned int i = 0; i < argc; i++) {
+		strings += argv[i];
+		strings.push_back('\0');
+	}
+
+	for (char **env = environ; *env; env++, envc++) {
+		strings += *env;
+		strings.push_back('\0');
+	}
+
+	struct server_request request;
+
+	request.magic = SERVER_MAGIC;
+	request.version = SERVER_VERSION;
+	request.argc = argc;
+	request.envc = envc;
+	request.size = strings.size();
+
+	// Closed stdin etc are passed as /dev/null
+	int fds[nStdFds];
+
+	for (unsigned int i = 0; i < nStdFds; i++) {
+		fds[i] = i;
+		if (fcntl(i, F_GETFD) < 0)
+			fds[i] = open("/dev/null", O_RDWR | O_CLOEXEC);
+	}
+
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov;
+	struct msghdr msg;
+
+	iov.iov_base = &request;
+	iov.iov_len = sizeof(request);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(request) ||
+			!writeAll(fd, strings.data(), strings.size())) {
+		error("kcov: Can't send the request to the kcov server\n");
+		close(fd);
+
+		return 1;
+	}
+
+	// Like kcov itself, pass these on to the traced program
+	g_clientFd = fd;
+	signal(SIGINT, forwardSignal);
+	signal(SIGTERM, forwardSignal);
+	signal(SIGHUP, forwardSignal);
+	signal(SIGQUIT, forwardSignal);
+
+	struct server_reply reply;
+
+	if (!readAll(fd, &reply, sizeof(reply)) || reply.magic != SERVER_MAGIC) {
+		error("kcov: Lost the connection to the kcov server\n");
+		close(fd);
+
+		return 1;
+	}
+	close(fd);
+
+	return reply.status;
+}
+
+
+/*
+ * Server side
+ */
+static int g_warmUpFd = -1;
+static int g_signalPipe[2] = {-1, -1};
+static volatile sig_atomic_t g_stop;
+
+void kcov::requestWarmUp(const std::string &file)
+{
+	if (g_warmUpFd < 0)
+		return;
+
+	const std::string &path = get_real_path(file);
+
+	// Unresolved, the server would look in the wrong place
+	if (path.empty() || path[0] != '/')
+		return;
+
+	std::string line = path + "\n";
+
+	// Atomic writes, so that lines from different requests don't mix
+	if (line.size() > PIPE_BUF)
+		return;
+
+	ssize_t rv = write(g_warmUpFd, line.c_str(), line.size());
+	(void)rv;
+}
+
+static void onServerSignal(int sig)
+{
+	int savedErrno = errno;
+	char c = 0;
+
+	if (sig != SIGCHLD)
+		g_stop = 1;
+
+	ssize_t rv = write(g_signalPipe[1], &c, 1);
+	(void)rv;
+
+	errno = savedErrno;
+}
+
+static void *forwardSignalsToRequest(void *arg)
+{
+	int fd = (int)(long)arg;
+	int32_t sig;
+
+	// Through the signal handlers of kcov, which pass them to the program
+	while (readAll(fd, &sig, sizeof(sig)))
+		kill(getpid(), sig);
+
+	// The client is gone, so stop the run
+	kill(getpid(), SIGTERM);
+
+	return NULL;
+}
+
+class Server
+{
+public:
+	Server(const std::string &socketPath, ServerRequestHandler_t handler) :
+		m_socketPath(socketPath),
+		m_handler(handler),
+		m_listenFd(-1)
+	{
+		m_warmUpPipe[0] = -1;
+		m_warmUpPipe[1] = -1;
+	}
+
+	~Server()
+	{
+		if (m_listenFd >= 0) {
+			close(m_listenFd);
+			unlink(m_socketPath.c_str());
+		}
+
+		for (unsigned int i = 0; i < 2; i++) {
+			if (m_warmUpPipe[i] >= 0)
+				close(m_warmUpPipe[i]);
+			if (g_signalPipe[i] >= 0)
+				close(g_signalPipe[i]);
+			g_signalPipe[i] = -1;
+		}
+	}
+
+	int run()
+	{
+		if (!setup())
+			return 1;
+
+		while (!g_stop) {
+			struct pollfd fds[3];
+
+			fds[0].fd = g_signalPipe[0];
+			fds[1].fd = m_warmUpPipe[0];
+			fds[2].fd = m_listenFd;
+			for (unsigned int i = 0; i < 3; i++) {
+				fds[i].events = POLLIN;
+				fds[i].revents = 0;
+			}
+
+			// Pending warm-ups are done when there's nothing else to do
+			int timeout = hasWarmUp() ? 0 : -1;
+
+			if (poll(fds, 3, timeout) < 0 && errno != EINTR) {
+				error("kcov: poll failed on the server socket\n");
+				break;
+			}
+
+			if (fds[0].revents & POLLIN) {
+				char buf[64];
+
+				while (read(g_signalPipe[0], buf, sizeof(buf)) > 0)
+					;
+				reapWorkers(false);
+			}
+
+			if (fds[1].revents & POLLIN)
+				readWarmUps();
+
+			if (!g_stop && (fds[2].revents & POLLIN))
+				acceptClient();
+			else if (!g_stop)
+				warmUpOne();
+		}
+
+		// Let the runs in progress finish
+		close(m_listenFd);
+		m_listenFd = -1;
+		unlink(m_socketPath.c_str());
+		reapWorkers(true);
+
+		return 0;
+	}
+
+private:
+	class Request
+	{
+	public:
+		Request() :
+			m_cwd(NULL)
+		{
+			for (unsigned int i = 0; i < nStdFds; i++)
+				m_fds[i] = -1;
+		}
+
+		void closeFds()
+		{
+			for (unsigned int i = 0; i < nStdFds; i++) {
+				if (m_fds[i] >= 0)
+					close(m_fds[i]);
+				m_fds[i] = -1;
+			}
+		}
+
+		std::vector<char> m_data;
+		const char *m_cwd;
+		std::vector<const char *> m_argv;
+		std::vector<char *> m_env;
+		int m_fds[nStdFds];
+	};
+
+	// Connections of the running requests, by worker
+	typedef std::map<pid_t, int> WorkerMap_t;
+
+	bool setup()
+	{
+		struct sockaddr_un addr;
+
+		if (!setupAddress(addr, m_socketPath))
+			return false;
+
+		// A server which is still running keeps its socket
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			error("kcov: A kcov server is already running on %s\n", m_socketPath.c_str());
+			close(probe);
+
+			return false;
+		}
+		if (probe >= 0)
+			close(probe);
+		unlink(m_socketPath.c_str());
+
+		m_listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (m_listenFd < 0) {
+			error("kcov: Can't create the server socket\n");
+			return false;
+		}
+
+		// Requests run as the server user, so only for that user
+		mode_t oldMask = umask(0077);
+		int rv = bind(m_listenFd, (struct sockaddr *)&addr, sizeof(addr));
+
+		umask(oldMask);
+		if (rv < 0 || listen(m_listenFd, SOMAXCONN) < 0) {
+			error("kcov: Can't listen on %s\n", m_socketPath.c_str());
+			close(m_listenFd);
+			m_listenFd = -1;
+
+			return false;
+		}
+
+		if (pipe2(g_signalPipe, O_CLOEXEC | O_NONBLOCK) < 0 ||
+				pipe2(m_warmUpPipe, O_CLOEXEC) < 0) {
+			error("kcov: Can't create pipes\n");
+			return false;
+		}
+		fcntl(m_warmUpPipe[0], F_SETFL, O_NONBLOCK);
+
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = onServerSignal;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGCHLD, &sa, NULL);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		signal(SIGPIPE, SIG_IGN);
+
+		kcov_debug(STATUS_MSG, "kcov: Serving on %s\n", m_socketPath.c_str());
+
+		return true;
+	}
+
+	void acceptClient()
+	{
+		int fd = accept4(m_listenFd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (fd < 0)
+			return;
+
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()) {
+			warning("kcov: Ignoring a request from another user\n");
+			close(fd);
+
+			return;
+		}
+
+		// The worker would otherwise write out what's buffered here to the client
+		fflush(stdout);
+		fflush(stderr);
+
+		// The request is read in the worker, so a slow client only holds up itself
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			error("kcov: Can't fork a request\n");
+			close(fd);
+
+			return;
+		}
+
+		if (pid == 0)
+			runRequest(fd);
+
+		m_workers[pid] = fd;
+	}
+
+	bool readRequest(int fd, Request &request)
+	{
+		struct server_request hdr;
+		union
+		{
+			char buf[CMSG_SPACE(sizeof(request.m_fds))];
+			struct cmsghdr align;
+		} control;
+		struct iovec iov;
+		struct msghdr msg;
+
+		iov.iov_base = &hdr;
+		iov.iov_len = sizeof(hdr);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+		if (n <= 0)
+			return false;
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t nFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+			memcpy(request.m_fds, CMSG_DATA(cmsg), std::min(nFds, (size_t)nStdFds) * sizeof(int));
+		}
+
+		if ((size_t)n < sizeof(hdr) && !readAll(fd, (uint8_t *)&hdr + n, sizeof(hdr) - n))
+			return false;
+
+		if (hdr.magic != SERVER_MAGIC || hdr.version != SERVER_VERSION) {
+			warning("kcov: Ignoring a request from another version of kcov\n");
+			return false;
+		}
+
+		for (unsigned int i = 0; i < nStdFds; i++) {
+			if (request.m_fds[i] < 0)
+				return false;
+		}
+
+		if (hdr.size > maxRequestSize)
+			return false;
+
+		request.m_data.resize(hdr.size + 1);
+		if (!readAll(fd, request.m_data.data(), hdr.size))
+			return false;
+		request.m_data[hdr.size] = '\0';
+
+		// Split into the strings
+		char *p = request.m_data.data();
+		char *end = p + hdr.size;
+		uint64_t nStrings = 1 + (uint64_t)hdr.argc + hdr.envc;
+
+		for (uint64_t i = 0; i < nStrings; i++) {
+			if (p >= end)
+				return false;
+
+			if (i == 0)
+				request.m_cwd = p;
+			else if (i <= hdr.argc)
+				request.m_argv.push_back(p);
+			else
+				request.m_env.push_back(p);
+
+			p += strlen(p) + 1;
+		}
+		request.m_argv.push_back(NULL);
+		request.m_env.push_back(NULL);
+
+		return true;
+	}
+
+	// In the forked process
+	void runRequest(int fd)
+	{
+		Request request;
+
+		close(m_listenFd);
+		close(g_signalPipe[0]);
+		close(g_signalPipe[1]);
+		close(m_warmUpPipe[0]);
+		for (WorkerMap_t::const_iterator it = m_workers.begin();
+				it != m_workers.end();
+				++it)
+			close(it->second);
+
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+
+		g_warmUpFd = m_warmUpPipe[1];
+
+		// Don't let a stuck client hang the worker
+		struct timeval tv = {5, 0};
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		if (!readRequest(fd, request)) {
+			request.closeFds();
+			exit(1);
+		}
+
+		// Sources might have been edited since the last request
+		ISourceFileCache::getInstance().refresh();
+
+		// Out of the way of 0-2 first, in case the server has them closed
+		for (unsigned int i = 0; i < nStdFds; i++) {
+			int tmp = fcntl(request.m_fds[i], F_DUPFD_CLOEXEC, nStdFds);
+
+			close(request.m_fds[i]);
+			request.m_fds[i] = tmp;
+		}
+		for (unsigned int i = 0; i < nStdFds; i++)
+			dup2(request.m_fds[i], i);
+		request.closeFds();
+
+		if (chdir(request.m_cwd) < 0) {
+			error("kcov: Can't change directory to %s\n", request.m_cwd);
+			exit(1);
+		}
+
+		clearenv();
+		for (std::vector<char *>::const_iterator it = request.m_env.begin();
+				*it;
+				++it)
+			putenv(*it);
+
+		// No timeout while the request runs
+		pthread_t thread;
+		sigset_t all, old;
+
+		tv.tv_sec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		// All signals (SIGCHLD for the engine in particular) go to the main thread
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		if (pthread_create(&thread, NULL, forwardSignalsToRequest, (void *)(long)fd) != 0)
+			warning("kcov: Can't forward signals from the client\n");
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		exit(m_handler(request.m_argv.size() - 1, request.m_argv.data()));
+	}
+
+	/*
+	 * The server replies with the exit code of the worker, so that the
+	 * client also gets it when kcov exits early (--exit-first-process)
+	 */
+	void reapWorkers(bool wait)
+	{
+		while (!m_workers.empty()) {
+			int status;
+			pid_t pid = waitpid(-1, &status, wait ? 0 : WNOHANG);
+
+			if (pid < 0 && errno == EINTR)
+				continue;
+			if (pid <= 0)
+				break;
+
+			WorkerMap_t::iterator it = m_workers.find(pid);
+
+			if (it == m_workers.end())
+				continue;
+
+			struct server_reply reply;
+
+			reply.magic = SERVER_MAGIC;
+			reply.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+			(void)writeAll(it->second, &reply, sizeof(reply));
+			close(it->second);
+			m_workers.erase(it);
+		}
+	}
+
+	// Files to parse ahead, one per line from the requests
+	void readWarmUps()
+	{
+		char buf[4096];
+		ssize_t n;
+
+		while ((n = read(m_warmUpPipe[0], buf, sizeof(buf))) > 0)
+			m_warmUpData.append(buf, n);
+	}
+
+	bool hasWarmUp() const
+	{
+		return m_warmUpData.find('\n') != std::string::npos;
+	}
+
+	/*
+	 * One file at a time, between accepts. A large file still delays a
+	 * request which arrives while it's parsed, but not the ones after it.
+	 */
+	void warmUpOne()
+	{
+		size_t pos = m_warmUpData.find('\n');
+
+		if (pos == std::string::npos)
+			return;
+
+		std::string file = m_warmUpData.substr(0, pos);
+		IFileParser *parser = IParserManager::getInstance().matchParser(file);
+
+		m_warmUpData.erase(0, pos + 1);
+		if (parser)
+			parser->warmUp(file);
+	}
+
+	std::string m_socketPath;
+	ServerRequestHandler_t m_handler;
+	int m_listenFd;
+	int m_warmUpPipe[2];
+	std::string m_warmUpData;
+	WorkerMap_t m_workers;
+};
+
+int kcov::runServer(const std::string &socketPath, ServerRequestHandler_t handler)
+{
+	Server server(socketPath, handler);
+
+	return server.run();
+}
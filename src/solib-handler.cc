@@ -1,31 +1,94 @@
 #include <solib-handler.hh>
+#include <server.hh>
 #include <collector.hh>
 #include <output-handler.hh>
 #include <configuration.hh>
+#include <statistics.hh>
 #include <capabilities.hh>
 #include <file-parser.hh>
 #include <utils.hh>
 #include <phdr_data.h>
 #include <generated-data-base.hh>
 
-#include <mutex>
+#include <list>
 #include <vector>
 #include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sched.h>
+#include <errno.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 
 using namespace kcov;
 
 extern GeneratedData __library_data;
 
+/*
+ * Lines and files found when parsing one solib on the worker thread, kept
+ * until they can be delivered on the main thread.
+ */
+class SolibParseBatch : public IFileParser::ILineListener, public IFileParser::IFileListener
+{
+public:
+	virtual ~SolibParseBatch()
+	{
+	}
+
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		onFileLine(IPathInterner::getInstance().intern(file), lineNr, addr, 0);
+	}
+
+	void onBasicBlockLine(const std::string &file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+	{
+		onFileLine(IPathInterner::getInstance().intern(file), lineNr, addr, blockAddr);
+	}
+
+	void onFileLine(FileId file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+	{
+		m_lines.add(file, lineNr, addr, blockAddr);
+	}
+
+	void onFileLines(FileId file, const unsigned int *lineNrs, const uint64_t *addrs,
+			const uint64_t *blockAddrs, size_t n)
+	{
+		m_lines.add(file, lineNrs, addrs, blockAddrs, n);
+	}
+
+	void onCodeRange(uint64_t start, uint64_t end)
+	{
+		m_lines.addRange(start, end);
+	}
+
+	void onFile(const IFileParser::File &file)
+	{
+		m_files.push_back(std::pair<std::string, enum IFileParser::FileFlags>(file.m_filename, file.m_flags));
+	}
+
+	void deliver(IFileParser &parser)
+	{
+		for (FileList_t::const_iterator it = m_files.begin();
+				it != m_files.end();
+				++it)
+			parser.deliverFile(IFileParser::File(it->first, it->second));
+
+		parser.deliverLines(m_lines);
+	}
+
+private:
+	typedef std::vector<std::pair<std::string, enum IFileParser::FileFlags> > FileList_t;
+
+	IFileParser::LineBatch m_lines;
+	FileList_t m_files;
+};
+
 class SolibHandler : public ISolibHandler, ICollector::IEventTickListener
 {
 public:
@@ -33,13 +96,15 @@ public:
 		m_ldPreloadString(NULL),
 		m_envString(NULL),
 		m_solibFd(-1),
-		m_solibThreadValid(false),
-		m_threadShouldExit(false),
+		m_solibWriteFd(-1),
 		m_parser(&parser),
-		m_hasSetupRelocation(false)
+		m_hasSetupRelocation(false),
+		m_firstSolibData(true),
+		m_workerValid(false),
+		m_syncTimeout(0),
+		m_workerShouldExit(false),
+		m_outstandingJobs(0)
 {
-		memset(&m_solibThread, 0, sizeof(m_solibThread));
-
 		// Only useful for ELF binaries
 		if (parser.getParserType() == "ELF" && !IConfiguration::getInstance().keyAsInt("gcov") &&
 				!IConfiguration::getInstance().keyAsInt("clang-sanitizer"))
@@ -48,28 +113,39 @@ public:
 
 	virtual ~SolibHandler()
 	{
-		void *rv;
+		if (m_workerValid) {
+			void *rv;
+
+			m_workMutex.lock();
+			m_workerShouldExit = true;
+			m_workMutex.unlock();
+			m_workCondition.notify_all();
+
+			pthread_join(m_worker, &rv);
+		}
+
+		for (JobList_t::iterator it = m_jobs.begin();
+				it != m_jobs.end();
+				++it)
+			free(*it);
+		for (BatchList_t::iterator it = m_doneBatches.begin();
+				it != m_doneBatches.end();
+				++it)
+			delete *it;
 
-		m_threadShouldExit = true;
 		if (m_solibPath != "")
 			unlink(m_solibPath.c_str());
 		if (m_solibDirectory != "")
 			rmdir(m_solibDirectory.c_str());
 		if (m_solibFd >= 0)
 			close(m_solibFd);
+		if (m_solibWriteFd >= 0)
+			close(m_solibWriteFd);
 
-		/*
-		 * First kill the solib thread if it's stuck in open (i.e., before
-		 * the tracee has started), then wait for it to terminate for maximum
-		 * niceness.
-		 *
-		 * Only do this if it has been started, naturally
-		 */
-		if (m_solibThreadValid) {
-			pthread_cancel(m_solibThread);
-			pthread_kill(m_solibThread, SIGTERM);
-			pthread_join(m_solibThread, &rv);
-		}
+		for (PhdrList_t::iterator it = m_phdrs.begin();
+				it != m_phdrs.end();
+				++it)
+			free(*it);
 	}
 
 	// From IEventTickListener
@@ -141,86 +217,224 @@ public:
 		putenv(m_envString);
 
 		m_solibPath = kcov_solib_pipe_path;
-		pthread_create(&m_solibThread, NULL,
-				SolibHandler::threadStatic, (void *)this);
 
+		/*
+		 * Opened non-blocking so that the engine can wait for it together
+		 * with the tracee. The write end is kept open by kcov itself so that
+		 * the FIFO never reports hangup when the tracee closes it.
+		 */
+		m_solibFd = ::open(m_solibPath.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (m_solibFd >= 0)
+			m_solibWriteFd = ::open(m_solibPath.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+
+		panic_if(m_solibFd < 0 || m_solibWriteFd < 0,
+				"Can't open solib FIFO %s", m_solibPath.c_str());
+
+		// Diverting is needed to parse without touching the listeners
+		if (m_parser->divertListeners(NULL, NULL)) {
+			sigset_t all, old;
+
+			m_syncTimeout = IConfiguration::getInstance().keyAsInt("solib-sync-timeout");
+
+			/*
+			 * The worker inherits the signal mask. Start it with everything
+			 * blocked, otherwise SIGCHLD can be delivered (and dropped) there
+			 * instead of reaching the engine signalfd.
+			 */
+			sigfillset(&all);
+			pthread_sigmask(SIG_SETMASK, &all, &old);
+			m_workerValid = pthread_create(&m_worker, NULL,
+					SolibHandler::workerThreadStatic, (void *)this) == 0;
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+		}
 	}
 
-	void solibThreadParse()
+	void stop()
 	{
-		uint8_t buf[1024 * 1024];
+		if (!m_workerValid)
+			return;
 
-		m_solibFd = ::open(m_solibPath.c_str(), O_RDONLY);
-		m_solibThreadValid = true;
+		// Deliver everything before the reports are written
+		waitForJobs(-1);
+		deliverBatches();
+	}
+
+	int getFd() const
+	{
+		return m_solibFd;
+	}
+
+	// Read everything available in the FIFO and queue the complete messages
+	void readSolibData()
+	{
+		uint8_t buf[64 * 1024];
 
 		if (m_solibFd < 0)
 			return;
 
 		while (1) {
-			int r = read(m_solibFd, buf, sizeof(buf));
+			ssize_t r = read(m_solibFd, buf, sizeof(buf));
 
-			// The destructor will close m_solibFd, so we'll exit here in that case
+			if (r < 0 && errno == EINTR)
+				continue;
 			if (r <= 0)
 				break;
 
-			panic_if ((unsigned)r >= sizeof(buf),
-					"Too much solib data read");
+			m_readBuffer.insert(m_readBuffer.end(), buf, buf + r);
+		}
+
+		// Messages are larger than PIPE_BUF, so they might arrive in pieces
+		while (m_readBuffer.size() >= sizeof(struct phdr_data)) {
+			struct phdr_data *p = phdr_data_unmarshal(m_readBuffer.data());
+
+			if (!p) {
+				warning("Invalid solib data, dropping %zu bytes\n", m_readBuffer.size());
+				m_readBuffer.clear();
+				break;
+			}
+
+			size_t sz = sizeof(struct phdr_data) + p->n_entries * sizeof(struct phdr_data_entry);
+
+			// Not all here yet
+			if (m_readBuffer.size() < sz)
+				break;
+
+			struct phdr_data *cpy = (struct phdr_data*)xmalloc(sz);
 
-			struct phdr_data *p = phdr_data_unmarshal(buf);
+			memcpy(cpy, p, sz);
+			m_phdrs.push_back(cpy);
+
+			m_readBuffer.erase(m_readBuffer.begin(), m_readBuffer.begin() + sz);
+		}
+	}
+
+	void checkSolibData()
+	{
+		if (!m_parser)
+			return;
 
-			if (p) {
-				size_t sz = sizeof(struct phdr_data) + p->n_entries * sizeof(struct phdr_data_entry);
-				struct phdr_data *cpy = (struct phdr_data*)xmalloc(sz);
+		// Pick up anything the engine hasn't already read out
+		readSolibData();
 
-				memcpy(cpy, p, sz);
+		if (!m_workerValid) {
+			while (!m_phdrs.empty()) {
+				struct phdr_data *p = m_phdrs.front();
 
-				m_phdrListMutex.lock();
-				m_phdrs.push_back(cpy);
-				m_phdrListMutex.unlock();
+				m_phdrs.pop_front();
+				parseSolibData(p);
 			}
-			m_solibDataReadSemaphore.notify();
+
+			return;
+		}
+
+		bool queued = !m_phdrs.empty();
+
+		if (queued) {
+			std::lock_guard<std::mutex> lock(m_workMutex);
+
+			m_outstandingJobs += m_phdrs.size();
+			m_jobs.splice(m_jobs.end(), m_phdrs);
+			m_workCondition.notify_one();
 		}
 
-		m_solibDataReadSemaphore.notify();
-		close(m_solibFd);
+		/*
+		 * The tracee is stopped right after reporting new solibs. The first
+		 * report (the main file relocation and the libraries loaded at startup)
+		 * is always waited for, later dlopens only for a short while. What
+		 * isn't ready by then is armed at a later stop.
+		 */
+		if (queued) {
+			waitForJobs(m_firstSolibData ? -1 : m_syncTimeout);
+			m_firstSolibData = false;
+		}
+
+		deliverBatches();
 	}
 
-	void solibThreadMain()
+	// Wait for all queued solibs to be parsed, for at most @a timeoutMs (forever if negative)
+	void waitForJobs(int timeoutMs)
 	{
-		while (1) {
-			if (m_threadShouldExit)
-				break;
+		StatisticsScope scope(IStatistics::PHASE_SOLIB);
+		std::unique_lock<std::mutex> lock(m_workMutex);
+
+		if (timeoutMs < 0) {
+			while (m_outstandingJobs != 0)
+				m_doneCondition.wait(lock);
+		} else {
+			std::chrono::steady_clock::time_point deadline =
+					std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+			while (m_outstandingJobs != 0) {
+				if (m_doneCondition.wait_until(lock, deadline) == std::cv_status::timeout)
+					break;
+			}
+		}
+	}
+
+	// Hand over parsed solibs to the listeners, the breakpoints are armed in one go on continue
+	void deliverBatches()
+	{
+		BatchList_t batches;
+
+		m_workMutex.lock();
+		batches.swap(m_doneBatches);
+		m_workMutex.unlock();
+
+		if (batches.empty())
+			return;
 
-			solibThreadParse();
+		StatisticsScope scope(IStatistics::PHASE_SOLIB);
+
+		for (BatchList_t::iterator it = batches.begin();
+				it != batches.end();
+				++it) {
+			(*it)->deliver(*m_parser);
+			delete *it;
 		}
 	}
 
-	// Wrapper for ptrace
-	static void *threadStatic(void *pThis)
+	static void *workerThreadStatic(void *pThis)
 	{
 		SolibHandler *p = (SolibHandler *)pThis;
 
-		p->solibThreadMain();
+		p->workerThread();
 
 		return NULL;
 	}
 
-	void checkSolibData()
+	void workerThread()
 	{
-		struct phdr_data *p = NULL;
+		std::unique_lock<std::mutex> lock(m_workMutex);
 
-		if (!m_parser)
-			return;
+		while (1) {
+			while (m_jobs.empty() && !m_workerShouldExit)
+				m_workCondition.wait(lock);
+
+			if (m_workerShouldExit)
+				break;
 
-		m_phdrListMutex.lock();
-		if (!m_phdrs.empty()) {
-			p = m_phdrs.front();
-			m_phdrs.pop_front();
+			struct phdr_data *p = m_jobs.front();
+			m_jobs.pop_front();
+
+			lock.unlock();
+
+			SolibParseBatch *batch = new SolibParseBatch();
+
+			m_parser->divertListeners(batch, batch);
+			parseSolibData(p);
+			m_parser->divertListeners(NULL, NULL);
+
+			lock.lock();
+
+			m_doneBatches.push_back(batch);
+			m_outstandingJobs--;
+			m_doneCondition.notify_all();
 		}
-		m_phdrListMutex.unlock();
+	}
 
-		if (!p)
-			return;
+	void parseSolibData(struct phdr_data *p)
+	{
+		StatisticsScope scope(IStatistics::PHASE_SOLIB);
 
 		// Setup where the main file is relocated once (for PIEs)
 		if (!m_hasSetupRelocation) {
@@ -238,7 +452,8 @@ public:
 			if (m_foundSolibs.find(cur->name) != m_foundSolibs.end())
 				continue;
 
-			m_parser->addFile(cur->name, cur);
+			if (m_parser->addFile(cur->name, cur))
+				requestWarmUp(cur->name);
 			m_parser->parse();
 
 			m_foundSolibs[cur->name] = true;
@@ -258,16 +473,29 @@ public:
 	char *m_ldPreloadString;
 	char *m_envString;
 	int m_solibFd;
-	bool m_solibThreadValid;
-	bool m_threadShouldExit;
-	pthread_t m_solibThread;
-	Semaphore m_solibDataReadSemaphore;
+	int m_solibWriteFd;
+	typedef std::list<struct phdr_data *> JobList_t;
+	typedef std::list<SolibParseBatch *> BatchList_t;
+
+	std::vector<uint8_t> m_readBuffer;
 	PhdrList_t m_phdrs;
 	FoundSolibsMap_t m_foundSolibs;
-	std::mutex m_phdrListMutex;
 
 	IFileParser *m_parser;
 	bool m_hasSetupRelocation;
+	bool m_firstSolibData;
+
+	// Background parsing, everything below m_workMutex is protected by it
+	pthread_t m_worker;
+	bool m_workerValid;
+	int m_syncTimeout;
+	std::mutex m_workMutex;
+	std::condition_variable m_workCondition;
+	std::condition_variable m_doneCondition;
+	bool m_workerShouldExit;
+	JobList_t m_jobs;
+	BatchList_t m_doneBatches;
+	size_t m_outstandingJobs;
 };
 
 
@@ -280,9 +508,16 @@ ISolibHandler &kcov::createSolibHandler(IFileParser &parser, ICollector &collect
 	return *g_handler;
 }
 
-void kcov::blockUntilSolibDataRead()
+int kcov::solibNotificationFd()
+{
+	if (!g_handler)
+		return -1;
+
+	return g_handler->getFd();
+}
+
+void kcov::handleSolibNotification()
 {
-	// If it has been started
-	if (g_handler->m_solibThreadValid)
-		g_handler->m_solibDataReadSemaphore.wait();
+	if (g_handler)
+		g_handler->readSolibData();
 }
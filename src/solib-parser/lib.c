@@ -18,6 +18,9 @@
 
 static struct phdr_data *phdr_data;
 
+// Set while trapping to kcov, so the trap handler knows the trap is ours
+__thread int kcov_solib_notifying;
+
 static int phdrCallback(struct dl_phdr_info *info, size_t size, void *data)
 {
 	// the first entry is used to determine the executable's "base address"
@@ -84,6 +87,7 @@ static void parse_solibs(void)
 
 static void force_breakpoint(void)
 {
+	kcov_solib_notifying = 1;
 	asm volatile(
 #if defined(__i386__) || defined(__x86_64__)
 			"int3\n"
@@ -96,7 +100,8 @@ static void force_breakpoint(void)
 #else
 # error Unsupported architecture
 #endif
-			);
+			::: "memory");
+	kcov_solib_notifying = 0;
 }
 
 static void *(*orig_dlopen)(const char *, int);
@@ -0,0 +1,256 @@
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <trap-table.h>
+
+/*
+ * Handles the breakpoints set by the kcov trap engine in the traced process
+ * itself, so that a hit doesn't stop the process. Only x86 for now, where
+ * the breakpoint is a one-byte int3.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+
+static struct trap_table *trap_table;
+static struct sigaction prev_sigtrap;
+
+/*
+ * The /proc/self/mem fd in the low half, and the pid which opened it in
+ * the high half, so that both are replaced together.
+ */
+static uint64_t mem_file = 0xffffffffULL;
+
+// In lib.c
+extern __thread int kcov_solib_notifying;
+
+static pid_t trap_getpid(void)
+{
+	// Not cached by the C library, which matters after fork
+	return (pid_t)syscall(SYS_getpid);
+}
+
+static uint64_t mem_file_pack(pid_t pid, int fd)
+{
+	return ((uint64_t)(uint32_t)pid << 32) | (uint32_t)fd;
+}
+
+static struct trap_table_entry *lookup(uint64_t addr)
+{
+	uint32_t mask = trap_table->capacity - 1;
+	uint32_t i = trap_table_hash(trap_table, addr);
+	uint32_t n;
+
+	for (n = 0; n < trap_table->capacity; n++) {
+		struct trap_table_entry *cur = &trap_table->entries[i];
+		uint64_t cur_addr = __atomic_load_n(&cur->addr, __ATOMIC_ACQUIRE);
+
+		if (cur_addr == addr)
+			return cur;
+		if (cur_addr == 0)
+			break;
+
+		i = (i + 1) & mask;
+	}
+
+	return NULL;
+}
+
+static void restore_instruction(uint64_t addr, uint8_t data)
+{
+	pid_t pid = trap_getpid();
+	uint64_t cur = __atomic_load_n(&mem_file, __ATOMIC_ACQUIRE);
+	int fd = (int)(uint32_t)cur;
+
+	// A forked child has the mem file of its parent
+	if (fd < 0 || (pid_t)(cur >> 32) != pid) {
+		int old = fd;
+
+		fd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+		if (fd >= 0 && __atomic_compare_exchange_n(&mem_file, &cur, mem_file_pack(pid, fd), 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			if (old >= 0)
+				close(old);
+		} else if (fd >= 0) {
+			// Another thread was first, use its file instead
+			close(fd);
+			fd = (pid_t)(cur >> 32) == pid ? (int)(uint32_t)cur : -1;
+		}
+	}
+
+	// Writes through /proc/self/mem are allowed to read-only mappings
+	if (fd >= 0 && pwrite(fd, &data, 1, (off_t)addr) == 1)
+		return;
+
+	// Fallback, racy if another thread restores on the same page
+	unsigned long page_size = (unsigned long)sysconf(_SC_PAGESIZE);
+	void *page = (void *)(unsigned long)(addr & ~(uint64_t)(page_size - 1));
+
+	mprotect(page, page_size, PROT_READ | PROT_WRITE | PROT_EXEC);
+	*(volatile uint8_t *)(unsigned long)addr = data;
+	mprotect(page, page_size, PROT_READ | PROT_EXEC);
+}
+
+static void wait_for_sync(void)
+{
+	uint32_t request = __atomic_add_fetch(&trap_table->sync_request, 1, __ATOMIC_ACQ_REL);
+	struct timespec ts = {0, 100 * 1000};
+	uint32_t waited_us = 0;
+
+	while ((int32_t)(__atomic_load_n(&trap_table->sync_ack, __ATOMIC_ACQUIRE) - request) < 0) {
+		if (waited_us / 1000 >= trap_table->sync_timeout)
+			break;
+
+		nanosleep(&ts, NULL);
+		waited_us += 100;
+	}
+}
+
+static void chain_handler(int sig, siginfo_t *info, void *p)
+{
+	if (prev_sigtrap.sa_flags & SA_SIGINFO) {
+		prev_sigtrap.sa_sigaction(sig, info, p);
+		return;
+	}
+
+	if (prev_sigtrap.sa_handler == SIG_IGN)
+		return;
+
+	if (prev_sigtrap.sa_handler == SIG_DFL) {
+		// Delivered when the handler returns, and dies like without kcov
+		signal(sig, SIG_DFL);
+		raise(sig);
+		return;
+	}
+
+	prev_sigtrap.sa_handler(sig);
+}
+
+static void trap_handler(int sig, siginfo_t *info, void *p)
+{
+	ucontext_t *ctx = (ucontext_t *)p;
+#if defined(__x86_64__)
+	uint64_t pc = (uint64_t)ctx->uc_mcontext.gregs[REG_RIP] - 1;
+#else
+	uint64_t pc = (uint64_t)(uint32_t)ctx->uc_mcontext.gregs[REG_EIP] - 1;
+#endif
+	struct trap_table_entry *entry = lookup(pc);
+
+	/*
+	 * The solib notification. Let kcov set breakpoints in new solibs, and
+	 * then continue after the int3 like the ptrace engine does.
+	 */
+	if (!entry && kcov_solib_notifying) {
+		wait_for_sync();
+		return;
+	}
+
+	// Not ours, the program or a debugger has its own use for SIGTRAP
+	if (!entry) {
+		chain_handler(sig, info, p);
+		return;
+	}
+
+	uint32_t idx = (uint32_t)(entry - trap_table->entries);
+
+	restore_instruction(pc, (uint8_t)entry->data);
+
+	__atomic_or_fetch(&trap_table_bitmap(trap_table)[idx / 64], 1ULL << (idx % 64), __ATOMIC_RELEASE);
+	__atomic_add_fetch(&trap_table->hits, 1, __ATOMIC_RELEASE);
+
+	// Run the original instruction
+#if defined(__x86_64__)
+	ctx->uc_mcontext.gregs[REG_RIP] = (greg_t)pc;
+#else
+	ctx->uc_mcontext.gregs[REG_EIP] = (greg_t)pc;
+#endif
+}
+
+/*
+ * Share the coverage map of an executable rewritten by kcov. Hits from
+ * before this (in preinit functions) are copied over.
+ */
+static void map_coverage(int fd)
+{
+	uint64_t size = trap_table->coverage_size;
+	void *addr = (void *)(unsigned long)trap_table->coverage_addr;
+	void *p;
+
+	if (size == 0)
+		return;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)trap_table->coverage_offset);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "kcov-trap: Can't map the coverage map\n");
+		return;
+	}
+
+	memcpy(p, addr, size);
+
+	// Replaces the private map in the executable
+	if (mremap(p, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, addr) == MAP_FAILED) {
+		fprintf(stderr, "kcov-trap: Can't move the coverage map\n");
+		munmap(p, size);
+	}
+}
+
+/*
+ * Before the solib notification in lib.c, since that one traps into the
+ * handler.
+ */
+void __attribute__((constructor(101)))kcov_trap_at_startup(void)
+{
+	struct trap_table hdr;
+	struct sigaction sa;
+	char *fd_str;
+	void *p;
+	int fd;
+
+	fd_str = getenv("KCOV_TRAP_FD");
+	if (!fd_str)
+		return;
+
+	// Programs exec:ed from here have nothing to do with the table
+	fd = atoi(fd_str);
+	unsetenv("KCOV_TRAP_FD");
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			hdr.magic != TRAP_TABLE_MAGIC || hdr.version != TRAP_TABLE_VERSION) {
+		fprintf(stderr, "kcov-trap: Invalid trap table in fd %d\n", fd);
+		close(fd);
+		return;
+	}
+
+	p = mmap(NULL, trap_table_size(hdr.capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "kcov-trap: Can't map the trap table\n");
+		close(fd);
+		return;
+	}
+
+	trap_table = (struct trap_table *)p;
+	map_coverage(fd);
+	close(fd);
+	fd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+	mem_file = mem_file_pack(trap_getpid(), fd);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = trap_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGTRAP, &sa, &prev_sigtrap);
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <unordered_map>
 
+#include <sys/stat.h>
+
 using namespace kcov;
 
 class SourceFileCache : public ISourceFileCache
@@ -34,6 +36,27 @@ public:
 		return file.m_crc;
 	}
 
+	void refresh()
+	{
+		std::unordered_map<std::string, File *>::iterator it = m_files.begin();
+
+		while (it != m_files.end()) {
+			File *file = it->second;
+			struct stat st;
+
+			// Missing files are looked up again, they might exist now
+			if (file != &m_empty && stat(it->first.c_str(), &st) == 0 &&
+					st.st_mtime == file->m_mtime && (size_t)st.st_size == file->m_dataSize) {
+				++it;
+				continue;
+			}
+
+			if (file != &m_empty)
+				delete file;
+			it = m_files.erase(it);
+		}
+	}
+
 private:
 	class File
 	{
@@ -41,7 +64,8 @@ private:
 		File() :
 			m_data(NULL),
 			m_dataSize(0),
-			m_crc(0)
+			m_crc(0),
+			m_mtime(0)
 		{
 		}
 
@@ -50,8 +74,8 @@ private:
 			free((void*)m_data);
 		}
 
-		File(const uint8_t *data, size_t size) :
-			m_data(data), m_dataSize(size)
+		File(const uint8_t *data, size_t size, time_t mtime) :
+			m_data(data), m_dataSize(size), m_mtime(mtime)
 		{
 			std::string fileData((const char*)m_data, size);
 
@@ -64,9 +88,10 @@ private:
 		size_t m_dataSize;
 		std::vector<std::string> m_lines;
 		uint32_t m_crc;
+		time_t m_mtime;
 	};
 
-	const File &lookupFile(const std::string filePath)
+	const File &lookupFile(const std::string &filePath)
 	{
 		std::unordered_map<std::string, File *>::iterator it = m_files.find(filePath);
 
@@ -81,14 +106,17 @@ private:
 			return m_empty;
 		}
 
+		struct stat st;
 		size_t sz;
 		uint8_t *p = (uint8_t *)read_file(&sz, "%s", filePath.c_str());
 
 		// Can read?
-		if (p)
-			m_files[filePath] = new File(p, sz);
-		else // Unreadable, populate with empty
+		if (p && stat(filePath.c_str(), &st) == 0)
+			m_files[filePath] = new File(p, sz, st.st_mtime);
+		else { // Unreadable, populate with empty
+			free(p);
 			m_files[filePath] = &m_empty;
+		}
 
 		return *m_files[filePath];
 	}
@@ -0,0 +1,231 @@
+#include <statistics.hh>
+#include <utils.hh>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace kcov;
+
+static const char *phaseNames[IStatistics::N_PHASES] =
+{
+	"parse",
+	"filter",
+	"arm",
+	"tracee",
+	"trap",
+	"solib",
+	"write",
+	"marshal",
+};
+
+static const char *counterNames[IStatistics::N_COUNTERS] =
+{
+	"traps",
+	"ptrace_calls",
+};
+
+// Small IDs for the trace, in the order threads first record something
+static std::atomic<uint32_t> g_nextThreadId(1);
+static __thread uint32_t t_threadId;
+
+class Statistics : public IStatistics
+{
+public:
+	Statistics() :
+		m_traceEnabled(false),
+		m_droppedEvents(0)
+	{
+		reset();
+	}
+
+	uint64_t enter(enum Phase phase)
+	{
+		return now();
+	}
+
+	void leave(enum Phase phase, uint64_t start)
+	{
+		uint64_t duration = now() - start;
+
+		m_phaseNs[phase].fetch_add(duration, std::memory_order_relaxed);
+		m_phaseCount[phase].fetch_add(1, std::memory_order_relaxed);
+
+		if (!m_traceEnabled)
+			return;
+
+		if (t_threadId == 0)
+			t_threadId = g_nextThreadId.fetch_add(1);
+
+		std::lock_guard<std::mutex> lock(m_traceMutex);
+
+		// Per-trap phases can be many, keep the trace file within reason
+		if (m_events.size() >= maxEvents) {
+			m_droppedEvents++;
+			return;
+		}
+
+		m_events.push_back(TraceEvent(phase, t_threadId, start, duration));
+	}
+
+	void count(enum Counter counter, uint64_t n)
+	{
+		m_counters[counter].fetch_add(n, std::memory_order_relaxed);
+	}
+
+	void enableTrace()
+	{
+		m_traceEnabled = true;
+	}
+
+	void reset()
+	{
+		for (unsigned int i = 0; i < N_PHASES; i++) {
+			m_phaseNs[i] = 0;
+			m_phaseCount[i] = 0;
+		}
+		for (unsigned int i = 0; i < N_COUNTERS; i++)
+			m_counters[i] = 0;
+
+		std::lock_guard<std::mutex> lock(m_traceMutex);
+
+		m_events.clear();
+		m_droppedEvents = 0;
+		m_startNs = now();
+		m_startWritten = bytesWritten();
+	}
+
+	bool writeStats(const std::string &path)
+	{
+		uint64_t totalNs = now() - m_startNs;
+		int64_t written = bytesWritten();
+		std::string out;
+
+		out += fmt("{\n  \"total_ms\": %.3f,\n  \"phases\": {\n", totalNs / 1000000.0);
+
+		kcov_debug(STATS_MSG, "kcov: %.3f ms in total\n", totalNs / 1000000.0);
+		for (unsigned int i = 0; i < N_PHASES; i++) {
+			uint64_t ns = m_phaseNs[i];
+			uint64_t n = m_phaseCount[i];
+
+			out += fmt("    \"%s\": {\"ms\": %.3f, \"count\": %llu, \"avg_us\": %.3f}%s\n",
+					phaseNames[i], ns / 1000000.0, (unsigned long long)n,
+					n ? ns / 1000.0 / n : 0.0,
+					i + 1 < N_PHASES ? "," : "");
+			kcov_debug(STATS_MSG, "kcov: %-8s %10.3f ms in %llu\n",
+					phaseNames[i], ns / 1000000.0, (unsigned long long)n);
+		}
+
+		out += "  },\n  \"counters\": {\n";
+		for (unsigned int i = 0; i < N_COUNTERS; i++) {
+			out += fmt("%s    \"%s\": %llu", i ? ",\n" : "",
+					counterNames[i], (unsigned long long)m_counters[i].load());
+			kcov_debug(STATS_MSG, "kcov: %-14s %llu\n",
+					counterNames[i], (unsigned long long)m_counters[i].load());
+		}
+		if (written >= 0 && m_startWritten >= 0) {
+			out += fmt(",\n    \"bytes_written\": %lld", (long long)(written - m_startWritten));
+			kcov_debug(STATS_MSG, "kcov: %-14s %lld\n", "bytes_written",
+					(long long)(written - m_startWritten));
+		}
+		out += "\n  }\n}\n";
+
+		return write_file(out.c_str(), out.size(), "%s", path.c_str()) == 0;
+	}
+
+	bool writeTrace(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lock(m_traceMutex);
+		std::string out;
+		int pid = (int)getpid();
+
+		out += "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+		for (std::vector<TraceEvent>::const_iterator it = m_events.begin();
+				it != m_events.end();
+				++it) {
+			// Microseconds, relative to the start of the run
+			out += fmt("{\"name\": \"%s\", \"cat\": \"kcov\", \"ph\": \"X\", \"pid\": %d, \"tid\": %u, "
+					"\"ts\": %.3f, \"dur\": %.3f},\n",
+					phaseNames[it->m_phase], pid, it->m_threadId,
+					(it->m_start - m_startNs) / 1000.0, it->m_duration / 1000.0);
+		}
+
+		// Closes the list, and tells the reader if it's incomplete
+		out += fmt("{\"name\": \"dropped events\", \"cat\": \"kcov\", \"ph\": \"C\", \"pid\": %d, \"tid\": 0, "
+				"\"ts\": 0, \"args\": {\"dropped\": %llu}}\n]}\n",
+				pid, (unsigned long long)m_droppedEvents);
+
+		return write_file(out.c_str(), out.size(), "%s", path.c_str()) == 0;
+	}
+
+private:
+	class TraceEvent
+	{
+	public:
+		TraceEvent(enum Phase phase, uint32_t threadId, uint64_t start, uint64_t duration) :
+			m_phase(phase), m_threadId(threadId), m_start(start), m_duration(duration)
+		{
+		}
+
+		enum Phase m_phase;
+		uint32_t m_threadId;
+		uint64_t m_start;
+		uint64_t m_duration;
+	};
+
+	static const size_t maxEvents = 256 * 1024;
+
+	/*
+	 * Everything kcov writes (the writers mostly use ofstreams), or -1
+	 * where the system doesn't tell
+	 */
+	int64_t bytesWritten()
+	{
+		size_t size;
+		char *data = (char *)read_file(&size, "/proc/self/io");
+
+		if (!data)
+			return -1;
+
+		std::string io(data, size);
+		size_t pos = io.find("wchar: ");
+
+		free(data);
+		if (pos == std::string::npos)
+			return -1;
+
+		return strtoll(io.c_str() + pos + 7, NULL, 10);
+	}
+
+	uint64_t now()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	std::atomic<uint64_t> m_phaseNs[N_PHASES];
+	std::atomic<uint64_t> m_phaseCount[N_PHASES];
+	std::atomic<uint64_t> m_counters[N_COUNTERS];
+	uint64_t m_startNs;
+	int64_t m_startWritten;
+
+	bool m_traceEnabled;
+	std::mutex m_traceMutex;
+	std::vector<TraceEvent> m_events;
+	uint64_t m_droppedEvents;
+};
+
+IStatistics &IStatistics::getInstance()
+{
+	// Initialised once, even when first used from a parser thread
+	static Statistics *g_instance = new Statistics();
+
+	return *g_instance;
+}
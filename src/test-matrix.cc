@@ -0,0 +1,547 @@
+#include <test-matrix.hh>
+#include <utils.hh>
+#include <swap-endian.hh>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace kcov;
+
+#define MATRIX_MAGIC   0x4b63746d // "Kctm"
+#define MATRIX_VERSION 1
+
+/*
+ * Everything is big-endian, with the offsets from the start of the file.
+ * The tables are read in place, so the file can be mapped and queried
+ * without parsing it.
+ */
+struct matrix_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t n_files;
+	uint32_t n_tests;
+	uint32_t n_lines;
+	uint32_t files_offset; // struct matrix_file[n_files], sorted by name
+	uint32_t tests_offset; // struct matrix_test[n_tests]
+	uint32_t lines_offset; // uint32_t[n_lines], the line number of each index
+	uint32_t padding;
+};
+
+struct matrix_file
+{
+	uint32_t name_offset;
+	uint32_t first_index;
+	uint32_t n_lines;
+};
+
+struct matrix_test
+{
+	uint32_t name_offset;
+	uint32_t bitmap_offset; // struct bitmap_header
+};
+
+/*
+ * Roaring style bitmap: the indexes are split on the upper 16 bits, and
+ * the lower 16 bits of each part are stored in whichever container is the
+ * smallest. Covered lines tend to come in runs, so the run containers are
+ * the common case.
+ */
+enum container_type
+{
+	CONTAINER_ARRAY  = 0, // n uint16_t values, sorted
+	CONTAINER_RUNS   = 1, // n pairs of uint16_t start and length - 1, sorted
+	CONTAINER_BITMAP = 2, // 1024 uint64_t, n is the number of bits set
+};
+
+struct bitmap_header
+{
+	uint32_t n_containers;
+	uint32_t cardinality;
+	// struct bitmap_container[n_containers], sorted by key
+};
+
+struct bitmap_container
+{
+	uint16_t key;
+	uint16_t type;
+	uint32_t n;
+	uint32_t data_offset; // From the bitmap header, 8-byte aligned
+};
+
+static const size_t bitmapContainerWords = 65536 / 64;
+
+
+class TestMatrix : public ITestMatrix
+{
+public:
+	TestMatrix(const uint8_t *data, size_t size) :
+		m_data(data),
+		m_size(size)
+	{
+		m_nFiles = get<uint32_t>(offsetof(struct matrix_header, n_files));
+		m_nTests = get<uint32_t>(offsetof(struct matrix_header, n_tests));
+		m_filesOffset = get<uint32_t>(offsetof(struct matrix_header, files_offset));
+		m_testsOffset = get<uint32_t>(offsetof(struct matrix_header, tests_offset));
+		m_linesOffset = get<uint32_t>(offsetof(struct matrix_header, lines_offset));
+	}
+
+	~TestMatrix()
+	{
+		munmap((void *)m_data, m_size);
+	}
+
+	TestList_t getTests(const std::string &filename, unsigned int lineNr)
+	{
+		TestList_t out;
+		int64_t index = lineIndex(filename, lineNr);
+
+		if (index < 0)
+			return out;
+
+		for (uint32_t i = 0; i < m_nTests; i++) {
+			uint32_t test = m_testsOffset + i * sizeof(struct matrix_test);
+
+			if (bitmapContains(get<uint32_t>(test + offsetof(struct matrix_test, bitmap_offset)), (uint32_t)index))
+				out.push_back(stringAt(get<uint32_t>(test + offsetof(struct matrix_test, name_offset))));
+		}
+
+		return out;
+	}
+
+	bool hasFile(const std::string &filename)
+	{
+		return findFile(filename) >= 0;
+	}
+
+	// Check that the tables are within the file
+	bool valid() const
+	{
+		uint64_t filesEnd = m_filesOffset + (uint64_t)m_nFiles * sizeof(struct matrix_file);
+		uint64_t testsEnd = m_testsOffset + (uint64_t)m_nTests * sizeof(struct matrix_test);
+		uint64_t linesEnd = m_linesOffset + (uint64_t)get<uint32_t>(offsetof(struct matrix_header, n_lines)) * sizeof(uint32_t);
+
+		// ... and the strings are terminated
+		return filesEnd <= m_size && testsEnd <= m_size && linesEnd <= m_size &&
+				m_data[m_size - 1] == '\0';
+	}
+
+private:
+	template <typename T>
+	T get(uint64_t offset) const
+	{
+		T v;
+
+		// Corrupt files read as zeroes
+		if (offset + sizeof(T) > m_size)
+			return 0;
+
+		memcpy(&v, m_data + offset, sizeof(T));
+
+		return be_to_host<T>(v);
+	}
+
+	const char *stringAt(uint32_t offset) const
+	{
+		if (offset >= m_size)
+			return "";
+
+		return (const char *)m_data + offset;
+	}
+
+	// The entry in the file table, or -1
+	int64_t findFile(const std::string &filename) const
+	{
+		uint32_t lo = 0;
+		uint32_t hi = m_nFiles;
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			uint32_t file = m_filesOffset + mid * sizeof(struct matrix_file);
+			int cmp = strcmp(stringAt(get<uint32_t>(file + offsetof(struct matrix_file, name_offset))),
+					filename.c_str());
+
+			if (cmp == 0)
+				return file;
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return -1;
+	}
+
+	int64_t lineIndex(const std::string &filename, unsigned int lineNr) const
+	{
+		int64_t file = findFile(filename);
+
+		if (file < 0)
+			return -1;
+
+		uint32_t first = get<uint32_t>(file + offsetof(struct matrix_file, first_index));
+		uint32_t lo = first;
+		uint32_t hi = first + get<uint32_t>(file + offsetof(struct matrix_file, n_lines));
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			uint32_t cur = get<uint32_t>(m_linesOffset + (uint64_t)mid * sizeof(uint32_t));
+
+			if (cur == lineNr)
+				return mid;
+			if (cur < lineNr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return -1;
+	}
+
+	bool bitmapContains(uint32_t bitmap, uint32_t index) const
+	{
+		uint16_t key = index >> 16;
+		uint16_t low = index & 0xffff;
+		uint32_t containers = bitmap + sizeof(struct bitmap_header);
+		uint32_t lo = 0;
+		uint32_t hi = get<uint32_t>(bitmap + offsetof(struct bitmap_header, n_containers));
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			uint64_t container = containers + (uint64_t)mid * sizeof(struct bitmap_container);
+			uint16_t cur = get<uint16_t>(container + offsetof(struct bitmap_container, key));
+
+			if (cur == key)
+				return containerContains(bitmap, container, low);
+			if (cur < key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return false;
+	}
+
+	bool containerContains(uint32_t bitmap, uint64_t container, uint16_t low) const
+	{
+		uint16_t type = get<uint16_t>(container + offsetof(struct bitmap_container, type));
+		uint32_t n = get<uint32_t>(container + offsetof(struct bitmap_container, n));
+		uint64_t data = (uint64_t)bitmap + get<uint32_t>(container + offsetof(struct bitmap_container, data_offset));
+
+		if (type == CONTAINER_BITMAP)
+			return (get<uint64_t>(data + (low / 64) * sizeof(uint64_t)) >> (low % 64)) & 1;
+
+		// Both have sorted 16-bit starts, with a stride of 2 or 4 bytes
+		unsigned int stride = type == CONTAINER_RUNS ? 2 * sizeof(uint16_t) : sizeof(uint16_t);
+		uint32_t lo = 0;
+		uint32_t hi = n;
+
+		// The last entry which starts at or before low
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if (get<uint16_t>(data + mid * stride) <= low)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == 0)
+			return false;
+
+		uint64_t entry = data + (lo - 1) * stride;
+		uint16_t start = get<uint16_t>(entry);
+
+		if (type == CONTAINER_ARRAY)
+			return start == low;
+
+		return low - start <= get<uint16_t>(entry + sizeof(uint16_t));
+	}
+
+	const uint8_t *m_data;
+	size_t m_size;
+
+	uint32_t m_nFiles;
+	uint32_t m_nTests;
+	uint32_t m_filesOffset;
+	uint32_t m_testsOffset;
+	uint32_t m_linesOffset;
+};
+
+ITestMatrix *ITestMatrix::open(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	void *p = MAP_FAILED;
+
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct matrix_header))
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED)
+		return NULL;
+
+	const struct matrix_header *hdr = (const struct matrix_header *)p;
+
+	if (be_to_host<uint32_t>(hdr->magic) != MATRIX_MAGIC ||
+			be_to_host<uint32_t>(hdr->version) != MATRIX_VERSION ||
+			be_to_host<uint32_t>(hdr->size) != (uint32_t)st.st_size) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	TestMatrix *out = new TestMatrix((const uint8_t *)p, st.st_size);
+
+	if (!out->valid()) {
+		delete out;
+		return NULL;
+	}
+
+	return out;
+}
+
+
+class TestMatrixBuilder : public ITestMatrixBuilder
+{
+public:
+	void addLine(const std::string &filename, unsigned int lineNr)
+	{
+		m_lines[filename].insert(lineNr);
+	}
+
+	void addHit(const std::string &test, const std::string &filename, unsigned int lineNr)
+	{
+		addLine(filename, lineNr);
+		m_hits[test][filename].insert(lineNr);
+	}
+
+	bool write(const std::string &path)
+	{
+		typedef std::map<std::string, uint32_t> FirstIndexMap_t;
+
+		FirstIndexMap_t firstIndexes;
+		std::vector<uint32_t> lines;
+
+		// The line index, which only changes when lines are added or removed
+		for (LinesByFile_t::const_iterator it = m_lines.begin();
+				it != m_lines.end();
+				++it) {
+			firstIndexes[it->first] = lines.size();
+			lines.insert(lines.end(), it->second.begin(), it->second.end());
+		}
+
+		m_out.clear();
+		reserve(sizeof(struct matrix_header));
+
+		uint32_t filesOffset = reserve(m_lines.size() * sizeof(struct matrix_file));
+		uint32_t testsOffset = reserve(m_hits.size() * sizeof(struct matrix_test));
+		uint32_t linesOffset = reserve(lines.size() * sizeof(uint32_t));
+
+		for (size_t i = 0; i < lines.size(); i++)
+			put<uint32_t>(linesOffset + i * sizeof(uint32_t), lines[i]);
+
+		uint32_t cur = testsOffset;
+		for (HitsByTest_t::const_iterator it = m_hits.begin();
+				it != m_hits.end();
+				++it) {
+			std::vector<uint32_t> indexes;
+
+			for (LinesByFile_t::const_iterator fileIt = it->second.begin();
+					fileIt != it->second.end();
+					++fileIt) {
+				const LineSet_t &fileLines = m_lines[fileIt->first];
+				uint32_t first = firstIndexes[fileIt->first];
+				LineSet_t::const_iterator lineIt = fileLines.begin();
+				uint32_t index = first;
+
+				// Both sorted, so walk them together
+				for (LineSet_t::const_iterator hitIt = fileIt->second.begin();
+						hitIt != fileIt->second.end();
+						++hitIt) {
+					while (*lineIt != *hitIt) {
+						++lineIt;
+						++index;
+					}
+					indexes.push_back(index);
+				}
+			}
+
+			put<uint32_t>(cur + offsetof(struct matrix_test, bitmap_offset), writeBitmap(indexes));
+			cur += sizeof(struct matrix_test);
+		}
+
+		// The strings last, so that the file ends with a terminator
+		cur = filesOffset;
+		for (LinesByFile_t::const_iterator it = m_lines.begin();
+				it != m_lines.end();
+				++it) {
+			put<uint32_t>(cur + offsetof(struct matrix_file, name_offset), writeString(it->first));
+			put<uint32_t>(cur + offsetof(struct matrix_file, first_index), firstIndexes[it->first]);
+			put<uint32_t>(cur + offsetof(struct matrix_file, n_lines), it->second.size());
+			cur += sizeof(struct matrix_file);
+		}
+
+		cur = testsOffset;
+		for (HitsByTest_t::const_iterator it = m_hits.begin();
+				it != m_hits.end();
+				++it) {
+			put<uint32_t>(cur + offsetof(struct matrix_test, name_offset), writeString(it->first));
+			cur += sizeof(struct matrix_test);
+		}
+		if (m_out.size() == sizeof(struct matrix_header) || m_out.back() != '\0')
+			writeString("");
+
+		put<uint32_t>(offsetof(struct matrix_header, magic), MATRIX_MAGIC);
+		put<uint32_t>(offsetof(struct matrix_header, version), MATRIX_VERSION);
+		put<uint32_t>(offsetof(struct matrix_header, size), m_out.size());
+		put<uint32_t>(offsetof(struct matrix_header, n_files), m_lines.size());
+		put<uint32_t>(offsetof(struct matrix_header, n_tests), m_hits.size());
+		put<uint32_t>(offsetof(struct matrix_header, n_lines), lines.size());
+		put<uint32_t>(offsetof(struct matrix_header, files_offset), filesOffset);
+		put<uint32_t>(offsetof(struct matrix_header, tests_offset), testsOffset);
+		put<uint32_t>(offsetof(struct matrix_header, lines_offset), linesOffset);
+
+		kcov_debug(INFO_MSG, "Test matrix: %zu tests over %zu lines in %zu bytes\n",
+				m_hits.size(), lines.size(), m_out.size());
+
+		return write_file(m_out.data(), m_out.size(), "%s", path.c_str()) == 0;
+	}
+
+private:
+	typedef std::set<unsigned int> LineSet_t;
+	typedef std::map<std::string, LineSet_t> LinesByFile_t;
+	typedef std::map<std::string, LinesByFile_t> HitsByTest_t;
+
+	// Offset of n zeroed bytes at the end
+	uint32_t reserve(size_t n)
+	{
+		size_t out = m_out.size();
+
+		m_out.resize(out + n);
+
+		return out;
+	}
+
+	void align(size_t n)
+	{
+		if (m_out.size() % n)
+			reserve(n - m_out.size() % n);
+	}
+
+	template <typename T>
+	void put(size_t offset, T value)
+	{
+		T v = to_be<T>(value);
+
+		memcpy(&m_out[offset], &v, sizeof(T));
+	}
+
+	uint32_t writeString(const std::string &str)
+	{
+		uint32_t out = reserve(str.size() + 1);
+
+		memcpy(&m_out[out], str.c_str(), str.size());
+
+		return out;
+	}
+
+	// @a indexes is sorted and unique
+	uint32_t writeBitmap(const std::vector<uint32_t> &indexes)
+	{
+		std::vector<size_t> starts;
+
+		// Where each container starts in indexes
+		for (size_t i = 0; i < indexes.size(); i++) {
+			if (i == 0 || (indexes[i] >> 16) != (indexes[i - 1] >> 16))
+				starts.push_back(i);
+		}
+		starts.push_back(indexes.size());
+
+		align(8);
+		uint32_t bitmap = reserve(sizeof(struct bitmap_header));
+		uint32_t containers = reserve((starts.size() - 1) * sizeof(struct bitmap_container));
+
+		put<uint32_t>(bitmap + offsetof(struct bitmap_header, n_containers), starts.size() - 1);
+		put<uint32_t>(bitmap + offsetof(struct bitmap_header, cardinality), indexes.size());
+
+		for (size_t c = 0; c + 1 < starts.size(); c++) {
+			size_t first = starts[c];
+			size_t n = starts[c + 1] - first;
+			uint32_t container = containers + c * sizeof(struct bitmap_container);
+			size_t nRuns = 1;
+
+			for (size_t i = first + 1; i < first + n; i++) {
+				if (indexes[i] != indexes[i - 1] + 1)
+					nRuns++;
+			}
+
+			// Bytes for each kind of container
+			size_t arraySize = n * sizeof(uint16_t);
+			size_t runsSize = nRuns * 2 * sizeof(uint16_t);
+			size_t bitmapSize = bitmapContainerWords * sizeof(uint64_t);
+
+			align(8);
+			put<uint16_t>(container + offsetof(struct bitmap_container, key), indexes[first] >> 16);
+			put<uint32_t>(container + offsetof(struct bitmap_container, data_offset), m_out.size() - bitmap);
+
+			if (runsSize < arraySize && runsSize < bitmapSize) {
+				uint32_t data = reserve(runsSize);
+				size_t runStart = first;
+
+				put<uint16_t>(container + offsetof(struct bitmap_container, type), CONTAINER_RUNS);
+				put<uint32_t>(container + offsetof(struct bitmap_container, n), nRuns);
+				for (size_t i = first + 1; i <= first + n; i++) {
+					if (i < first + n && indexes[i] == indexes[i - 1] + 1)
+						continue;
+
+					put<uint16_t>(data, indexes[runStart] & 0xffff);
+					put<uint16_t>(data + sizeof(uint16_t), indexes[i - 1] - indexes[runStart]);
+					data += 2 * sizeof(uint16_t);
+					runStart = i;
+				}
+			} else if (arraySize <= bitmapSize) {
+				uint32_t data = reserve(arraySize);
+
+				put<uint16_t>(container + offsetof(struct bitmap_container, type), CONTAINER_ARRAY);
+				put<uint32_t>(container + offsetof(struct bitmap_container, n), n);
+				for (size_t i = 0; i < n; i++)
+					put<uint16_t>(data + i * sizeof(uint16_t), indexes[first + i] & 0xffff);
+			} else {
+				std::vector<uint64_t> words(bitmapContainerWords);
+				uint32_t data = reserve(bitmapSize);
+
+				put<uint16_t>(container + offsetof(struct bitmap_container, type), CONTAINER_BITMAP);
+				put<uint32_t>(container + offsetof(struct bitmap_container, n), n);
+				for (size_t i = first; i < first + n; i++)
+					words[(indexes[i] & 0xffff) / 64] |= 1ULL << (indexes[i] % 64);
+				for (size_t i = 0; i < bitmapContainerWords; i++)
+					put<uint64_t>(data + i * sizeof(uint64_t), words[i]);
+			}
+		}
+
+		return bitmap;
+	}
+
+	LinesByFile_t m_lines;
+	HitsByTest_t m_hits;
+	std::vector<uint8_t> m_out;
+};
+
+ITestMatrixBuilder &ITestMatrixBuilder::create()
+{
+	return *new TestMatrixBuilder();
+}
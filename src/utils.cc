@@ -13,6 +13,9 @@
 #include <limits.h>
 #include <time.h>
 #include <zlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <poll.h>
 
 #include <utils.hh>
 
@@ -21,6 +24,7 @@
 #include <stdexcept>
 #include <algorithm>
 #include <unordered_map>
+#include <mutex>
 
 int g_kcov_debug_mask = STATUS_MSG;
 static void* (*mocked_read_callback)(size_t* out_size, const char* path);
@@ -120,6 +124,50 @@ void *read_file(size_t *out_size, const char *fmt, ...)
 	return read_file_int(out_size, 0, path);
 }
 
+void *map_file(size_t *out_size, const char *fmt, ...)
+{
+	char path[2048];
+	struct stat st;
+	va_list ap;
+	void *out;
+	int fd;
+	int r;
+
+	/* Create the filename */
+	va_start(ap, fmt);
+	r = vsnprintf(path, 2048, fmt, ap);
+	va_end(ap);
+
+	panic_if (r >= 2048,
+			"Too long string!");
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	// Private and writable since libelf might modify the image
+	out = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (out == MAP_FAILED)
+		return NULL;
+
+	*out_size = st.st_size;
+
+	return out;
+}
+
+void unmap_file(void *data, size_t size)
+{
+	if (data)
+		munmap(data, size);
+}
+
 void *peek_file(size_t *out_size, const char *fmt, ...)
 {
 	char path[2048];
@@ -249,21 +297,13 @@ const char *get_home(void)
 
 bool file_readable(FILE *fp, unsigned int ms)
 {
-	fd_set rfds;
-	struct timeval tv;
-	int rv;
-
-	int fd = fileno(fp);
-
-	FD_ZERO(&rfds);
-	FD_SET(fd, &rfds);
-
-	tv.tv_sec = ms / 1000;
-	tv.tv_usec = (ms % 1000) * 1000;
+	struct pollfd pfd;
 
-	rv = select(fd + 1, &rfds, NULL, NULL, &tv);
+	pfd.fd = fileno(fp);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
 
-	return rv > 0;
+	return poll(&pfd, 1, ms) > 0;
 }
 
 static std::unordered_map<std::string, bool> statCache;
@@ -479,8 +519,11 @@ std::string trim_string(const std::string &strIn, const std::string &trimEndChar
 // Cache for ::realpath - it's apparently one of the reasons why kcov is slow
 typedef std::unordered_map<std::string, std::string> PathMap_t;
 static PathMap_t realPathCache;
+// Also used from the solib parser thread. The entries stay put on rehash.
+static std::mutex realPathCacheMutex;
 const std::string &get_real_path(const std::string &path)
 {
+	std::lock_guard<std::mutex> lock(realPathCacheMutex);
 	PathMap_t::const_iterator it = realPathCache.find(path);
 	if (it != realPathCache.end())
 		return it->second;
@@ -643,6 +686,165 @@ uint32_t hash_block(const void *buf, size_t len)
 	return crc32(0, (const Bytef *)buf, len);
 }
 
+// CRC32C (Castagnoli), which has instruction support on x86
+static uint32_t crc32cTable[8][256];
+
+static void crc32cInit()
+{
+	for (unsigned int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (unsigned int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+		crc32cTable[0][i] = crc;
+	}
+
+	for (unsigned int i = 0; i < 256; i++) {
+		for (unsigned int j = 1; j < 8; j++)
+			crc32cTable[j][i] = (crc32cTable[j - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[j - 1][i] & 0xff];
+	}
+}
+
+static uint32_t crc32cSoftware(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = crc32cTable[7][v & 0xff] ^
+				crc32cTable[6][(v >> 8) & 0xff] ^
+				crc32cTable[5][(v >> 16) & 0xff] ^
+				crc32cTable[4][(v >> 24) & 0xff] ^
+				crc32cTable[3][(v >> 32) & 0xff] ^
+				crc32cTable[2][(v >> 40) & 0xff] ^
+				crc32cTable[1][(v >> 48) & 0xff] ^
+				crc32cTable[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = ~crc;
+
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+
+	uint32_t crc32 = crc64;
+	while (len--)
+		crc32 = __builtin_ia32_crc32qi(crc32, *p++);
+
+	return ~crc32;
+}
+#endif
+
+static uint32_t (*crc32cFn)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+static void crc32cSetup()
+{
+	crc32cInit();
+	crc32cFn = crc32cSoftware;
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32cFn = crc32cHardware;
+#endif
+}
+
+class HashJob
+{
+public:
+	const uint8_t *m_data;
+	size_t m_size;
+	size_t m_chunkSize;
+	std::vector<uint32_t> m_chunkHashes;
+
+	size_t m_nextChunk;
+	pthread_mutex_t m_mutex;
+};
+
+static void *hashThread(void *priv)
+{
+	HashJob *job = (HashJob *)priv;
+
+	while (1) {
+		pthread_mutex_lock(&job->m_mutex);
+		size_t chunk = job->m_nextChunk++;
+		pthread_mutex_unlock(&job->m_mutex);
+
+		if (chunk >= job->m_chunkHashes.size())
+			break;
+
+		size_t offset = chunk * job->m_chunkSize;
+
+		job->m_chunkHashes[chunk] = crc32cFn(0, job->m_data + offset,
+				std::min(job->m_chunkSize, job->m_size - offset));
+	}
+
+	return NULL;
+}
+
+uint64_t hash_block_parallel(const void *buf, size_t len)
+{
+	// Fixed chunk size, so the result doesn't depend on the number of CPUs
+	const size_t chunkSize = 4 * 1024 * 1024;
+	HashJob job;
+
+	pthread_once(&crc32cOnce, crc32cSetup);
+
+	job.m_data = (const uint8_t *)buf;
+	job.m_size = len;
+	job.m_chunkSize = chunkSize;
+	job.m_chunkHashes.resize((len + chunkSize - 1) / chunkSize);
+	job.m_nextChunk = 0;
+	pthread_mutex_init(&job.m_mutex, NULL);
+
+	long nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	std::vector<pthread_t> threads;
+
+	if (nThreads > (long)job.m_chunkHashes.size())
+		nThreads = job.m_chunkHashes.size();
+	for (long i = 1; i < nThreads; i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, hashThread, (void *)&job) == 0)
+			threads.push_back(thread);
+	}
+
+	// Work on this thread as well
+	hashThread((void *)&job);
+
+	for (std::vector<pthread_t>::iterator it = threads.begin();
+			it != threads.end();
+			++it)
+		pthread_join(*it, NULL);
+	pthread_mutex_destroy(&job.m_mutex);
+
+	// Combine the chunk hashes, and the size in the low part
+	uint32_t hi = crc32cFn(0, (const uint8_t *)job.m_chunkHashes.data(),
+			job.m_chunkHashes.size() * sizeof(uint32_t));
+
+	return ((uint64_t)hi << 32) | (uint32_t)len;
+}
+
 std::pair<std::string, std::string> split_path(const std::string &pathStr)
 {
 	std::pair<std::string, std::string> out;
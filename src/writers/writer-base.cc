@@ -102,6 +102,26 @@ void WriterBase::onLine(const std::string &file, unsigned int lineNr, uint64_t a
 	m_files[file] = new File(file);
 }
 
+void WriterBase::onFileLine(FileId file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr)
+{
+	if (file >= m_seenFiles.size())
+		m_seenFiles.resize(file + 1, false);
+
+	if (m_seenFiles[file])
+		return;
+	m_seenFiles[file] = true;
+
+	onLine(IPathInterner::getInstance().getPath(file), lineNr, addr);
+}
+
+void WriterBase::onFileLines(FileId file, const unsigned int *lineNrs, const uint64_t *addrs,
+		const uint64_t *blockAddrs, size_t n)
+{
+	// Only the file matters here
+	if (n > 0)
+		onFileLine(file, lineNrs[0], addrs[0], blockAddrs[0]);
+}
+
 
 void *WriterBase::marshalSummary(IReporter::ExecutionSummary &summary,
 		const std::string &name, size_t *sz)
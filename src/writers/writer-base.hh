@@ -6,6 +6,7 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace kcov
 {
@@ -41,11 +42,18 @@ namespace kcov
 		};
 
 		typedef std::unordered_map<std::string, File *> FileMap_t;
+		typedef std::vector<bool> SeenFileList_t;
 
 
 		/* Called when the ELF is parsed */
 		void onLine(const std::string &file, unsigned int lineNr, uint64_t addr);
 
+		/* Same, but only looks at each file once */
+		void onFileLine(FileId file, unsigned int lineNr, uint64_t addr, uint64_t blockAddr);
+
+		void onFileLines(FileId file, const unsigned int *lineNrs, const uint64_t *addrs,
+				const uint64_t *blockAddrs, size_t n);
+
 
 		void *marshalSummary(IReporter::ExecutionSummary &summary,
 				const std::string &name, size_t *sz);
@@ -59,6 +67,7 @@ namespace kcov
 		IFileParser &m_fileParser;
 		IReporter &m_reporter;
 		FileMap_t m_files;
+		SeenFileList_t m_seenFiles; // By file ID
 		std::string m_commonPath;
 	};
 }
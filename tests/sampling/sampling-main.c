@@ -0,0 +1,29 @@
+#include <pthread.h>
+#include <stdio.h>
+
+static volatile unsigned long sink;
+
+static void *spin(void *arg)
+{
+	unsigned long i;
+
+	for (i = 0; i < 400000000UL; i++)
+		sink += i;
+
+	return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+	pthread_t thr;
+
+	// Samples from both threads
+	pthread_create(&thr, NULL, spin, NULL);
+	spin(NULL);
+	pthread_join(thr, NULL);
+
+	if (argc > 5)
+		printf("Not reached\n");
+
+	return 0;
+}
@@ -52,6 +52,61 @@ class merge_merged_output(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "shell-main", 4) == 1
         assert parse_cobertura.hitsPerLine(dom, "dollar-var-replacements.sh", 2) == 1
 
+class merge_incremental(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/first " + testbase.sources + "/tests/python/main 5")
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/second " + testbase.sources + "/tests/bash/shell-main")
+        rv,o = self.do(testbase.kcov + " --merge --incremental-merge " + testbase.outbase + "/kcov/merged " + testbase.outbase + "/kcov/first " + testbase.outbase + "/kcov/second")
+
+        # Only third is read, the others come from the merged state
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/third " + testbase.sources + "/tests/bash/dollar-var-replacements.sh")
+        rv,o = self.do(testbase.kcov + " --merge --incremental-merge " + testbase.outbase + "/kcov/merged " + testbase.outbase + "/kcov/first " + testbase.outbase + "/kcov/second " + testbase.outbase + "/kcov/third")
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/merged/kcov-merged/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main", 10) == 1
+        assert parse_cobertura.hitsPerLine(dom, "shell-main", 4) == 1
+        assert parse_cobertura.hitsPerLine(dom, "dollar-var-replacements.sh", 2) == 1
+
+        rv,o = self.doShell("grep -c kcov/third/ %s/kcov/merged/kcov-merged/merge-manifest" % (testbase.outbase))
+        assert rv == 0
+
+        # Nothing new in first and second, so they aren't read again
+        f = open(testbase.outbase + "/kcov/fourth.py", "w")
+        f.write("a = 1\n")
+        f.close()
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/fourth " + testbase.outbase + "/kcov/fourth.py")
+        rv,o = self.do(testbase.kcov + " --debug=1 --merge --incremental-merge " + testbase.outbase + "/kcov/merged " + testbase.outbase + "/kcov/first " + testbase.outbase + "/kcov/second " + testbase.outbase + "/kcov/third " + testbase.outbase + "/kcov/fourth")
+        assert o.find(b"kcov/first/main is unchanged") != -1
+        assert o.find(b"kcov/second/shell-main is unchanged") != -1
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/merged/kcov-merged/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main", 10) == 1
+        assert parse_cobertura.hitsPerLine(dom, "fourth.py", 1) == 1
+
+class merge_incremental_edited_source(testbase.KcovTestCase):
+    def writeSource(self, text):
+        f = open(testbase.outbase + "/kcov/edited.py", "w")
+        f.write(text)
+        f.close()
+
+    def runTest(self):
+        self.setUp()
+        self.writeSource("a = 1\nb = 2\nc = 3\n")
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/first " + testbase.outbase + "/kcov/edited.py")
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/second " + testbase.sources + "/tests/python/main 5")
+        rv,o = self.do(testbase.kcov + " --merge --incremental-merge " + testbase.outbase + "/kcov/merged " + testbase.outbase + "/kcov/first " + testbase.outbase + "/kcov/second")
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/merged/kcov-merged/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "edited.py", 3) == 1
+
+        # The lines of the old source are gone, as with a full merge
+        self.writeSource("x = 1\n# b\n# c\nd = 4\n")
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/first " + testbase.outbase + "/kcov/edited.py")
+        rv,o = self.do(testbase.kcov + " --merge --incremental-merge " + testbase.outbase + "/kcov/merged " + testbase.outbase + "/kcov/first " + testbase.outbase + "/kcov/second")
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/merged/kcov-merged/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "edited.py", 1) == 1
+        assert parse_cobertura.hitsPerLine(dom, "edited.py", 3) == None
+        assert parse_cobertura.hitsPerLine(dom, "edited.py", 4) == 1
+        assert parse_cobertura.hitsPerLine(dom, "main", 10) == 1
+
 class merge_coveralls(testbase.KcovTestCase):
     def runTest(self):
         self.setUp()
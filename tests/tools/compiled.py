@@ -3,6 +3,10 @@ import unittest
 import parse_cobertura
 import sys
 import os
+import platform
+import subprocess
+import time
+import json
 
 class illegal_insn(testbase.KcovTestCase):
     @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
@@ -49,6 +53,19 @@ class fork_32(ForkBase):
     def runTest(self):
         self.doTest("fork-32")
 
+class fork_per_process(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " --per-process " + testbase.outbase + "/kcov " + testbase.testbuild + "/fork", False)
+        assert rv == 0
+
+        # The parent, child and grand child
+        dbs = [f for f in os.listdir(testbase.outbase + "/kcov/fork/processes") if f.endswith(".db")]
+        assert len(dbs) == 3
+        for f in dbs:
+            assert os.path.getsize(testbase.outbase + "/kcov/fork/processes/" + f) > 16
+
 class vfork(testbase.KcovTestCase):
     def runTest(self):
         self.setUp()
@@ -71,6 +88,18 @@ class shared_library(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "main.c", 9) >= 1
         assert parse_cobertura.hitsPerLine(dom, "solib.c", 5) == 1
 
+class shared_library_trap_handler(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux") or platform.machine() not in ("x86_64", "i686"), "Linux x86-only")
+    def runTest(self):
+        self.setUp()
+        noKcovRv,o = self.do(testbase.testbuild + "/shared_library_test", False)
+        rv,o = self.do(testbase.kcov + " --trap-handler " + testbase.outbase + "/kcov " + testbase.testbuild + "/shared_library_test", False)
+        assert rv == noKcovRv
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/shared_library_test/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main.c", 9) >= 1
+        assert parse_cobertura.hitsPerLine(dom, "solib.c", 5) == 1
+
 class shared_library_skip(testbase.KcovTestCase):
     @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only, Issue #157")
     def runTest(self):
@@ -132,6 +161,74 @@ class main_test_verify(MainTestBase):
     def runTest(self):
         self.doTest("--verify")
 
+class main_test_trap_handler(MainTestBase):
+    @unittest.skipIf(not sys.platform.startswith("linux") or platform.machine() not in ("x86_64", "i686"), "Linux x86-only")
+    def runTest(self):
+        self.doTest("--trap-handler")
+
+class main_test_uprobes(MainTestBase):
+    @unittest.skipIf(not sys.platform.startswith("linux") or platform.machine() not in ("x86_64", "i686") or os.geteuid() != 0, "Linux x86-only, needs root")
+    def runTest(self):
+        self.doTest("--uprobes")
+
+class main_test_rewrite(MainTestBase):
+    @unittest.skipIf(not sys.platform.startswith("linux") or platform.machine() != "x86_64", "Linux x86_64-only")
+    def runTest(self):
+        self.doTest("--rewrite")
+
+class sampling(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux") or platform.machine() not in ("x86_64", "i686"), "Linux x86-only")
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " --sample=1000 " + testbase.outbase + "/kcov " + testbase.testbuild + "/sampling", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/sampling/cobertura.xml")
+        # Hit counts are samples, so only the hot loop can be counted on
+        assert parse_cobertura.hitsPerLine(dom, "sampling-main.c", 11) >= 10
+        assert parse_cobertura.hitsPerLine(dom, "sampling-main.c", 25) == 0
+
+class statistics(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        trace = testbase.outbase + "/kcov/trace.json"
+        rv,o = self.do(testbase.kcov + " --chrome-trace=" + trace + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests 5", False)
+
+        stats = json.load(open(testbase.outbase + "/kcov/main-tests/stats.json"))
+        for phase in ("parse", "filter", "arm", "tracee", "trap", "solib", "write", "marshal"):
+            assert phase in stats["phases"]
+            assert "count" in stats["phases"][phase]
+        assert stats["phases"]["parse"]["count"] >= 1
+        assert stats["counters"]["traps"] >= 1
+        # Each batch of traps is timed once
+        assert stats["phases"]["trap"]["count"] <= stats["counters"]["traps"]
+        assert "ptrace_calls" in stats["counters"]
+
+        events = json.load(open(trace))["traceEvents"]
+        names = [e["name"] for e in events]
+        assert "parse" in names
+        assert "trap" in names
+
+class main_test_server(MainTestBase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        socket = testbase.outbase + "/kcov-server.sock"
+        server = subprocess.Popen([testbase.kcov, "--server=" + socket])
+
+        try:
+            for i in range(50):
+                if os.path.exists(socket):
+                    break
+                time.sleep(0.1)
+
+            # The second run uses what the first left parsed in the server
+            self.doTest("--connect=" + socket)
+            self.doTest("--connect=" + socket)
+        finally:
+            server.terminate()
+            server.wait()
+
 class main_test_lldb_raw_breakpoints(MainTestBase):
     def runTest(self):
         self.doTest("--configure=lldb-use-raw-breakpoint-writes=1")
@@ -333,6 +430,27 @@ class merge_same_file_in_multiple_binaries(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "file.c", 3) == 0
         assert parse_cobertura.hitsPerLine(dom, "file.c", 8) == 1
 
+class merge_test_matrix(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/first " + testbase.testbuild + "/argv_dependent", False)
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov/second " + testbase.testbuild + "/argv_dependent a", False)
+        rv,o = self.do(testbase.kcov + " --merge --test-matrix " + testbase.outbase + "/kcov/merged " + testbase.outbase + "/kcov/first " + testbase.outbase + "/kcov/second", False)
+        assert rv == 0
+
+        rv,o = self.do(testbase.kcov + " --tests-covering=" + testbase.sources + "/tests/argv-dependent.c:5 " + testbase.outbase + "/kcov/merged", False)
+        assert rv == 0
+        assert o.find("first/argv_dependent") != -1
+        assert o.find("second/argv_dependent") == -1
+
+        rv,o = self.do(testbase.kcov + " --tests-covering=" + testbase.sources + "/tests/argv-dependent.c:17 " + testbase.outbase + "/kcov/merged", False)
+        assert o.split() == ["first/argv_dependent", "second/argv_dependent"]
+
+        # Named the same way without --merge
+        rv,o = self.do(testbase.kcov + " --test-matrix " + testbase.outbase + "/kcov/single " + testbase.testbuild + "/argv_dependent", False)
+        rv,o = self.do(testbase.kcov + " --tests-covering=" + testbase.sources + "/tests/argv-dependent.c:17 " + testbase.outbase + "/kcov/single", False)
+        assert o.split() == ["single/argv_dependent"]
+
 
 class debuglink(testbase.KcovTestCase):
     @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "../test.hh"
+
+#include <file-parser.hh>
+#include <string>
+
+class MockParser : public kcov::IFileParser
+{
+public:
+	MAKE_MOCK2(addFile, bool(const std::string &filename, struct phdr_data_entry *phdr_data));
+	MAKE_MOCK1(setMainFileRelocation, bool(unsigned long relocation));
+	MAKE_MOCK1(registerLineListener, void(kcov::IFileParser::ILineListener &listener));
+	MAKE_MOCK1(registerFileListener, void(kcov::IFileParser::IFileListener &listener));
+	MAKE_MOCK0(parse, bool());
+	MAKE_MOCK0(getChecksum, uint64_t());
+	MAKE_MOCK0(getParserType, std::string());
+	MAKE_MOCK0(maxPossibleHits, enum kcov::IFileParser::PossibleHits());
+	MAKE_MOCK3(matchParser, unsigned int(const std::string &filename, uint8_t *data, size_t dataSize));
+	MAKE_MOCK1(setupParser, void(kcov::IFilter *filter));
+
+	void mockRegisterLineListener(ILineListener &listener)
+	{
+		m_lineListener = &listener;
+	}
+
+	ILineListener *m_lineListener;
+};
@@ -1,5 +1,6 @@
 #include "test.hh"
 #include "mocks/mock-engine.hh"
+#include "mocks/mock-parser.hh"
 
 #include <file-parser.hh>
 #include <collector.hh>
@@ -7,6 +8,7 @@
 #include <utils.hh>
 
 #include <string>
+#include <vector>
 
 using namespace kcov;
 
@@ -20,6 +22,33 @@ public:
 	MAKE_MOCK2(onAddressHit, void(uint64_t addr, unsigned long hits));
 };
 
+class BatchCollectorListener : public ICollector::IListener
+{
+public:
+	BatchCollectorListener() :
+		m_batches(0)
+	{
+	}
+
+	virtual ~BatchCollectorListener()
+	{
+	}
+
+	void onAddressHit(uint64_t addr, unsigned long hits)
+	{
+		m_hits.push_back(addr);
+	}
+
+	void onAddressHits(const uint64_t *addrs, size_t n)
+	{
+		m_hits.insert(m_hits.end(), addrs, addrs + n);
+		m_batches++;
+	}
+
+	std::vector<uint64_t> m_hits;
+	unsigned int m_batches;
+};
+
 DISABLED_TEST(collector)
 {
 	MockEngine engine;
@@ -85,3 +114,176 @@ DISABLED_TEST(collector)
 
 	ASSERT_EQ(v, -1);
 }
+
+TEST(collectorBasicBlockBreakpoints)
+{
+	MockEngine engine;
+	MockParser parser;
+	MockCollectorListener listener;
+
+	REQUIRE_CALL(parser, registerLineListener(_))
+		.TIMES(1)
+		.LR_SIDE_EFFECT(parser.mockRegisterLineListener(_1))
+		;
+
+	ICollector &collector = ICollector::create(parser, engine, IFilter::createBasic());
+
+	collector.registerListener(listener);
+
+	// One breakpoint per block, not per line
+	{
+		REQUIRE_CALL(engine, registerBreakpoint(0x1000))
+			.TIMES(1)
+			.RETURN(0)
+			;
+		REQUIRE_CALL(engine, registerBreakpoint(0x2000))
+			.TIMES(1)
+			.RETURN(0)
+			;
+
+		parser.m_lineListener->onBasicBlockLine("a.c", 1, 0x1000, 0x1000);
+		parser.m_lineListener->onBasicBlockLine("a.c", 2, 0x1008, 0x1000);
+		parser.m_lineListener->onBasicBlockLine("a.c", 2, 0x1008, 0x1000);
+		parser.m_lineListener->onBasicBlockLine("a.c", 3, 0x2004, 0x2000);
+	}
+
+	IEngine::IEventListener &eventListener = dynamic_cast<IEngine::IEventListener &>(collector);
+	IEngine::Event ev;
+
+	ev.type = ev_breakpoint;
+	ev.data = 0;
+
+	// A hit on the block is a hit on all lines in it
+	{
+		REQUIRE_CALL(listener, onAddressHit(0x1000, 1))
+			.TIMES(1)
+			;
+		REQUIRE_CALL(listener, onAddressHit(0x1008, 1))
+			.TIMES(1)
+			;
+
+		ev.addr = 0x1000;
+		eventListener.onEvent(ev);
+	}
+
+	{
+		REQUIRE_CALL(listener, onAddressHit(0x2004, 1))
+			.TIMES(1)
+			;
+
+		ev.addr = 0x2000;
+		eventListener.onEvent(ev);
+	}
+
+	// Plain lines are reported as before
+	{
+		REQUIRE_CALL(listener, onAddressHit(0x3000, 1))
+			.TIMES(1)
+			;
+
+		ev.addr = 0x3000;
+		eventListener.onEvent(ev);
+	}
+}
+
+TEST(collectorBatchedBreakpoints)
+{
+	MockEngine engine;
+	MockParser parser;
+	BatchCollectorListener listener;
+
+	REQUIRE_CALL(parser, registerLineListener(_))
+		.TIMES(1)
+		.LR_SIDE_EFFECT(parser.mockRegisterLineListener(_1))
+		;
+
+	ICollector &collector = ICollector::create(parser, engine, IFilter::createBasic());
+
+	collector.registerListener(listener);
+
+	{
+		ALLOW_CALL(engine, registerBreakpoint(_))
+			.RETURN(0)
+			;
+
+		parser.m_lineListener->onBasicBlockLine("a.c", 1, 0x1000, 0x1000);
+		parser.m_lineListener->onBasicBlockLine("a.c", 2, 0x1008, 0x1000);
+		parser.m_lineListener->onLine("b.c", 1, 0x3000);
+	}
+
+	IEngine::IEventListener &eventListener = dynamic_cast<IEngine::IEventListener &>(collector);
+	uint64_t addrs[] = {0x3000, 0x1000, 0x4000};
+
+	// Blocks are expanded, and everything reaches the listener in one call
+	eventListener.onBreakpoints(addrs, 3);
+
+	ASSERT_EQ(listener.m_batches, 1U);
+	ASSERT_EQ(listener.m_hits.size(), 4U);
+	ASSERT_EQ(listener.m_hits[0], 0x3000U);
+	ASSERT_EQ(listener.m_hits[1], 0x1000U);
+	ASSERT_EQ(listener.m_hits[2], 0x1008U);
+	ASSERT_EQ(listener.m_hits[3], 0x4000U);
+
+	// Single events take the same path
+	IEngine::Event ev(ev_breakpoint, 0, 0x3000);
+
+	eventListener.onEvent(ev);
+	ASSERT_EQ(listener.m_batches, 2U);
+	ASSERT_EQ(listener.m_hits.size(), 5U);
+
+	// Empty batches aren't passed on
+	eventListener.onBreakpoints(addrs, 0);
+	ASSERT_EQ(listener.m_batches, 2U);
+}
+
+class FileLinesRecorder : public IFileParser::ILineListener
+{
+public:
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+	}
+
+	void onFileLines(FileId file, const unsigned int *lineNrs, const uint64_t *addrs,
+			const uint64_t *blockAddrs, size_t n)
+	{
+		m_files.push_back(file);
+		m_counts.push_back(n);
+		m_addrs.insert(m_addrs.end(), addrs, addrs + n);
+	}
+
+	std::vector<FileId> m_files;
+	std::vector<size_t> m_counts;
+	std::vector<uint64_t> m_addrs;
+};
+
+TEST(lineBatchGroupsByFile)
+{
+	IPathInterner &interner = IPathInterner::getInstance();
+	FileId a = interner.intern("batch-a.c");
+	FileId b = interner.intern("batch-b.c");
+	IFileParser::LineBatch batch;
+	FileLinesRecorder recorder;
+
+	batch.add(b, 1, 0x10, 0);
+	batch.add(a, 1, 0x20, 0);
+	batch.add(b, 2, 0x30, 0);
+	batch.add(a, 5, 0x40, 0);
+	batch.add(b, 3, 0x50, 0);
+
+	batch.deliver(recorder);
+
+	// One call per file, in first-seen order, with rows kept in order
+	ASSERT_EQ(recorder.m_files.size(), 2U);
+	ASSERT_EQ(recorder.m_files[0], b);
+	ASSERT_EQ(recorder.m_files[1], a);
+	ASSERT_EQ(recorder.m_counts[0], 3U);
+	ASSERT_EQ(recorder.m_counts[1], 2U);
+	ASSERT_EQ(recorder.m_addrs[0], 0x10U);
+	ASSERT_EQ(recorder.m_addrs[1], 0x30U);
+	ASSERT_EQ(recorder.m_addrs[2], 0x50U);
+	ASSERT_EQ(recorder.m_addrs[3], 0x20U);
+	ASSERT_EQ(recorder.m_addrs[4], 0x40U);
+
+	batch.clear();
+	ASSERT_TRUE(batch.empty());
+}
@@ -83,3 +83,37 @@ TEST(filter)
 	res = filter.runLineFilters("Kalle", 15, "Inget speciellt");
 	ASSERT_TRUE(res);
 }
+
+TEST(filterByFileId)
+{
+	IConfiguration &conf = IConfiguration::getInstance();
+	IPathInterner &interner = IPathInterner::getInstance();
+	Filter &filter = (Filter &)IFilter::create();
+	bool res;
+
+	const char *argv[] = {NULL, "--exclude-pattern=hej", "/tmp/vobb", "tjena"};
+	res = conf.parse(4, argv);
+	ASSERT_TRUE(res);
+	filter.setup();
+
+	FileId included = interner.intern("/tmp/binary");
+	FileId excluded = interner.intern("/tmp/hej/binary");
+
+	ASSERT_NE(included, excluded);
+	ASSERT_EQ(interner.intern("/tmp/binary"), included);
+	ASSERT_TRUE(interner.getPath(excluded) == "/tmp/hej/binary");
+
+	res = filter.runFilters(included);
+	ASSERT_TRUE(res);
+	res = filter.runFilters(excluded);
+	ASSERT_FALSE(res);
+
+	// Cached results are dropped when the filter is setup again
+	const char *argv2[] = {NULL, "--exclude-pattern=binary", "/tmp/vobb", "tjena"};
+	res = conf.parse(4, argv2);
+	ASSERT_TRUE(res);
+	filter.setup();
+
+	res = filter.runFilters(included);
+	ASSERT_FALSE(res);
+}
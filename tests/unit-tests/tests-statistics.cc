@@ -0,0 +1,87 @@
+#include "test.hh"
+
+#include <statistics.hh>
+#include <utils.hh>
+
+#include <stdlib.h>
+#include <string>
+
+using namespace kcov;
+
+static std::string readBack(const char *path)
+{
+	size_t size;
+	char *data = (char *)read_file(&size, "%s", path);
+
+	if (!data)
+		return "";
+
+	std::string out(data, size);
+
+	free(data);
+
+	return out;
+}
+
+TESTSUITE(statistics)
+{
+	TEST(counters_and_phases)
+	{
+		IStatistics &stats = IStatistics::getInstance();
+
+		stats.reset();
+		stats.count(IStatistics::COUNTER_TRAPS);
+		stats.count(IStatistics::COUNTER_TRAPS, 2);
+		stats.count(IStatistics::COUNTER_PTRACE, 5);
+
+		{
+			StatisticsScope scope(IStatistics::PHASE_PARSE);
+		}
+		{
+			StatisticsScope scope(IStatistics::PHASE_PARSE);
+		}
+
+		ASSERT_TRUE(stats.writeStats("stats.json"));
+
+		std::string json = readBack("stats.json");
+
+		ASSERT_TRUE(json.find("\"traps\": 3") != std::string::npos);
+		ASSERT_TRUE(json.find("\"ptrace_calls\": 5") != std::string::npos);
+		ASSERT_TRUE(json.find("\"parse\": {") != std::string::npos);
+		ASSERT_TRUE(json.find("\"count\": 2,") != std::string::npos);
+		ASSERT_TRUE(json.find("\"write\": {\"ms\": 0.000, \"count\": 0,") != std::string::npos);
+
+		// Starts over
+		stats.reset();
+		ASSERT_TRUE(stats.writeStats("stats.json"));
+
+		json = readBack("stats.json");
+		ASSERT_TRUE(json.find("\"traps\": 0") != std::string::npos);
+		ASSERT_TRUE(json.find("\"count\": 2,") == std::string::npos);
+	}
+
+	TEST(trace_events)
+	{
+		IStatistics &stats = IStatistics::getInstance();
+
+		stats.reset();
+
+		// Not recorded before the trace is enabled
+		{
+			StatisticsScope scope(IStatistics::PHASE_WRITE);
+		}
+		stats.enableTrace();
+		{
+			StatisticsScope scope(IStatistics::PHASE_TRAP);
+		}
+
+		ASSERT_TRUE(stats.writeTrace("trace.json"));
+
+		std::string json = readBack("trace.json");
+
+		ASSERT_TRUE(json.find("\"traceEvents\": [") != std::string::npos);
+		ASSERT_TRUE(json.find("\"name\": \"trap\"") != std::string::npos);
+		ASSERT_TRUE(json.find("\"name\": \"write\"") == std::string::npos);
+		ASSERT_TRUE(json.find("\"dropped\": 0") != std::string::npos);
+	}
+}
@@ -0,0 +1,80 @@
+#include "test.hh"
+
+#include <test-matrix.hh>
+#include <string>
+
+using namespace kcov;
+
+static bool hasTest(const ITestMatrix::TestList_t &tests, const std::string &name)
+{
+	for (ITestMatrix::TestList_t::const_iterator it = tests.begin();
+			it != tests.end();
+			++it) {
+		if (*it == name)
+			return true;
+	}
+
+	return false;
+}
+
+TESTSUITE(test_matrix)
+{
+	TEST(can_query_what_was_written)
+	{
+		ITestMatrixBuilder &builder = ITestMatrixBuilder::create();
+
+		builder.addLine("/src/a.c", 3);
+		builder.addLine("/src/a.c", 4);
+		builder.addHit("first", "/src/a.c", 4);
+		builder.addHit("second", "/src/b.c", 7);
+		builder.addHit("second", "/src/a.c", 4);
+
+		// More than one container, with runs ...
+		for (unsigned int i = 1; i <= 70000; i++)
+			builder.addHit("runs", "/src/big.c", i);
+		// ... and dense enough for a bitmap
+		for (unsigned int i = 1; i <= 20000; i += 2)
+			builder.addHit("bitmap", "/src/dense.c", i);
+		builder.addLine("/src/dense.c", 2);
+
+		ASSERT_TRUE(builder.write("matrix"));
+		delete &builder;
+
+		ITestMatrix *matrix = ITestMatrix::open("matrix");
+		ASSERT_TRUE(matrix);
+
+		ASSERT_TRUE(matrix->hasFile("/src/a.c"));
+		ASSERT_FALSE(matrix->hasFile("/src/c.c"));
+
+		ITestMatrix::TestList_t tests = matrix->getTests("/src/a.c", 4);
+		ASSERT_TRUE(tests.size() == 2);
+		ASSERT_TRUE(hasTest(tests, "first"));
+		ASSERT_TRUE(hasTest(tests, "second"));
+
+		ASSERT_TRUE(matrix->getTests("/src/a.c", 3).empty());
+		ASSERT_TRUE(matrix->getTests("/src/a.c", 5).empty());
+		ASSERT_TRUE(matrix->getTests("/src/b.c", 7).size() == 1);
+
+		ASSERT_TRUE(hasTest(matrix->getTests("/src/big.c", 1), "runs"));
+		ASSERT_TRUE(hasTest(matrix->getTests("/src/big.c", 65536), "runs"));
+		ASSERT_TRUE(hasTest(matrix->getTests("/src/big.c", 70000), "runs"));
+		ASSERT_TRUE(matrix->getTests("/src/big.c", 70001).empty());
+
+		ASSERT_TRUE(hasTest(matrix->getTests("/src/dense.c", 19999), "bitmap"));
+		ASSERT_TRUE(matrix->getTests("/src/dense.c", 2).empty());
+
+		delete matrix;
+	}
+
+	TEST(rejects_other_files)
+	{
+		ASSERT_FALSE(ITestMatrix::open("does-not-exist"));
+
+		FILE *fp = fopen("not-a-matrix", "w");
+		ASSERT_TRUE(fp);
+		fprintf(fp, "This is not a test matrix, but long enough for the header\n");
+		fclose(fp);
+
+		ASSERT_FALSE(ITestMatrix::open("not-a-matrix"));
+	}
+}
@@ -66,4 +66,25 @@ TESTSUITE(utils)
 		// Filename with slash
 		ASSERT_TRUE(dir_concat(singleDoubleSlashes, "/hej") == "/kalle/hej");
 	}
+
+	TEST(hash_block_parallel_is_stable)
+	{
+		// Single chunk: CRC32C of the chunk CRC32C, and the size
+		ASSERT_TRUE(hash_block_parallel("123456789", 9) == 0x55a059d900000009ULL);
+
+		size_t sz = 9 * 1024 * 1024 + 17;
+		uint8_t *p = (uint8_t *)xmalloc(sz);
+
+		for (size_t i = 0; i < sz; i++)
+			p[i] = i * 7 + (i >> 12);
+
+		uint64_t first = hash_block_parallel(p, sz);
+		ASSERT_TRUE(hash_block_parallel(p, sz) == first);
+
+		// A change in a later chunk is noticed
+		p[sz - 5]++;
+		ASSERT_TRUE(hash_block_parallel(p, sz) != first);
+
+		free(p);
+	}
 }
@@ -0,0 +1,210 @@
+#include <disassembler.hh>
+#include <elf.hh>
+#include <utils.hh>
+
+#include "../src/parsers/x86-decoder.hh"
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <libelf.h>
+
+#if KCOV_HAS_LIBBFD
+# ifndef ATTRIBUTE_FPTR_PRINTF_2
+#  define ATTRIBUTE_FPTR_PRINTF_2
+# endif
+# include <bfd.h>
+# include <dis-asm.h>
+#endif
+
+using namespace kcov;
+
+const char *kcov_version = "";
+
+class Result
+{
+public:
+	Result() :
+		m_instructions(0), m_branches(0), m_undecoded(0)
+	{
+	}
+
+	uint64_t m_instructions;
+	uint64_t m_branches;
+	uint64_t m_undecoded;
+};
+
+static Result decodeNative(const std::vector<Segment> &segments, bool is64Bit)
+{
+	Result out;
+
+	for (std::vector<Segment>::const_iterator it = segments.begin();
+			it != segments.end();
+			++it) {
+		const uint8_t *data = (const uint8_t *)it->getData();
+		size_t size = it->getSize();
+		size_t pc = 0;
+
+		while (pc < size) {
+			X86Instruction insn;
+			unsigned int count = x86DecodeInstruction(data + pc, size - pc, it->getBase() + pc, is64Bit, insn);
+
+			// Skip a byte, what the fallback would have had to handle
+			if (count == 0) {
+				out.m_undecoded++;
+				count = 1;
+			}
+
+			out.m_instructions++;
+			if (insn.m_controlFlow != X86_CF_NONE)
+				out.m_branches++;
+			pc += count;
+		}
+	}
+
+	return out;
+}
+
+#if KCOV_HAS_LIBBFD
+static int opcodesFprintFunc(void *info, const char *fmt, ...)
+{
+	std::vector<std::string> *vec = (std::vector<std::string> *)info;
+	char str[64];
+	int out;
+
+	va_list args;
+	va_start (args, fmt);
+	out = vsnprintf(str, sizeof(str) - 1, fmt, args);
+	va_end (args);
+
+	// Same work as the text-based disassembly
+	vec->push_back(trim_string(std::string(str)));
+
+	return out;
+}
+
+static Result decodeOpcodes(const std::vector<Segment> &segments, bool is64Bit)
+{
+	std::vector<std::string> vec;
+	struct disassemble_info info;
+	Result out;
+
+	memset(&info, 0, sizeof(info));
+	init_disassemble_info(&info, (void *)&vec, opcodesFprintFunc);
+	info.arch = bfd_arch_i386;
+	info.mach = is64Bit ? bfd_mach_x86_64 : bfd_mach_i386_i386;
+	disassemble_init_for_target(&info);
+
+	for (std::vector<Segment>::const_iterator it = segments.begin();
+			it != segments.end();
+			++it) {
+		info.buffer_vma = 0;
+		info.buffer_length = it->getSize();
+		info.buffer = (bfd_byte *)it->getData();
+
+		uint64_t pc = 0;
+		int count;
+		do {
+			vec.clear();
+			count = print_insn_i386(pc, &info);
+			if (count <= 0)
+				break;
+
+			out.m_instructions++;
+			if (!vec.empty() && vec[0][0] == 'j')
+				out.m_branches++;
+			pc += count;
+		} while (pc < it->getSize());
+	}
+
+	return out;
+}
+#endif
+
+static void report(const char *name, const Result &res, uint64_t ms, size_t bytes)
+{
+	printf("%-12s %10llu insns %9llu branches %7llu undecoded %7llu ms %8.1f MB/s\n",
+			name,
+			(unsigned long long)res.m_instructions,
+			(unsigned long long)res.m_branches,
+			(unsigned long long)res.m_undecoded,
+			(unsigned long long)ms,
+			ms ? (bytes / 1048576.0) / (ms / 1000.0) : 0.0);
+}
+
+int main(int argc, const char *argv[])
+{
+	std::string file;
+	unsigned int iterations = 5;
+
+	if (argc >= 2) {
+		file = argv[1];
+	} else {
+		Dl_info info;
+
+		// Default to the C library, which is large enough to be interesting
+		if (dladdr((void *)printf, &info) && info.dli_fname)
+			file = info.dli_fname;
+	}
+
+	if (argc >= 3 && string_is_integer(argv[2]))
+		iterations = string_to_integer(argv[2]);
+
+	if (file == "" || iterations == 0) {
+		fprintf(stderr, "Usage: disassembler-bench [elf-file] [iterations]\n");
+		return 1;
+	}
+
+	panic_if(elf_version(EV_CURRENT) == EV_NONE,
+			"ELF version failed\n");
+
+	IElf *elf = IElf::create(file);
+	if (!elf) {
+		fprintf(stderr, "Can't read %s\n", file.c_str());
+		return 1;
+	}
+
+	size_t sz;
+	const uint8_t *hdr = (const uint8_t *)elf->getRawData(sz);
+	bool is64Bit = sz > EI_CLASS && hdr[EI_CLASS] == ELFCLASS64;
+	const std::vector<Segment> &segments = elf->getSegments();
+	size_t bytes = 0;
+
+	for (std::vector<Segment>::const_iterator it = segments.begin();
+			it != segments.end();
+			++it)
+		bytes += it->getSize();
+
+	printf("%s: %zu executable bytes in %zu sections, %u iterations\n",
+			file.c_str(), bytes, segments.size(), iterations);
+
+	uint64_t start = get_ms_timestamp();
+	Result native;
+	for (unsigned int i = 0; i < iterations; i++)
+		native = decodeNative(segments, is64Bit);
+	report("native", native, (get_ms_timestamp() - start) / iterations, bytes);
+
+#if KCOV_HAS_LIBBFD
+	start = get_ms_timestamp();
+	Result opcodes;
+	for (unsigned int i = 0; i < iterations; i++)
+		opcodes = decodeOpcodes(segments, is64Bit);
+	report("libopcodes", opcodes, (get_ms_timestamp() - start) / iterations, bytes);
+#endif
+
+	// Full basic block setup through the regular interface (once, it's cached)
+	IDisassembler &disassembler = IDisassembler::getInstance();
+
+	start = get_ms_timestamp();
+	disassembler.setup(hdr, sz);
+	for (std::vector<Segment>::const_iterator it = segments.begin();
+			it != segments.end();
+			++it)
+		disassembler.addSection(it->getData(), it->getSize(), it->getBase());
+	if (!segments.empty())
+		disassembler.getBasicBlock(segments[0].getBase());
+	printf("%-12s %7llu ms\n", "basic-blocks", (unsigned long long)(get_ms_timestamp() - start));
+
+	delete elf;
+
+	return 0;
+}
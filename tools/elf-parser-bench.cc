@@ -0,0 +1,207 @@
+#include <configuration.hh>
+#include <file-parser.hh>
+#include <filter.hh>
+#include <elf.hh>
+#include <phdr_data.h>
+#include <utils.hh>
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <link.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+using namespace kcov;
+
+const char *kcov_version = "";
+
+class LineCounter : public IFileParser::ILineListener
+{
+public:
+	LineCounter(IFileParser &parser) :
+		m_lines(0)
+	{
+		parser.registerLineListener(*this);
+	}
+
+	virtual ~LineCounter()
+	{
+	}
+
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		m_lines++;
+	}
+
+	uint64_t m_lines;
+};
+
+static int segmentCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	std::vector<Segment> *segments = (std::vector<Segment> *)data;
+
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *cur = &info->dlpi_phdr[i];
+
+		if (cur->p_type != PT_LOAD)
+			continue;
+
+		uint64_t base = info->dlpi_addr + cur->p_vaddr;
+
+		segments->push_back(Segment(NULL, base, base, cur->p_memsz));
+	}
+
+	return 0;
+}
+
+static int phdrCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct phdr_data *p = (struct phdr_data *)data;
+
+	if (p->n_entries == 0)
+		p->relocation = info->dlpi_addr;
+
+	phdr_data_add(p, info);
+
+	return 0;
+}
+
+// What ElfInstance did before the index
+static const Segment *linearLookup(const std::vector<Segment> &segments, uint64_t addr)
+{
+	for (std::vector<Segment>::const_iterator it = segments.begin();
+			it != segments.end();
+			++it) {
+		if (it->addressIsWithinSegment(addr))
+			return &*it;
+	}
+
+	return NULL;
+}
+
+static void benchLookups(const std::vector<Segment> &segments, const std::vector<uint64_t> &addresses,
+		const char *order, unsigned int iterations)
+{
+	SegmentIndex index;
+	unsigned long found = 0;
+
+	index.setup(segments);
+
+	uint64_t start = get_ms_timestamp();
+	for (unsigned int i = 0; i < iterations; i++) {
+		for (std::vector<uint64_t>::const_iterator it = addresses.begin();
+				it != addresses.end();
+				++it)
+			found += linearLookup(segments, *it) != NULL;
+	}
+	uint64_t linearMs = get_ms_timestamp() - start;
+
+	start = get_ms_timestamp();
+	for (unsigned int i = 0; i < iterations; i++) {
+		for (std::vector<uint64_t>::const_iterator it = addresses.begin();
+				it != addresses.end();
+				++it)
+			found += index.lookup(*it) != NULL;
+	}
+	uint64_t indexMs = get_ms_timestamp() - start;
+
+	double n = (double)addresses.size() * iterations;
+
+	printf("%-12s linear %6.1f ns/lookup, index %6.1f ns/lookup (%lu found)\n",
+			order, linearMs * 1000000.0 / n, indexMs * 1000000.0 / n, found);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int iterations = 20;
+	char buf[PATH_MAX];
+	std::string file;
+
+	if (argc >= 2) {
+		file = argv[1];
+	} else {
+		// Our own binary, which has debug info and a fair number of solibs
+		ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+
+		if (len > 0) {
+			buf[len] = '\0';
+			file = buf;
+		}
+	}
+
+	if (argc >= 3 && string_is_integer(argv[2]))
+		iterations = string_to_integer(argv[2]);
+
+	if (file == "" || iterations == 0) {
+		fprintf(stderr, "Usage: elf-parser-bench [elf-file] [iterations]\n");
+		return 1;
+	}
+
+	// Segment lookups over everything loaded in this process
+	std::vector<Segment> segments;
+	std::vector<uint64_t> addresses;
+
+	dl_iterate_phdr(segmentCallback, (void *)&segments);
+	for (std::vector<Segment>::const_iterator it = segments.begin();
+			it != segments.end();
+			++it) {
+		uint64_t step = std::max((uint64_t)1, (uint64_t)it->getSize() / 4096);
+
+		for (uint64_t offs = 0; offs < it->getSize(); offs += step)
+			addresses.push_back(it->getBase() + offs);
+	}
+
+	printf("%zu segments, %zu addresses, %u iterations\n",
+			segments.size(), addresses.size(), iterations);
+
+	benchLookups(segments, addresses, "sequential", iterations);
+	std::random_shuffle(addresses.begin(), addresses.end());
+	benchLookups(segments, addresses, "random", iterations);
+
+	// Full line table parse of the file and the solibs loaded here
+	IFileParser *parser = IParserManager::getInstance().matchParser(file);
+	if (!parser) {
+		fprintf(stderr, "Can't match parser for %s\n", file.c_str());
+		return 1;
+	}
+
+	size_t allocSize = sizeof(struct phdr_data) + 1024 * sizeof(struct phdr_data_entry);
+	struct phdr_data *p = phdr_data_new(allocSize);
+
+	dl_iterate_phdr(phdrCallback, (void *)p);
+
+	parser->setupParser(&IFilter::create());
+	LineCounter counter(*parser);
+
+	uint64_t start = get_ms_timestamp();
+
+	parser->addFile(file);
+	parser->parse();
+	parser->setMainFileRelocation(p->relocation);
+
+	unsigned int nSolibs = 0;
+	for (uint32_t i = 0; i < p->n_entries; i++) {
+		struct phdr_data_entry *cur = &p->entries[i];
+
+		if (strlen(cur->name) == 0)
+			continue;
+
+		parser->addFile(cur->name, cur);
+		parser->parse();
+		nSolibs++;
+	}
+
+	uint64_t ms = get_ms_timestamp() - start;
+
+	printf("%-12s %llu lines in %s and %u solibs, %llu ms, %.1f ns/line\n",
+			"parse",
+			(unsigned long long)counter.m_lines, file.c_str(), nSolibs,
+			(unsigned long long)ms,
+			counter.m_lines ? ms * 1000000.0 / counter.m_lines : 0.0);
+
+	return 0;
+}
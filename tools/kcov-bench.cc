@@ -0,0 +1,697 @@
+#include <configuration.hh>
+#include <file-parser.hh>
+#include <filter.hh>
+#include <phdr_data.h>
+#include <utils.hh>
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <link.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace kcov;
+
+const char *kcov_version = "";
+
+class BenchConfig
+{
+public:
+	BenchConfig() :
+		m_kcov("kcov"),
+		m_cc("cc"),
+		m_cus(8),
+		m_functions(50),
+		m_lines(20),
+		m_threads(1),
+		m_solibs(0),
+		m_repeat(3),
+		m_keep(false)
+	{
+		const char *cc = getenv("CC");
+
+		if (cc && *cc)
+			m_cc = cc;
+
+		m_engines.push_back("ptrace");
+	}
+
+	std::string m_kcov;
+	std::string m_cc;
+	std::string m_workDir;
+	std::vector<std::string> m_engines;
+	unsigned int m_cus;
+	unsigned int m_functions;
+	unsigned int m_lines;
+	unsigned int m_threads;
+	unsigned int m_solibs;
+	unsigned int m_repeat;
+	bool m_keep;
+};
+
+class RunResult
+{
+public:
+	RunResult() :
+		m_status(-1), m_us(0), m_maxRssKb(0)
+	{
+	}
+
+	int m_status;
+	uint64_t m_us;
+	long m_maxRssKb;
+};
+
+class EngineResult
+{
+public:
+	EngineResult() :
+		m_startupUs(~0ULL), m_runUs(~0ULL), m_fullUs(~0ULL), m_coveredLines(0), m_maxRssKb(0)
+	{
+	}
+
+	std::string m_error;
+	uint64_t m_startupUs;
+	uint64_t m_runUs;
+	uint64_t m_fullUs;
+	uint64_t m_coveredLines;
+	long m_maxRssKb;
+};
+
+class LineCounter : public IFileParser::ILineListener
+{
+public:
+	LineCounter(IFileParser &parser) :
+		m_lines(0)
+	{
+		parser.registerLineListener(*this);
+	}
+
+	virtual ~LineCounter()
+	{
+	}
+
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		m_lines++;
+	}
+
+	uint64_t m_lines;
+};
+
+static uint64_t usNow()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static double toMs(uint64_t us)
+{
+	return us / 1000.0;
+}
+
+// Run @a args with stdout/stderr appended to @a logFile, and time it
+static bool runCommand(const std::vector<std::string> &args, const std::string &logFile, RunResult &out)
+{
+	std::vector<const char *> argv;
+
+	for (std::vector<std::string>::const_iterator it = args.begin();
+			it != args.end();
+			++it)
+		argv.push_back(it->c_str());
+	argv.push_back(NULL);
+
+	uint64_t start = usNow();
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return false;
+
+	if (pid == 0) {
+		int logFd = open(logFile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		int nullFd = open("/dev/null", O_RDONLY);
+
+		if (logFd >= 0) {
+			dup2(logFd, 1);
+			dup2(logFd, 2);
+		}
+		if (nullFd >= 0)
+			dup2(nullFd, 0);
+
+		execvp(argv[0], (char * const *)argv.data());
+		_exit(127);
+	}
+
+	struct rusage ru;
+	int status;
+
+	if (wait4(pid, &status, 0, &ru) != pid)
+		return false;
+
+	out.m_us = usNow() - start;
+	out.m_maxRssKb = ru.ru_maxrss;
+	if (WIFEXITED(status))
+		out.m_status = WEXITSTATUS(status);
+	else
+		out.m_status = 128 + WTERMSIG(status);
+
+	return true;
+}
+
+static bool removeTree(const std::string &path)
+{
+	std::vector<std::string> args;
+	RunResult res;
+
+	args.push_back("rm");
+	args.push_back("-rf");
+	args.push_back(path);
+
+	return runCommand(args, "/dev/null", res) && res.m_status == 0;
+}
+
+// One function is m_lines statements on separate lines, so there's one breakpoint per line
+static std::string generateUnit(const BenchConfig &conf, const std::string &prefix)
+{
+	std::string out;
+
+	for (unsigned int f = 0; f < conf.m_functions; f++) {
+		out += fmt("int %s_f%u(int x)\n{\n", prefix.c_str(), f);
+		for (unsigned int l = 0; l < conf.m_lines; l++)
+			out += fmt("\tx = x * 3 + %u;\n", l);
+		out += "\treturn x;\n}\n\n";
+	}
+
+	out += fmt("int %s_run(int x)\n{\n", prefix.c_str());
+	for (unsigned int f = 0; f < conf.m_functions; f++)
+		out += fmt("\tx = %s_f%u(x);\n", prefix.c_str(), f);
+	out += "\treturn x;\n}\n";
+
+	return out;
+}
+
+/*
+ * The units (CUs and solibs) are spread over the threads. With "run" as
+ * argument everything is executed once, otherwise main returns directly,
+ * which gives the startup cost.
+ */
+static std::string generateMain(const BenchConfig &conf, const std::vector<std::string> &units)
+{
+	std::string out;
+
+	out += "#include <pthread.h>\n#include <string.h>\n\n";
+	for (std::vector<std::string>::const_iterator it = units.begin();
+			it != units.end();
+			++it)
+		out += fmt("extern int %s_run(int x);\n", it->c_str());
+
+	out += "\nstatic void *worker(void *arg)\n{\n\tlong t = (long)arg;\n\tint x = (int)t;\n\n";
+	for (unsigned int i = 0; i < units.size(); i++)
+		out += fmt("\tif (t == %u)\n\t\tx = %s_run(x);\n", i % conf.m_threads, units[i].c_str());
+	out += "\n\treturn (void *)(long)x;\n}\n\n";
+
+	out += fmt("int main(int argc, char *argv[])\n{\n"
+			"\tpthread_t threads[%u];\n"
+			"\tlong i;\n\n"
+			"\tif (argc < 2 || strcmp(argv[1], \"run\") != 0)\n"
+			"\t\treturn 0;\n\n"
+			"\tfor (i = 1; i < %u; i++)\n"
+			"\t\tpthread_create(&threads[i], NULL, worker, (void *)i);\n"
+			"\tworker((void *)0);\n"
+			"\tfor (i = 1; i < %u; i++)\n"
+			"\t\tpthread_join(threads[i], NULL);\n\n"
+			"\treturn 0;\n}\n",
+			conf.m_threads, conf.m_threads, conf.m_threads);
+
+	return out;
+}
+
+static bool generate(const BenchConfig &conf, const std::string &binary,
+		std::vector<std::string> &solibs)
+{
+	std::string log = conf.m_workDir + "/build.log";
+	std::vector<std::string> units;
+	std::vector<std::string> mainArgs;
+	RunResult res;
+
+	mainArgs.push_back(conf.m_cc);
+	mainArgs.push_back("-g");
+	mainArgs.push_back("-O0");
+	mainArgs.push_back("-o");
+	mainArgs.push_back(binary);
+	mainArgs.push_back(conf.m_workDir + "/main.c");
+
+	for (unsigned int i = 0; i < conf.m_cus; i++) {
+		std::string name = fmt("cu%u", i);
+		std::string src = fmt("%s/%s.c", conf.m_workDir.c_str(), name.c_str());
+		std::string data = generateUnit(conf, name);
+
+		if (write_file(data.c_str(), data.size(), "%s", src.c_str()) != 0)
+			return false;
+
+		units.push_back(name);
+		mainArgs.push_back(src);
+	}
+
+	for (unsigned int i = 0; i < conf.m_solibs; i++) {
+		std::string name = fmt("lib%u", i);
+		std::string src = fmt("%s/%s.c", conf.m_workDir.c_str(), name.c_str());
+		std::string so = fmt("%s/libbench%u.so", conf.m_workDir.c_str(), i);
+		std::string data = generateUnit(conf, name);
+		std::vector<std::string> args;
+
+		if (write_file(data.c_str(), data.size(), "%s", src.c_str()) != 0)
+			return false;
+
+		args.push_back(conf.m_cc);
+		args.push_back("-g");
+		args.push_back("-O0");
+		args.push_back("-fPIC");
+		args.push_back("-shared");
+		args.push_back("-o");
+		args.push_back(so);
+		args.push_back(src);
+
+		if (!runCommand(args, log, res) || res.m_status != 0)
+			return false;
+
+		units.push_back(name);
+		solibs.push_back(so);
+		mainArgs.push_back(so);
+	}
+
+	std::string data = generateMain(conf, units);
+
+	if (write_file(data.c_str(), data.size(), "%s/main.c", conf.m_workDir.c_str()) != 0)
+		return false;
+
+	mainArgs.push_back("-Wl,-rpath," + conf.m_workDir);
+	mainArgs.push_back("-lpthread");
+
+	return runCommand(mainArgs, log, res) && res.m_status == 0;
+}
+
+static int phdrCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct phdr_data *p = (struct phdr_data *)data;
+
+	phdr_data_add(p, info);
+
+	return 0;
+}
+
+// Parse the binary and its solibs in-process, the same way kcov does
+static bool measureParse(const std::string &binary, const std::vector<std::string> &solibs,
+		uint64_t &us, uint64_t &lines)
+{
+	IFileParser *parser = IParserManager::getInstance().matchParser(binary);
+
+	if (!parser)
+		return false;
+
+	// Loaded here only to get their segments
+	for (std::vector<std::string>::const_iterator it = solibs.begin();
+			it != solibs.end();
+			++it) {
+		if (!dlopen(it->c_str(), RTLD_LAZY | RTLD_LOCAL))
+			return false;
+	}
+
+	size_t allocSize = sizeof(struct phdr_data) + 1024 * sizeof(struct phdr_data_entry);
+	struct phdr_data *p = phdr_data_new(allocSize);
+
+	dl_iterate_phdr(phdrCallback, (void *)p);
+
+	parser->setupParser(&IFilter::create());
+	LineCounter counter(*parser);
+
+	uint64_t start = usNow();
+
+	parser->addFile(binary);
+	parser->parse();
+	// Parsing a PIE waits for the relocation, which doesn't matter here
+	parser->setMainFileRelocation(0);
+
+	for (uint32_t i = 0; i < p->n_entries; i++) {
+		struct phdr_data_entry *cur = &p->entries[i];
+
+		for (std::vector<std::string>::const_iterator it = solibs.begin();
+				it != solibs.end();
+				++it) {
+			if (*it != cur->name)
+				continue;
+
+			parser->addFile(cur->name, cur);
+			parser->parse();
+		}
+	}
+
+	us = usNow() - start;
+	lines = counter.m_lines;
+	phdr_data_free(p);
+
+	return true;
+}
+
+static uint64_t readCoveredLines(const std::string &outDir, const std::string &binaryName)
+{
+	size_t size;
+	char *data = (char *)read_file(&size, "%s/%s/coverage.json", outDir.c_str(), binaryName.c_str());
+
+	if (!data)
+		return 0;
+
+	// The per-file entries come first, the totals last
+	std::string json(data, size);
+	std::string key = "\"covered_lines\": ";
+	size_t pos = json.rfind(key);
+
+	free(data);
+	if (pos == std::string::npos)
+		return 0;
+
+	return strtoull(json.c_str() + pos + key.size(), NULL, 10);
+}
+
+static std::string engineFlag(const std::string &engine)
+{
+	if (engine == "trap")
+		return "--trap-handler";
+	if (engine == "uprobes")
+		return "--uprobes";
+	if (engine == "rewrite")
+		return "--rewrite";
+
+	return "";
+}
+
+static bool engineIsValid(const std::string &engine)
+{
+	return engine == "ptrace" || engineFlag(engine) != "";
+}
+
+static std::vector<std::string> kcovArgs(const BenchConfig &conf, const std::string &engine,
+		bool collectOnly, const std::string &outDir, const std::string &binary, const char *arg)
+{
+	std::vector<std::string> out;
+	std::string flag = engineFlag(engine);
+
+	out.push_back(conf.m_kcov);
+	if (flag != "")
+		out.push_back(flag);
+	if (collectOnly)
+		out.push_back("--collect-only");
+	out.push_back("--include-path=" + conf.m_workDir);
+	out.push_back(outDir);
+	out.push_back(binary);
+	out.push_back(arg);
+
+	return out;
+}
+
+/*
+ * Per repetition: Collect with the program returning directly (startup),
+ * collect with everything executed once (run), then the same with the
+ * reports written (full). The fastest repetition counts.
+ */
+static EngineResult benchEngine(const BenchConfig &conf, const std::string &engine,
+		const std::string &binary)
+{
+	std::string outDir = conf.m_workDir + "/kcov-" + engine;
+	std::string log = conf.m_workDir + "/kcov-" + engine + ".log";
+	EngineResult out;
+
+	for (unsigned int i = 0; i < conf.m_repeat; i++) {
+		RunResult startup, run, full;
+
+		removeTree(outDir);
+		if (!runCommand(kcovArgs(conf, engine, true, outDir, binary, "idle"), log, startup) ||
+				startup.m_status != 0) {
+			out.m_error = fmt("startup run failed with %d, see %s", startup.m_status, log.c_str());
+			return out;
+		}
+
+		removeTree(outDir);
+		if (!runCommand(kcovArgs(conf, engine, true, outDir, binary, "run"), log, run) ||
+				run.m_status != 0) {
+			out.m_error = fmt("collection failed with %d, see %s", run.m_status, log.c_str());
+			return out;
+		}
+
+		removeTree(outDir);
+		if (!runCommand(kcovArgs(conf, engine, false, outDir, binary, "run"), log, full) ||
+				full.m_status != 0) {
+			out.m_error = fmt("full run failed with %d, see %s", full.m_status, log.c_str());
+			return out;
+		}
+
+		out.m_startupUs = std::min(out.m_startupUs, startup.m_us);
+		out.m_runUs = std::min(out.m_runUs, run.m_us);
+		out.m_fullUs = std::min(out.m_fullUs, full.m_us);
+		out.m_maxRssKb = std::max(out.m_maxRssKb,
+				std::max(startup.m_maxRssKb, std::max(run.m_maxRssKb, full.m_maxRssKb)));
+	}
+
+	out.m_coveredLines = readCoveredLines(outDir, "bench");
+
+	return out;
+}
+
+static bool nativeRun(const std::string &binary, const char *arg, const std::string &log,
+		unsigned int repeat, uint64_t &us)
+{
+	std::vector<std::string> args;
+
+	args.push_back(binary);
+	args.push_back(arg);
+
+	us = ~0ULL;
+	for (unsigned int i = 0; i < repeat; i++) {
+		RunResult res;
+
+		if (!runCommand(args, log, res) || res.m_status != 0)
+			return false;
+		us = std::min(us, res.m_us);
+	}
+
+	return true;
+}
+
+static void usage()
+{
+	fprintf(stderr,
+			"Usage: kcov-bench [options]\n"
+			"\n"
+			"Generates a C program of the given size, runs it under kcov with each\n"
+			"engine and writes the timings as JSON to stdout.\n"
+			"\n"
+			" --kcov=path             the kcov binary to run (default: kcov)\n"
+			" --engines=e1,e2...      ptrace, trap, uprobes or rewrite (default: ptrace)\n"
+			" --cus=N                 compilation units in the program (default: 8)\n"
+			" --functions=N           functions per compilation unit/solib (default: 50)\n"
+			" --lines=N               lines per function (default: 20)\n"
+			" --threads=N             threads running the program (default: 1)\n"
+			" --solibs=N              shared libraries linked to the program (default: 0)\n"
+			" --repeat=N              runs per measurement, the fastest counts (default: 3)\n"
+			" --work-dir=dir          where to generate the program (default: a temporary dir)\n"
+			" --keep                  keep the work directory\n"
+			"\n"
+			"The C compiler is taken from $CC (default: cc).\n");
+}
+
+static bool parseCount(const char *arg, unsigned int minimum, unsigned int &out)
+{
+	if (!string_is_integer(arg) || string_to_integer(arg) < minimum)
+		return false;
+
+	out = (unsigned int)string_to_integer(arg);
+
+	return true;
+}
+
+static bool parseArguments(int argc, char *argv[], BenchConfig &conf)
+{
+	static const struct option long_options[] = {
+			{"help", no_argument, 0, 'h'},
+			{"kcov", required_argument, 0, 'k'},
+			{"engines", required_argument, 0, 'e'},
+			{"cus", required_argument, 0, 'c'},
+			{"functions", required_argument, 0, 'f'},
+			{"lines", required_argument, 0, 'l'},
+			{"threads", required_argument, 0, 't'},
+			{"solibs", required_argument, 0, 's'},
+			{"repeat", required_argument, 0, 'r'},
+			{"work-dir", required_argument, 0, 'w'},
+			{"keep", no_argument, 0, 'K'},
+			{0, 0, 0, 0}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		bool ok = true;
+
+		switch (c) {
+		case 'k':
+			conf.m_kcov = optarg;
+			break;
+		case 'e':
+			conf.m_engines = split_string(optarg, ",");
+			for (std::vector<std::string>::const_iterator it = conf.m_engines.begin();
+					it != conf.m_engines.end();
+					++it) {
+				if (!engineIsValid(*it)) {
+					fprintf(stderr, "kcov-bench: Unknown engine %s\n", it->c_str());
+					ok = false;
+				}
+			}
+			ok = ok && !conf.m_engines.empty();
+			break;
+		case 'c':
+			ok = parseCount(optarg, 1, conf.m_cus);
+			break;
+		case 'f':
+			ok = parseCount(optarg, 1, conf.m_functions);
+			break;
+		case 'l':
+			ok = parseCount(optarg, 1, conf.m_lines);
+			break;
+		case 't':
+			ok = parseCount(optarg, 1, conf.m_threads);
+			break;
+		case 's':
+			ok = parseCount(optarg, 0, conf.m_solibs);
+			break;
+		case 'r':
+			ok = parseCount(optarg, 1, conf.m_repeat);
+			break;
+		case 'w':
+			conf.m_workDir = optarg;
+			break;
+		case 'K':
+			conf.m_keep = true;
+			break;
+		default:
+			ok = false;
+			break;
+		}
+
+		if (!ok)
+			return false;
+	}
+
+	return optind == argc;
+}
+
+int main(int argc, char *argv[])
+{
+	BenchConfig conf;
+
+	if (!parseArguments(argc, argv, conf)) {
+		usage();
+		return 1;
+	}
+
+	if (conf.m_workDir == "") {
+		char tmpl[] = "/tmp/kcov-bench.XXXXXX";
+
+		if (!mkdtemp(tmpl)) {
+			fprintf(stderr, "kcov-bench: Can't create a work directory\n");
+			return 1;
+		}
+		conf.m_workDir = tmpl;
+	} else {
+		(void)mkdir(conf.m_workDir.c_str(), 0755);
+	}
+	conf.m_workDir = get_real_path(conf.m_workDir);
+
+	std::string binary = conf.m_workDir + "/bench";
+	std::string log = conf.m_workDir + "/bench.log";
+	std::vector<std::string> solibs;
+	uint64_t parseUs, lineAddresses, idleUs, runUs;
+
+	uint64_t start = usNow();
+	if (!generate(conf, binary, solibs)) {
+		fprintf(stderr, "kcov-bench: Can't build the program, see %s/build.log\n", conf.m_workDir.c_str());
+		return 1;
+	}
+	uint64_t buildUs = usNow() - start;
+
+	if (!measureParse(binary, solibs, parseUs, lineAddresses)) {
+		fprintf(stderr, "kcov-bench: Can't parse %s\n", binary.c_str());
+		return 1;
+	}
+
+	if (!nativeRun(binary, "idle", log, conf.m_repeat, idleUs) ||
+			!nativeRun(binary, "run", log, conf.m_repeat, runUs)) {
+		fprintf(stderr, "kcov-bench: %s failed, see %s\n", binary.c_str(), log.c_str());
+		return 1;
+	}
+
+	printf("{\n"
+			"  \"config\": {\"cus\": %u, \"functions\": %u, \"lines\": %u, \"threads\": %u, "
+			"\"solibs\": %u, \"repeat\": %u},\n"
+			"  \"build_ms\": %.3f,\n"
+			"  \"parse_ms\": %.3f,\n"
+			"  \"line_addresses\": %llu,\n"
+			"  \"native\": {\"startup_ms\": %.3f, \"run_ms\": %.3f},\n"
+			"  \"engines\": {\n",
+			conf.m_cus, conf.m_functions, conf.m_lines, conf.m_threads, conf.m_solibs, conf.m_repeat,
+			toMs(buildUs), toMs(parseUs), (unsigned long long)lineAddresses,
+			toMs(idleUs), toMs(runUs));
+
+	for (std::vector<std::string>::const_iterator it = conf.m_engines.begin();
+			it != conf.m_engines.end();
+			++it) {
+		EngineResult res = benchEngine(conf, *it, binary);
+		const char *sep = it + 1 == conf.m_engines.end() ? "" : ",";
+
+		if (res.m_error != "") {
+			printf("    \"%s\": {\"error\": \"%s\"}%s\n",
+					it->c_str(), escape_json(res.m_error).c_str(), sep);
+			continue;
+		}
+
+		/*
+		 * Arming is what's left of the startup after parsing and running the
+		 * program. Each covered line traps once, so the trap latency is the
+		 * extra time of executing everything, over the covered lines. The
+		 * reports are what the full run adds to the collection.
+		 */
+		double armMs = toMs(res.m_startupUs) - toMs(parseUs) - toMs(idleUs);
+		double trapMs = toMs(res.m_runUs) - toMs(res.m_startupUs) - (toMs(runUs) - toMs(idleUs));
+		double reportMs = toMs(res.m_fullUs) - toMs(res.m_runUs);
+
+		printf("    \"%s\": {\"startup_ms\": %.3f, \"arm_ms\": %.3f, \"run_ms\": %.3f, "
+				"\"covered_lines\": %llu, \"trap_latency_us\": %.3f, \"report_ms\": %.3f, "
+				"\"peak_rss_kb\": %ld}%s\n",
+				it->c_str(), toMs(res.m_startupUs), armMs < 0 ? 0 : armMs, toMs(res.m_runUs),
+				(unsigned long long)res.m_coveredLines,
+				res.m_coveredLines && trapMs > 0 ? trapMs * 1000 / res.m_coveredLines : 0.0,
+				reportMs < 0 ? 0 : reportMs, res.m_maxRssKb, sep);
+	}
+
+	printf("  }\n}\n");
+
+	if (!conf.m_keep)
+		removeTree(conf.m_workDir);
+
+	return 0;
+}